@@ -8,6 +8,8 @@
 #include <math.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
 
 #define ASSERT assert // RTree uses ASSERT( condition )
 #ifndef Min
@@ -101,6 +103,18 @@ public:
   /// Remove all entries from tree
   void RemoveAll();
 
+  /// Bulk load entries using Sort-Tile-Recursive packing.
+  /// Entries already in the tree are kept and packed together with the new ones.
+  /// \param a_count Number of entries to add
+  /// \param a_mins Min of bounding rects, a_count * NUMDIMS values
+  /// \param a_maxs Max of bounding rects, a_count * NUMDIMS values
+  /// \param a_dataIds Data of the entries, a_count values
+  void BulkLoad(int a_count, const ELEMTYPE* a_mins, const ELEMTYPE* a_maxs, const DATATYPE* a_dataIds);
+
+  /// Rebuild the tree from its current content with Sort-Tile-Recursive packing.
+  /// Useful after many Insert/Remove which leave the nodes partly filled and overlapping.
+  void Repack();
+
   /// Count the data elements in this container.  This is slow as no internal counter is maintained.
   int Count();
 
@@ -362,6 +376,8 @@ protected:
   void ReInsert(Node* a_node, ListNode** a_listNode);
   bool Search(Node* a_node, Rect* a_rect, int& a_foundCount, bool __cdecl a_resultCallback(DATATYPE a_data, void* a_context), void* a_context);
   void RemoveAllRec(Node* a_node);
+  void CollectRec(Node* a_node, std::vector<Branch>& a_branches);
+  void PackLevel(std::vector<Branch>& a_branches, int a_level);
   void Reset();
   void CountRec(Node* a_node, int& a_count);
 
@@ -779,6 +795,130 @@ void RTREE_QUAL::RemoveAll()
 }
 
 
+RTREE_TEMPLATE
+void RTREE_QUAL::BulkLoad(int a_count, const ELEMTYPE* a_mins, const ELEMTYPE* a_maxs, const DATATYPE* a_dataIds)
+{
+  std::vector<Branch> branches;
+  branches.reserve(a_count);
+  CollectRec(m_root, branches);
+
+  for(int index = 0; index < a_count; ++index)
+  {
+    Branch branch;
+    for(int axis = 0; axis < NUMDIMS; ++axis)
+    {
+      branch.m_rect.m_min[axis] = a_mins[index * NUMDIMS + axis];
+      branch.m_rect.m_max[axis] = a_maxs[index * NUMDIMS + axis];
+    }
+    branch.m_data = a_dataIds[index];
+    branches.push_back(branch);
+  }
+
+  Reset();
+
+  // Pack the leaves, then each upper level, until everything fits in the root
+  int level = 0;
+  while((int)branches.size() > MAXNODES)
+  {
+    PackLevel(branches, level);
+    ++level;
+  }
+
+  m_root = AllocNode();
+  m_root->m_level = level;
+  for(unsigned int index = 0; index < branches.size(); ++index)
+  {
+    m_root->m_branch[index] = branches[index];
+  }
+  m_root->m_count = branches.size();
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::Repack()
+{
+  BulkLoad(0, NULL, NULL, NULL);
+}
+
+
+// Append all the data branches found under a_node
+RTREE_TEMPLATE
+void RTREE_QUAL::CollectRec(Node* a_node, std::vector<Branch>& a_branches)
+{
+  if(a_node->IsInternalNode())
+  {
+    for(int index = 0; index < a_node->m_count; ++index)
+    {
+      CollectRec(a_node->m_branch[index].m_child, a_branches);
+    }
+  }
+  else
+  {
+    for(int index = 0; index < a_node->m_count; ++index)
+    {
+      a_branches.push_back(a_node->m_branch[index]);
+    }
+  }
+}
+
+
+// Orders branches on the center of their rect along one axis
+template<class BRANCH, int AXIS>
+struct RTreeBranchCenterLess
+{
+  bool operator()(const BRANCH& a_branchA, const BRANCH& a_branchB) const
+  {
+    return (a_branchA.m_rect.m_min[AXIS] + a_branchA.m_rect.m_max[AXIS]) <
+           (a_branchB.m_rect.m_min[AXIS] + a_branchB.m_rect.m_max[AXIS]);
+  }
+};
+
+
+// One Sort-Tile-Recursive pass: groups a_branches into full nodes of level a_level
+// and replaces them with the branches pointing to these new nodes.
+// Only the first two axis are used for tiling.
+RTREE_TEMPLATE
+void RTREE_QUAL::PackLevel(std::vector<Branch>& a_branches, int a_level)
+{
+  int count = a_branches.size();
+  int nodeCount = (count + MAXNODES - 1) / MAXNODES;
+  int sliceCount = (int)ceil(sqrt((double)nodeCount));
+  int sliceSize = sliceCount * MAXNODES;
+
+  std::sort(a_branches.begin(), a_branches.end(), RTreeBranchCenterLess<Branch, 0>());
+
+  std::vector<Branch> parents;
+  parents.reserve(nodeCount);
+
+  for(int sliceStart = 0; sliceStart < count; sliceStart += sliceSize)
+  {
+    int sliceEnd = Min(sliceStart + sliceSize, count);
+    if(NUMDIMS > 1)
+    {
+      std::sort(a_branches.begin() + sliceStart, a_branches.begin() + sliceEnd, RTreeBranchCenterLess<Branch, (NUMDIMS > 1 ? 1 : 0)>());
+    }
+
+    for(int nodeStart = sliceStart; nodeStart < sliceEnd; nodeStart += MAXNODES)
+    {
+      Node* node = AllocNode();
+      node->m_level = a_level;
+      int nodeEnd = Min(nodeStart + (int)MAXNODES, sliceEnd);
+      for(int index = nodeStart; index < nodeEnd; ++index)
+      {
+        node->m_branch[node->m_count++] = a_branches[index];
+      }
+
+      Branch branch;
+      branch.m_rect = NodeCover(node);
+      branch.m_child = node;
+      parents.push_back(branch);
+    }
+  }
+
+  a_branches.swap(parents);
+}
+
+
 RTREE_TEMPLATE
 void RTREE_QUAL::Reset()
 {
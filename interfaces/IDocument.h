@@ -15,6 +15,10 @@ public:
     virtual const QList<CoordBox> getDownloadBoxes() const = 0;
     virtual const QList<CoordBox> getDownloadBoxes(Layer* l) const = 0;
 
+    virtual int revision() = 0;
+    virtual bool changedSince(int aRevision, QList<CoordBox>& theBoxes) const = 0;
+    virtual int styleRevision() const = 0;
+
 };
 
 #endif // IDOCUMENT_H
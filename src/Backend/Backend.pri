@@ -2,9 +2,15 @@ INCLUDEPATH += $$MERKAARTOR_SRC_DIR/Backend
 DEPENDPATH += $$MERKAARTOR_SRC_DIR/Backend
 
 HEADERS += \
+    FeaturePool.h \
+    NodeCoordStore.h \
+    RenderQueue.h \
     MemoryBackend.h
 
 SOURCES += \
+    FeaturePool.cpp \
+    NodeCoordStore.cpp \
+    RenderQueue.cpp \
     MemoryBackend.cpp
 
 contains (SPATIALITE, 1) {
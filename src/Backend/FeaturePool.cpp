@@ -0,0 +1,161 @@
+#include "FeaturePool.h"
+
+#include <string.h>
+
+#define SLAB_SIZE (64 * 1024)
+#define SLOT_ALIGN 16
+#define SLAB_MAX_SLOTS (SLAB_SIZE / SLOT_ALIGN)
+
+struct FeaturePool::Slab
+{
+    FeaturePool* pool;
+    int slotSize;
+    int slotCount;
+    int carved;
+    int kind;
+    quint32 liveBits[SLAB_MAX_SLOTS / 32];
+
+    static int headerSize()
+    {
+        return (sizeof(Slab) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+    }
+    char* slotBase()
+    {
+        return (char*)this + headerSize();
+    }
+    int slotIndex(const void* ptr)
+    {
+        return ((const char*)ptr - slotBase()) / slotSize;
+    }
+    bool isLive(int idx) const
+    {
+        return liveBits[idx >> 5] & (1u << (idx & 31));
+    }
+    void setLive(int idx, bool live)
+    {
+        if (live)
+            liveBits[idx >> 5] |= (1u << (idx & 31));
+        else
+            liveBits[idx >> 5] &= ~(1u << (idx & 31));
+    }
+};
+
+FeaturePool::Slab* FeaturePool::slabOf(const void* ptr)
+{
+    return (FeaturePool::Slab*)((quintptr)ptr & ~(quintptr)(SLAB_SIZE - 1));
+}
+
+FeaturePool::FeaturePool()
+    : Live(0)
+{
+}
+
+FeaturePool::~FeaturePool()
+{
+    foreach (Slab* slab, Slabs)
+        qFreeAligned(slab);
+}
+
+FeaturePool::Slab* FeaturePool::newSlab(int slotSize, SlotKind kind)
+{
+    Slab* slab = (Slab*)qMallocAligned(SLAB_SIZE, SLAB_SIZE);
+    if (!slab)
+        throw std::bad_alloc();
+
+    slab->pool = this;
+    slab->slotSize = slotSize;
+    slab->slotCount = (SLAB_SIZE - Slab::headerSize()) / slotSize;
+    slab->carved = 0;
+    slab->kind = kind;
+    memset(slab->liveBits, 0, sizeof(slab->liveBits));
+    Slabs << slab;
+
+    return slab;
+}
+
+void* FeaturePool::allocate(std::size_t sz, SlotKind kind)
+{
+    int slotSize = (sz + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+    Q_ASSERT(slotSize <= SLAB_SIZE / 4);
+
+    SizeClass& sc = Classes[slotSize * 2 + kind];
+
+    void* ptr;
+    Slab* slab;
+    if (sc.freeList) {
+        ptr = sc.freeList;
+        sc.freeList = *(void**)ptr;
+        slab = slabOf(ptr);
+    } else {
+        if (!sc.current || sc.current->carved == sc.current->slotCount) {
+            sc.current = newSlab(slotSize, kind);
+        }
+        slab = sc.current;
+        ptr = slab->slotBase() + slab->carved * slotSize;
+        ++slab->carved;
+    }
+    slab->setLive(slab->slotIndex(ptr), true);
+    ++Live;
+
+    return ptr;
+}
+
+void FeaturePool::releaseSlot(Slab* slab, void* ptr)
+{
+    int idx = slab->slotIndex(ptr);
+    if (!slab->isLive(idx))
+        return;
+    slab->setLive(idx, false);
+
+    SizeClass& sc = Classes[slab->slotSize * 2 + slab->kind];
+    *(void**)ptr = sc.freeList;
+    sc.freeList = ptr;
+    --Live;
+}
+
+void FeaturePool::release(void* ptr)
+{
+    if (!ptr)
+        return;
+    Slab* slab = slabOf(ptr);
+    slab->pool->releaseSlot(slab, ptr);
+}
+
+FeaturePool* FeaturePool::poolOf(const void* ptr)
+{
+    return slabOf(ptr)->pool;
+}
+
+bool FeaturePool::isLive(const void* ptr)
+{
+    Slab* slab = slabOf(ptr);
+    return slab->isLive(slab->slotIndex(ptr));
+}
+
+int FeaturePool::slotSize(const void* ptr)
+{
+    return slabOf(ptr)->slotSize;
+}
+
+QList<void*> FeaturePool::liveObjects(SlotKind kind) const
+{
+    QList<void*> res;
+    foreach (Slab* slab, Slabs) {
+        if (slab->kind != kind)
+            continue;
+        for (int i=0; i<slab->carved; ++i)
+            if (slab->isLive(i))
+                res << (slab->slotBase() + i * slab->slotSize);
+    }
+    return res;
+}
+
+int FeaturePool::liveCount() const
+{
+    return Live;
+}
+
+qint64 FeaturePool::reservedBytes() const
+{
+    return (qint64)Slabs.size() * SLAB_SIZE;
+}
@@ -0,0 +1,51 @@
+#ifndef FEATUREPOOL_H
+#define FEATUREPOOL_H
+
+#include <QtGlobal>
+#include <QHash>
+#include <QList>
+
+#include <new>
+
+/// Slab allocator for features and their private data.
+/// Slots are carved out of aligned slabs, so any pointer finds its slab (and pool) back
+/// by masking. Slabs are only given back to the system when the whole pool is deleted.
+class FeaturePool
+{
+public:
+    typedef enum { FeatureSlot, PrivateSlot } SlotKind;
+
+    FeaturePool();
+    /// Frees the slabs. Objects still living in the pool are not destroyed.
+    ~FeaturePool();
+
+    void* allocate(std::size_t sz, SlotKind kind);
+    static void release(void* ptr);
+
+    static FeaturePool* poolOf(const void* ptr);
+    static bool isLive(const void* ptr);
+    static int slotSize(const void* ptr);
+
+    QList<void*> liveObjects(SlotKind kind) const;
+    int liveCount() const;
+    qint64 reservedBytes() const;
+
+private:
+    struct Slab;
+    struct SizeClass
+    {
+        SizeClass() : current(0), freeList(0) {}
+        Slab* current;
+        void* freeList;
+    };
+
+    static Slab* slabOf(const void* ptr);
+    Slab* newSlab(int slotSize, SlotKind kind);
+    void releaseSlot(Slab* slab, void* ptr);
+
+    QHash<int, SizeClass> Classes;
+    QList<Slab*> Slabs;
+    int Live;
+};
+
+#endif // FEATUREPOOL_H
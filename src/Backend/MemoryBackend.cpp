@@ -1,23 +1,12 @@
 #include "MemoryBackend.h"
+#include "FeaturePool.h"
+#include "NodeCoordStore.h"
 #include "RTree.h"
+#include "Document.h"
 
 RenderPriority NodePri(RenderPriority::IsSingular,0., 0);
 RenderPriority SegmentPri(RenderPriority::IsLinear,0.,99);
 
-inline void* operator new (std::size_t sz) throw(std::bad_alloc)
-{
-  // fixme: throw bad_alloc on error
-    void *p = (void *) malloc(sz);
-    if (!p)
-        qDebug() << "Alloc error";
-    return p;
-}
-
-void operator delete (void *p) throw()
-{
-    free(p);
-}
-
 typedef RTree<Feature*, qreal, 2, qreal, 32> CoordTree;
 
 class MemoryBackendPrivate
@@ -25,7 +14,16 @@ class MemoryBackendPrivate
 public:
     QHash<Feature*, CoordBox> AllocFeatures;
     QHash<ILayer*, CoordTree*> theRTree;
+    QHash<ILayer*, QHash<Feature*, QRectF> > BulkIndex;
     QList<Feature*> findResult;
+
+    FeaturePool* DefaultPool;
+    QHash<ILayer*, FeaturePool*> Pools;
+    QList<FeaturePool*> DetachedPools;
+
+    // NULL for layers that keep node coordinates in the nodes
+    QHash<ILayer*, NodeCoordStore*> CoordStores;
+    QList<NodeCoordStore*> DetachedCoordStores;
 };
 
 bool __cdecl indexFindCallbackList(Feature* F, void* ctxt)
@@ -41,39 +39,31 @@ bool __cdecl indexFindCallback(Feature* F, void* ctxt)
     if (!F->isVisible())
         return true;
 
+    // Features found more than once are queued more than once, RenderQueue::sort() drops the copies
     if (CHECK_WAY(F)) {
         Way * R = STATIC_CAST_WAY(F);
-        if (pCtxt->theFeatures->value(R->renderPriority()).contains(F))
-            return true;
         R->buildPath(*(pCtxt->theProjection));
         if (M_PREFS->getTrackPointsVisible()) {
             for (int i=0; i<R->size(); ++i) {
                 if (pCtxt->bbox.contains(R->getNode(i)->boundingBox()))
-                    if (!pCtxt->theFeatures->value(NodePri).contains(R->getNode(i)))
-                        (*(pCtxt->theFeatures))[NodePri].insert(R->getNode(i));
+                    pCtxt->theFeatures->add(NodePri, R->getNode(i));
             }
         }
-        (*(pCtxt->theFeatures))[R->renderPriority()].insert(F);
+        pCtxt->theFeatures->add(R->renderPriority(), F);
     } else
     if (CHECK_RELATION(F)) {
         Relation * RR = STATIC_CAST_RELATION(F);
-        if (pCtxt->theFeatures->value(RR->renderPriority()).contains(F))
-            return true;
         RR->buildPath(*(pCtxt->theProjection));
-        (*(pCtxt->theFeatures))[RR->renderPriority()].insert(F);
+        pCtxt->theFeatures->add(RR->renderPriority(), F);
     } else
     if (CHECK_NODE(F)) {
-        if (pCtxt->theFeatures->value(NodePri).contains(F))
-            return true;
         if (!(F->isVirtual() && !M_PREFS->getVirtualNodesVisible())) {
             Node * N = STATIC_CAST_NODE(F);
             N->buildPath(*(pCtxt->theProjection));
-            (*(pCtxt->theFeatures))[NodePri].insert(F);
+            pCtxt->theFeatures->add(NodePri, F);
         }
     } else {
-        if (pCtxt->theFeatures->value(SegmentPri).contains(F))
-            return true;
-        (*(pCtxt->theFeatures))[SegmentPri].insert(F);
+        pCtxt->theFeatures->add(SegmentPri, F);
     }
 
     return true;
@@ -87,6 +77,10 @@ void MemoryBackend::indexAdd(ILayer* l, const QRectF& bb, Feature* aFeat)
         p->theRTree[l] = new CoordTree();
 
     p->AllocFeatures[aFeat] = bb;
+    if (p->BulkIndex.contains(l)) {
+        p->BulkIndex[l].insert(aFeat, bb);
+        return;
+    }
     qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
     qreal max[] = {bb.topRight().x(), bb.topRight().y()};
     p->theRTree[l]->Insert(min, max, aFeat);
@@ -98,12 +92,56 @@ void MemoryBackend::indexRemove(ILayer* l, const QRectF& bb, Feature* aFeat)
         return;
     if (!p->theRTree.contains(l))
         return;
+    if (p->BulkIndex.contains(l) && p->BulkIndex[l].remove(aFeat))
+        return;
 
     qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
     qreal max[] = {bb.topRight().x(), bb.topRight().y()};
     p->theRTree[l]->Remove(min, max, aFeat);
 }
 
+void MemoryBackend::beginBulkIndex(ILayer* l)
+{
+    if (!l)
+        return;
+    if (!p->theRTree.contains(l))
+        p->theRTree[l] = new CoordTree();
+
+    p->BulkIndex[l];
+}
+
+void MemoryBackend::endBulkIndex(ILayer* l)
+{
+    if (!p->BulkIndex.contains(l))
+        return;
+
+    QHash<Feature*, QRectF> pending = p->BulkIndex.take(l);
+    QVector<qreal> mins;
+    QVector<qreal> maxs;
+    QVector<Feature*> feats;
+    mins.reserve(pending.size()*2);
+    maxs.reserve(pending.size()*2);
+    feats.reserve(pending.size());
+
+    QHash<Feature*, QRectF>::const_iterator i = pending.constBegin();
+    for (; i != pending.constEnd(); ++i) {
+        mins << i.value().bottomLeft().x() << i.value().bottomLeft().y();
+        maxs << i.value().topRight().x() << i.value().topRight().y();
+        feats << i.key();
+    }
+    p->theRTree[l]->BulkLoad(feats.size(), mins.constData(), maxs.constData(), feats.constData());
+}
+
+void MemoryBackend::repackIndex(ILayer* l)
+{
+    if (!p->theRTree.contains(l))
+        return;
+    if (p->BulkIndex.contains(l))
+        endBulkIndex(l);
+    else
+        p->theRTree[l]->Repack();
+}
+
 const QList<Feature*>& MemoryBackend::indexFind(ILayer* l, const QRectF& bb)
 {
     p->findResult.clear();
@@ -135,7 +173,7 @@ void MemoryBackend::get(ILayer* l, const QRectF& bb, QList<Feature*>& theFeature
     p->theRTree[l]->Search(min, max, &indexFindCallback, (void*)(&theFeatures));
 }
 
-void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+void MemoryBackend::getFeatureSet(ILayer* l, RenderQueue& theFeatures,
                                   const QList<CoordBox>& invalidRects, Projection& theProjection)
 {
     IndexFindContext ctxt;
@@ -148,7 +186,7 @@ void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*
     }
 }
 
-void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+void MemoryBackend::getFeatureSet(ILayer* l, RenderQueue& theFeatures,
                                   const CoordBox& invalidRect, Projection& theProjection)
 {
     IndexFindContext ctxt;
@@ -165,36 +203,110 @@ void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*
 MemoryBackend::MemoryBackend()
 {
     p = new MemoryBackendPrivate;
+    p->DefaultPool = new FeaturePool;
 }
 
 MemoryBackend::~MemoryBackend()
 {
-//    CoordTree::Iterator it;
-//    p->theRTree.GetFirst(it);
-//    while (!p->theRTree.IsNull(it)) {
-//        delete *it;
-//        p->theRTree.GetNext(it);
-//    }
-
-    QHash<Feature *, CoordBox>::const_iterator i = p->AllocFeatures.constBegin();
-    while (i != p->AllocFeatures.constEnd()) {
-        delete i.key();
-        ++i;
+    QList<FeaturePool*> pools = p->Pools.values() + p->DetachedPools;
+    pools << p->DefaultPool;
+
+    // Destroying a feature may release others (e.g. a way its nodes), so check each one is still alive
+    foreach (FeaturePool* pool, pools) {
+        foreach (void* f, pool->liveObjects(FeaturePool::FeatureSlot))
+            if (FeaturePool::isLive(f))
+                delete static_cast<Feature*>(f);
     }
+    qDeleteAll(pools);
+    qDeleteAll(p->theRTree);
+    qDeleteAll(p->CoordStores);
+    qDeleteAll(p->DetachedCoordStores);
 
     delete p;
 }
 
+FeaturePool* MemoryBackend::featurePool(ILayer* l)
+{
+    if (!l)
+        return p->DefaultPool;
+
+    FeaturePool* pool = p->Pools.value(l);
+    if (!pool) {
+        pool = new FeaturePool;
+        p->Pools.insert(l, pool);
+    }
+    return pool;
+}
+
+NodeCoordStore* MemoryBackend::coordStore(ILayer* l)
+{
+    if (!l)
+        return NULL;
+
+    QHash<ILayer*, NodeCoordStore*>::const_iterator it = p->CoordStores.constFind(l);
+    if (it != p->CoordStores.constEnd())
+        return it.value();
+
+    NodeCoordStore* store = M_PREFS->getColumnarNodeStore() ? new NodeCoordStore : NULL;
+    p->CoordStores.insert(l, store);
+    return store;
+}
+
+void MemoryBackend::attachCoordStore(ILayer* l, Node* N)
+{
+    NodeCoordStore* store = coordStore(l);
+    if (store) {
+        N->CoordStore = store;
+        N->CoordSlot = store->add(N->position());
+    }
+}
+
+void MemoryBackend::releaseLayer(ILayer* l)
+{
+    if (p->theRTree.contains(l))
+        delete p->theRTree.take(l);
+    p->BulkIndex.remove(l);
+
+    // Features may still be used elsewhere (e.g. moved to the dirty layer),
+    // so the slabs of the layer are only given back once they are all gone.
+    if (p->Pools.contains(l))
+        p->DetachedPools << p->Pools.take(l);
+
+    QList<FeaturePool*>::iterator it = p->DetachedPools.begin();
+    while (it != p->DetachedPools.end()) {
+        if (!(*it)->liveCount()) {
+            delete *it;
+            it = p->DetachedPools.erase(it);
+        } else
+            ++it;
+    }
+
+    // Same for the coordinates of nodes still alive
+    NodeCoordStore* store = p->CoordStores.take(l);
+    if (store)
+        p->DetachedCoordStores << store;
+
+    QList<NodeCoordStore*>::iterator si = p->DetachedCoordStores.begin();
+    while (si != p->DetachedCoordStores.end()) {
+        if (!(*si)->liveCount()) {
+            delete *si;
+            si = p->DetachedCoordStores.erase(si);
+        } else
+            ++si;
+    }
+}
+
 Node * MemoryBackend::allocNode(ILayer* l, const Node& other)
 {
     Node* f;
     try {
-        f = new Node(other);
+        f = new (featurePool(l)) Node(other);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
         return NULL;
     }
+    attachCoordStore(l, f);
 
     p->AllocFeatures[f] = f->BBox;
     if (!f->BBox.isNull()) {
@@ -207,12 +319,13 @@ Node * MemoryBackend::allocNode(ILayer* l, const QPointF& aCoord)
 {
     Node* f;
     try {
-        f = new Node(aCoord);
+        f = new (featurePool(l)) Node(aCoord);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
         return NULL;
     }
+    attachCoordStore(l, f);
     p->AllocFeatures[f] = f->BBox;
     if (!f->BBox.isNull()) {
         indexAdd(l, f->BBox, f);
@@ -224,7 +337,7 @@ TrackNode * MemoryBackend::allocTrackNode(ILayer* l, const QPointF& aCoord)
 {
     TrackNode* f;
     try {
-        f = new TrackNode(aCoord);
+        f = new (featurePool(l)) TrackNode(aCoord);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -241,7 +354,7 @@ PhotoNode * MemoryBackend::allocPhotoNode(ILayer* l, const QPointF& aCoord)
 {
     PhotoNode* f;
     try {
-        f = new PhotoNode(aCoord);
+        f = new (featurePool(l)) PhotoNode(aCoord);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -258,7 +371,7 @@ PhotoNode * MemoryBackend::allocPhotoNode(ILayer* l, const Node& other)
 {
     PhotoNode* f;
     try {
-        f = new PhotoNode(other);
+        f = new (featurePool(l)) PhotoNode(other);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -276,7 +389,7 @@ PhotoNode * MemoryBackend::allocPhotoNode(ILayer* l, const TrackNode& other)
 {
     PhotoNode* f;
     try {
-        f = new PhotoNode(other);
+        f = new (featurePool(l)) PhotoNode(other);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -294,7 +407,7 @@ Node * MemoryBackend::allocVirtualNode(const QPointF& aCoord)
 {
     Node* f;
     try {
-        f = new Node(aCoord);
+        f = new (featurePool(NULL)) Node(aCoord);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -303,11 +416,11 @@ Node * MemoryBackend::allocVirtualNode(const QPointF& aCoord)
     return f;
 }
 
-Way * MemoryBackend::allocWay(ILayer* /*l*/)
+Way * MemoryBackend::allocWay(ILayer* l)
 {
     Way* f;
     try {
-        f = new Way();
+        f = new (featurePool(l)) Way();
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -317,11 +430,11 @@ Way * MemoryBackend::allocWay(ILayer* /*l*/)
     return f;
 }
 
-Way * MemoryBackend::allocWay(ILayer* /*l*/, const Way& other)
+Way * MemoryBackend::allocWay(ILayer* l, const Way& other)
 {
     Way* f;
     try {
-        f = new Way(other);
+        f = new (featurePool(l)) Way(other);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -331,11 +444,11 @@ Way * MemoryBackend::allocWay(ILayer* /*l*/, const Way& other)
     return f;
 }
 
-Relation * MemoryBackend::allocRelation(ILayer* /*l*/)
+Relation * MemoryBackend::allocRelation(ILayer* l)
 {
     Relation* f;
     try {
-        f = new Relation();
+        f = new (featurePool(l)) Relation();
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -345,11 +458,11 @@ Relation * MemoryBackend::allocRelation(ILayer* /*l*/)
     return f;
 }
 
-Relation * MemoryBackend::allocRelation(ILayer* /*l*/, const Relation& other)
+Relation * MemoryBackend::allocRelation(ILayer* l, const Relation& other)
 {
     Relation* f;
     try {
-        f = new Relation(other);
+        f = new (featurePool(l)) Relation(other);
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -359,11 +472,11 @@ Relation * MemoryBackend::allocRelation(ILayer* /*l*/, const Relation& other)
     return f;
 }
 
-TrackSegment * MemoryBackend::allocSegment(ILayer* /*l*/)
+TrackSegment * MemoryBackend::allocSegment(ILayer* l)
 {
     TrackSegment* f;
     try {
-        f = new TrackSegment();
+        f = new (featurePool(l)) TrackSegment();
         if (!f)
             return NULL;
     } catch (...) { // Out-of-memory?
@@ -373,9 +486,17 @@ TrackSegment * MemoryBackend::allocSegment(ILayer* /*l*/)
     return f;
 }
 
+// The tile renderer only redraws what changed
+static void touchDocument(Feature* f, const CoordBox& bb)
+{
+    if (f->layer() && f->layer()->getDocument())
+        f->layer()->getDocument()->touch(bb);
+}
+
 void MemoryBackend::deallocFeature(ILayer* l, Feature *f)
 {
     if (p->AllocFeatures.contains(f)) {
+        touchDocument(f, p->AllocFeatures[f]);
         indexRemove(l, p->AllocFeatures[f], f);
         p->AllocFeatures.remove(f);
     }
@@ -388,8 +509,10 @@ void MemoryBackend::deallocVirtualNode(Feature *f)
 
 void MemoryBackend::sync(Feature *f)
 {
-    if (p->AllocFeatures.contains(f) && !p->AllocFeatures[f].isNull())
+    if (p->AllocFeatures.contains(f) && !p->AllocFeatures[f].isNull()) {
+        touchDocument(f, p->AllocFeatures[f]);
         indexRemove(f->layer(), p->AllocFeatures[f], f);
+    }
     if (CHECK_NODE(f)) {
         Node* N = STATIC_CAST_NODE(f);
         if (!N->tagSize())
@@ -400,6 +523,7 @@ void MemoryBackend::sync(Feature *f)
     if (!f->isDeleted() && f->layer()) {
         CoordBox bb = f->boundingBox();
         if (!bb.isNull()) {
+            touchDocument(f, bb);
             indexAdd(f->layer(), bb, f);
         }
     }
@@ -2,9 +2,10 @@
 #define MEMORYBACKEND_H
 
 #include "Features.h"
+#include "RenderQueue.h"
 
 struct IndexFindContext {
-    QMap<RenderPriority, QSet <Feature*> >* theFeatures;
+    RenderQueue* theFeatures;
     QRectF* clipRect;
     Projection* theProjection;
     QTransform* theTransform;
@@ -12,6 +13,8 @@ struct IndexFindContext {
 };
 
 class MemoryBackendPrivate;
+class FeaturePool;
+class NodeCoordStore;
 class MemoryBackend
 {
 public:
@@ -41,18 +44,36 @@ public:
     virtual void deallocFeature(ILayer* l, Feature* f);
     virtual void deallocVirtualNode(Feature* f);
 
+    /// Pool the features of layer l are allocated from (the default pool if l is NULL)
+    FeaturePool* featurePool(ILayer* l);
+    /// Column store the node coordinates of layer l are kept in, or NULL if the layer doesn't use one.
+    /// Whether a layer uses one is decided by the ColumnarNodeStore preference when it first gets a node.
+    NodeCoordStore* coordStore(ILayer* l);
+    /// Layer l is being destroyed: drop its index and release its pool once empty
+    virtual void releaseLayer(ILayer* l);
+
     virtual void sync(Feature* f);
 
     virtual const QList<Feature*>& indexFind(ILayer* l, const QRectF& vp);
     virtual void indexFind(ILayer* l, const QRectF& bb, const IndexFindContext& findResult);
     virtual void get(ILayer* l, const QRectF& bb, QList<Feature*>& theFeatures);
-    virtual void getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+    /// Queue the visible features of l in the boxes, building their paths.
+    /// The queue is left unsorted, with duplicates: call RenderQueue::sort() once all layers are in.
+    virtual void getFeatureSet(ILayer* l, RenderQueue& theFeatures,
                                const QList<CoordBox>& invalidRects, Projection& theProjection);
-    virtual void getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+    virtual void getFeatureSet(ILayer* l, RenderQueue& theFeatures,
                                const CoordBox& invalidRect, Projection& theProjection);
     virtual void indexAdd(ILayer* l, const QRectF& bb, Feature* aFeat);
     virtual void indexRemove(ILayer* l, const QRectF& bb, Feature* aFeat);
 
+    /// Defer index insertions for layer l until endBulkIndex(), which packs them in one go
+    virtual void beginBulkIndex(ILayer* l);
+    virtual void endBulkIndex(ILayer* l);
+    /// Rebuild the index of layer l, packing nodes left fragmented by edits
+    virtual void repackIndex(ILayer* l);
+
+protected:
+    void attachCoordStore(ILayer* l, Node* N);
 };
 
 #endif // MEMORYBACKEND_H
@@ -0,0 +1,149 @@
+#include "NodeCoordStore.h"
+
+#include "Projection.h"
+
+#include <QAtomicInt>
+
+#include <string.h>
+
+#define PAGE_BITS 12
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define MAX_PAGES (1 << 14)
+
+struct NodeCoordStore::Page
+{
+    qreal Lon[PAGE_SIZE];
+    qreal Lat[PAGE_SIZE];
+    qreal X[PAGE_SIZE];
+    qreal Y[PAGE_SIZE];
+    // Projection revision X/Y are valid for, 0 if they must be recomputed or are being written
+    QAtomicInt Rev[PAGE_SIZE];
+};
+
+NodeCoordStore::NodeCoordStore()
+    : Count(0), Live(0)
+{
+    Pages = new Page*[MAX_PAGES];
+    memset(Pages, 0, MAX_PAGES * sizeof(Page*));
+}
+
+NodeCoordStore::~NodeCoordStore()
+{
+    for (int i=0; i<MAX_PAGES && Pages[i]; ++i)
+        delete Pages[i];
+    delete [] Pages;
+}
+
+NodeCoordStore::Page* NodeCoordStore::page(quint32 slot) const
+{
+    return Pages[slot >> PAGE_BITS];
+}
+
+quint32 NodeCoordStore::add(const Coord& C)
+{
+    quint32 slot;
+    if (!Free.isEmpty()) {
+        slot = Free.takeLast();
+    } else {
+        slot = Count;
+        int pg = slot >> PAGE_BITS;
+        // Going on would write past the page directory
+        if (pg >= MAX_PAGES)
+            qFatal("NodeCoordStore: more than %d nodes in a layer", MAX_PAGES * PAGE_SIZE);
+        if (!Pages[pg])
+            Pages[pg] = new Page;
+        ++Count;
+    }
+    ++Live;
+    setPosition(slot, C);
+    return slot;
+}
+
+void NodeCoordStore::release(quint32 slot)
+{
+    Free << slot;
+    --Live;
+}
+
+void NodeCoordStore::setPosition(quint32 slot, const Coord& C)
+{
+    Page* pg = page(slot);
+    int i = slot & PAGE_MASK;
+    pg->Lon[i] = C.x();
+    pg->Lat[i] = C.y();
+    pg->Rev[i].fetchAndStoreOrdered(0);
+}
+
+Coord NodeCoordStore::position(quint32 slot) const
+{
+    Page* pg = page(slot);
+    int i = slot & PAGE_MASK;
+    return Coord(pg->Lon[i], pg->Lat[i]);
+}
+
+/* Seqlock style: writers clear Rev, write X/Y and publish Rev again, one at a time.
+   Readers check Rev before and after reading X/Y; if it changed in between, they project themselves. */
+QPointF NodeCoordStore::cachedProjection(Page* pg, int i, const Projection& aProjection)
+{
+    int rev = aProjection.projectionRevision();
+    // testAndSet*(rev, rev) only reads Rev, with the wanted ordering
+    if (pg->Rev[i].testAndSetAcquire(rev, rev)) {
+        QPointF P(pg->X[i], pg->Y[i]);
+        if (pg->Rev[i].testAndSetOrdered(rev, rev))
+            return P;
+    }
+
+    QPointF P = aProjection.project(QPointF(pg->Lon[i], pg->Lat[i]));
+    QMutexLocker lock(&CacheLock);
+    if (!pg->Rev[i].testAndSetAcquire(rev, rev)) {
+        pg->Rev[i].fetchAndStoreOrdered(0);
+        pg->X[i] = P.x();
+        pg->Y[i] = P.y();
+        pg->Rev[i].fetchAndStoreRelease(rev);
+    }
+    return P;
+}
+
+QPointF NodeCoordStore::projected(quint32 slot, const Projection& aProjection)
+{
+    return cachedProjection(page(slot), slot & PAGE_MASK, aProjection);
+}
+
+void NodeCoordStore::project(const quint32* slots, int n, const Projection& aProjection, QPointF* out)
+{
+    for (int k=0; k<n; ++k)
+        out[k] = cachedProjection(page(slots[k]), slots[k] & PAGE_MASK, aProjection);
+}
+
+CoordBox NodeCoordStore::boundingBox(const quint32* slots, int n) const
+{
+    qreal minLon = 0, minLat = 0, maxLon = 0, maxLat = 0;
+    bool haveFirst = false;
+    for (int k=0; k<n; ++k) {
+        Page* pg = page(slots[k]);
+        int i = slots[k] & PAGE_MASK;
+        qreal lon = pg->Lon[i];
+        qreal lat = pg->Lat[i];
+        if (lon == 0. && lat == 0.)
+            continue;
+        if (!haveFirst) {
+            minLon = maxLon = lon;
+            minLat = maxLat = lat;
+            haveFirst = true;
+            continue;
+        }
+        minLon = qMin(minLon, lon);
+        maxLon = qMax(maxLon, lon);
+        minLat = qMin(minLat, lat);
+        maxLat = qMax(maxLat, lat);
+    }
+    if (!haveFirst)
+        return CoordBox();
+    return CoordBox(Coord(minLon, minLat), Coord(maxLon, maxLat));
+}
+
+int NodeCoordStore::liveCount() const
+{
+    return Live;
+}
@@ -0,0 +1,53 @@
+#ifndef NODECOORDSTORE_H
+#define NODECOORDSTORE_H
+
+#include <QtGlobal>
+#include <QList>
+#include <QMutex>
+
+#include "Coord.h"
+
+class Projection;
+
+/// Column store of node coordinates for one layer.
+/// Longitudes, latitudes and their projections are kept in separate contiguous arrays indexed
+/// by a node slot, so that a way can build its path or bounding box with a scan over its slots
+/// instead of visiting each of its nodes. Arrays grow by pages that never move, so readers
+/// don't have to lock against a slot being added. Projections are cached per slot; any number
+/// of rendering threads may read and fill that cache at once.
+class NodeCoordStore
+{
+public:
+    NodeCoordStore();
+    ~NodeCoordStore();
+
+    quint32 add(const Coord& C);
+    void release(quint32 slot);
+
+    void setPosition(quint32 slot, const Coord& C);
+    Coord position(quint32 slot) const;
+    /// Projected position of slot, reprojecting it if aProjection changed since
+    QPointF projected(quint32 slot, const Projection& aProjection);
+
+    /// Projects n slots into out
+    void project(const quint32* slots, int n, const Projection& aProjection, QPointF* out);
+    /// Bounding box of the non null positions of n slots (null if there are none)
+    CoordBox boundingBox(const quint32* slots, int n) const;
+
+    int liveCount() const;
+
+private:
+    struct Page;
+
+    Page* page(quint32 slot) const;
+    QPointF cachedProjection(Page* pg, int i, const Projection& aProjection);
+
+    Page** Pages;
+    quint32 Count;
+    QList<quint32> Free;
+    int Live;
+    // Serializes the writes to the projection cache
+    QMutex CacheLock;
+};
+
+#endif // NODECOORDSTORE_H
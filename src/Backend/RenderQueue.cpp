@@ -0,0 +1,125 @@
+#include "RenderQueue.h"
+
+#include "Feature.h"
+
+#include <algorithm>
+#include <string.h>
+
+#define RADIX_BITS 16
+#define RADIX_SIZE (1 << RADIX_BITS)
+// Below this, clearing the digit counts costs more than a comparison sort
+#define RADIX_MIN 4096
+
+RenderQueue::RenderQueue()
+    : Count(0)
+{
+}
+
+void RenderQueue::reserve(int n)
+{
+    if (n > Items.size())
+        Items.resize(n);
+}
+
+void RenderQueue::clear()
+{
+    Count = 0;
+}
+
+void RenderQueue::add(const RenderPriority& aPriority, Feature* F)
+{
+    Item it;
+    it.Key = aPriority.sortKey();
+    it.F = F;
+    it.Layer = aPriority.layer();
+    append(it);
+}
+
+void RenderQueue::append(const Item& anItem)
+{
+    if (Count == Items.size())
+        Items.resize(qMax(256, Count * 2));
+    Items[Count++] = anItem;
+}
+
+static bool byKey(const RenderQueue::Item& a, const RenderQueue::Item& b)
+{
+    return a.Key < b.Key;
+}
+
+static bool byFeature(const RenderQueue::Item& a, const RenderQueue::Item& b)
+{
+    return a.F < b.F;
+}
+
+static bool sameFeature(const RenderQueue::Item& a, const RenderQueue::Item& b)
+{
+    return a.F == b.F;
+}
+
+void RenderQueue::sort()
+{
+    if (Count < 2)
+        return;
+
+    if (Count < RADIX_MIN)
+        std::sort(Items.data(), Items.data() + Count, byKey);
+    else
+        radixSort();
+
+    // A feature always comes with the same key, so its copies end up in the same run
+    Item* out = Items.data();
+    Item* end = Items.data() + Count;
+    for (Item* run = Items.data(); run != end; ) {
+        Item* runEnd = run + 1;
+        while (runEnd != end && runEnd->Key == run->Key)
+            ++runEnd;
+        if (runEnd - run > 1) {
+            std::sort(run, runEnd, byFeature);
+            Item* last = std::unique(run, runEnd, sameFeature);
+            out = std::copy(run, last, out);
+        } else
+            *out++ = *run;
+        run = runEnd;
+    }
+    Count = out - Items.data();
+}
+
+// LSD radix sort, 16 bits at a time; passes where all keys share the digit are skipped
+void RenderQueue::radixSort()
+{
+    if (Scratch.size() < Count)
+        Scratch.resize(Count);
+    Item* src = Items.data();
+    Item* dst = Scratch.data();
+    QVector<int> counts(RADIX_SIZE);
+    for (int shift=0; shift<64; shift += RADIX_BITS) {
+        int* c = counts.data();
+        memset(c, 0, RADIX_SIZE * sizeof(int));
+        for (int i=0; i<Count; ++i)
+            ++c[(src[i].Key >> shift) & (RADIX_SIZE-1)];
+        if (c[(src[0].Key >> shift) & (RADIX_SIZE-1)] == Count)
+            continue;
+
+        int sum = 0;
+        for (int d=0; d<RADIX_SIZE; ++d) {
+            int n = c[d];
+            c[d] = sum;
+            sum += n;
+        }
+        for (int i=0; i<Count; ++i)
+            dst[c[(src[i].Key >> shift) & (RADIX_SIZE-1)]++] = src[i];
+        qSwap(src, dst);
+    }
+    if (src != Items.data())
+        memcpy(Items.data(), src, Count * sizeof(Item));
+}
+
+int RenderQueue::layerEnd(int i) const
+{
+    int layer = Items[i].Layer;
+    int j = i + 1;
+    while (j < Count && Items[j].Layer == layer)
+        ++j;
+    return j;
+}
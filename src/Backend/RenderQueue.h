@@ -0,0 +1,53 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <QtGlobal>
+#include <QVector>
+
+class Feature;
+class RenderPriority;
+
+/// Features to draw, in drawing order.
+/// Backend queries add features in any order, possibly more than once; sort() then puts them
+/// in RenderPriority order with a radix sort on RenderPriority::sortKey() and drops the duplicates.
+/// Storage is kept across clear(), so a queue that is reused doesn't reallocate.
+class RenderQueue
+{
+public:
+    struct Item
+    {
+        quint64 Key;
+        Feature* F;
+        int Layer;
+    };
+
+    RenderQueue();
+
+    void reserve(int n);
+    void clear();
+
+    /// Queue F, to be drawn at aPriority
+    void add(const RenderPriority& aPriority, Feature* F);
+    /// Queue an item taken, in order, from a sorted queue
+    void append(const Item& anItem);
+    /// Sort in drawing order and drop duplicates
+    void sort();
+
+    int size() const { return Count; }
+    bool isEmpty() const { return !Count; }
+    const Item& at(int i) const { return Items[i]; }
+    Feature* feature(int i) const { return Items[i].F; }
+    /// End of the run of items from i on that share the layer of item i
+    int layerEnd(int i) const;
+
+private:
+    void radixSort();
+
+    QVector<Item> Items;
+    QVector<Item> Scratch;
+    int Count;
+};
+
+Q_DECLARE_TYPEINFO(RenderQueue::Item, Q_PRIMITIVE_TYPE);
+
+#endif // RENDERQUEUE_H
@@ -15,17 +15,84 @@
 #include <QFile>
 
 #include "Features.h"
+#include "Layer.h"
+#include "Document.h"
 #include "MerkaartorPreferences.h"
+#ifndef _MOBILE
+#include "MainWindow.h"
+#include "PropertiesDock.h"
+#endif
+
+#include <algorithm>
+
+// Ids looked up per query by prefetch()
+#define PREFETCH_BATCH 100
+
+typedef QPair<int, qint64> StoreKey;
+
+static StoreKey storeKey(const IFeature::FId& id)
+{
+    return qMakePair((int)id.type, id.numId);
+}
 
 class SpatialBackendPrivate
 {
 public:
-    QHash<Feature*, qint64> AllocFeatures;
-    QList<Feature*> findResult;
+    SpatialBackendPrivate()
+        : Loading(0), Evicting(false), Streaming(false), Generation(0), StoredCount(0)
+    {
+    }
+
+    int Loading;
+    bool Evicting;
+    bool Streaming;
+    quint32 Generation;
+    int StoredCount;
+
+    // Smallest and largest id stored per feature type, to skip pointless lookups
+    QHash<int, QPair<qint64, qint64> > IdRange;
+    QHash<Feature*, quint32> LastUse;
+    QHash<Feature*, uint> LoadedSignature;
+    // Features that came back after the user moved them away: never paged out again
+    QSet<Feature*> Pinned;
+    // Stored features that left the layer: their rows are stale
+    QSet<StoreKey> Detached;
+    // Looked up by the last prefetch() and not stored
+    QSet<StoreKey> KnownMissing;
+    // Paged in by visitStored() for the current batch
+    QList<Feature*> Streamed;
+    QHash<QPair<QString, QString>, qint64> TagIds;
+
+    CoordBox LoadedBox;
+    CoordBox LastViewport;
+    CoordBox Extent;
 };
 
-SpatialiteBackend::SpatialiteBackend()
-    : SpatialiteBase(), p(new SpatialBackendPrivate)
+/* Cheap fingerprint of what gets stored, to only write back features that changed since they were loaded */
+static uint signature(Feature* F)
+{
+    uint h = 0;
+#ifndef FRISIUS_BUILD
+    h = F->versionNumber();
+#endif
+    for (int i=0; i<F->tagSize(); ++i)
+        h = h * 31 + (qHash(F->tagKey(i)) ^ qHash(F->tagValue(i)));
+    if (CHECK_NODE(F)) {
+        h = h * 31 + qHash(STATIC_CAST_NODE(F)->position());
+    } else if (CHECK_WAY(F)) {
+        Way* W = STATIC_CAST_WAY(F);
+        for (int i=0; i<W->size(); ++i)
+            h = h * 31 + qHash(W->getNode(i)->id().numId);
+    } else if (CHECK_RELATION(F)) {
+        Relation* R = STATIC_CAST_RELATION(F);
+        for (int i=0; i<R->size(); ++i)
+            h = h * 31 + (qHash(R->get(i)->id().numId) ^ qHash(R->getRole(i)));
+    }
+    return h;
+}
+
+SpatialiteBackend::SpatialiteBackend(Layer* aLayer)
+    : SpatialiteBase(), p(new SpatialBackendPrivate), theLayer(aLayer)
 {
     /*
     VERY IMPORTANT:
@@ -41,12 +108,12 @@ SpatialiteBackend::SpatialiteBackend()
 
     isTemp = true;
     theFilename = HOMEDIR + "/" + QDateTime::currentDateTime().toString("yyyyMMdd-hhmmsszzz") + ".spatialite";
-    open(HOMEDIR + "/temDb.spatialite", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    open(theFilename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
     InitializeNew();
 }
 
-SpatialiteBackend::SpatialiteBackend(const QString& filename)
-    : SpatialiteBase(), p(new SpatialBackendPrivate)
+SpatialiteBackend::SpatialiteBackend(Layer* aLayer, const QString& filename)
+    : SpatialiteBase(), p(new SpatialBackendPrivate), theLayer(aLayer)
 {
     /*
     VERY IMPORTANT:
@@ -68,8 +135,19 @@ SpatialiteBackend::SpatialiteBackend(const QString& filename)
 
 SpatialiteBackend::~SpatialiteBackend()
 {
+    SpatialStatement* statements[] = {
+        &fSelectFeature, &fSelectFeatureById, &fSelectFeatureBbox, &fSelectFeatureBatch, &fSelectFeatureIds, &fInsertFeature, &fInsertNode, &fDeleteFeature,
+        &fSelectTag, &fInsertTag, &fSelectFeatureTags, &fInsertFeatureTags, &fDeleteFeatureTags,
+        &fSelectWayNodes, &fInsertWayNodes, &fDeleteWayNodes,
+        &fSelectRelationMembers, &fInsertRelationMembers, &fDeleteRelationMembers
+    };
+    for (unsigned int i=0; i<sizeof(statements)/sizeof(statements[0]); ++i)
+        statements[i]->finalize();
+    close();
+
     if (isTemp)
         QFile::remove(theFilename);
+    delete p;
 }
 
 void SpatialiteBackend::InitializeNew()
@@ -81,11 +159,14 @@ void SpatialiteBackend::InitializeNew()
     //
     exec(
          "CREATE TABLE IF NOT EXISTS feature ("
-         "   type UNSIGNED CHAR,"
+         "   type INTEGER,"
          "   id INTEGER,"
          "   version INTEGER,"
-         "   timestamp TIMESTAMP,"
+         "   timestamp INTEGER,"
          "   user TEXT DEFAULT NULL,"
+         "   actor INTEGER,"
+         "   lon REAL,"
+         "   lat REAL,"
 
          "   PRIMARY KEY (type, id)"
          "       );"
@@ -115,7 +196,7 @@ void SpatialiteBackend::InitializeNew()
          "CREATE TABLE IF NOT EXISTS way_nodes ("
          "   id_way INTEGER REFERENCES feature,"
          "   rang INTEGER(5),"
-         "   id_node INTEGER REFERENCES feature,"
+         "   id_node INTEGER,"
          "   PRIMARY KEY (id_way, rang));"
                 );
 
@@ -129,19 +210,36 @@ void SpatialiteBackend::InitializeNew()
          "   type INTEGER(1) NOT NULL,"
          "   id_member INTEGER NOT NULL,"
          "   role TEXT NULL,"
-         "   PRIMARY KEY (id_relation, rang, type, id_member))");
-
-    fSelectFeature = SpatialStatement(this, "SELECT ROWID from feature where (type = ? AND id = ?)");
-    fSelectFeatureBbox = SpatialStatement(this, "SELECT * from feature where ROWID IN "
-                                       "(Select rowid from idx_feature_Geometry WHERE xmax > ? and ymax > ? and xmin < ? and ymin < ?);");
+         "   PRIMARY KEY (id_relation, rang))");
+
+#define FEATURE_COLUMNS "type, id, version, timestamp, user, actor, lon, lat, ROWID"
+    fSelectFeature = SpatialStatement(this, "SELECT ROWID FROM feature WHERE (type = ? AND id = ?)");
+    fSelectFeatureById = SpatialStatement(this, "SELECT " FEATURE_COLUMNS " FROM feature WHERE (type = ? AND id = ?)");
+    fSelectFeatureBbox = SpatialStatement(this, "SELECT " FEATURE_COLUMNS " FROM feature WHERE ROWID IN "
+                                       "(SELECT pkid FROM idx_feature_GEOMETRY WHERE xmax > ? AND ymax > ? AND xmin < ? AND ymin < ?)");
+    fSelectFeatureBatch = SpatialStatement(this, "SELECT " FEATURE_COLUMNS " FROM feature WHERE (type = ? AND ROWID > ?) ORDER BY ROWID LIMIT ?");
+    QString idParams = "?";
+    for (int i=1; i<PREFETCH_BATCH; ++i)
+        idParams += ",?";
+    fSelectFeatureIds = SpatialStatement(this, QString("SELECT " FEATURE_COLUMNS " FROM feature WHERE (type = ? AND id IN (%1))").arg(idParams));
+    fInsertFeature = SpatialStatement(this, "INSERT INTO feature (type, id, version, timestamp, user, actor, lon, lat, GEOMETRY) "
+                                      "VALUES (?,?,?,?,?,?,?,?,BuildMbr(?,?,?,?,4326))");
+    fInsertNode = SpatialStatement(this, "INSERT INTO feature (type, id, version, timestamp, user, actor, lon, lat, GEOMETRY) "
+                                   "VALUES (?,?,?,?,?,?,?,?,MakePoint(?,?,4326))");
+    fDeleteFeature = SpatialStatement(this, "DELETE FROM feature WHERE ROWID = ?");
 
     fSelectTag = SpatialStatement(this, "SELECT id FROM tag WHERE (key=? AND value=?)");
     fInsertTag = SpatialStatement(this, "INSERT INTO tag (key, value) VALUES (?,?)");
-    fCreateFeature = SpatialStatement(this, "INSERT INTO feature (type) VALUES (?)");
-    fUpdateFeature = SpatialStatement(this, "UPDATE feature set version=?,uid=?,actor=?,virtual=?,deleted=?,special=?,uploaded=?,dirtylevel=?,timestamp=?,bbox=?) WHERE ROWID=?");
+    fSelectFeatureTags = SpatialStatement(this, "SELECT tag.key, tag.value FROM feature_tags JOIN tag ON tag.id = feature_tags.id_tag "
+                                          "WHERE feature_tags.id_feature = ?");
     fInsertFeatureTags = SpatialStatement(this, "INSERT INTO feature_tags (id_feature, id_tag) VALUES (?,?)");
+    fDeleteFeatureTags = SpatialStatement(this, "DELETE FROM feature_tags WHERE id_feature = ?");
+    fSelectWayNodes = SpatialStatement(this, "SELECT id_node FROM way_nodes WHERE id_way = ? ORDER BY rang");
     fInsertWayNodes = SpatialStatement(this, "INSERT INTO way_nodes (id_way, id_node, rang) VALUES (?,?,?)");
+    fDeleteWayNodes = SpatialStatement(this, "DELETE FROM way_nodes WHERE id_way = ?");
+    fSelectRelationMembers = SpatialStatement(this, "SELECT type, id_member, role FROM relation_members WHERE id_relation = ? ORDER BY rang");
     fInsertRelationMembers = SpatialStatement(this, "INSERT INTO relation_members (id_relation, type, id_member, role, rang) VALUES (?,?,?,?,?)");
+    fDeleteRelationMembers = SpatialStatement(this, "DELETE FROM relation_members WHERE id_relation = ?");
 
     exec("PRAGMA cache_size = 10000");
     exec("PRAGMA synchronous = OFF");
@@ -150,126 +248,553 @@ void SpatialiteBackend::InitializeNew()
     exec("PRAGMA locking_mode = EXCLUSIVE");
 }
 
-void SpatialiteBackend::updateFeature(Feature *F)
+int SpatialiteBackend::storedCount() const
 {
-    qint64 rowid;
-    fSelectFeature.bind_int(1, F->id().type);
-    fSelectFeature.bind_int64(2, F->id().numId);
-    if (fSelectFeature.step()) {
-        rowid = fSelectFeature.col_int64(1);
-        fUpdateFeature.bind_int(1, F->versionNumber());
-    }
+    return p->StoredCount;
+}
+
+int SpatialiteBackend::residentCount() const
+{
+    return theLayer->size();
 }
 
-void SpatialiteBackend::deleteFeature(Feature *F)
+CoordBox SpatialiteBackend::extent() const
 {
+    return p->Extent;
 }
 
-/*******/
+/* Layer notifications */
 
-Node * SpatialiteBackend::allocNode(const Node& other)
+void SpatialiteBackend::featureAdded(Feature* F)
 {
-    fCreateFeature.bind_int(1, 'N');
-    if (fCreateFeature.step()) {
-        Node* f = new Node(other);
-        f->internal_id = lastRowId();
-        p->AllocFeatures[f] = f->internal_id;
-        return f;
+    if (p->Loading) {
+        p->LastUse[F] = p->Generation;
+        if (p->Streaming)
+            p->Streamed << F;
+        return;
     }
-    return NULL;
+    if (CHECK_NODE(F)) {
+        Coord C = STATIC_CAST_NODE(F)->position();
+        if (p->Extent.isNull())
+            p->Extent = CoordBox(C, C);
+        else
+            p->Extent.merge(C);
+    }
+    // Coming back to the layer (i.e. undo): whoever moved it away may still hold it
+    if (p->Detached.remove(storeKey(F->id())))
+        p->Pinned.insert(F);
 }
 
-Node * SpatialiteBackend::allocNode(const QPointF& aCoord)
+void SpatialiteBackend::featureRemoved(Feature* F)
 {
-    fCreateFeature.bind_int(1, 'N');
-    if (fCreateFeature.step()) {
-        Node* f = new Node(aCoord);
-        f->internal_id = lastRowId();
-        p->AllocFeatures[f] = f->internal_id;
-        return f;
+    p->LastUse.remove(F);
+    p->LoadedSignature.remove(F);
+    if (p->Evicting)
+        return;
+
+    p->Pinned.remove(F);
+    if (p->StoredCount)
+        p->Detached.insert(storeKey(F->id()));
+}
+
+/* Paging in */
+
+bool SpatialiteBackend::needsPaging(const CoordBox& bb) const
+{
+    return (bb != p->LastViewport);
+}
+
+int SpatialiteBackend::pageIn(const CoordBox& bb)
+{
+    if (!needsPaging(bb))
+        return 0;
+    p->LastViewport = bb;
+    ++p->Generation;
+
+    int loaded = 0;
+    if (p->StoredCount && !(p->LoadedBox.contains(bb))) {
+        QList<StoredFeature> rows;
+        fSelectFeatureBbox.bind_double(1, bb.bottomLeft().x());
+        fSelectFeatureBbox.bind_double(2, bb.bottomLeft().y());
+        fSelectFeatureBbox.bind_double(3, bb.topRight().x());
+        fSelectFeatureBbox.bind_double(4, bb.topRight().y());
+        while (fSelectFeatureBbox.step()) {
+            StoredFeature row;
+            readRow(fSelectFeatureBbox, row);
+            rows << row;
+        }
+        fSelectFeatureBbox.reset();
+
+        // Nodes first, so that ways find them resident
+        for (int pass=0; pass<3; ++pass) {
+            char type = (pass == 0 ? IFeature::Point : (pass == 1 ? IFeature::LineString : IFeature::OsmRelation));
+            foreach (const StoredFeature& row, rows)
+                if (row.type == type && materialize(row))
+                    ++loaded;
+        }
+        p->LoadedBox = bb;
     }
-    return NULL;
+
+    // Stamp what is in view, so that trim() pages out the least recently viewed features first
+    const QList<Feature*>& inView = g_backend.indexFind(theLayer, bb);
+    for (int i=0; i<inView.size(); ++i)
+        if (p->LastUse.contains(inView.at(i)))
+            p->LastUse[inView.at(i)] = p->Generation;
+
+    trim(bb);
+    return loaded;
 }
 
-Way * SpatialiteBackend::allocWay()
+Feature* SpatialiteBackend::load(const IFeature::FId& id)
 {
-    fCreateFeature.bind_int(1, 'W');
-    if (fCreateFeature.step()) {
-        Way* f = new Way();
-        f->internal_id = lastRowId();
-        p->AllocFeatures[f] = f->internal_id;
-        return f;
+    if (!p->StoredCount)
+        return NULL;
+
+    static const char types[] = { IFeature::Point, IFeature::LineString, IFeature::OsmRelation };
+    for (int t=0; t<3; ++t) {
+        if (!(id.type & types[t]))
+            continue;
+        QHash<int, QPair<qint64, qint64> >::const_iterator r = p->IdRange.constFind(types[t]);
+        if (r == p->IdRange.constEnd() || id.numId < r.value().first || id.numId > r.value().second)
+            continue;
+        if (p->Detached.contains(qMakePair((int)types[t], id.numId)))
+            continue;
+        if (p->KnownMissing.contains(qMakePair((int)types[t], id.numId)))
+            continue;
+
+        StoredFeature row;
+        if (fetch(types[t], id.numId, row))
+            return materialize(row);
     }
     return NULL;
 }
 
-Way * SpatialiteBackend::allocWay(const Way& other)
+int SpatialiteBackend::prefetch(const QList<IFeature::FId>& ids)
 {
-    fCreateFeature.bind_int(1, 'W');
-    if (fCreateFeature.step()) {
-        Way* f = new Way(other);
-        f->internal_id = lastRowId();
-        p->AllocFeatures[f] = f->internal_id;
-        return f;
+    p->KnownMissing.clear();
+    if (!p->StoredCount)
+        return 0;
+    Document* theDocument = theLayer->getDocument();
+
+    int loaded = 0;
+    static const char types[] = { IFeature::Point, IFeature::LineString, IFeature::OsmRelation };
+    for (int t=0; t<3; ++t) {
+        QHash<int, QPair<qint64, qint64> >::const_iterator r = p->IdRange.constFind(types[t]);
+        if (r == p->IdRange.constEnd())
+            continue;
+
+        QSet<qint64> wanted;
+        for (int i=0; i<ids.size(); ++i) {
+            const IFeature::FId& id = ids.at(i);
+            if (id.type != types[t] || id.numId < r.value().first || id.numId > r.value().second)
+                continue;
+            if (p->Detached.contains(storeKey(id)))
+                continue;
+            if (theDocument && theDocument->getResidentFeature(id))
+                continue;
+            wanted.insert(id.numId);
+        }
+        if (wanted.isEmpty())
+            continue;
+
+        QList<qint64> batch = wanted.toList();
+        QList<StoredFeature> rows;
+        for (int i=0; i<batch.size(); i += PREFETCH_BATCH) {
+            fSelectFeatureIds.bind_int(1, types[t]);
+            // Unused parameters repeat the last id
+            for (int j=0; j<PREFETCH_BATCH; ++j)
+                fSelectFeatureIds.bind_int64(j+2, batch.at(qMin(i+j, batch.size()-1)));
+            while (fSelectFeatureIds.step()) {
+                StoredFeature row;
+                readRow(fSelectFeatureIds, row);
+                rows << row;
+                wanted.remove(row.id);
+            }
+            fSelectFeatureIds.reset();
+        }
+
+        foreach (const StoredFeature& row, rows)
+            if (materialize(row))
+                ++loaded;
+        foreach (qint64 id, wanted)
+            p->KnownMissing.insert(qMakePair((int)types[t], id));
     }
-    return NULL;
+    return loaded;
 }
 
-Relation * SpatialiteBackend::allocRelation()
+bool SpatialiteBackend::visitStored(StoredFeatureVisitor& aVisitor, int aBatchSize)
 {
-    fCreateFeature.bind_int(1, 'R');
-    if (fCreateFeature.step()) {
-        Relation* f = new Relation();
-        f->internal_id = lastRowId();
-        p->AllocFeatures[f] = f->internal_id;
-        return f;
+    if (!p->StoredCount)
+        return true;
+    Document* theDocument = theLayer->getDocument();
+
+    bool OK = true;
+    static const char types[] = { IFeature::Point, IFeature::LineString, IFeature::OsmRelation };
+    for (int t=0; t<3 && OK; ++t) {
+        qint64 lastRowId = 0;
+        for (;;) {
+            QList<StoredFeature> rows;
+            fSelectFeatureBatch.bind_int(1, types[t]);
+            fSelectFeatureBatch.bind_int64(2, lastRowId);
+            fSelectFeatureBatch.bind_int(3, aBatchSize);
+            while (fSelectFeatureBatch.step()) {
+                StoredFeature row;
+                readRow(fSelectFeatureBatch, row);
+                rows << row;
+            }
+            fSelectFeatureBatch.reset();
+            if (rows.isEmpty())
+                break;
+            lastRowId = rows.last().rowid;
+
+            // Resident features are the caller's: only those paged in here are visited
+            QList<Feature*> batch;
+            p->Streaming = true;
+            foreach (const StoredFeature& row, rows) {
+                IFeature::FId id(row.type, row.id);
+                Feature* F = materialize(row);
+                if (!F && theDocument) {
+                    F = theDocument->getResidentFeature(id);
+                    if (!p->Streamed.contains(F))
+                        F = NULL;
+                }
+                if (F)
+                    batch << F;
+            }
+            p->Streaming = false;
+
+            if (!batch.isEmpty() && !aVisitor.visit(batch))
+                OK = false;
+            releaseStreamed();
+            if (!OK)
+                break;
+        }
     }
-    return NULL;
+    return OK;
+}
+
+void SpatialiteBackend::readRow(SpatialStatement& st, StoredFeature& row)
+{
+    row.type = st.col_int(0);
+    row.id = st.col_int64(1);
+    row.version = st.col_int(2);
+    row.timestamp = st.col_int64(3);
+    row.user = st.col_string(4);
+    row.actor = st.col_int(5);
+    row.lon = st.col_double(6);
+    row.lat = st.col_double(7);
+    row.rowid = st.col_int64(8);
 }
 
-Relation * SpatialiteBackend::allocRelation(const Relation& other)
+bool SpatialiteBackend::fetch(char type, qint64 id, StoredFeature& row)
 {
-    fCreateFeature.bind_int(1, 'R');
-    if (fCreateFeature.step()) {
-        Relation* f = new Relation(other);
-        f->internal_id = lastRowId();
-        p->AllocFeatures[f] = f->internal_id;
-        return f;
+    fSelectFeatureById.bind_int(1, type);
+    fSelectFeatureById.bind_int64(2, id);
+    bool found = fSelectFeatureById.step();
+    if (found)
+        readRow(fSelectFeatureById, row);
+    fSelectFeatureById.reset();
+    return found;
+}
+
+Feature* SpatialiteBackend::materialize(const StoredFeature& row)
+{
+    IFeature::FId id(row.type, row.id);
+    Document* theDocument = theLayer->getDocument();
+    if (theDocument && theDocument->getResidentFeature(id))
+        return NULL;
+    if (p->Detached.contains(storeKey(id)))
+        return NULL;
+
+    Feature* F;
+    switch (row.type) {
+    case IFeature::Point:
+        F = g_backend.allocNode(theLayer, Coord(row.lon, row.lat));
+        break;
+    case IFeature::LineString:
+        F = g_backend.allocWay(theLayer);
+        break;
+    case IFeature::OsmRelation:
+        F = g_backend.allocRelation(theLayer);
+        break;
+    default:
+        return NULL;
     }
-    return NULL;
+    F->setId(id);
+#ifndef FRISIUS_BUILD
+    F->setVersionNumber(row.version);
+    F->setTime(row.timestamp);
+    F->setUser(row.user);
+#endif
+    F->setLastUpdated((Feature::ActorType)row.actor);
+
+    QList<QPair<QString, QString> > tags;
+    fSelectFeatureTags.bind_int64(1, row.rowid);
+    while (fSelectFeatureTags.step())
+        tags << qMakePair(fSelectFeatureTags.col_string(0), fSelectFeatureTags.col_string(1));
+    fSelectFeatureTags.reset();
+    for (int i=0; i<tags.size(); ++i)
+        F->setTag(tags[i].first, tags[i].second);
+
+    ++p->Loading;
+    theLayer->add(F);
+    --p->Loading;
+
+    // Resolving refs may page in more features (from this layer or another), so read them all first
+    if (row.type == IFeature::LineString) {
+        Way* W = STATIC_CAST_WAY(F);
+        QList<qint64> nodes;
+        fSelectWayNodes.bind_int64(1, row.rowid);
+        while (fSelectWayNodes.step())
+            nodes << fSelectWayNodes.col_int64(0);
+        fSelectWayNodes.reset();
+
+        for (int i=0; i<nodes.size(); ++i) {
+            Feature* N = theDocument ? theDocument->getFeature(IFeature::FId(IFeature::Point, nodes[i])) : NULL;
+            if (N)
+                W->add(STATIC_CAST_NODE(N));
+        }
+    } else if (row.type == IFeature::OsmRelation) {
+        Relation* R = STATIC_CAST_RELATION(F);
+        QList<QPair<IFeature::FId, QString> > members;
+        fSelectRelationMembers.bind_int64(1, row.rowid);
+        while (fSelectRelationMembers.step())
+            members << qMakePair(IFeature::FId(fSelectRelationMembers.col_int(0), fSelectRelationMembers.col_int64(1)),
+                                 fSelectRelationMembers.col_string(2));
+        fSelectRelationMembers.reset();
+
+        for (int i=0; i<members.size(); ++i) {
+            Feature* M = theDocument ? theDocument->getFeature(members[i].first) : NULL;
+            if (M)
+                R->add(members[i].second, M);
+        }
+    }
+
+    p->LoadedSignature[F] = signature(F);
+    return F;
 }
 
-TrackSegment * SpatialiteBackend::allocSegment()
+/* Paging out */
+
+bool SpatialiteBackend::canEvict(Feature* F, const CoordBox& keep)
 {
-    TrackSegment* f = new TrackSegment();
-    p->AllocFeatures[f] = -1;
-    return f;
+    if (p->Pinned.contains(F))
+        return false;
+    if (F->sizeParents() || F->isDirty() || F->getDirtyLevel() || F->isDeleted())
+        return false;
+    if (CHECK_NODE(F) && dynamic_cast<TrackNode*>(F))
+        return false;
+    if (!keep.isNull() && keep.intersects(F->boundingBox()))
+        return false;
+#ifndef _MOBILE
+    if (g_Merk_MainWindow && g_Merk_MainWindow->properties()->isSelected(F))
+        return false;
+#endif
+    return true;
 }
 
-void SpatialiteBackend::deallocFeature(Feature *f)
+static bool lessRecentlyUsed(const QPair<quint32, Feature*>& a, const QPair<quint32, Feature*>& b)
 {
+    return a.first < b.first;
 }
 
-void SpatialiteBackend::sync(Feature *f)
+int SpatialiteBackend::trim(const CoordBox& keep)
 {
-//    CoordBox bb = f->boundingBox();
-//    if (!bb.isNull()) {
-//        qreal min[] = {bb.bottomLeft().x(), bb.bottomLeft().y()};
-//        qreal max[] = {bb.topRight().x(), bb.topRight().y()};
-//        p->theRTree.Insert(min, max, f);
-    //    }
+    int budget = M_PREFS->getDiskBackendWorkingSet();
+    if (theLayer->size() <= budget)
+        return 0;
+    // Leave some slack, so that we don't page out on every call
+    int target = budget - budget / 4;
+
+    QList<QPair<quint32, Feature*> > candidates[3];
+    for (int i=0; i<theLayer->size(); ++i) {
+        Feature* F = theLayer->get(i);
+        int kind;
+        if (CHECK_RELATION(F))
+            kind = 0;
+        else if (CHECK_WAY(F))
+            kind = 1;
+        else if (CHECK_NODE(F))
+            kind = 2;
+        else
+            continue;
+        candidates[kind] << qMakePair(p->LastUse.value(F, 0), F);
+    }
+
+    int evicted = 0;
+    exec("BEGIN");
+    // Relations, then ways: paging them out is what releases their members
+    for (int kind=0; kind<3 && theLayer->size() > target; ++kind) {
+        qStableSort(candidates[kind].begin(), candidates[kind].end(), lessRecentlyUsed);
+        for (int i=0; i<candidates[kind].size() && theLayer->size() > target; ++i) {
+            Feature* F = candidates[kind].at(i).second;
+            if (!canEvict(F, keep))
+                continue;
+            evict(F);
+            ++evicted;
+        }
+    }
+    exec("COMMIT");
+
+    if (!p->LoadedBox.isNull() && (keep.isNull() || !keep.contains(p->LoadedBox)))
+        p->LoadedBox = keep;
+
+    return evicted;
 }
 
-void SpatialiteBackend::getFeatureSet(QMap<RenderPriority, QSet<Feature *> > &theFeatures, QList<QRectF> &invalidRects, QRectF &clipRect, Projection &theProjection, QTransform &theTransform)
+void SpatialiteBackend::releaseStreamed()
 {
+    QList<Feature*> streamed = p->Streamed;
+    p->Streamed.clear();
+
+    exec("BEGIN");
+    // Relations, then ways, then nodes, as in trim()
+    for (int kind=0; kind<3; ++kind) {
+        for (int i=0; i<streamed.size(); ++i) {
+            Feature* F = streamed.at(i);
+            if (!F)
+                continue;
+            if ((kind == 0 && !CHECK_RELATION(F)) || (kind == 1 && !CHECK_WAY(F)) || (kind == 2 && !CHECK_NODE(F)))
+                continue;
+            // What lies in the loaded box stays, or pageIn() wouldn't bring it back
+            if (canEvict(F, p->LoadedBox))
+                evict(F);
+            streamed[i] = NULL;
+        }
+    }
+    exec("COMMIT");
 }
 
-const QList<Feature *> & SpatialiteBackend::indexFind(const QRectF &vp)
+void SpatialiteBackend::evict(Feature* F)
 {
-    return findResult;
+    QHash<Feature*, uint>::const_iterator sig = p->LoadedSignature.constFind(F);
+    if (sig == p->LoadedSignature.constEnd() || sig.value() != signature(F))
+        write(F);
+
+    QList<NodePtr> virtuals;
+    if (CHECK_WAY(F))
+        virtuals = STATIC_CAST_WAY(F)->getVirtuals();
+
+    p->Evicting = true;
+    theLayer->deleteFeature(F);
+    p->Evicting = false;
+
+    foreach (Node* N, virtuals)
+        g_backend.deallocVirtualNode(N);
+    delete F;
 }
 
-void SpatialiteBackend::get(const QRectF &bb, QList<Feature *> &theFeatures)
+qint64 SpatialiteBackend::tagId(const QString& k, const QString& v)
 {
+    QPair<QString, QString> tag(k, v);
+    QHash<QPair<QString, QString>, qint64>::const_iterator it = p->TagIds.constFind(tag);
+    if (it != p->TagIds.constEnd())
+        return it.value();
+
+    qint64 id;
+    fSelectTag.bind_string(1, k);
+    fSelectTag.bind_string(2, v);
+    if (fSelectTag.step()) {
+        id = fSelectTag.col_int64(0);
+        fSelectTag.reset();
+    } else {
+        fSelectTag.reset();
+        fInsertTag.bind_string(1, k);
+        fInsertTag.bind_string(2, v);
+        fInsertTag.step();
+        fInsertTag.reset();
+        id = lastRowId();
+    }
+    p->TagIds.insert(tag, id);
+    return id;
 }
 
+void SpatialiteBackend::write(Feature* F)
+{
+    fSelectFeature.bind_int(1, F->id().type);
+    fSelectFeature.bind_int64(2, F->id().numId);
+    if (fSelectFeature.step()) {
+        qint64 rowid = fSelectFeature.col_int64(0);
+        fSelectFeature.reset();
+
+        fDeleteFeatureTags.bind_int64(1, rowid);
+        fDeleteFeatureTags.step();
+        fDeleteFeatureTags.reset();
+        fDeleteWayNodes.bind_int64(1, rowid);
+        fDeleteWayNodes.step();
+        fDeleteWayNodes.reset();
+        fDeleteRelationMembers.bind_int64(1, rowid);
+        fDeleteRelationMembers.step();
+        fDeleteRelationMembers.reset();
+        fDeleteFeature.bind_int64(1, rowid);
+        fDeleteFeature.step();
+        fDeleteFeature.reset();
+    } else {
+        fSelectFeature.reset();
+
+        p->KnownMissing.remove(storeKey(F->id()));
+        ++p->StoredCount;
+        QHash<int, QPair<qint64, qint64> >::iterator r = p->IdRange.find(F->id().type);
+        if (r == p->IdRange.end())
+            p->IdRange.insert(F->id().type, qMakePair(F->id().numId, F->id().numId));
+        else {
+            r.value().first = qMin(r.value().first, F->id().numId);
+            r.value().second = qMax(r.value().second, F->id().numId);
+        }
+    }
+
+    CoordBox bb = F->boundingBox();
+    SpatialStatement& ins = CHECK_NODE(F) ? fInsertNode : fInsertFeature;
+    ins.bind_int(1, F->id().type);
+    ins.bind_int64(2, F->id().numId);
+#ifndef FRISIUS_BUILD
+    ins.bind_int(3, F->versionNumber());
+    ins.bind_int64(4, F->time().toTime_t());
+    ins.bind_string(5, F->user());
+#endif
+    ins.bind_int(6, F->lastUpdated());
+    if (CHECK_NODE(F)) {
+        Coord pos = STATIC_CAST_NODE(F)->position();
+        ins.bind_double(7, pos.x());
+        ins.bind_double(8, pos.y());
+        ins.bind_double(9, pos.x());
+        ins.bind_double(10, pos.y());
+    } else {
+        ins.bind_double(9, bb.bottomLeft().x());
+        ins.bind_double(10, bb.bottomLeft().y());
+        ins.bind_double(11, bb.topRight().x());
+        ins.bind_double(12, bb.topRight().y());
+    }
+    ins.step();
+    ins.reset();
+    qint64 rowid = lastRowId();
+
+    for (int i=0; i<F->tagSize(); ++i) {
+        fInsertFeatureTags.bind_int64(1, rowid);
+        fInsertFeatureTags.bind_int64(2, tagId(F->tagKey(i), F->tagValue(i)));
+        fInsertFeatureTags.step();
+        fInsertFeatureTags.reset();
+    }
+
+    if (CHECK_WAY(F)) {
+        Way* W = STATIC_CAST_WAY(F);
+        for (int i=0; i<W->size(); ++i) {
+            fInsertWayNodes.bind_int64(1, rowid);
+            fInsertWayNodes.bind_int64(2, W->getNode(i)->id().numId);
+            fInsertWayNodes.bind_int(3, i);
+            fInsertWayNodes.step();
+            fInsertWayNodes.reset();
+        }
+    } else if (CHECK_RELATION(F)) {
+        Relation* R = STATIC_CAST_RELATION(F);
+        for (int i=0; i<R->size(); ++i) {
+            fInsertRelationMembers.bind_int64(1, rowid);
+            fInsertRelationMembers.bind_int(2, R->get(i)->id().type);
+            fInsertRelationMembers.bind_int64(3, R->get(i)->id().numId);
+            fInsertRelationMembers.bind_string(4, R->getRole(i));
+            fInsertRelationMembers.bind_int(5, i);
+            fInsertRelationMembers.step();
+            fInsertRelationMembers.reset();
+        }
+    }
+}
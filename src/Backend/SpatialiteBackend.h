@@ -16,65 +16,110 @@
 #include <QtCore>
 
 #include "SpatialiteBase.h"
-#include "IBackend.h"
 #include "Features.h"
 
+class Layer;
 class SpatialBackendPrivate;
-class SpatialiteBackend : public SpatialiteBase, public IBackend
+
+/// Receives the stored features read back by SpatialiteBackend::visitStored()
+class StoredFeatureVisitor
 {
 public:
-    SpatialiteBackend();
-    SpatialiteBackend(const QString& filename);
+    virtual ~StoredFeatureVisitor() {}
+    /// The batch is paged out again once this returns; return false to stop
+    virtual bool visit(const QList<Feature*>& aBatch) = 0;
+};
+
+/// On-disk store backing one layer.
+/// The layer only keeps a bounded working set of features in memory (see trim()); the others
+/// live in a SpatiaLite database and are paged back in by viewport (pageIn()) or by id (load()).
+/// Features the user touched are never paged out.
+class SpatialiteBackend : public SpatialiteBase
+{
+public:
+    SpatialiteBackend(Layer* aLayer);
+    SpatialiteBackend(Layer* aLayer, const QString& filename);
     virtual ~SpatialiteBackend();
 
 private:
     SpatialBackendPrivate* p;
 
 public:
-    virtual Node* allocNode(const Node& other);
-    virtual Node* allocNode(const QPointF& aCoord);
-
-    virtual Way* allocWay();
-    virtual Way* allocWay(const Way& other);
-
-    virtual Relation* allocRelation();
-    virtual Relation* allocRelation(const Relation& other);
-
-    virtual TrackSegment* allocSegment();
-
-    virtual void deallocFeature(Feature* f);
-
-    virtual void sync(Feature* f);
-
-    virtual const QList<Feature*>& indexFind(const QRectF& vp);
-    virtual void get(const QRectF& bb, QList<Feature*>& theFeatures);
-    virtual void getFeatureSet(QMap<RenderPriority, QSet <Feature*> >& theFeatures,
-                       QList<QRectF>& invalidRects, QRectF& clipRect, Projection& theProjection, QTransform& theTransform);
+    /// Load the stored features within bb, then trim the working set around it.
+    /// Must be called from the GUI thread, with no rendering in progress.
+    int pageIn(const CoordBox& bb);
+    /// True if pageIn(bb) has anything to do
+    bool needsPaging(const CoordBox& bb) const;
+    /// Page back in the stored feature with the given id (id.type may be a mask)
+    Feature* load(const IFeature::FId& id);
+    /// Page back in the stored features among ids with a few queries, instead of a load() each.
+    /// Until the next call, load() doesn't query again for those that aren't stored.
+    int prefetch(const QList<IFeature::FId>& ids);
+    /// Read back the stored features that are not resident, nodes first, in batches of at most
+    /// aBatchSize, so that saving or exporting the layer doesn't need it all in memory.
+    /// Returns false if the visitor stopped.
+    bool visitStored(StoredFeatureVisitor& aVisitor, int aBatchSize = 1000);
+    /// Page out least recently viewed features outside keep until the layer fits the working set
+    int trim(const CoordBox& keep);
+
+    /// Called by the layer when a feature enters or leaves it
+    void featureAdded(Feature* F);
+    void featureRemoved(Feature* F);
+
+    int storedCount() const;
+    int residentCount() const;
+    /// Bounding box of the nodes the layer ever held, paged in or not
+    CoordBox extent() const;
 
 protected:
     void InitializeNew();
 
+    struct StoredFeature
+    {
+        char type;
+        qint64 id;
+        int version;
+        uint timestamp;
+        QString user;
+        int actor;
+        qreal lon;
+        qreal lat;
+        qint64 rowid;
+    };
+    void readRow(SpatialStatement& st, StoredFeature& row);
+    bool fetch(char type, qint64 id, StoredFeature& row);
+    Feature* materialize(const StoredFeature& row);
+    bool canEvict(Feature* F, const CoordBox& keep);
+    void releaseStreamed();
+    void evict(Feature* F);
+    void write(Feature* F);
+    qint64 tagId(const QString& k, const QString& v);
+
     SpatialStatement fSelectFeature;
+    SpatialStatement fSelectFeatureById;
     SpatialStatement fSelectFeatureBbox;
+    SpatialStatement fSelectFeatureBatch;
+    SpatialStatement fSelectFeatureIds;
+    SpatialStatement fInsertFeature;
+    SpatialStatement fInsertNode;
+    SpatialStatement fDeleteFeature;
 
     SpatialStatement fSelectTag;
     SpatialStatement fInsertTag;
-    SpatialStatement fCreateFeature;
-    SpatialStatement fUpdateFeature;
+    SpatialStatement fSelectFeatureTags;
     SpatialStatement fInsertFeatureTags;
-    SpatialStatement fInsertWayTags;
+    SpatialStatement fDeleteFeatureTags;
+    SpatialStatement fSelectWayNodes;
     SpatialStatement fInsertWayNodes;
-    SpatialStatement fInsertRelationTags;
+    SpatialStatement fDeleteWayNodes;
+    SpatialStatement fSelectRelationMembers;
     SpatialStatement fInsertRelationMembers;
-
-public slots:
-    void updateFeature(Feature* F);
-    void deleteFeature(Feature* F);
+    SpatialStatement fDeleteRelationMembers;
 
 protected:
     bool isTemp;
     QString theFilename;
-    QList<Feature*> findResult;
+    Layer* theLayer;
 };
 
 #endif // SPATIALITEBACKEND_H
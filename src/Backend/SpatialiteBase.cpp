@@ -15,6 +15,7 @@
 #include <QFile>
 
 SpatialiteBase::SpatialiteBase()
+    : m_handle(0)
 {
 }
 
@@ -30,6 +31,13 @@ sqlite3* SpatialiteBase::open(const QString& aNom,
     return m_handle;
 }
 
+void SpatialiteBase::close()
+{
+    if (m_handle)
+        sqlite3_close(m_handle);
+    m_handle = NULL;
+}
+
 bool SpatialiteBase::exec(const QString& aSql)
 {
     const int err = sqlite3_exec(m_handle, aSql.toUtf8().data(), 0, 0, 0);
@@ -74,7 +82,8 @@ void SpatialStatement::bind_int64(int idx, qint64 val)
 
 void SpatialStatement::bind_string(int idx, const QString& val)
 {
-    sqlite3_bind_text(statement(), idx, val.toUtf8().data(), val.size(), SQLITE_STATIC);
+    QByteArray utf8 = val.toUtf8();
+    sqlite3_bind_text(statement(), idx, utf8.constData(), utf8.size(), SQLITE_TRANSIENT);
 }
 
 qreal SpatialStatement::col_double(int idx)
@@ -94,7 +103,7 @@ qint64 SpatialStatement::col_int64(int idx)
 
 QString SpatialStatement::col_string(int idx)
 {
-    return QString ((const char*)sqlite3_column_text(statement(), idx));
+    return QString::fromUtf8((const char*)sqlite3_column_text(statement(), idx));
 }
 
 bool SpatialStatement::step()
@@ -108,15 +117,25 @@ void SpatialStatement::reset()
     sqlite3_clear_bindings(statement());
 }
 
+void SpatialStatement::finalize()
+{
+    if (isPrepared)
+        sqlite3_finalize(pStmt);
+    isPrepared = false;
+    pStmt = NULL;
+}
+
 sqlite3_stmt* SpatialStatement::statement()
 {
     if (isPrepared)
         return pStmt;
 
-    const int ret = sqlite3_prepare_v2(theBackend->m_handle, theQuery.toUtf8().data(), theQuery.size(), &pStmt, NULL);
+    QByteArray utf8 = theQuery.toUtf8();
+    const int ret = sqlite3_prepare_v2(theBackend->m_handle, utf8.constData(), utf8.size(), &pStmt, NULL);
     if (ret != SQLITE_OK) {
         qDebug() << QString(sqlite3_errmsg(theBackend->m_handle)) + " in prepare statement: " + theQuery;
         return NULL;
     }
+    isPrepared = true;
     return pStmt;
 }
@@ -30,6 +30,7 @@ public:
     SpatialiteBase();
 
     sqlite3 * open(const QString &aNom, const int aFlags);
+    void close();
     bool exec(const QString &aSql);
     bool execFile(const QString &aPath);
     qint64 lastRowId();
@@ -45,11 +46,11 @@ class SpatialStatement
 
 public:
     SpatialStatement()
-        :theBackend(0), isPrepared(false)
+        :theBackend(0), isPrepared(false), pStmt(0)
     {
     }
     SpatialStatement(SpatialiteBase* backend, const QString& query)
-        : theBackend(backend), theQuery(query), isPrepared(false)
+        : theBackend(backend), theQuery(query), isPrepared(false), pStmt(0)
     {
     }
 
@@ -65,6 +66,7 @@ public:
     sqlite3_stmt* statement();
     bool step();
     void reset();
+    void finalize();
 
 protected:
     SpatialiteBase* theBackend;
@@ -70,10 +70,18 @@ bool Command::buildUndoList(QListWidget* theListWidget)
     return true;
 }
 
+// Lets the views redraw only around what a command changed
+static void touch(Layer* aLayer, Feature* F)
+{
+    if (aLayer && aLayer->getDocument())
+        aLayer->getDocument()->touch(F->boundingBox());
+}
+
 int Command::incDirtyLevel(Layer* aLayer, Feature* F)
 {
     F->incDirtyLevel();
     aLayer->incDirtyLevel();
+    touch(aLayer, F);
     return ++commandDirtyLevel;
 }
 
@@ -81,6 +89,7 @@ int Command::decDirtyLevel(Layer* aLayer, Feature* F)
 {
     F->decDirtyLevel();
     aLayer->decDirtyLevel();
+    touch(aLayer, F);
     return commandDirtyLevel;
 }
 
@@ -94,6 +103,7 @@ void Command::undo()
     if (mainFeature) {
         isUndone = true;
         mainFeature->notifyChanges();
+        touch(mainFeature->layer(), mainFeature);
     }
 }
 
@@ -102,6 +112,7 @@ void Command::redo()
     if (mainFeature) {
         isUndone = false;
         mainFeature->notifyChanges();
+        touch(mainFeature->layer(), mainFeature);
     }
 }
 
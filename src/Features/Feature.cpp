@@ -1,4 +1,5 @@
 #include "Global.h"
+#include "FeaturePool.h"
 
 #include "MainWindow.h"
 #include "Features.h"
@@ -22,6 +23,8 @@
 #include <QProgressDialog>
 #include <QPainter>
 #include <QPainterPath>
+#include <QMutex>
+#include <QAtomicPointer>
 
 #include <algorithm>
 
@@ -102,20 +105,108 @@ void copyTags(Feature* Dest, Feature* Src)
 }
 
 
+// Painter resolution results, only allocated for features that get rendered
+class FeaturePaintState
+{
+public:
+    FeaturePaintState()
+        : PixelPerMForPainter(-1), CurrentPainter(0)
+    {
+    }
+
+    QList<const FeaturePainter*> PossiblePainters;
+    qreal PixelPerMForPainter;
+    const FeaturePainter* CurrentPainter;
+};
+
+// Most features have at most one parent: it is kept inline, a list is only allocated for more.
+// The low bit of d tells if it holds a Feature* or a QList<Feature*>*.
+class FeatureParents
+{
+public:
+    FeatureParents()
+        : d(0)
+    {
+    }
+    ~FeatureParents()
+    {
+        if (isList())
+            delete list();
+    }
+
+    int size() const
+    {
+        if (isList())
+            return list()->size();
+        return d ? 1 : 0;
+    }
+    Feature* at(int i) const
+    {
+        if (isList())
+            return list()->at(i);
+        return (Feature*)d;
+    }
+    bool contains(Feature* F) const
+    {
+        if (isList())
+            return list()->contains(F);
+        return (d && (Feature*)d == F);
+    }
+    void append(Feature* F)
+    {
+        if (isList())
+            list()->append(F);
+        else if (!d)
+            d = (quintptr)F;
+        else {
+            QList<Feature*>* l = new QList<Feature*>;
+            *l << (Feature*)d << F;
+            d = (quintptr)l | 1;
+        }
+    }
+    void removeOne(Feature* F)
+    {
+        if (isList()) {
+            QList<Feature*>* l = list();
+            l->removeOne(F);
+            if (l->size() == 1) {
+                d = (quintptr)l->at(0);
+                delete l;
+            }
+        } else if ((Feature*)d == F)
+            d = 0;
+    }
+
+private:
+    Q_DISABLE_COPY(FeatureParents)
+
+    bool isList() const { return d & 1; }
+    QList<Feature*>* list() const { return (QList<Feature*>*)(d & ~(quintptr)1); }
+
+    quintptr d;
+};
+
 class FeaturePrivate
 {
 public:
+    typedef enum {
+        Deleted                     = 0x01,
+        Visible                     = 0x02,
+        Uploaded                    = 0x04,
+        Virtual                     = 0x08,
+        Special                     = 0x10,
+        PossiblePaintersUpToDate    = 0x20,
+        HasPainter                  = 0x40
+    } Flag;
+
     FeaturePrivate(Feature* aFeature)
-        :  LastActor(Feature::User)
-        , PossiblePaintersUpToDate(false)
-        , PixelPerMForPainter(-1), CurrentPainter(0), HasPainter(false)
-        , theFeature(aFeature), LastPartNotification(0)
-        , Deleted(false), Visible(true), Uploaded(false), FilterRevision(-1)
-        , Virtual(false), Special(false), DirtyLevel(0)
-        , parentLayer(0)
+        : theFeature(aFeature), PaintState(0), Mutex(0), FilterLayers(0)
+        , Alpha(1.0), parentLayer(0)
+        , LastPartNotification(0), DirtyLevel(0)
     #ifndef FRISIUS_BUILD
         , Time(QDateTime::currentDateTime().toTime_t()), User(0xffffffff)
     #endif
+        , LastActor(Feature::User), Flags(Visible)
     {
 #ifndef FRISIUS_BUILD
         initVersionNumber();
@@ -123,21 +214,68 @@ public:
 #endif
     }
     FeaturePrivate(const FeaturePrivate& other)
-        : Tags(other.Tags), LastActor(other.LastActor)
-        , PossiblePaintersUpToDate(false)
-        , PixelPerMForPainter(-1), CurrentPainter(0), HasPainter(false)
-        , theFeature(NULL), LastPartNotification(0)
-        , Deleted(false), Visible(true), Uploaded(false), FilterRevision(-1)
-        , Virtual(other.Virtual), Special(other.Special), DirtyLevel(0)
-        , parentLayer(0)
+        : Tags(other.Tags)
+        , theFeature(NULL), PaintState(0), Mutex(0), FilterLayers(0)
+        , Alpha(1.0), parentLayer(0)
+        , LastPartNotification(0), DirtyLevel(0)
     #ifndef FRISIUS_BUILD
         , Time(other.Time), User(other.User)
     #endif
+        , LastActor(other.LastActor), Flags(Visible | (other.Flags & (Virtual | Special)))
     {
+        for (int i=0; i<Tags.size(); ++i)
+            g_addToTagList(Tags[i].first, Tags[i].second);
 #ifndef FRISIUS_BUILD
         initVersionNumber();
 #endif
     }
+    ~FeaturePrivate()
+    {
+        for (int i=0; i<Tags.size(); ++i)
+            g_removeFromTagList(Tags[i].first, Tags[i].second);
+        delete PaintState;
+        delete (QMutex*)Mutex;
+        delete FilterLayers;
+    }
+
+    static void* operator new(std::size_t sz, FeaturePool* aPool)
+    {
+        return aPool->allocate(sz, FeaturePool::PrivateSlot);
+    }
+    static void operator delete(void* ptr, FeaturePool*)
+    {
+        FeaturePool::release(ptr);
+    }
+    static void operator delete(void* ptr)
+    {
+        FeaturePool::release(ptr);
+    }
+
+    bool testFlag(Flag f) const
+    {
+        return Flags & f;
+    }
+    void setFlag(Flag f, bool val)
+    {
+        if (val)
+            Flags |= f;
+        else
+            Flags &= ~f;
+    }
+    FeaturePaintState* paintState()
+    {
+        if (!PaintState)
+            PaintState = new FeaturePaintState;
+        return PaintState;
+    }
+    qreal pixelPerMForPainter() const
+    {
+        return PaintState ? PaintState->PixelPerMForPainter : -1;
+    }
+    const FeaturePainter* currentPainter() const
+    {
+        return PaintState ? PaintState->CurrentPainter : NULL;
+    }
 
     void updatePossiblePainters();
     void blankPainters();
@@ -151,38 +289,31 @@ public:
     }
 #endif
 
-    mutable IFeature::FId Id; // 9 (16)
-    QList<QPair<quint32, quint32> > Tags; // 4
-    Feature::ActorType LastActor; // 4
-    QList<const FeaturePainter*> PossiblePainters; // 4
-    bool PossiblePaintersUpToDate; // 1
-    qreal PixelPerMForPainter; // 8
-    const FeaturePainter* CurrentPainter; // 4
-    bool HasPainter; // 1
-    Feature* theFeature; // 4
-    QList<Feature*> Parents; // 4
+    mutable IFeature::FId Id; // 16
+    QList<QPair<quint32, quint32> > Tags; // 8
+    Feature* theFeature; // 8
+    FeatureParents Parents; // 8
+    FeaturePaintState* PaintState; // 8
+    // Only created when a feature is changed or gets its meta or path rebuilt, see Feature::featMutex()
+    QAtomicPointer<QMutex> Mutex; // 8
+    QList<FilterLayer*>* FilterLayers; // 8
+    qreal Alpha; // 8
+    Layer* parentLayer; // 8
     int LastPartNotification; // 4
+    int DirtyLevel; // 4
 #ifndef FRISIUS_BUILD
     uint Time; // 4
     quint32 User; // 4
     int VersionNumber; // 4
 #endif
-    bool Deleted; // 1
-    bool Visible; // 1
-    bool Uploaded; // 1
-    int FilterRevision; // 4
-    bool Virtual; // 1
-    bool Special; // 1
-    int DirtyLevel; // 4
-    QList<FilterLayer*> FilterLayers; // 4
-    qreal Alpha; // 8
-    Layer* parentLayer; // 4
+    quint8 LastActor; // 1
+    quint8 Flags; // 1
 };
 
 Feature::Feature()
 : MetaUpToDate(false), m_references(0), ReadOnly(false)
 {
-    p = new FeaturePrivate(this);
+    p = new (FeaturePool::poolOf(this)) FeaturePrivate(this);
     p->Id = IFeature::FId(IFeature::Uninitialized, 0);
 
     //     qDebug() << "Feature size: " << sizeof(Feature);
@@ -191,7 +322,7 @@ Feature::Feature()
 Feature::Feature(const Feature& other)
 : IFeature(other), MetaUpToDate(false), m_references(0), ReadOnly(other.ReadOnly)
 {
-    p = new FeaturePrivate(*other.p);
+    p = new (FeaturePool::poolOf(this)) FeaturePrivate(*other.p);
     p->Id = IFeature::FId(IFeature::Uninitialized, 0);
     p->theFeature = this;
 }
@@ -205,6 +336,26 @@ Feature::~Feature(void)
     delete p;
 }
 
+void* Feature::operator new(std::size_t sz)
+{
+    return g_backend.featurePool(NULL)->allocate(sz, FeaturePool::FeatureSlot);
+}
+
+void* Feature::operator new(std::size_t sz, FeaturePool* aPool)
+{
+    return aPool->allocate(sz, FeaturePool::FeatureSlot);
+}
+
+void Feature::operator delete(void* ptr)
+{
+    FeaturePool::release(ptr);
+}
+
+void Feature::operator delete(void* ptr, FeaturePool*)
+{
+    FeaturePool::release(ptr);
+}
+
 void Feature::setLayer(Layer* aLayer)
 {
     p->parentLayer = aLayer;
@@ -217,7 +368,7 @@ Layer* Feature::layer() const
 
 void Feature::setLastUpdated(Feature::ActorType A)
 {
-    p->LastActor = A;
+    p->LastActor = (quint8)A;
 }
 
 Feature::ActorType Feature::lastUpdated() const
@@ -226,7 +377,7 @@ Feature::ActorType Feature::lastUpdated() const
     if (L && L->classType() == Layer::DirtyLayerType)
         return Feature::User;
     else
-        return p->LastActor;
+        return (Feature::ActorType)p->LastActor;
 }
 
 QString Feature::stripToOSMId(const IFeature::FId& id)
@@ -294,7 +445,12 @@ void Feature::setTime(uint epoch)
     p->Time = epoch;
 }
 
-const QString& Feature::user() const
+bool Feature::hasTime() const
+{
+    return p->Time != uint(-1);
+}
+
+QString Feature::user() const
 {
     return g_getUser(p->User);
 }
@@ -304,6 +460,16 @@ void Feature::setUser(const QString& user)
     p->User = g_setUser(user);
 }
 
+quint32 Feature::userId() const
+{
+    return p->User;
+}
+
+void Feature::setUserId(quint32 anId)
+{
+    p->User = anId;
+}
+
 void Feature::setVersionNumber(int vn)
 {
     p->VersionNumber = vn;
@@ -357,12 +523,12 @@ bool Feature::isDirty() const
 
 void Feature::setUploaded(bool state)
 {
-    p->Uploaded = state;
+    p->setFlag(FeaturePrivate::Uploaded, state);
 }
 
 bool Feature::isUploaded() const
 {
-    return p->Uploaded;
+    return p->testFlag(FeaturePrivate::Uploaded);
 }
 
 bool Feature::isUploadable() const
@@ -387,44 +553,44 @@ bool Feature::isReadonly()
 
 void Feature::setDeleted(bool delState)
 {
-    if (delState == p->Deleted)
+    if (delState == p->testFlag(FeaturePrivate::Deleted))
         return;
-    p->Deleted = delState;
+    p->setFlag(FeaturePrivate::Deleted, delState);
     g_backend.sync(this);
 }
 
 bool Feature::isDeleted() const
 {
-    return p->Deleted;
+    return p->testFlag(FeaturePrivate::Deleted);
 }
 
 void Feature::setVisible(bool state)
 {
-    if (state == p->Visible)
+    if (state == p->testFlag(FeaturePrivate::Visible))
         return;
-    p->Visible = state;
+    p->setFlag(FeaturePrivate::Visible, state);
 }
 
 bool Feature::isVisible()
 {
     if (!MetaUpToDate)
         updateMeta();
-    return p->Visible;
+    return p->testFlag(FeaturePrivate::Visible);
 }
 
 bool Feature::isHidden()
 {
     if (!MetaUpToDate)
         updateMeta();
-    return !p->Visible;
+    return !p->testFlag(FeaturePrivate::Visible);
 }
 
 void Feature::setVirtual(bool val)
 {
-    if (val == p->Virtual)
+    if (val == p->testFlag(FeaturePrivate::Virtual))
         return;
-    p->Virtual = val;
-    if (!p->Virtual) {
+    p->setFlag(FeaturePrivate::Virtual, val);
+    if (!val) {
         resetId();
     }
     g_backend.sync(this);
@@ -432,12 +598,12 @@ void Feature::setVirtual(bool val)
 
 bool Feature::isVirtual() const
 {
-    return p->Virtual;
+    return p->testFlag(FeaturePrivate::Virtual);
 }
 
 void Feature::setSpecial(bool val)
 {
-    p->Special = val;
+    p->setFlag(FeaturePrivate::Special, val);
 }
 
 void Feature::buildPath(const Projection &)
@@ -446,7 +612,14 @@ void Feature::buildPath(const Projection &)
 
 bool Feature::isSpecial() const
 {
-    return p->Special;
+    return p->testFlag(FeaturePrivate::Special);
+}
+
+// Tags decide how a feature is drawn
+static void touchDocument(Feature* F)
+{
+    if (F->layer() && F->layer()->getDocument())
+        F->layer()->getDocument()->touch(F->boundingBox());
 }
 
 void Feature::setTag(int index, const QString& key, const QString& value)
@@ -460,8 +633,10 @@ void Feature::setTag(int index, const QString& key, const QString& value)
     for (; i<p->Tags.size(); ++i)
         if (p->Tags[i].first == pi.first)
         {
-            if (p->Tags[i].second == pi.second)
+            if (p->Tags[i].second == pi.second) {
+                g_removeFromTagList(pi.first, pi.second);
                 return;
+            }
             g_removeFromTagList(p->Tags[i].first, p->Tags[i].second);
             p->Tags[i].second = pi.second;
             break;
@@ -471,6 +646,7 @@ void Feature::setTag(int index, const QString& key, const QString& value)
     }
     invalidatePainter();
     invalidateMeta();
+    touchDocument(this);
 }
 
 void Feature::setTag(const QString& key, const QString& value)
@@ -484,8 +660,10 @@ void Feature::setTag(const QString& key, const QString& value)
     for (; i<p->Tags.size(); ++i)
         if (p->Tags[i].first == pi.first)
         {
-            if (p->Tags[i].second == pi.second)
+            if (p->Tags[i].second == pi.second) {
+                g_removeFromTagList(pi.first, pi.second);
                 return;
+            }
             g_removeFromTagList(p->Tags[i].first, p->Tags[i].second);
             p->Tags[i].second = pi.second;
             break;
@@ -495,6 +673,32 @@ void Feature::setTag(const QString& key, const QString& value)
     }
     invalidateMeta();
     invalidatePainter();
+    touchDocument(this);
+}
+
+void Feature::setTagIds(quint32 k, quint32 v)
+{
+    int i = 0;
+    for (; i<p->Tags.size(); ++i)
+        if (p->Tags[i].first == k)
+        {
+            if (p->Tags[i].second == v)
+                return;
+            g_removeFromTagList(p->Tags[i].first, p->Tags[i].second);
+            p->Tags[i].second = v;
+            break;
+        }
+    g_addToTagList(k, v);
+    if (i == p->Tags.size()) {
+        p->Tags.push_back(qMakePair(k, v));
+    }
+    invalidateMeta();
+    invalidatePainter();
+}
+
+void Feature::tagsChanged()
+{
+    touchDocument(this);
 }
 
 void Feature::clearTags()
@@ -505,6 +709,7 @@ void Feature::clearTags()
     }
     invalidateMeta();
     invalidatePainter();
+    touchDocument(this);
 }
 
 void Feature::clearTag(const QString& k)
@@ -520,6 +725,7 @@ void Feature::clearTag(const QString& k)
         }
     invalidateMeta();
     invalidatePainter();
+    touchDocument(this);
 }
 
 void Feature::removeTag(int idx)
@@ -528,6 +734,7 @@ void Feature::removeTag(int idx)
     p->Tags.erase(p->Tags.begin()+idx);
     invalidateMeta();
     invalidatePainter();
+    touchDocument(this);
 }
 
 int Feature::tagSize() const
@@ -568,8 +775,39 @@ void Feature::invalidateMeta()
 
 void Feature::invalidatePainter()
 {
-    p->PossiblePaintersUpToDate = false;
-    p->PixelPerMForPainter = -1;
+    p->setFlag(FeaturePrivate::PossiblePaintersUpToDate, false);
+    if (p->PaintState)
+        p->PaintState->PixelPerMForPainter = -1;
+}
+
+int Feature::memoryUsage() const
+{
+    int sz = FeaturePool::slotSize(this) + FeaturePool::slotSize(p);
+    sz += p->Tags.size() * sizeof(QPair<quint32, quint32>);
+    if (p->Parents.size() > 1)
+        sz += p->Parents.size() * sizeof(Feature*);
+    if (p->PaintState)
+        sz += sizeof(FeaturePaintState) + p->PaintState->PossiblePainters.size() * sizeof(FeaturePainter*);
+    if (p->FilterLayers)
+        sz += p->FilterLayers->size() * sizeof(FilterLayer*);
+    if (p->Mutex)
+        sz += sizeof(QMutex);
+    sz += thePath.elementCount() * sizeof(QPainterPath::Element);
+    return sz;
+}
+
+QMutex* Feature::featMutex() const
+{
+    QMutex* m = p->Mutex;
+    if (!m) {
+        m = new QMutex(QMutex::Recursive);
+        // Another thread may have got there first
+        if (!p->Mutex.testAndSetOrdered(0, m)) {
+            delete m;
+            m = p->Mutex;
+        }
+    }
+    return m;
 }
 
 static QPainterPath painterPath;
@@ -579,9 +817,19 @@ const QPainterPath& Feature::getPath() const
     return painterPath;
 }
 
+// Painter state is never locked along with another feature's, so a few mutexes shared by
+// address do, rather than a mutex for every feature that gets drawn
+#define PAINTER_LOCKS 64
+static QMutex painterLocks[PAINTER_LOCKS];
+
+static QMutex* painterLock(const Feature* F)
+{
+    return &painterLocks[(quintptr(F) >> 4) % PAINTER_LOCKS];
+}
+
 void FeaturePrivate::updatePossiblePainters()
 {
-    QMutexLocker mutlock(&theFeature->featMutex);
+    QMutexLocker mutlock(painterLock(theFeature));
 
     //still match features with no tags and no parent, i.e. "lost" trackpoints
     if ( (theFeature->layer()->isTrack()) && M_PREFS->getDisableStyleForTracks() ) return blankPainters();
@@ -591,14 +839,15 @@ void FeaturePrivate::updatePossiblePainters()
         if (!theFeature->tagSize()) return blankPainters();
     }
 
-    PossiblePainters.clear();
+    FeaturePaintState* ps = paintState();
+    ps->PossiblePainters.clear();
     QList<const FeaturePainter*> DefaultPainters;
     for (int i=0; i<theFeature->layer()->getDocument()->getPaintersSize(); ++i)
     {
         const FeaturePainter* Current = dynamic_cast<const FeaturePainter*>(theFeature->layer()->getDocument()->getPainter(i));
         switch (Current->matchesTag(theFeature,NULL)) {
         case TagSelect_Match:
-            PossiblePainters.push_back(Current);
+            ps->PossiblePainters.push_back(Current);
             break;
         case TagSelect_DefaultMatch:
             DefaultPainters.push_back(Current);
@@ -607,90 +856,90 @@ void FeaturePrivate::updatePossiblePainters()
             break;
         }
     }
-    if (!PossiblePainters.size())
-        PossiblePainters = DefaultPainters;
-    PossiblePaintersUpToDate = true;
-    HasPainter = (PossiblePainters.size() > 0);
+    if (!ps->PossiblePainters.size())
+        ps->PossiblePainters = DefaultPainters;
+    setFlag(PossiblePaintersUpToDate, true);
+    setFlag(HasPainter, ps->PossiblePainters.size() > 0);
 }
 
 void FeaturePrivate::updatePainters(qreal PixelPerM)
 {
-    if (!PossiblePaintersUpToDate)
+    if (!testFlag(PossiblePaintersUpToDate))
         updatePossiblePainters();
 
-    QMutexLocker mutlock(&theFeature->featMutex);
-    CurrentPainter = NULL;
-    PixelPerMForPainter = PixelPerM;
-    for (int i=0; i<PossiblePainters.size(); ++i)
-        if (PossiblePainters[i]->matchesZoom(PixelPerM))
+    QMutexLocker mutlock(painterLock(theFeature));
+    FeaturePaintState* ps = paintState();
+    ps->CurrentPainter = NULL;
+    ps->PixelPerMForPainter = PixelPerM;
+    for (int i=0; i<ps->PossiblePainters.size(); ++i)
+        if (ps->PossiblePainters[i]->matchesZoom(PixelPerM))
         {
-            CurrentPainter = PossiblePainters[i];
+            ps->CurrentPainter = ps->PossiblePainters[i];
             return;
         }
 }
 
 void FeaturePrivate::blankPainters()
 {
-    CurrentPainter = NULL;
-    PossiblePainters.clear();
-    PossiblePaintersUpToDate = true;
-    HasPainter = false;
+    if (PaintState) {
+        PaintState->CurrentPainter = NULL;
+        PaintState->PossiblePainters.clear();
+    }
+    setFlag(PossiblePaintersUpToDate, true);
+    setFlag(HasPainter, false);
 }
 
 const FeaturePainter* Feature::getPainter(qreal PixelPerM) const
 {
-    if (p->PixelPerMForPainter != PixelPerM)
+    if (p->pixelPerMForPainter() != PixelPerM)
         p->updatePainters(PixelPerM);
-    return p->CurrentPainter;
+    return p->currentPainter();
 }
 
 const FeaturePainter* Feature::getCurrentPainter() const
 {
-    if (p->CurrentPainter)
-        return p->CurrentPainter;
+    if (!p->PaintState)
+        return NULL;
+    if (p->PaintState->CurrentPainter)
+        return p->PaintState->CurrentPainter;
     else {
-        if (p->PossiblePainters.size())
-            return p->PossiblePainters[0];
+        if (p->PaintState->PossiblePainters.size())
+            return p->PaintState->PossiblePainters[0];
         else return NULL;
     }
 }
 
 bool Feature::hasPainter() const
 {
-    if (!p->PossiblePaintersUpToDate)
+    if (!p->testFlag(FeaturePrivate::PossiblePaintersUpToDate))
         p->updatePossiblePainters();
 
-    return p->HasPainter;
+    return p->testFlag(FeaturePrivate::HasPainter);
 }
 
 bool Feature::hasPainter(qreal PixelPerM) const
 {
     if (!layer())
         return false;
-    if (p->PixelPerMForPainter != PixelPerM)
+    if (p->pixelPerMForPainter() != PixelPerM)
         p->updatePainters(PixelPerM);
-    return (p->CurrentPainter != NULL);
+    return (p->currentPainter() != NULL);
 }
 
 void Feature::setParentFeature(Feature* F)
 {
-    if (std::find(p->Parents.begin(),p->Parents.end(),F) == p->Parents.end())
-        p->Parents.push_back(F);
+    if (!p->Parents.contains(F))
+        p->Parents.append(F);
 }
 
 void Feature::unsetParentFeature(Feature* F)
 {
-    for (int i=0; i<p->Parents.size(); ++i)
-        if (p->Parents[i] == F)
-        {
-            p->Parents.erase(p->Parents.begin()+i);
-            return;
-        }
+    p->Parents.removeOne(F);
 }
 
 void Feature::updateFilters()
 {
-    p->FilterLayers.clear();
+    SAFE_DELETE(p->FilterLayers);
 
     Layer* L = layer();
     if (!L)
@@ -705,8 +954,11 @@ void Feature::updateFilters()
             FilterLayer* Fl = dynamic_cast<FilterLayer*>(D->getLayer(i));
             if (!Fl->isEnabled() || !Fl->selector())
                 continue;
-            if (Fl->selector()->matches(this, 0) != TagSelect_NoMatch)
-                p->FilterLayers << Fl;
+            if (Fl->selector()->matches(this, 0) != TagSelect_NoMatch) {
+                if (!p->FilterLayers)
+                    p->FilterLayers = new QList<FilterLayer*>;
+                *p->FilterLayers << Fl;
+            }
         }
     }
     invalidateMeta();
@@ -720,13 +972,16 @@ void Feature::updateMeta()
     if (!L)
         return;
 
+    static const QList<FilterLayer*> NoFilterLayers;
+    const QList<FilterLayer*>& FilterLayers = (p->FilterLayers ? *p->FilterLayers : NoFilterLayers);
+
     if (!L->isVisible())
-        p->Visible = false;
+        p->setFlag(FeaturePrivate::Visible, false);
     else {
-        p->Visible = true;
-        foreach(FilterLayer* Fl, p->FilterLayers) {
+        p->setFlag(FeaturePrivate::Visible, true);
+        foreach(FilterLayer* Fl, FilterLayers) {
             if (!Fl->isVisible()) {
-                p->Visible = false;
+                p->setFlag(FeaturePrivate::Visible, false);
                 break;
             }
         }
@@ -736,7 +991,7 @@ void Feature::updateMeta()
         p->Alpha = L->getAlpha();
     else {
         p->Alpha = 1.0;
-        foreach(FilterLayer* Fl, p->FilterLayers) {
+        foreach(FilterLayer* Fl, FilterLayers) {
             if (Fl->getAlpha() != 1) {
                 p->Alpha = Fl->getAlpha();
                 break;
@@ -748,7 +1003,7 @@ void Feature::updateMeta()
         ReadOnly = true;
     else {
         ReadOnly = false;
-        foreach(FilterLayer* Fl, p->FilterLayers) {
+        foreach(FilterLayer* Fl, FilterLayers) {
             if (Fl->isReadonly()) {
                 ReadOnly = true;
                 break;
@@ -765,12 +1020,12 @@ int Feature::sizeParents() const
 
 IFeature* Feature::getParent(int i)
 {
-    return p->Parents[i];
+    return p->Parents.at(i);
 }
 
 const IFeature* Feature::getParent(int i) const
 {
-    return p->Parents[i];
+    return p->Parents.at(i);
 }
 
 void Feature::notifyChanges()
@@ -785,7 +1040,7 @@ void Feature::notifyParents(int Id)
     {
         p->LastPartNotification = Id;
         for (int i=0; i<p->Parents.size(); ++i)
-            p->Parents[i]->partChanged(this, Id);
+            p->Parents.at(i)->partChanged(this, Id);
     }
 }
 
@@ -865,6 +1120,7 @@ void Feature::fromXML(QXmlStreamReader& stream, Feature* F)
 
     QDateTime time;
     time = QDateTime::fromString(stream.attributes().value("timestamp").toString().left(19), Qt::ISODate);
+    time.setTimeSpec(Qt::UTC);
     QString user = stream.attributes().value("user").toString();
     int Version = stream.attributes().value("version").toString().toInt();
     if (Version < 1)
@@ -891,7 +1147,7 @@ void Feature::toXML(QXmlStreamWriter& stream, bool strict, QString changetsetid)
 {
     stream.writeAttribute("id", xmlId());
 #ifndef FRISIUS_BUILD
-    stream.writeAttribute("timestamp", time().toString(Qt::ISODate)+"Z");
+    stream.writeAttribute("timestamp", time().toUTC().toString(Qt::ISODate)+"Z");
     stream.writeAttribute("version", QString::number(versionNumber()));
     stream.writeAttribute("user", user());
 #endif
@@ -938,13 +1194,25 @@ bool Feature::tagsToXML(QXmlStreamWriter& stream, bool strict)
 void Feature::tagsFromXML(Document* d, Feature * f, QXmlStreamReader& stream)
 {
     Q_UNUSED(d)
+    // The document is told once, not for every tag
+    bool changed = false;
     while(!stream.atEnd() && !stream.isEndElement()) {
         if (stream.name() == "tag") {
-            f->setTag(stream.attributes().value("k").toString(), stream.attributes().value("v").toString());
+            QString k = stream.attributes().value("k").toString();
+            if (k.toLower() != "created_by") {
+                quint32 ik = g_addTagKey(k);
+                quint32 iv = g_addTagValue(stream.attributes().value("v").toString());
+                f->setTagIds(ik, iv);
+                g_releaseTagKey(ik);
+                g_releaseTagValue(iv);
+                changed = true;
+            }
             stream.readNext();
         }
         stream.readNext();
     }
+    if (changed)
+        f->tagsChanged();
 }
 
 Relation * Feature::GetSingleParentRelation(Feature * mapFeature)
@@ -47,6 +47,7 @@ class QPen;
 class QProgressDialog;
 
 class FeaturePrivate;
+class FeaturePool;
 
 class RenderPriority
 {
@@ -80,6 +81,16 @@ public:
     {
         return theLayer;
     }
+    /// Unsigned key that sorts like operator<
+    quint64 sortKey() const
+    {
+        // Flip doubles so that their bits order as unsigned: all of them if negative, the sign otherwise
+        union { double d; quint64 u; } v;
+        v.d = InClassPriority;
+        quint64 k = (v.u >> 63) ? ~v.u : (v.u | (Q_UINT64_C(1) << 63));
+        // The class takes the top 2 bits, the priority loses its 2 lowest ones
+        return (quint64(theClass) << 62) | (k >> 2);
+    }
 
 private:
     Class theClass;
@@ -107,6 +118,12 @@ public:
     /// Destructor
     virtual ~Feature();
 
+    /// Features live in the slabs of a FeaturePool, by default the one of the backend
+    static void* operator new(std::size_t sz);
+    static void* operator new(std::size_t sz, FeaturePool* aPool);
+    static void operator delete(void* ptr);
+    static void operator delete(void* ptr, FeaturePool* aPool);
+
     /** Return the smalest box contening all the MapFeature
          * @return A coord box
          */
@@ -152,8 +169,13 @@ public:
     const QDateTime time() const;
     void setTime(const QDateTime& aTime);
     void setTime(uint epoch);
-    const QString& user() const;
+    /// Whether the time is known; setting an invalid one, or (uint)-1, forgets it
+    bool hasTime() const;
+    QString user() const;
     void setUser(const QString& aUser);
+    /// The user as an index in the interned user table (see g_setUser)
+    quint32 userId() const;
+    void setUserId(quint32 anId);
     int versionNumber() const;
     void setVersionNumber(int vn);
 #endif
@@ -178,6 +200,19 @@ public:
         */
     virtual void setTag(int index, const QString& key, const QString& value);
 
+    /** Set the tag whose key and value are already interned (see g_addTagKey and g_addTagValue).
+         * Works as setTag(key, value), without hashing the strings again.
+         * "created_by" is not filtered out: callers don't pass it.
+         * Unlike setTag, the document isn't told: call tagsChanged() once all the tags are set
+         * @param k the index of the key
+         * @param v the index of the value
+        */
+    virtual void setTagIds(quint32 k, quint32 v);
+
+    /** Tell the document the tags changed, after a series of setTagIds
+         */
+    void tagsChanged();
+
     /** remove all the tags for the curent feature
          */
     virtual void clearTags();
@@ -288,6 +323,11 @@ public:
     virtual void buildPath(const Projection& aProjection);
     virtual const QPainterPath& getPath() const;
 
+    /** Approximate memory held by the feature, including its private data
+         * @return size in bytes
+         */
+    virtual int memoryUsage() const;
+
     const FeaturePainter* getPainter(qreal PixelPerM) const;
     const FeaturePainter* getCurrentPainter() const;
     bool hasPainter() const;
@@ -352,7 +392,9 @@ protected:
     bool ReadOnly; // 1
     bool MetaUpToDate;
     IFeature::FId newId(IFeature::FeatureType type) const;
-    QMutex featMutex;
+    /// Guards what renderers compute lazily, such as meta and paths; created on first use.
+    /// Check whether the work is needed before taking it, so that features that are only read never get one.
+    QMutex* featMutex() const;
 
     bool tagsToXML(QXmlStreamWriter& stream, bool strict);
     static void tagsFromXML(Document* d, Feature* f, QXmlStreamReader& stream);
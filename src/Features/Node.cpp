@@ -4,6 +4,7 @@
 #include "MapRenderer.h"
 #include "LineF.h"
 #include "Global.h"
+#include "NodeCoordStore.h"
 
 #include <QApplication>
 #include <QtGui/QPainter>
@@ -13,7 +14,7 @@
 
 Node::Node(const Coord& aCoord)
     : Feature()
-    , ProjectionRevision(0)
+    , ProjectionRevision(0), CoordStore(0), CoordSlot(0)
 {
     BBox = CoordBox(aCoord, aCoord);
 //    qDebug() << "Node size: " << sizeof(Node) << sizeof(PhotoNode);
@@ -21,7 +22,7 @@ Node::Node(const Coord& aCoord)
 }
 
 Node::Node(const Node& other)
-    : Feature(other)
+    : Feature(other), CoordStore(0), CoordSlot(0)
 {
     BBox = other.BBox;
     Projected = other.Projected;
@@ -29,6 +30,8 @@ Node::Node(const Node& other)
 
 Node::~Node(void)
 {
+    if (CoordStore)
+        CoordStore->release(CoordSlot);
 }
 
 const QPointF& Node::projected() const
@@ -45,7 +48,10 @@ const QPointF& Node::projected(const Projection& aProjection)
 void Node::buildPath(const Projection& aProjection)
 {
     if (ProjectionRevision != aProjection.projectionRevision()) {
-        Projected = aProjection.project(BBox.topLeft());
+        if (CoordStore)
+            Projected = CoordStore->projected(CoordSlot, aProjection);
+        else
+            Projected = aProjection.project(BBox.topLeft());
         ProjectionRevision = aProjection.projectionRevision();
     }
 }
@@ -59,6 +65,8 @@ void Node::setPosition(const Coord& aCoord)
 {
     BBox = CoordBox(aCoord, aCoord);
     ProjectionRevision = 0;
+    if (CoordStore)
+        CoordStore->setPosition(CoordSlot, aCoord);
     g_backend.sync(this);
 
     notifyChanges();
@@ -276,7 +284,9 @@ void Node::partChanged(Feature*, int)
 
 void Node::updateMeta()
 {
-    QMutexLocker mutlock(&featMutex);
+    if (MetaUpToDate)
+        return;
+    QMutexLocker mutlock(featMutex());
     if (MetaUpToDate)
         return;
 
@@ -400,9 +410,9 @@ bool Node::toGPX(QXmlStreamWriter& stream, QProgressDialog * progress, QString e
     stream.writeAttribute("lon",COORD2STRING(BBox.topRight().x()));
     stream.writeAttribute("lat", COORD2STRING(BBox.topRight().y()));
 #ifndef FRISIUS_BUILD
-    stream.writeTextElement("time", time().toString(Qt::ISODate)+"Z");
+    stream.writeTextElement("time", time().toUTC().toString(Qt::ISODate)+"Z");
 #else
-    stream.writeTextElement("time", QDateTime::currentDateTime().toString(Qt::ISODate)+"Z");
+    stream.writeTextElement("time", QDateTime::currentDateTime().toUTC().toString(Qt::ISODate)+"Z");
 #endif
 
     QString s = tagValue("name","");
@@ -524,6 +534,7 @@ TrackNode * TrackNode::fromGPX(Document* d, Layer* L, QXmlStreamReader& stream)
             stream.readNext();
             QString dtm = stream.text().toString();
             time = QDateTime::fromString(dtm.left(19), Qt::ISODate);
+            time.setTimeSpec(Qt::UTC);
             stream.readNext();
         } else if (stream.name() == "ele") {
             stream.readNext();
@@ -591,7 +602,7 @@ bool TrackNode::toGPX(QXmlStreamWriter& stream, QProgressDialog * progress, QStr
     stream.writeAttribute("lon",COORD2STRING(BBox.topRight().x()));
     stream.writeAttribute("lat", COORD2STRING(BBox.topRight().y()));
 
-    stream.writeTextElement("time", time().toString(Qt::ISODate)+"Z");
+    stream.writeTextElement("time", time().toUTC().toString(Qt::ISODate)+"Z");
 
     QString s = tagValue("name","");
     if (!s.isEmpty()) {
@@ -711,7 +722,8 @@ void PhotoNode::drawTouchup(QPainter& thePainter , MapView* theView)
             qreal phRt = 1. * Photo->width() / Photo->height();
             phPt = me - QPoint(10*rt, 10*rt) - QPoint(M_PREFS->getMaxGeoPicWidth()*rt, M_PREFS->getMaxGeoPicWidth()*rt/phRt);
         }
-        thePainter.drawPixmap(phPt, Photo->scaledToWidth(M_PREFS->getMaxGeoPicWidth()*rt));
+        // The touchup is recorded and played back by workers, which can't use pixmaps
+        thePainter.drawImage(phPt, Photo->scaledToWidth(M_PREFS->getMaxGeoPicWidth()*rt).toImage());
     }
 #endif
     Node::drawTouchup(thePainter, theView);
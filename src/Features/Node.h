@@ -19,6 +19,7 @@
 #endif
 
 class QProgressDialog;
+class NodeCoordStore;
 
 class Node : public Feature
 {
@@ -27,7 +28,7 @@ class Node : public Feature
 
 public:
     Node()
-        : ProjectionRevision(0)
+        : ProjectionRevision(0), CoordStore(0), CoordSlot(0)
     {
     }
 
@@ -36,11 +37,15 @@ public:
     virtual ~Node();
 
     quint16 ProjectionRevision;
-    QPointF Projected;
-
     bool IsWaypoint;
     bool IsPOI;
 
+    QPointF Projected;
+
+    // Set if the node layer keeps coordinates in a column store (see MemoryBackend::coordStore)
+    NodeCoordStore* CoordStore;
+    quint32 CoordSlot;
+
 public:
     virtual QString getClass() const {return "Node";}
     virtual char getType() const {return IFeature::Point;}
@@ -424,7 +424,7 @@ void Relation::buildPath(Projection const &theProjection)
 //    QPainterPath clipPath;
 //    clipPath.addRect(cr);
 
-    QMutexLocker mutlock(&featMutex);
+    QMutexLocker mutlock(featMutex());
     p->theBoundingPath = QPainterPath();
 
     if (!p->Members.size())
@@ -537,6 +537,13 @@ const QPainterPath& Relation::getPath() const
     return p->thePath;
 }
 
+int Relation::memoryUsage() const
+{
+    return Feature::memoryUsage() + sizeof(RelationPrivate)
+            + p->Members.size() * sizeof(QPair<QString, MapFeaturePtr>)
+            + (p->thePath.elementCount() + p->theBoundingPath.elementCount()) * sizeof(QPainterPath::Element);
+}
+
 const RenderPriority& Relation::renderPriority()
 {
     if (!MetaUpToDate)
@@ -546,7 +553,9 @@ const RenderPriority& Relation::renderPriority()
 
 void Relation::updateMeta()
 {
-    QMutexLocker mutlock(&featMutex);
+    if (MetaUpToDate)
+        return;
+    QMutexLocker mutlock(featMutex());
     if (MetaUpToDate)
         return;
 
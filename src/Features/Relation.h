@@ -55,6 +55,7 @@ public:
     virtual void partChanged(Feature* F, int ChangeId);
 
     const QPainterPath& getPath() const;
+    virtual int memoryUsage() const;
     void buildPath(Projection const &theProjection);
 
     virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid="");
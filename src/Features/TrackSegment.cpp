@@ -315,7 +315,9 @@ void TrackSegment::partChanged(Feature*, int)
 
 void TrackSegment::updateMeta()
 {
-    QMutexLocker mutlock(&featMutex);
+    if (MetaUpToDate)
+        return;
+    QMutexLocker mutlock(featMutex());
     if (MetaUpToDate)
         return;
 
@@ -2,6 +2,7 @@
 
 #include "Way.h"
 #include "Node.h"
+#include "NodeCoordStore.h"
 
 #include "DocumentCommands.h"
 #include "WayCommands.h"
@@ -17,8 +18,11 @@
 #include <QtGui/QPainter>
 #include <QtGui/QPainterPath>
 #include <QProgressDialog>
+#include <QVarLengthArray>
 
 #include <algorithm>
+#include <float.h>
+#include <math.h>
 #include <QList>
 
 #if (QT_VERSION < 0x040700 || defined(FORCE_46)) && !defined(_MOBILE)
@@ -40,6 +44,9 @@ class WayPrivate
             , ProjectionRevision(0)
             , BestSegment(-1)
             , SimpleWidth(0)
+            , SlotStore(0), SlotsUpToDate(false)
+            , MinImportance(0), LodTolerance(-1)
+            , ScreenUpToDate(false)
         {
         }
         Way* theWay;
@@ -47,6 +54,11 @@ class WayPrivate
         QList<Node*> Nodes;
         QList<Node*> virtualNodes;
 
+        // Slots of Nodes, when they all live in the same column store
+        NodeCoordStore* SlotStore;
+        QVector<quint32> Slots;
+        bool SlotsUpToDate;
+
         bool BBoxUpToDate;
 
         qreal Area;
@@ -56,6 +68,20 @@ class WayPrivate
         bool VirtualsUptodate;
         QPainterPath thePath;
         int ProjectionRevision;
+
+        // Douglas-Peucker importance of each vertex of thePath, empty when the way is too short
+        // to be worth simplifying
+        QVector<float> Importance;
+        qreal MinImportance;
+        // Simplified thePath for the last tolerance asked for
+        qreal LodTolerance;
+        QPainterPath LodPath;
+
+        // thePath mapped by ScreenTransform and snapped to whole pixels
+        bool ScreenUpToDate;
+        QTransform ScreenTransform;
+        QPainterPath ScreenPath;
+
         int BestSegment;
         qreal SimpleWidth;
         QColor SimpleColor;
@@ -63,12 +89,18 @@ class WayPrivate
         RenderPriority theRenderPriority; // 10 (24)
 
         void CalculateWidth();
+        void updateSlots();
+        void computeImportance(const QPointF* points, int n);
         void doUpdateVirtuals();
         void removeVirtuals();
         void addVirtuals();
 };
 
 #define DEFAULTWIDTH 6
+// Ways with fewer nodes are always drawn in full
+#define LOD_MIN_NODES 32
+// How far from whole pixels a pan may be and still reuse the snapped screen path
+#define SCREEN_SNAP_EPSILON 0.01
 #define LANEWIDTH 4
 
 void WayPrivate::CalculateWidth()
@@ -107,6 +139,72 @@ void WayPrivate::CalculateWidth()
         SimpleWidth = s.toDouble();
 }
 
+void WayPrivate::updateSlots()
+{
+    if (SlotsUpToDate)
+        return;
+    SlotsUpToDate = true;
+
+    SlotStore = Nodes.size() && Nodes[0] ? Nodes[0]->CoordStore : NULL;
+    Slots.resize(SlotStore ? Nodes.size() : 0);
+    for (int i=0; i<Slots.size(); ++i) {
+        if (!Nodes[i] || Nodes[i]->CoordStore != SlotStore) {
+            SlotStore = NULL;
+            Slots.clear();
+            return;
+        }
+        Slots[i] = Nodes[i]->CoordSlot;
+    }
+}
+
+// Douglas-Peucker: a vertex is as important as its distance to the chord it splits, capped by the
+// importance of the vertex that split the enclosing chord, so that keeping every vertex at least
+// as important as a tolerance gives the simplification at that tolerance.
+void WayPrivate::computeImportance(const QPointF* points, int n)
+{
+    Importance.resize(n);
+    Importance[0] = Importance[n-1] = FLT_MAX;
+    MinImportance = FLT_MAX;
+
+    struct Span { int first, last; float cap; };
+    QVarLengthArray<Span, 64> stack;
+    Span whole = { 0, n-1, FLT_MAX };
+    stack.append(whole);
+    while (stack.size()) {
+        Span s = stack[stack.size()-1];
+        stack.removeLast();
+        if (s.last - s.first < 2)
+            continue;
+
+        const QPointF& A = points[s.first];
+        QPointF AB = points[s.last] - A;
+        qreal len2 = AB.x()*AB.x() + AB.y()*AB.y();
+        qreal best = -1;
+        int split = s.first+1;
+        for (int k=s.first+1; k<s.last; ++k) {
+            QPointF AP = points[k] - A;
+            qreal d2;
+            if (len2 > 0) {
+                qreal cross = AB.x()*AP.y() - AB.y()*AP.x();
+                d2 = cross * cross / len2;
+            } else
+                d2 = AP.x()*AP.x() + AP.y()*AP.y();
+            if (d2 > best) {
+                best = d2;
+                split = k;
+            }
+        }
+        float imp = qMin(float(sqrt(best)), s.cap);
+        Importance[split] = imp;
+        MinImportance = qMin(MinImportance, qreal(imp));
+
+        Span left = { s.first, split, imp };
+        Span right = { split, s.last, imp };
+        stack.append(left);
+        stack.append(right);
+    }
+}
+
 void WayPrivate::removeVirtuals()
 {
     while (virtualNodes.size()) {
@@ -239,12 +337,13 @@ void Way::add(Node* Pt)
 
 void Way::add(Node* Pt, int Idx)
 {
-    QMutexLocker mutlock(&featMutex);
+    QMutexLocker mutlock(featMutex());
     p->Nodes.insert(p->Nodes.begin() + Idx, Pt);
 //	p->Nodes.push_back(Pt);
 //	std::rotate(p->Nodes.begin()+Idx,p->Nodes.end()-1,p->Nodes.end());
     Pt->setParentFeature(this);
     g_backend.sync(Pt);
+    p->SlotsUpToDate = false;
     p->BBoxUpToDate = false;
     p->PathUpToDate = false;
     MetaUpToDate = false;
@@ -272,13 +371,14 @@ int Way::findVirtual(Feature* Pt) const
 
 void Way::remove(int idx)
 {
-    QMutexLocker mutlock(&featMutex);
+    QMutexLocker mutlock(featMutex());
     Node* Pt = p->Nodes[idx];
     // only remove as parent if the node is only included once
     p->Nodes.erase(p->Nodes.begin()+idx);
     if (Pt && (find(Pt) >= size()))
         Pt->unsetParentFeature(this);
     g_backend.sync(Pt);
+    p->SlotsUpToDate = false;
     p->BBoxUpToDate = false;
     p->PathUpToDate = false;
     MetaUpToDate = false;
@@ -348,7 +448,13 @@ const CoordBox& Way::boundingBox(bool update) const
 {
     if (!p->BBoxUpToDate && update)
     {
-        if (p->Nodes.size())
+        p->updateSlots();
+        if (p->SlotStore) {
+            BBox = p->SlotStore->boundingBox(p->Slots.constData(), p->Slots.size());
+            if (BBox.isNull())
+                BBox = CoordBox(Coord(0,0),Coord(0,0));
+        }
+        else if (p->Nodes.size())
         {
             bool haveFirst = false;
             for (int i=0; i<p->Nodes.size(); ++i)
@@ -392,12 +498,19 @@ void Way::drawSimple(QPainter &P, MapView *theView)
 
     P.setBrush(theBrush);
     P.setPen(thePen);
-    P.drawPath(theView->transform().map(p->thePath));
+    QPoint offset;
+    QPainterPath pth = getScreenPath(theView->transform(), offset);
+    P.translate(offset);
+    P.drawPath(pth);
+    P.translate(-offset);
 }
 
 void Way::updateMeta()
 {
-    QMutexLocker mutlock(&featMutex);
+    // Checked again under the lock: most calls find the meta up to date, and need no mutex
+    if (MetaUpToDate)
+        return;
+    QMutexLocker mutlock(featMutex());
     if (MetaUpToDate)
         return;
 
@@ -488,7 +601,11 @@ void Way::drawTouchup(QPainter& P, MapView* theView)
     if (isDirty() && isUploadable() && M_PREFS->getDirtyVisible()) {
         QPen thePen(M_PREFS->getDirtyColor(),M_PREFS->getDirtyWidth());
         P.setPen(thePen);
-        P.drawPath(theView->transform().map(getPath()));
+        QPoint offset;
+        QPainterPath pth = getScreenPath(theView->transform(), offset);
+        P.translate(offset);
+        P.drawPath(pth);
+        P.translate(-offset);
     }
 
     qreal theWidth = theView->nodeWidth();
@@ -514,7 +631,11 @@ void Way::drawSpecial(QPainter& thePainter, QPen& Pen, MapView* theView)
         thePainter.drawLine(theView->transform().map(theView->projection().project(getSegment(p->BestSegment))));
     else {
         buildPath(theView->projection());
-        thePainter.drawPath(theView->transform().map(p->thePath));
+        QPoint offset;
+        QPainterPath pth = getScreenPath(theView->transform(), offset);
+        thePainter.translate(offset);
+        thePainter.drawPath(pth);
+        thePainter.translate(-offset);
     }
 }
 
@@ -654,12 +775,86 @@ const QPainterPath& Way::getPath() const
     return p->thePath;
 }
 
+QPainterPath Way::getPath(qreal aTolerance) const
+{
+    if (p->Importance.isEmpty() || aTolerance <= p->MinImportance)
+        return p->thePath;
+
+    // Snap to a power of two, so that nearby scales share one simplification
+    aTolerance = pow(2., floor(log(aTolerance) / log(2.)));
+    if (aTolerance <= p->MinImportance)
+        return p->thePath;
+
+    // Workers only read the paths prepared for their scale, so only preparing them takes the lock
+    if (p->LodTolerance == aTolerance)
+        return p->LodPath;
+    QMutexLocker mutlock(featMutex());
+    if (p->LodTolerance == aTolerance)
+        return p->LodPath;
+
+    QPainterPath pth;
+    int n = p->thePath.elementCount();
+    for (int i=0; i<n; ++i) {
+        if (p->Importance[i] < aTolerance)
+            continue;
+        const QPainterPath::Element& e = p->thePath.elementAt(i);
+        if (e.isMoveTo())
+            pth.moveTo(e.x, e.y);
+        else
+            pth.lineTo(e.x, e.y);
+    }
+    p->LodPath = pth;
+    p->LodTolerance = aTolerance;
+    return p->LodPath;
+}
+
+QPainterPath Way::getScreenPath(const QTransform& aTransform, QPoint& offset) const
+{
+    // Only the GUI thread draws the wireframe, so the screen path needs no lock
+    if (p->ScreenUpToDate
+            && aTransform.m11() == p->ScreenTransform.m11() && aTransform.m12() == p->ScreenTransform.m12()
+            && aTransform.m21() == p->ScreenTransform.m21() && aTransform.m22() == p->ScreenTransform.m22()) {
+        // Same scale and rotation: a pan by whole pixels only moves the snapped path
+        qreal dx = aTransform.dx() - p->ScreenTransform.dx();
+        qreal dy = aTransform.dy() - p->ScreenTransform.dy();
+        offset = QPoint(qRound(dx), qRound(dy));
+        if (qAbs(dx - offset.x()) < SCREEN_SNAP_EPSILON && qAbs(dy - offset.y()) < SCREEN_SNAP_EPSILON)
+            return p->ScreenPath;
+    }
+
+    p->ScreenPath = aTransform.map(p->thePath);
+    for (int i=0; i<p->ScreenPath.elementCount(); ++i) {
+        const QPainterPath::Element& e = p->ScreenPath.elementAt(i);
+        p->ScreenPath.setElementPositionAt(i, qRound(e.x), qRound(e.y));
+    }
+    p->ScreenTransform = aTransform;
+    p->ScreenUpToDate = true;
+    offset = QPoint(0, 0);
+    return p->ScreenPath;
+}
+
+int Way::memoryUsage() const
+{
+    return Feature::memoryUsage() + sizeof(WayPrivate)
+            + (p->Nodes.size() + p->virtualNodes.size()) * sizeof(Node*)
+            + p->thePath.elementCount() * sizeof(QPainterPath::Element)
+            + p->Importance.size() * sizeof(float)
+            + p->LodPath.elementCount() * sizeof(QPainterPath::Element)
+            + p->ScreenPath.elementCount() * sizeof(QPainterPath::Element);
+}
+
 void Way::addPathHole(const QPainterPath& pth)
 {
     if (!p->PathUpToDate)
         return;
 
     p->thePath = p->thePath.subtracted(pth);
+    // Vertices no longer match the importance
+    p->Importance.clear();
+    p->LodTolerance = -1;
+    p->LodPath = QPainterPath();
+    p->ScreenUpToDate = false;
+    p->ScreenPath = QPainterPath();
 }
 
 void Way::rebuildPath(const Projection &theProjection)
@@ -670,20 +865,36 @@ void Way::rebuildPath(const Projection &theProjection)
 
 void Way::buildPath(const Projection &theProjection)
 {
-    QMutexLocker mutlock(&featMutex);
+    if (p->PathUpToDate && p->ProjectionRevision == theProjection.projectionRevision())
+        return;
+    QMutexLocker mutlock(featMutex());
     if (p->PathUpToDate && p->ProjectionRevision == theProjection.projectionRevision())
         return;
     else {
         p->thePath = QPainterPath();
+        p->Importance.clear();
+        p->LodTolerance = -1;
+        p->LodPath = QPainterPath();
+        p->ScreenUpToDate = false;
+        p->ScreenPath = QPainterPath();
         if (p->Nodes.size() < 2) {
             p->PathUpToDate = true;
             return;
         }
 
-        p->thePath.moveTo(p->Nodes.at(0)->projected(theProjection));
-        for (int i=1; i<p->Nodes.size(); ++i) {
-            p->thePath.lineTo((p->Nodes.at(i)->projected(theProjection)));
+        p->updateSlots();
+        QVarLengthArray<QPointF, 256> points(p->Nodes.size());
+        if (p->SlotStore) {
+            p->SlotStore->project(p->Slots.constData(), p->Slots.size(), theProjection, points.data());
+        } else {
+            for (int i=0; i<p->Nodes.size(); ++i)
+                points[i] = p->Nodes.at(i)->projected(theProjection);
         }
+        p->thePath.moveTo(points[0]);
+        for (int i=1; i<points.size(); ++i)
+            p->thePath.lineTo(points[i]);
+        if (points.size() >= LOD_MIN_NODES)
+            p->computeImportance(points.constData(), points.size());
         for (int i=0; i<p->virtualNodes.size(); ++i) {
             p->virtualNodes[i]->buildPath(theProjection);
         }
@@ -828,6 +1039,7 @@ Way * Way::fromXML(Document* d, Layer * L, QXmlStreamReader& stream)
                 R->add(Part);
             } else {
                 R->p->Nodes.push_back(Part);
+                R->p->SlotsUpToDate = false;
                 Part->setParentFeature(R);
             }
             stream.readNext();
@@ -84,6 +84,12 @@ public:
     virtual bool deleteChildren(Document* theDocument, CommandList* theList);
 
     const QPainterPath& getPath() const;
+    /// Path without the vertices that move it less than aTolerance (in projected units)
+    QPainterPath getPath(qreal aTolerance) const;
+    /// Path mapped by aTransform and snapped to whole pixels, to be drawn translated by offset.
+    /// It is kept while aTransform only pans by whole pixels, so that pans need no per-vertex work.
+    QPainterPath getScreenPath(const QTransform& aTransform, QPoint& offset) const;
+    virtual int memoryUsage() const;
     void addPathHole(const QPainterPath &pth);
     void rebuildPath(const Projection &theProjection);
     void buildPath(Projection const &theProjection);
@@ -15,9 +15,21 @@
 #include <QApplication>
 #include <QMessageBox>
 #include <QDateTime>
+#include <QTime>
+#include <QMutex>
+#include <QQueue>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtConcurrentRun>
 
 #include "ImportExportPBF.h"
 #include "Global.h"
+#include "MerkaartorPreferences.h"
+#ifdef USE_SPATIALITE
+#include "SpatialiteBackend.h"
+#endif
 
 #include "zlib.h"
 //#include "bzlib.h"
@@ -25,6 +37,54 @@
 #define NANO ( 1000.0 * 1000.0 * 1000.0 )
 #define MAX_BLOCK_HEADER_SIZE ( 64 * 1024 )
 #define MAX_BLOB_SIZE ( 32 * 1024 * 1024 )
+#define USER_UNMAPPED 0xfffffffe
+#define TAG_UNMAPPED 0xfffffffe
+// Keys that are never imported
+#define TAG_SKIPPED 0xffffffff
+// Milliseconds between progress updates, which give the event loop a turn
+#define PROGRESS_INTERVAL 100
+// Entities per written block, as osmosis and osmium do
+#define EXPORT_BLOCK_SIZE 8000
+// Coordinates are written in units of 100 nanodegrees
+#define EXPORT_GRANULARITY 100
+
+/// Member of a relation, or node of a way (Role 0)
+struct PbfMember
+{
+    char Type;
+    qint64 Id;
+    int Role;
+};
+
+/// Node, way or relation of a decoded block. Strings are indices into the block string table.
+struct PbfEntity
+{
+    char Type;
+    qint64 Id;
+    Coord Position;
+    bool HasVersion, HasTime, HasUser;
+    int Version;
+    uint Time;
+    int UserSid;
+    // Key and value pairs in PbfBlock::Tags
+    int FirstTag, TagCount;
+    // In PbfBlock::Members
+    int FirstMember, MemberCount;
+};
+
+/// A PrimitiveBlock decoded by a worker into plain data, for the committer to apply to the layer
+struct PbfBlock
+{
+    PbfBlock() : Ok(false), Pos(0) {}
+
+    bool Ok;
+    // File position after the block
+    qint64 Pos;
+    QVector<QString> Strings;
+    QVector<PbfEntity> Entities;
+    QVector<int> Tags;
+    QVector<PbfMember> Members;
+};
 
 ImportExportPBF::ImportExportPBF(Document* doc)
     : IImportExport(doc)
@@ -36,11 +96,6 @@ ImportExportPBF::~ImportExportPBF()
 {
 }
 
-// export
-bool ImportExportPBF::export_(const QList<Feature *>& /*featList*/)
-{
-    return false;
-}
 
 /***************************************************/
 /*
@@ -66,66 +121,45 @@ static void SzFree( void *p, void *address)
     free( address );
 }
 
-void ImportExportPBF::loadGroup()
-{
-    const OSMPBF::PrimitiveGroup& group = m_primitiveBlock.primitivegroup( m_currentGroup );
-    if ( group.nodes_size() != 0 ) {
-        m_mode = ModeNode;
-    } else if ( group.ways_size() != 0 ) {
-        m_mode = ModeWay;
-    } else if ( group.relations_size() != 0 ) {
-        m_mode = ModeRelation;
-    } else if ( group.has_dense() )  {
-        m_mode = ModeDense;
-        m_lastDenseID = 0;
-        m_lastDenseTag = 0;
-        m_lastDenseLatitude = 0;
-        m_lastDenseLongitude = 0;
-        m_lastDenseTimestamp = 0;
-        m_lastDenseChangeset = 0;
-        m_lastDenseUId = 0;
-        m_lastDenseUserSid = 0;
-        assert( group.dense().id_size() != 0 );
-    } else
-        assert( false );
-}
-
-void ImportExportPBF::loadBlock()
-{
-    m_loadBlock = false;
-    m_currentGroup = 0;
-    m_currentEntity = 0;
-    int stringCount = m_primitiveBlock.stringtable().s_size();
-    // precompute all strings that match a necessary tag
-    m_nodeTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_nodeTagIDs[i] = m_nodeTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-    m_wayTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_wayTagIDs[i] = m_wayTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-    m_relationTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_relationTagIDs[i] = m_relationTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-}
-
-bool ImportExportPBF::readNextBlock()
+quint32 ImportExportPBF::userId( const PbfBlock& aBlock, int sid )
 {
-    if ( !readBlockHeader() )
-        return false;
+    quint32& id = m_userIDs[sid];
+    if ( id == USER_UNMAPPED )
+        id = g_setUser( aBlock.Strings.at( sid ) );
+    return id;
+}
 
-    if ( m_blockHeader.type() != "OSMData" ) {
-        qCritical() << "invalid block type, found" << m_blockHeader.type().data() << "instead of OSMData";
-        return false;
+quint32 ImportExportPBF::keyId( const PbfBlock& aBlock, int sid )
+{
+    quint32& id = m_keyIDs[sid];
+    if ( id == TAG_UNMAPPED ) {
+        const QString& key = aBlock.Strings.at( sid );
+        if ( key.compare( "created_by", Qt::CaseInsensitive ) == 0 )
+            id = TAG_SKIPPED;
+        else
+            id = g_addTagKey( key );
     }
+    return id;
+}
 
-    if ( !readBlob() )
-        return false;
+quint32 ImportExportPBF::valueId( const PbfBlock& aBlock, int sid )
+{
+    quint32& id = m_valueIDs[sid];
+    if ( id == TAG_UNMAPPED )
+        id = g_addTagValue( aBlock.Strings.at( sid ) );
+    return id;
+}
 
-    if ( !m_primitiveBlock.ParseFromArray( m_buffer.data(), m_buffer.size() ) ) {
-        qCritical() << "failed to parse PrimitiveBlock";
-        return false;
-    }
-    return true;
+void ImportExportPBF::releaseTagIds()
+{
+    for ( unsigned i = 0; i < m_keyIDs.size(); i++ )
+        if ( m_keyIDs[i] != TAG_UNMAPPED && m_keyIDs[i] != TAG_SKIPPED )
+            g_releaseTagKey( m_keyIDs[i] );
+    for ( unsigned i = 0; i < m_valueIDs.size(); i++ )
+        if ( m_valueIDs[i] != TAG_UNMAPPED )
+            g_releaseTagValue( m_valueIDs[i] );
+    m_keyIDs.clear();
+    m_valueIDs.clear();
 }
 
 bool ImportExportPBF::readBlockHeader()
@@ -170,19 +204,22 @@ bool ImportExportPBF::readBlob()
         return false;
     }
 
-    if ( m_blob.has_raw() ) {
-        const std::string& data = m_blob.raw();
-        m_buffer.resize( data.size() );
-        for ( unsigned i = 0; i < data.size(); i++ )
-            m_buffer[i] = data[i];
-    } else if ( m_blob.has_zlib_data() ) {
-        if ( !unpackZlib() )
+    return unpackBlob( m_blob, m_buffer );
+}
+
+bool ImportExportPBF::unpackBlob( const OSMPBF::Blob& aBlob, QByteArray& aBuffer )
+{
+    if ( aBlob.has_raw() ) {
+        const std::string& data = aBlob.raw();
+        aBuffer = QByteArray( data.data(), data.size() );
+    } else if ( aBlob.has_zlib_data() ) {
+        if ( !unpackZlib( aBlob, aBuffer ) )
             return false;
-//    } else if ( m_blob.has_bzip2_data() ) {
-//        if ( !unpackBzip2() )
+//    } else if ( aBlob.has_bzip2_data() ) {
+//        if ( !unpackBzip2( aBlob, aBuffer ) )
 //            return false;
-    } else if ( m_blob.has_lzma_data() ) {
-        if ( !unpackLzma() )
+    } else if ( aBlob.has_lzma_data() ) {
+        if ( !unpackLzma( aBlob, aBuffer ) )
             return false;
     } else {
         qCritical() << "Blob contains no data";
@@ -192,14 +229,14 @@ bool ImportExportPBF::readBlob()
     return true;
 }
 
-bool ImportExportPBF::unpackZlib()
+bool ImportExportPBF::unpackZlib( const OSMPBF::Blob& aBlob, QByteArray& aBuffer )
 {
-    m_buffer.resize( m_blob.raw_size() );
+    aBuffer.resize( aBlob.raw_size() );
     z_stream compressedStream;
-    compressedStream.next_in = ( unsigned char* ) m_blob.zlib_data().data();
-    compressedStream.avail_in = m_blob.zlib_data().size();
-    compressedStream.next_out = ( unsigned char* ) m_buffer.data();
-    compressedStream.avail_out = m_blob.raw_size();
+    compressedStream.next_in = ( unsigned char* ) aBlob.zlib_data().data();
+    compressedStream.avail_in = aBlob.zlib_data().size();
+    compressedStream.next_out = ( unsigned char* ) aBuffer.data();
+    compressedStream.avail_out = aBlob.raw_size();
     compressedStream.zalloc = Z_NULL;
     compressedStream.zfree = Z_NULL;
     compressedStream.opaque = Z_NULL;
@@ -221,14 +258,12 @@ bool ImportExportPBF::unpackZlib()
     return true;
 }
 
-bool ImportExportPBF::unpackBzip2()
+bool ImportExportPBF::unpackBzip2( const OSMPBF::Blob& /*aBlob*/, QByteArray& /*aBuffer*/ )
 {
-//    unsigned size = m_blob.raw_size();
-//    m_buffer.resize( size );
-//    m_bzip2Buffer.resize( m_blob.bzip2_data().size() );
-//    for ( unsigned i = 0; i < m_blob.bzip2_data().size(); i++ )
-//        m_bzip2Buffer[i] = m_blob.bzip2_data()[i];
-//    int ret = BZ2_bzBuffToBuffDecompress( m_buffer.data(), &size, m_bzip2Buffer.data(), m_bzip2Buffer.size(), 0, 0 );
+//    unsigned size = aBlob.raw_size();
+//    aBuffer.resize( size );
+//    QByteArray bzip2Buffer( aBlob.bzip2_data().data(), aBlob.bzip2_data().size() );
+//    int ret = BZ2_bzBuffToBuffDecompress( aBuffer.data(), &size, bzip2Buffer.data(), bzip2Buffer.size(), 0, 0 );
 //    if ( ret != BZ_OK ) {
 //        qCritical() << "failed to unpack bzip2 stream";
 //        return false;
@@ -236,18 +271,18 @@ bool ImportExportPBF::unpackBzip2()
     return true;
 }
 
-bool ImportExportPBF::unpackLzma()
+bool ImportExportPBF::unpackLzma( const OSMPBF::Blob& /*aBlob*/, QByteArray& /*aBuffer*/ )
 {
 //    ISzAlloc alloc = { SzAlloc, SzFree };
 //    ELzmaStatus status;
-//    SizeT destinationLength = m_blob.raw_size();
-//    SizeT sourceLength = m_blob.lzma_data().size() - LZMA_PROPS_SIZE + 8;
+//    SizeT destinationLength = aBlob.raw_size();
+//    SizeT sourceLength = aBlob.lzma_data().size() - LZMA_PROPS_SIZE + 8;
 //    int ret = LzmaDecode(
-//            ( unsigned char* ) m_buffer.data(),
+//            ( unsigned char* ) aBuffer.data(),
 //            &destinationLength,
-//            ( const unsigned char* ) m_blob.lzma_data().data() + LZMA_PROPS_SIZE + 8,
+//            ( const unsigned char* ) aBlob.lzma_data().data() + LZMA_PROPS_SIZE + 8,
 //            &sourceLength,
-//            ( const unsigned char* ) m_blob.lzma_data().data(),
+//            ( const unsigned char* ) aBlob.lzma_data().data(),
 //            LZMA_PROPS_SIZE + 8,
 //            LZMA_FINISH_END,
 //            &status,
@@ -259,262 +294,803 @@ bool ImportExportPBF::unpackLzma()
     return true;
 }
 
-void ImportExportPBF::parseNode( Layer* aLayer )
+template< class T >
+static void decodeInfo( const T& input, PbfEntity& e )
 {
-    const OSMPBF::Node& inputNode = m_primitiveBlock.primitivegroup( m_currentGroup ).nodes( m_currentEntity );
+    const OSMPBF::Info& info = input.info();
+    e.HasVersion = input.has_info() && info.has_version();
+    e.Version = info.version();
+    e.HasTime = input.has_info() && info.has_timestamp();
+    e.Time = info.timestamp();
+    e.HasUser = input.has_info() && info.has_user_sid();
+    e.UserSid = info.user_sid();
+}
 
-    Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, inputNode.id())));
-    if (!N) {
-        N = g_backend.allocNode(aLayer, Coord(
-                ( ( qreal ) inputNode.lon() * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) inputNode.lat() * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
-        N->setId(IFeature::FId(IFeature::Point, inputNode.id()));
-        aLayer->add(N);
-    } else {
-        N->setPosition(Coord(
-                ( ( qreal ) inputNode.lon() * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) inputNode.lat() * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
-        N->setLastUpdated(Feature::OSMServer);
-    }
+template< class T >
+static void decodeTags( const T& input, PbfBlock& aBlock, PbfEntity& e )
+{
+    e.FirstTag = aBlock.Tags.size();
+    e.TagCount = input.keys_size();
+    for ( int tag = 0; tag < input.keys_size(); tag++ )
+        aBlock.Tags << input.keys( tag ) << input.vals( tag );
+}
 
-#ifndef FRISIUS_BUILD
-    if (inputNode.has_info()) {
-        OSMPBF::Info info = inputNode.info();
-        if (info.has_version())
-            N->setVersionNumber(info.version());
-        if (info.has_timestamp())
-            N->setTime(QDateTime::fromTime_t(info.timestamp()));
-        if (info.has_user_sid())
-            N->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+bool ImportExportPBF::decodeBlock( const QByteArray& aData, PbfBlock& aBlock )
+{
+    OSMPBF::Blob blob;
+    if ( !blob.ParseFromArray( aData.constData(), aData.size() ) ) {
+        qCritical() << "failed to parse blob";
+        return false;
+    }
+    QByteArray buffer;
+    if ( !unpackBlob( blob, buffer ) )
+        return false;
+    OSMPBF::PrimitiveBlock block;
+    if ( !block.ParseFromArray( buffer.data(), buffer.size() ) ) {
+        qCritical() << "failed to parse PrimitiveBlock";
+        return false;
     }
-#endif
 
-    for ( int tag = 0; tag < inputNode.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputNode.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputNode.vals( tag ) ).data() );
-        N->setTag(key, value);
+    int stringCount = block.stringtable().s_size();
+    aBlock.Strings.resize( stringCount );
+    for ( int i = 1; i < stringCount; i++ ) {
+        const std::string& str = block.stringtable().s( i );
+        aBlock.Strings[i] = QString::fromUtf8( str.data(), str.size() );
     }
 
-    m_currentEntity++;
-    if ( m_currentEntity >= m_primitiveBlock.primitivegroup( m_currentGroup ).nodes_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
+    qreal granularity = block.granularity();
+    qreal lonOffset = block.lon_offset();
+    qreal latOffset = block.lat_offset();
+
+    for ( int g = 0; g < block.primitivegroup_size(); g++ ) {
+        const OSMPBF::PrimitiveGroup& group = block.primitivegroup( g );
+
+        for ( int i = 0; i < group.nodes_size(); i++ ) {
+            const OSMPBF::Node& inputNode = group.nodes( i );
+            PbfEntity e;
+            e.Type = IFeature::Point;
+            e.Id = inputNode.id();
+            e.Position = Coord(
+                    ( ( qreal ) inputNode.lon() * granularity + lonOffset ) / NANO,
+                    ( ( qreal ) inputNode.lat() * granularity + latOffset ) / NANO
+                    );
+            decodeInfo( inputNode, e );
+            decodeTags( inputNode, aBlock, e );
+            e.FirstMember = e.MemberCount = 0;
+            aBlock.Entities << e;
+        }
+
+        if ( group.has_dense() ) {
+            const OSMPBF::DenseNodes& dense = group.dense();
+            long long lastId = 0, lastLat = 0, lastLon = 0;
+            long long lastTimestamp = 0, lastUserSid = 0;
+            int lastTag = 0;
+            for ( int i = 0; i < dense.id_size(); i++ ) {
+                lastId += dense.id( i );
+                lastLat += dense.lat( i );
+                lastLon += dense.lon( i );
+
+                PbfEntity e;
+                e.Type = IFeature::Point;
+                e.Id = lastId;
+                e.Position = Coord(
+                        ( ( qreal ) lastLon * granularity + lonOffset ) / NANO,
+                        ( ( qreal ) lastLat * granularity + latOffset ) / NANO
+                        );
+                e.HasVersion = e.HasTime = e.HasUser = dense.has_denseinfo();
+                if ( dense.has_denseinfo() ) {
+                    lastTimestamp += dense.denseinfo().timestamp( i );
+                    lastUserSid += dense.denseinfo().user_sid( i );
+                    e.Version = dense.denseinfo().version( i );
+                    e.Time = lastTimestamp;
+                    e.UserSid = lastUserSid;
+                }
+
+                e.FirstTag = aBlock.Tags.size();
+                e.TagCount = 0;
+                while ( lastTag < dense.keys_vals_size() ) {
+                    int key = dense.keys_vals( lastTag );
+                    if ( key == 0 ) {
+                        lastTag++;
+                        break;
+                    }
+                    aBlock.Tags << key << dense.keys_vals( lastTag + 1 );
+                    e.TagCount++;
+                    lastTag += 2;
+                }
+                e.FirstMember = e.MemberCount = 0;
+                aBlock.Entities << e;
+            }
+        }
+
+        for ( int i = 0; i < group.ways_size(); i++ ) {
+            const OSMPBF::Way& inputWay = group.ways( i );
+            PbfEntity e;
+            e.Type = IFeature::LineString;
+            e.Id = inputWay.id();
+            decodeInfo( inputWay, e );
+            decodeTags( inputWay, aBlock, e );
+
+            e.FirstMember = aBlock.Members.size();
+            e.MemberCount = inputWay.refs_size();
+            long long lastRef = 0;
+            for ( int k = 0; k < inputWay.refs_size(); k++ ) {
+                lastRef += inputWay.refs( k );
+                PbfMember m = { IFeature::Point, lastRef, 0 };
+                aBlock.Members << m;
+            }
+            aBlock.Entities << e;
+        }
+
+        for ( int i = 0; i < group.relations_size(); i++ ) {
+            const OSMPBF::Relation& inputRelation = group.relations( i );
+            PbfEntity e;
+            e.Type = IFeature::OsmRelation;
+            e.Id = inputRelation.id();
+            decodeInfo( inputRelation, e );
+            decodeTags( inputRelation, aBlock, e );
+
+            e.FirstMember = aBlock.Members.size();
+            e.MemberCount = inputRelation.types_size();
+            long long lastRef = 0;
+            for ( int k = 0; k < inputRelation.types_size(); k++ ) {
+                lastRef += inputRelation.memids( k );
+                PbfMember m;
+                m.Type = 0;
+                m.Id = lastRef;
+                m.Role = inputRelation.roles_sid( k );
+                switch ( inputRelation.types( k ) ) {
+                case OSMPBF::Relation::NODE:
+                    m.Type = IFeature::Point;
+                    break;
+                case OSMPBF::Relation::WAY:
+                    m.Type = IFeature::LineString;
+                    break;
+                case OSMPBF::Relation::RELATION:
+                    m.Type = IFeature::OsmRelation;
+                    break;
+                }
+                aBlock.Members << m;
+            }
+            aBlock.Entities << e;
+        }
     }
+    return true;
 }
 
-void ImportExportPBF::parseWay( Layer* aLayer )
+static PbfBlock decodeBlob( QByteArray aData, qint64 aPos )
 {
-    const OSMPBF::Way& inputWay = m_primitiveBlock.primitivegroup( m_currentGroup ).ways( m_currentEntity );
+    PbfBlock b;
+    b.Ok = ImportExportPBF::decodeBlock( aData, b );
+    b.Pos = aPos;
+    return b;
+}
 
-    Way* W = STATIC_CAST_WAY(theDoc->getFeature(IFeature::FId(IFeature::LineString, inputWay.id())));
-    if (!W) {
-        W = g_backend.allocWay(aLayer);
-        W->setId(IFeature::FId(IFeature::LineString, inputWay.id()));
-        aLayer->add(W);
-    } else {
-        W->setLastUpdated(Feature::OSMServer);
+/// Reads the OSMData blobs of a file in a thread of its own, and has the thread pool decode them.
+/// next() gives the decoded blocks back in file order. A bounded number of blocks is in flight,
+/// so that a committer slower than the decoders doesn't pile them up in memory.
+class PbfPipeline : public QThread
+{
+public:
+    PbfPipeline( const QString& aFilename, qint64 aPos )
+        : FileName( aFilename ), StartPos( aPos ), Stopped( false ), Done( false )
+    {
+        MaxQueued = QThreadPool::globalInstance()->maxThreadCount() * 2;
     }
 
-#ifndef FRISIUS_BUILD
-    if (inputWay.has_info()) {
-        OSMPBF::Info info = inputWay.info();
-        if (info.has_version())
-            W->setVersionNumber(info.version());
-        if (info.has_timestamp())
-            W->setTime(QDateTime::fromTime_t(info.timestamp()));
-        if (info.has_user_sid())
-            W->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+    ~PbfPipeline()
+    {
+        stop();
+    }
+
+    /// The next decoded block, false past the last one
+    bool next( PbfBlock& aBlock )
+    {
+        QFuture< PbfBlock > f;
+        {
+            QMutexLocker lock( &Mutex );
+            while ( Queue.isEmpty() && !Done )
+                NotEmpty.wait( &Mutex );
+            if ( Queue.isEmpty() )
+                return false;
+            f = Queue.dequeue();
+            NotFull.wakeOne();
+        }
+        aBlock = f.result();
+        return true;
+    }
+
+    /// Stops reading; blocks already handed to the pool are left to finish on their own
+    void stop()
+    {
+        {
+            QMutexLocker lock( &Mutex );
+            Stopped = true;
+            Queue.clear();
+            NotFull.wakeOne();
+        }
+        wait();
+    }
+
+protected:
+    virtual void run()
+    {
+        QFile file( FileName );
+        if ( file.open( QIODevice::ReadOnly ) && file.seek( StartPos ) ) {
+            QByteArray data;
+            while ( true ) {
+                {
+                    QMutexLocker lock( &Mutex );
+                    while ( Queue.size() >= MaxQueued && !Stopped )
+                        NotFull.wait( &Mutex );
+                    if ( Stopped )
+                        break;
+                }
+                if ( !readBlob( file, data ) )
+                    break;
+                QFuture< PbfBlock > f = QtConcurrent::run( decodeBlob, data, file.pos() );
+
+                QMutexLocker lock( &Mutex );
+                Queue.enqueue( f );
+                NotEmpty.wakeOne();
+            }
+        }
+
+        QMutexLocker lock( &Mutex );
+        Done = true;
+        NotEmpty.wakeAll();
+    }
+
+    /// Frames the next blob of file into data
+    static bool readBlob( QFile& file, QByteArray& data )
+    {
+        char sizeData[4];
+        if ( file.read( sizeData, 4 * sizeof( char ) ) != 4 * sizeof( char ) )
+            return false; // end of stream?
+
+        int size = convertNetworkByteOrder( sizeData );
+        if ( size > MAX_BLOCK_HEADER_SIZE || size < 0 ) {
+            qCritical() << "BlockHeader size invalid:" << size;
+            return false;
+        }
+        data = file.read( size );
+        OSMPBF::BlobHeader header;
+        if ( data.size() != size || !header.ParseFromArray( data.constData(), size ) ) {
+            qCritical() << "failed to read BlockHeader";
+            return false;
+        }
+        if ( header.type() != "OSMData" ) {
+            qCritical() << "invalid block type, found" << header.type().data() << "instead of OSMData";
+            return false;
+        }
+
+        size = header.datasize();
+        if ( size < 0 || size > MAX_BLOB_SIZE ) {
+            qCritical() << "invalid Blob size:" << size;
+            return false;
+        }
+        data = file.read( size );
+        if ( data.size() != size ) {
+            qCritical() << "failed to read Blob";
+            return false;
+        }
+        return true;
     }
+
+    QString FileName;
+    qint64 StartPos;
+    int MaxQueued;
+
+    QMutex Mutex;
+    QWaitCondition NotEmpty;
+    QWaitCondition NotFull;
+    QQueue< QFuture< PbfBlock > > Queue;
+    bool Stopped;
+    bool Done;
+};
+
+void ImportExportPBF::commitInfo( Feature* F, const PbfBlock& aBlock, const PbfEntity& e )
+{
+#ifndef FRISIUS_BUILD
+    if ( e.HasVersion )
+        F->setVersionNumber( e.Version );
+    // 0, or (uint)-1 from older exports, is an unknown time
+    if ( e.HasTime )
+        F->setTime( e.Time ? e.Time : uint( -1 ) );
+    if ( e.HasUser )
+        F->setUserId( userId( aBlock, e.UserSid ) );
+#else
+    Q_UNUSED( F );
+    Q_UNUSED( aBlock );
+    Q_UNUSED( e );
 #endif
+}
 
-    for ( int tag = 0; tag < inputWay.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputWay.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputWay.vals( tag ) ).data() );
-        W->setTag(key, value);
+void ImportExportPBF::commitTags( Feature* F, const PbfBlock& aBlock, const PbfEntity& e )
+{
+    const int* tags = aBlock.Tags.constData() + e.FirstTag;
+    for ( int tag = 0; tag < e.TagCount; tag++ ) {
+        quint32 k = keyId( aBlock, tags[2*tag] );
+        if ( k != TAG_SKIPPED )
+            F->setTagIds( k, valueId( aBlock, tags[2*tag+1] ) );
     }
+    if ( e.TagCount )
+        F->tagsChanged();
+}
 
-    long long lastRef = 0;
-    for ( int i = 0; i < inputWay.refs_size(); i++ ) {
-        lastRef += inputWay.refs( i );
+void ImportExportPBF::commitNode( Layer* aLayer, const PbfBlock& aBlock, const PbfEntity& e )
+{
+    Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, e.Id)));
+    if (!N) {
+        N = g_backend.allocNode(aLayer, e.Position);
+        N->setId(IFeature::FId(IFeature::Point, e.Id));
+        aLayer->add(N);
+    } else {
+        N->setPosition(e.Position);
+        N->setLastUpdated(Feature::OSMServer);
+    }
+    commitInfo( N, aBlock, e );
+    commitTags( N, aBlock, e );
+}
 
-        Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, lastRef)));
+void ImportExportPBF::commitWay( Layer* aLayer, const PbfBlock& aBlock, const PbfEntity& e )
+{
+    Way* W = STATIC_CAST_WAY(theDoc->getFeature(IFeature::FId(IFeature::LineString, e.Id)));
+    if (!W) {
+        W = g_backend.allocWay(aLayer);
+        W->setId(IFeature::FId(IFeature::LineString, e.Id));
+        aLayer->add(W);
+    } else {
+        W->setLastUpdated(Feature::OSMServer);
+    }
+    commitInfo( W, aBlock, e );
+    commitTags( W, aBlock, e );
+
+    const PbfMember* refs = aBlock.Members.constData() + e.FirstMember;
+    for ( int i = 0; i < e.MemberCount; i++ ) {
+        Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, refs[i].Id)));
         if (!N) {
             N = g_backend.allocNode(aLayer, Coord(0, 0));
-            N->setId(IFeature::FId(IFeature::Point, lastRef));
+            N->setId(IFeature::FId(IFeature::Point, refs[i].Id));
             N->setLastUpdated(Feature::NotYetDownloaded);
             aLayer->add(N);
         }
         W->add(N);
     }
-
-    m_currentEntity++;
-    if ( m_currentEntity >= m_primitiveBlock.primitivegroup( m_currentGroup ).ways_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
-    }
 }
 
-void ImportExportPBF::parseRelation( Layer* aLayer )
+void ImportExportPBF::commitRelation( Layer* aLayer, const PbfBlock& aBlock, const PbfEntity& e )
 {
-    const OSMPBF::Relation& inputRelation = m_primitiveBlock.primitivegroup( m_currentGroup ).relations( m_currentEntity );
-
-    Relation* R = STATIC_CAST_RELATION(theDoc->getFeature(IFeature::FId(IFeature::OsmRelation, inputRelation.id())));
+    Relation* R = STATIC_CAST_RELATION(theDoc->getFeature(IFeature::FId(IFeature::OsmRelation, e.Id)));
     if (!R) {
         R = g_backend.allocRelation(aLayer);
-        R->setId(IFeature::FId(IFeature::OsmRelation, inputRelation.id()));
+        R->setId(IFeature::FId(IFeature::OsmRelation, e.Id));
         aLayer->add(R);
     } else {
         R->setLastUpdated(Feature::OSMServer);
     }
+    commitInfo( R, aBlock, e );
+    commitTags( R, aBlock, e );
 
-#ifndef FRISIUS_BUILD
-    if (inputRelation.has_info()) {
-        OSMPBF::Info info = inputRelation.info();
-        if (info.has_version())
-            R->setVersionNumber(info.version());
-        if (info.has_timestamp())
-            R->setTime(QDateTime::fromTime_t(info.timestamp()));
-        if (info.has_user_sid())
-            R->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
-    }
-#endif
-
-    for ( int tag = 0; tag < inputRelation.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputRelation.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputRelation.vals( tag ) ).data() );
-        R->setTag(key, value);
-    }
-
-    long long lastRef = 0;
-    for ( int i = 0; i < inputRelation.types_size(); i++ ) {
-        lastRef += inputRelation.memids( i );
-        QString role = QString::fromUtf8(m_primitiveBlock.stringtable().s( inputRelation.roles_sid( i ) ).data());
+    const PbfMember* members = aBlock.Members.constData() + e.FirstMember;
+    for ( int i = 0; i < e.MemberCount; i++ ) {
+        const PbfMember& m = members[i];
+        const QString& role = aBlock.Strings.at( m.Role );
 
-        switch (inputRelation.types( i )) {
-        case OSMPBF::Relation::NODE: {
-            Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, lastRef)));
+        switch (m.Type) {
+        case IFeature::Point: {
+            Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, m.Id)));
             if (!N) {
                 N = g_backend.allocNode(aLayer, Coord(0, 0));
-                N->setId(IFeature::FId(IFeature::Point, lastRef));
+                N->setId(IFeature::FId(IFeature::Point, m.Id));
                 N->setLastUpdated(Feature::NotYetDownloaded);
                 aLayer->add(N);
             }
             R->add(role, N);
             break;
         }
-        case OSMPBF::Relation::WAY: {
-            Way* W = STATIC_CAST_WAY(theDoc->getFeature(IFeature::FId(IFeature::LineString, lastRef)));
+        case IFeature::LineString: {
+            Way* W = STATIC_CAST_WAY(theDoc->getFeature(IFeature::FId(IFeature::LineString, m.Id)));
             if (!W) {
                 W = g_backend.allocWay(aLayer);
-                W->setId(IFeature::FId(IFeature::LineString, lastRef));
+                W->setId(IFeature::FId(IFeature::LineString, m.Id));
                 W->setLastUpdated(Feature::NotYetDownloaded);
                 aLayer->add(W);
             }
             R->add(role, W);
             break;
         }
-        case OSMPBF::Relation::RELATION: {
-            Relation* Rl = STATIC_CAST_RELATION(theDoc->getFeature(IFeature::FId(IFeature::OsmRelation, lastRef)));
+        case IFeature::OsmRelation: {
+            Relation* Rl = STATIC_CAST_RELATION(theDoc->getFeature(IFeature::FId(IFeature::OsmRelation, m.Id)));
             if (!Rl) {
                 Rl = g_backend.allocRelation(aLayer);
-                Rl->setId(IFeature::FId(IFeature::OsmRelation, lastRef));
+                Rl->setId(IFeature::FId(IFeature::OsmRelation, m.Id));
                 Rl->setLastUpdated(Feature::NotYetDownloaded);
                 aLayer->add(Rl);
             }
             R->add(role, Rl);
             break;
         }
+        default:
+            break;
         }
     }
+}
 
-    m_currentEntity++;
-    if ( m_currentEntity >= m_primitiveBlock.primitivegroup( m_currentGroup ).relations_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
+/* End of MoNav rip */
+/***************************************************/
+
+/// Features of one block to write, all of one type
+struct PbfChunk
+{
+    char Type;
+    QList<Feature*> Features;
+};
+
+/// String table of a block being written. Entry 0 is left unused: dense nodes end their tags with it.
+class PbfStringTable
+{
+public:
+    PbfStringTable()
+    {
+        Strings << QByteArray();
     }
-}
 
-void ImportExportPBF::parseDense( Layer* aLayer )
+    int index( const QString& s )
+    {
+        QHash< QString, int >::const_iterator it = Index.constFind( s );
+        if ( it != Index.constEnd() )
+            return it.value();
+        int i = Strings.size();
+        Strings << s.toUtf8();
+        Index.insert( s, i );
+        return i;
+    }
+
+    void write( OSMPBF::StringTable* aTable ) const
+    {
+        foreach ( const QByteArray& b, Strings )
+            aTable->add_s( std::string( b.constData(), b.size() ) );
+    }
+
+private:
+    QHash< QString, int > Index;
+    QList< QByteArray > Strings;
+};
+
+/// Compresses aData into a blob of type aType, framed as in a file: size, BlobHeader and Blob
+static QByteArray frameBlob( const char* aType, const std::string& aData )
 {
-    const OSMPBF::DenseNodes& dense = m_primitiveBlock.primitivegroup( m_currentGroup ).dense();
+    OSMPBF::Blob blob;
+    blob.set_raw_size( aData.size() );
+    uLongf size = compressBound( aData.size() );
+    QByteArray compressed( size, 0 );
+    if ( compress2( ( Bytef* ) compressed.data(), &size, ( const Bytef* ) aData.data(), aData.size(), Z_DEFAULT_COMPRESSION ) == Z_OK )
+        blob.set_zlib_data( compressed.constData(), size );
+    else
+        blob.set_raw( aData );
+    std::string blobData;
+    blob.SerializeToString( &blobData );
+
+    OSMPBF::BlobHeader header;
+    header.set_type( aType );
+    header.set_datasize( blobData.size() );
+    std::string headerData;
+    header.SerializeToString( &headerData );
 
-    m_lastDenseID += dense.id( m_currentEntity );
-    m_lastDenseLatitude += dense.lat( m_currentEntity );
-    m_lastDenseLongitude += dense.lon( m_currentEntity );
+    char sizeData[4];
+    quint32 headerSize = headerData.size();
+    sizeData[0] = ( headerSize >> 24 ) & 0xff;
+    sizeData[1] = ( headerSize >> 16 ) & 0xff;
+    sizeData[2] = ( headerSize >> 8 ) & 0xff;
+    sizeData[3] = headerSize & 0xff;
+
+    QByteArray framed;
+    framed.reserve( 4 + headerData.size() + blobData.size() );
+    framed.append( sizeData, 4 );
+    framed.append( headerData.data(), headerData.size() );
+    framed.append( blobData.data(), blobData.size() );
+    return framed;
+}
 
-    Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, m_lastDenseID)));
-    if (!N) {
-        N = g_backend.allocNode(aLayer, Coord(
-                ( ( qreal ) m_lastDenseLongitude * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) m_lastDenseLatitude * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
-        N->setId(IFeature::FId(IFeature::Point, m_lastDenseID));
-        aLayer->add(N);
-    } else {
-        N->setPosition(Coord(
-                ( ( qreal ) m_lastDenseLongitude * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) m_lastDenseLatitude * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
-        N->setLastUpdated(Feature::OSMServer);
+template< class T >
+static void encodeTags( const Feature* F, PbfStringTable& strings, T* output )
+{
+    for ( int i = 0; i < F->tagSize(); i++ ) {
+        output->add_keys( strings.index( F->tagKey( i ) ) );
+        output->add_vals( strings.index( F->tagValue( i ) ) );
     }
+}
 
-    if (dense.has_denseinfo()) {
-        m_lastDenseTimestamp += dense.denseinfo().timestamp(m_currentEntity);
-        m_lastDenseChangeset += dense.denseinfo().changeset(m_currentEntity);
-        m_lastDenseUId += dense.denseinfo().uid(m_currentEntity);
-        m_lastDenseUserSid += dense.denseinfo().user_sid(m_currentEntity);
+template< class T >
+static void encodeInfo( const Feature* F, PbfStringTable& strings, T* output )
+{
+#ifndef FRISIUS_BUILD
+    OSMPBF::Info* info = output->mutable_info();
+    info->set_version( F->versionNumber() );
+    // 0 stands for an unknown time, which would come out as (uint)-1
+    info->set_timestamp( F->hasTime() ? F->time().toTime_t() : 0 );
+    info->set_user_sid( strings.index( F->user() ) );
+#else
+    Q_UNUSED( F );
+    Q_UNUSED( strings );
+    Q_UNUSED( output );
+#endif
+}
 
+static void encodeDense( const QList<Feature*>& aNodes, PbfStringTable& strings, OSMPBF::DenseNodes* dense )
+{
+    long long lastId = 0, lastLat = 0, lastLon = 0;
 #ifndef FRISIUS_BUILD
-        N->setVersionNumber(dense.denseinfo().version(m_currentEntity));
-        N->setTime(m_lastDenseTimestamp);
-        N->setUser(m_primitiveBlock.stringtable().s(m_lastDenseUserSid).data());
+    OSMPBF::DenseInfo* info = dense->mutable_denseinfo();
+    long long lastTimestamp = 0, lastUserSid = 0;
 #endif
-    }
+    foreach ( Feature* F, aNodes ) {
+        const Node* N = STATIC_CAST_NODE( F );
+        long long id = N->id().numId;
+        long long lat = qRound64( N->position().y() * NANO / EXPORT_GRANULARITY );
+        long long lon = qRound64( N->position().x() * NANO / EXPORT_GRANULARITY );
+        dense->add_id( id - lastId );
+        dense->add_lat( lat - lastLat );
+        dense->add_lon( lon - lastLon );
+        lastId = id;
+        lastLat = lat;
+        lastLon = lon;
 
-    while ( true ){
-        if ( m_lastDenseTag >= dense.keys_vals_size() )
-            break;
+#ifndef FRISIUS_BUILD
+        long long timestamp = N->hasTime() ? N->time().toTime_t() : 0;
+        long long userSid = strings.index( N->user() );
+        info->add_version( N->versionNumber() );
+        info->add_timestamp( timestamp - lastTimestamp );
+        info->add_changeset( 0 );
+        info->add_uid( 0 );
+        info->add_user_sid( userSid - lastUserSid );
+        lastTimestamp = timestamp;
+        lastUserSid = userSid;
+#endif
 
-        int tagValue = dense.keys_vals( m_lastDenseTag );
-        if ( tagValue == 0 ) {
-            m_lastDenseTag++;
-            break;
+        for ( int i = 0; i < N->tagSize(); i++ ) {
+            dense->add_keys_vals( strings.index( N->tagKey( i ) ) );
+            dense->add_keys_vals( strings.index( N->tagValue( i ) ) );
+        }
+        dense->add_keys_vals( 0 );
+    }
+}
+
+/// Encodes one block of features, ready to be written (any thread: features are only read)
+static QByteArray encodeChunk( PbfChunk aChunk )
+{
+    OSMPBF::PrimitiveBlock block;
+    block.set_granularity( EXPORT_GRANULARITY );
+    PbfStringTable strings;
+    OSMPBF::PrimitiveGroup* group = block.add_primitivegroup();
+
+    switch ( aChunk.Type ) {
+    case IFeature::Point:
+        encodeDense( aChunk.Features, strings, group->mutable_dense() );
+        break;
+
+    case IFeature::LineString:
+        foreach ( Feature* F, aChunk.Features ) {
+            const Way* W = STATIC_CAST_WAY( F );
+            OSMPBF::Way* output = group->add_ways();
+            output->set_id( W->id().numId );
+            encodeTags( W, strings, output );
+            encodeInfo( W, strings, output );
+            long long lastRef = 0;
+            for ( int i = 0; i < W->size(); i++ ) {
+                long long ref = W->get( i )->id().numId;
+                output->add_refs( ref - lastRef );
+                lastRef = ref;
+            }
+        }
+        break;
+
+    case IFeature::OsmRelation:
+        foreach ( Feature* F, aChunk.Features ) {
+            Relation* R = STATIC_CAST_RELATION( F );
+            OSMPBF::Relation* output = group->add_relations();
+            output->set_id( R->id().numId );
+            encodeTags( R, strings, output );
+            encodeInfo( R, strings, output );
+            long long lastRef = 0;
+            for ( int i = 0; i < R->size(); i++ ) {
+                Feature* M = R->get( i );
+                if ( CAST_NODE( M ) )
+                    output->add_types( OSMPBF::Relation::NODE );
+                else if ( CAST_WAY( M ) )
+                    output->add_types( OSMPBF::Relation::WAY );
+                else if ( CAST_RELATION( M ) )
+                    output->add_types( OSMPBF::Relation::RELATION );
+                else
+                    continue;
+                long long ref = M->id().numId;
+                output->add_memids( ref - lastRef );
+                output->add_roles_sid( strings.index( R->getRole( i ) ) );
+                lastRef = ref;
+            }
         }
+        break;
+    }
 
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( dense.keys_vals( m_lastDenseTag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( dense.keys_vals( m_lastDenseTag + 1 ) ).data() );
-        N->setTag(key, value);
+    strings.write( block.mutable_stringtable() );
+    std::string data;
+    block.SerializeToString( &data );
+    return frameBlob( "OSMData", data );
+}
 
-        m_lastDenseTag += 2;
+static bool idLessThan( const Feature* a, const Feature* b )
+{
+    return a->id().numId < b->id().numId;
+}
+
+#ifdef USE_SPATIALITE
+/// Encodes and writes the exportable stored features of a disk-backed layer, a block per batch
+class StoredPbfWriter : public StoredFeatureVisitor
+{
+public:
+    StoredPbfWriter( QIODevice* aDevice, QProgressDialog& aProgress )
+        : Device( aDevice ), Progress( aProgress )
+    {
     }
 
-    m_currentEntity++;
-    if ( m_currentEntity >= dense.id_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
+    virtual bool visit( const QList<Feature*>& aBatch )
+    {
+        PbfChunk c;
+        c.Type = aBatch.first()->id().type;
+        foreach ( Feature* F, aBatch ) {
+            if ( F->lastUpdated() == Feature::NotYetDownloaded || F->isDeleted() || F->isHidden()
+                    || F->notEverythingDownloaded() )
+                continue;
+            c.Features << F;
+        }
+        if ( !c.Features.isEmpty() ) {
+            // Encoded here: the batch is paged out again as soon as this returns
+            qSort( c.Features.begin(), c.Features.end(), idLessThan );
+            QByteArray framed = encodeChunk( c );
+            if ( Device->write( framed ) != framed.size() )
+                return false;
+        }
+
+        Progress.setValue( qMin( Progress.value() + 1, Progress.maximum() ) );
+        qApp->processEvents();
+        return !Progress.wasCanceled();
     }
+
+private:
+    QIODevice* Device;
+    QProgressDialog& Progress;
+};
+#endif
+
+#ifdef USE_SPATIALITE
+/// Ids of the entities of a block and of what they refer to
+static QList<IFeature::FId> blockIds( const PbfBlock& aBlock )
+{
+    QList<IFeature::FId> ids;
+    for ( int i = 0; i < aBlock.Entities.size(); i++ ) {
+        const PbfEntity& e = aBlock.Entities.at( i );
+        ids << IFeature::FId( e.Type, e.Id );
+        const PbfMember* members = aBlock.Members.constData() + e.FirstMember;
+        for ( int m = 0; m < e.MemberCount; m++ )
+            if ( members[m].Type )
+                ids << IFeature::FId( members[m].Type, members[m].Id );
+    }
+    return ids;
 }
+#endif
 
-/* End of MoNav rip */
-/***************************************************/
+// export
+bool ImportExportPBF::export_(const QList<Feature *>& featList)
+{
+    return export_( featList, false );
+}
+
+bool ImportExportPBF::export_(const QList<Feature *>& featList, bool withStored)
+{
+    if ( !IImportExport::export_( featList ) )
+        return false;
+    if ( !Device || !Device->isOpen() )
+        return false;
+
+    // Nodes, then ways, then relations, each sorted by id as other tools expect.
+    // Ways take their nodes along, or they would have no geometry.
+    // Features paged out by disk-backed layers follow, in the same order.
+    QSet<Feature*> seen;
+    QList<Feature*> nodes, ways, relations;
+    foreach ( Feature* F, theFeatures ) {
+        if ( seen.contains( F ) )
+            continue;
+        seen.insert( F );
+        if ( CAST_NODE( F ) ) {
+            nodes << F;
+        } else if ( Way* W = CAST_WAY( F ) ) {
+            ways << W;
+            for ( int i = 0; i < W->size(); i++ ) {
+                Feature* N = W->get( i );
+                if ( !seen.contains( N ) ) {
+                    seen.insert( N );
+                    nodes << N;
+                }
+            }
+        } else if ( CAST_RELATION( F ) ) {
+            relations << F;
+        }
+    }
+    qSort( nodes.begin(), nodes.end(), idLessThan );
+    qSort( ways.begin(), ways.end(), idLessThan );
+    qSort( relations.begin(), relations.end(), idLessThan );
+
+    QList<PbfChunk> chunks;
+    const QList<Feature*>* lists[] = { &nodes, &ways, &relations };
+    const char types[] = { IFeature::Point, IFeature::LineString, IFeature::OsmRelation };
+    for ( int l = 0; l < 3; l++ )
+        for ( int i = 0; i < lists[l]->size(); i += EXPORT_BLOCK_SIZE ) {
+            PbfChunk c;
+            c.Type = types[l];
+            c.Features = lists[l]->mid( i, EXPORT_BLOCK_SIZE );
+            chunks << c;
+        }
+
+    OSMPBF::HeaderBlock header;
+    header.add_required_features( "OsmSchema-V0.6" );
+    header.add_required_features( "DenseNodes" );
+    header.set_writingprogram( QString( "%1 %2" ).arg( qApp->applicationName() ).arg( STRINGIFY(VERSION) ).toUtf8().constData() );
+    std::string headerData;
+    header.SerializeToString( &headerData );
+    QByteArray framed = frameBlob( "OSMHeader", headerData );
+    if ( Device->write( framed ) != framed.size() )
+        return false;
+
+    int storedChunks = 0;
+#ifdef USE_SPATIALITE
+    for ( int i = 0; withStored && i < theDoc->layerSize(); i++ )
+        if ( theDoc->getLayer( i )->diskStore() )
+            storedChunks += theDoc->getLayer( i )->diskStore()->storedCount() / EXPORT_BLOCK_SIZE + 3;
+#else
+    Q_UNUSED( withStored );
+#endif
+
+    QProgressDialog progress(QApplication::tr("Exporting..."), QApplication::tr("Cancel"), 0, chunks.size() + storedChunks);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.show();
+
+    // Blocks are encoded on the thread pool, a bounded number ahead of the one being written.
+    // The workers read the features: the progress dialog is modal, so that they can't be edited meanwhile.
+    int maxQueued = QThreadPool::globalInstance()->maxThreadCount() * 2;
+    QQueue< QFuture< QByteArray > > queue;
+    int next = 0;
+    bool OK = true;
+    for ( int written = 0; written < chunks.size() && OK; written++ ) {
+        while ( next < chunks.size() && queue.size() < maxQueued )
+            queue.enqueue( QtConcurrent::run( encodeChunk, chunks.at( next++ ) ) );
+
+        framed = queue.dequeue().result();
+        if ( Device->write( framed ) != framed.size() )
+            OK = false;
+
+        progress.setValue( written + 1 );
+        qApp->processEvents();
+        if ( progress.wasCanceled() )
+            OK = false;
+    }
+    // The features must outlive the blocks still being encoded
+    while ( !queue.isEmpty() )
+        queue.dequeue().waitForFinished();
+
+#ifdef USE_SPATIALITE
+    for ( int i = 0; storedChunks && OK && i < theDoc->layerSize(); i++ ) {
+        SpatialiteBackend* store = theDoc->getLayer( i )->diskStore();
+        if ( !store )
+            continue;
+        StoredPbfWriter writer( Device, progress );
+        OK = store->visitStored( writer, EXPORT_BLOCK_SIZE );
+    }
+#endif
+    progress.reset();
+
+    return OK;
+}
 
 // Specify the input as a QFile
 bool ImportExportPBF::loadFile(QString filename)
@@ -555,7 +1131,6 @@ bool ImportExportPBF::loadFile(QString filename)
             return false;
         }
     }
-    m_loadBlock = true;
     return true;
 }
 
@@ -567,35 +1142,56 @@ bool ImportExportPBF::import(Layer* aLayer)
     progress.setRange(0, m_file.size());
     progress.show();
 
-    while (true && !progress.wasCanceled()) {
-        if ( m_loadBlock ) {
-            if ( !readNextBlock() )
+    // Reading and decoding run ahead in other threads; features are only created here, in file order
+    PbfPipeline pipeline( FileName, m_file.pos() );
+    pipeline.start();
+
+    // Events are only processed between blocks, and not more often than PROGRESS_INTERVAL:
+    // a large file has hundreds of millions of entities
+    QTime sinceProgress;
+    sinceProgress.start();
+
+    PbfBlock block;
+    while ( !progress.wasCanceled() && pipeline.next( block ) ) {
+        if ( !block.Ok )
+            break;
+#ifdef USE_SPATIALITE
+        // Keep the working set bounded while importing into a disk-backed layer,
+        // and page in what the block refers to with a few queries instead of one per id
+        if ( aLayer->diskStore() ) {
+            aLayer->diskStore()->trim( CoordBox() );
+            aLayer->diskStore()->prefetch( blockIds( block ) );
+        }
+#endif
+        // Each string is interned at most once per block, then tags are set by index
+        m_userIDs.assign( block.Strings.size(), USER_UNMAPPED );
+        m_keyIDs.assign( block.Strings.size(), TAG_UNMAPPED );
+        m_valueIDs.assign( block.Strings.size(), TAG_UNMAPPED );
+
+        for ( int i = 0; i < block.Entities.size(); i++ ) {
+            const PbfEntity& e = block.Entities.at( i );
+            switch ( e.Type ) {
+            case IFeature::Point:
+                commitNode( aLayer, block, e );
+                break;
+            case IFeature::LineString:
+                commitWay( aLayer, block, e );
+                break;
+            case IFeature::OsmRelation:
+                commitRelation( aLayer, block, e );
                 break;
-            loadBlock();
-            loadGroup();
+            }
         }
+        releaseTagIds();
 
-        switch ( m_mode ) {
-        case ModeNode:
-            parseNode( aLayer );
-            break;
-        case ModeWay:
-            parseWay( aLayer );
-            break;
-        case ModeRelation:
-            parseRelation( aLayer );
-            break;
-        case ModeDense:
-            parseDense( aLayer );
-            break;
+        if ( sinceProgress.elapsed() >= PROGRESS_INTERVAL ) {
+            progress.setValue(block.Pos);
+            qApp->processEvents();
+            sinceProgress.restart();
         }
-        progress.setValue(m_file.pos());
-        qApp->processEvents();
-//#ifndef NDEBUG
-//        if (aLayer->size() > 1000000)
-//            break;
-//#endif
     }
+    // Cancelling drops the blocks still being read or decoded
+    pipeline.stop();
     progress.reset();
 
     return true;
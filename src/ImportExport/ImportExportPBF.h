@@ -18,16 +18,14 @@
 #include "osmformat.pb.h"
 
 class QDomDocument;
+struct PbfBlock;
+struct PbfEntity;
+
 /**
     @author cbro <cbro@semperpax.com>
 */
 class ImportExportPBF : public IImportExport
 {
-protected:
-    enum Mode {
-        ModeNode, ModeWay, ModeRelation, ModeDense
-    };
-
 public:
     ImportExportPBF(Document* doc);
 
@@ -40,55 +38,44 @@ public:
 
     //export
     virtual bool export_(const QList<Feature *>& featList);
+    /// With withStored, what disk-backed layers keep on disk is written too
+    bool export_(const QList<Feature *>& featList, bool withStored);
+
+    /// Inflates and parses the blob of one OSMData block, and decodes its entities (any thread)
+    static bool decodeBlock( const QByteArray& aData, PbfBlock& aBlock );
 
 protected:
     OSMPBF::BlobHeader m_blockHeader;
     OSMPBF::Blob m_blob;
 
     OSMPBF::HeaderBlock m_headerBlock;
-    OSMPBF::PrimitiveBlock m_primitiveBlock;
-
-    int m_currentGroup;
-    int m_currentEntity;
-    bool m_loadBlock;
 
-    Mode m_mode;
-
-    QHash< QString, int > m_nodeTags;
-    QHash< QString, int > m_wayTags;
-    QHash< QString, int > m_relationTags;
-
-    std::vector< int > m_nodeTagIDs;
-    std::vector< int > m_wayTagIDs;
-    std::vector< int > m_relationTagIDs;
-
-    long long m_lastDenseID;
-    long long m_lastDenseLatitude;
-    long long m_lastDenseLongitude;
-    long long m_lastDenseTimestamp;
-    long long m_lastDenseChangeset;
-    long long m_lastDenseUId;
-    long long m_lastDenseUserSid;
-    int m_lastDenseTag;
+    // User ids (see g_setUser) of the block string table entries, mapped on first use
+    std::vector< quint32 > m_userIDs;
+    // Tag key and value ids (see g_addTagKey) of the block string table entries, held until the block is done
+    std::vector< quint32 > m_keyIDs;
+    std::vector< quint32 > m_valueIDs;
 
     QFile m_file;
     QByteArray m_buffer;
-    QByteArray m_bzip2Buffer;
 
 protected:
-    void loadGroup();
-    void loadBlock();
-    bool readNextBlock();
+    quint32 userId( const PbfBlock& aBlock, int sid );
+    quint32 keyId( const PbfBlock& aBlock, int sid );
+    quint32 valueId( const PbfBlock& aBlock, int sid );
+    void releaseTagIds();
     bool readBlockHeader();
     bool readBlob();
-    bool unpackZlib();
-    bool unpackBzip2();
-    bool unpackLzma();
-
-    void parseNode( Layer* aLayer );
-    void parseWay( Layer* aLayer );
-    void parseRelation( Layer* aLayer );
-    void parseDense( Layer* aLayer );
+    static bool unpackBlob( const OSMPBF::Blob& aBlob, QByteArray& aBuffer );
+    static bool unpackZlib( const OSMPBF::Blob& aBlob, QByteArray& aBuffer );
+    static bool unpackBzip2( const OSMPBF::Blob& aBlob, QByteArray& aBuffer );
+    static bool unpackLzma( const OSMPBF::Blob& aBlob, QByteArray& aBuffer );
+
+    void commitNode( Layer* aLayer, const PbfBlock& aBlock, const PbfEntity& e );
+    void commitWay( Layer* aLayer, const PbfBlock& aBlock, const PbfEntity& e );
+    void commitRelation( Layer* aLayer, const PbfBlock& aBlock, const PbfEntity& e );
+    void commitInfo( Feature* F, const PbfBlock& aBlock, const PbfEntity& e );
+    void commitTags( Feature* F, const PbfBlock& aBlock, const PbfEntity& e );
 };
 
 #endif
@@ -14,56 +14,483 @@
 #include <QApplication>
 #include <QtCore/QBuffer>
 #include <QtCore/QDateTime>
-#include <QtCore/QEventLoop>
 #include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
+#include <QtCore/QThread>
+#include <QtCore/QTime>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QXmlStreamReader>
 #include <QtGui/QMessageBox>
 #include <QtGui/QProgressBar>
 #include <QtGui/QProgressDialog>
-#include <QtXml/QDomDocument>
-#include <QtXml/QXmlAttributes>
 
+#define USER_UNMAPPED 0xfffffffe
+#define TAG_UNMAPPED 0xfffffffe
+// Keys that are never imported
+#define TAG_SKIPPED 0xffffffff
+// Entities per batch handed from the parsing thread to the document
+#define BATCH_SIZE 8000
+// Batches parsed ahead of the one being committed
+#define MAX_QUEUED 4
+// Milliseconds between progress updates, which give the event loop a turn
+#define PROGRESS_INTERVAL 100
+
+/// Node of a way (Role -1), or member of a relation
+struct OsmXmlMember
+{
+    char Type;
+    qint64 Id;
+    int Role;
+};
+
+/// Node, way or relation of a batch. Strings are indices into the batch string table.
+struct OsmXmlEntity
+{
+    char Type;
+    qint64 Id;
+    Coord Position;
+    bool HasVersion, HasTime;
+    int Version;
+    uint Time;
+    // -1 if the entity has no user
+    int User;
+    // Key and value pairs in OsmXmlBatch::Tags
+    int FirstTag, TagCount;
+    // In OsmXmlBatch::Members
+    int FirstMember, MemberCount;
+};
+
+/// Entities parsed by the reader thread into plain data, for OSMHandler to apply to the layer
+struct OsmXmlBatch
+{
+    OsmXmlBatch() : Pos(0) {}
+
+    // Input position after the batch
+    qint64 Pos;
+    QVector<QString> Strings;
+    QVector<OsmXmlEntity> Entities;
+    QVector<int> Tags;
+    QVector<OsmXmlMember> Members;
+};
+
+/* Attribute values are read in place from the QStringRef the stream reader gives;
+   QStringRef has no number conversions in Qt 4, and going through a QString would copy every one. */
+
+static qint64 toLongLong(const QStringRef& s)
+{
+    const QChar* c = s.unicode();
+    const QChar* end = c + s.size();
+    bool negative = (c != end && *c == QLatin1Char('-'));
+    if (negative)
+        ++c;
+    qint64 v = 0;
+    for (; c != end && c->unicode() >= '0' && c->unicode() <= '9'; ++c)
+        v = v * 10 + (c->unicode() - '0');
+    return negative ? -v : v;
+}
+
+static qreal toDouble(const QStringRef& s)
+{
+    static const qreal Pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+                                   1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17 };
+
+    // Coordinates are plain decimals: the digits are gathered into an integer, so that
+    // a single division rounds the value exactly as toDouble() would
+    const QChar* c = s.unicode();
+    const QChar* end = c + s.size();
+    bool negative = (c != end && *c == QLatin1Char('-'));
+    if (negative)
+        ++c;
+    qint64 mantissa = 0;
+    int digits = 0;
+    int decimals = -1;
+    for (; c != end; ++c) {
+        ushort u = c->unicode();
+        if (u >= '0' && u <= '9') {
+            mantissa = mantissa * 10 + (u - '0');
+            ++digits;
+            if (decimals >= 0)
+                ++decimals;
+        } else if (u == '.' && decimals < 0) {
+            decimals = 0;
+        } else
+            break;
+    }
+    if (c != end || digits > 17)
+        return s.toString().toDouble();
+    qreal v = decimals > 0 ? qreal(mantissa) / Pow10[decimals] : qreal(mantissa);
+    return negative ? -v : v;
+}
+
+static int toNumber(const QChar* c, int n)
+{
+    int v = 0;
+    for (int i=0; i<n; ++i) {
+        ushort u = c[i].unicode();
+        if (u < '0' || u > '9')
+            return -1;
+        v = v * 10 + (u - '0');
+    }
+    return v;
+}
+
+/// Reads the "yyyy-MM-ddThh:mm:ss" start of an OSM timestamp, in UTC
+static bool toTime(const QStringRef& s, uint& aTime)
+{
+    if (s.size() < 19)
+        return false;
+    const QChar* c = s.unicode();
+    QDateTime time(QDate(toNumber(c, 4), toNumber(c+5, 2), toNumber(c+8, 2)),
+                   QTime(toNumber(c+11, 2), toNumber(c+14, 2), toNumber(c+17, 2)), Qt::UTC);
+    if (!time.isValid())
+        return false;
+    aTime = time.toTime_t();
+    return true;
+}
+
+/// Parses OSM XML in a thread of its own, and hands the entities out in batches of BATCH_SIZE.
+/// A file is mapped in memory when the platform allows it, and read otherwise.
+/// At most MAX_QUEUED batches wait for next(), so that a committer slower than the parser
+/// doesn't pile them up in memory.
+class OsmXmlReader : public QThread
+{
+public:
+    OsmXmlReader(const QString& aFilename)
+        : FileName(aFilename), Stopped(false), Done(false)
+    {
+    }
+
+    OsmXmlReader(const QByteArray& aContent)
+        : Content(aContent), Stopped(false), Done(false)
+    {
+    }
+
+    ~OsmXmlReader()
+    {
+        stop();
+    }
+
+    /// The next batch, false past the last one
+    bool next(OsmXmlBatch& aBatch)
+    {
+        QMutexLocker lock(&Mutex);
+        while (Queue.isEmpty() && !Done)
+            NotEmpty.wait(&Mutex);
+        if (Queue.isEmpty())
+            return false;
+        aBatch = Queue.dequeue();
+        NotFull.wakeOne();
+        return true;
+    }
+
+    /// Stops parsing, and drops the batches not taken yet
+    void stop()
+    {
+        {
+            QMutexLocker lock(&Mutex);
+            Stopped = true;
+            Queue.clear();
+            NotFull.wakeOne();
+        }
+        wait();
+    }
+
+protected:
+    virtual void run()
+    {
+        QFile file;
+        uchar* map = 0;
+        QByteArray mapped;
+        QBuffer buffer;
+        QIODevice* device = &buffer;
+
+        if (FileName.isEmpty()) {
+            buffer.setBuffer(&Content);
+        } else {
+            file.setFileName(FileName);
+            if (file.open(QIODevice::ReadOnly)) {
+                if (file.size())
+                    map = file.map(0, file.size());
+                if (map) {
+                    mapped = QByteArray::fromRawData(reinterpret_cast<const char*>(map), file.size());
+                    buffer.setBuffer(&mapped);
+                } else
+                    device = &file;
+            } else
+                device = 0;
+        }
+        if (device == &buffer)
+            buffer.open(QIODevice::ReadOnly);
+        if (device)
+            parse(device);
+
+        buffer.close();
+        if (map)
+            file.unmap(map);
+
+        QMutexLocker lock(&Mutex);
+        Done = true;
+        NotEmpty.wakeAll();
+    }
+
+    void parse(QIODevice* aDevice)
+    {
+        QXmlStreamReader xml(aDevice);
+        OsmXmlBatch batch;
+        bool inEntity = false;
+
+        while (!xml.atEnd()) {
+            QXmlStreamReader::TokenType token = xml.readNext();
+            if (token == QXmlStreamReader::EndElement) {
+                QStringRef name = xml.name();
+                if (name == QLatin1String("node") || name == QLatin1String("way") || name == QLatin1String("relation"))
+                    inEntity = false;
+                continue;
+            }
+            if (token != QXmlStreamReader::StartElement)
+                continue;
+
+            QStringRef name = xml.name();
+            QXmlStreamAttributes atts = xml.attributes();
+            if (inEntity) {
+                OsmXmlEntity& e = batch.Entities.last();
+                if (name == QLatin1String("tag")) {
+                    batch.Tags << stringIndex(batch, atts.value(QLatin1String("k")))
+                               << stringIndex(batch, atts.value(QLatin1String("v")));
+                    e.TagCount++;
+                } else if (name == QLatin1String("nd")) {
+                    OsmXmlMember m = { IFeature::Point, toLongLong(atts.value(QLatin1String("ref"))), -1 };
+                    batch.Members << m;
+                    e.MemberCount++;
+                } else if (name == QLatin1String("member")) {
+                    QStringRef type = atts.value(QLatin1String("type"));
+                    OsmXmlMember m;
+                    if (type == QLatin1String("node"))
+                        m.Type = IFeature::Point;
+                    else if (type == QLatin1String("way"))
+                        m.Type = IFeature::LineString;
+                    else if (type == QLatin1String("relation"))
+                        m.Type = IFeature::OsmRelation;
+                    else
+                        continue;
+                    m.Id = toLongLong(atts.value(QLatin1String("ref")));
+                    m.Role = stringIndex(batch, atts.value(QLatin1String("role")));
+                    batch.Members << m;
+                    e.MemberCount++;
+                }
+                continue;
+            }
+
+            OsmXmlEntity e;
+            if (name == QLatin1String("node"))
+                e.Type = IFeature::Point;
+            else if (name == QLatin1String("way"))
+                e.Type = IFeature::LineString;
+            else if (name == QLatin1String("relation"))
+                e.Type = IFeature::OsmRelation;
+            else
+                continue;
+
+            if (batch.Entities.size() >= BATCH_SIZE) {
+                batch.Pos = aDevice->pos();
+                if (!push(batch))
+                    return;
+                batch = OsmXmlBatch();
+                Index.clear();
+            }
+
+            e.Id = 0;
+            e.HasVersion = e.HasTime = false;
+            e.Version = 0;
+            e.Time = 0;
+            e.User = -1;
+            e.FirstTag = batch.Tags.size() / 2;
+            e.FirstMember = batch.Members.size();
+            e.TagCount = e.MemberCount = 0;
+            qreal lat = 0, lon = 0;
+            for (int i=0; i<atts.size(); ++i) {
+                const QXmlStreamAttribute& a = atts.at(i);
+                QStringRef n = a.name();
+                if (n == QLatin1String("id"))
+                    e.Id = toLongLong(a.value());
+                else if (n == QLatin1String("lat"))
+                    lat = toDouble(a.value());
+                else if (n == QLatin1String("lon"))
+                    lon = toDouble(a.value());
+                else if (n == QLatin1String("version")) {
+                    e.HasVersion = !a.value().isEmpty();
+                    e.Version = toLongLong(a.value());
+                } else if (n == QLatin1String("timestamp"))
+                    e.HasTime = toTime(a.value(), e.Time);
+                else if (n == QLatin1String("user"))
+                    e.User = stringIndex(batch, a.value());
+            }
+            e.Position = Coord(lon, lat);
+            batch.Entities << e;
+            inEntity = true;
+        }
+        if (xml.hasError())
+            qDebug() << "OSM XML:" << xml.errorString() << "at line" << xml.lineNumber();
+
+        if (batch.Entities.size()) {
+            batch.Pos = aDevice->pos();
+            push(batch);
+        }
+    }
+
+    /// Index of s in the batch string table, adding it on first use
+    int stringIndex(OsmXmlBatch& aBatch, const QStringRef& s)
+    {
+        // The lookup key shares the reader's buffer; only new strings are copied
+        QHash<QString, int>::const_iterator it = Index.constFind(QString::fromRawData(s.unicode(), s.size()));
+        if (it != Index.constEnd())
+            return it.value();
+        QString copy(s.unicode(), s.size());
+        int i = aBatch.Strings.size();
+        aBatch.Strings << copy;
+        Index.insert(copy, i);
+        return i;
+    }
+
+    /// Queues aBatch, waiting for room; false once stopped
+    bool push(const OsmXmlBatch& aBatch)
+    {
+        QMutexLocker lock(&Mutex);
+        while (Queue.size() >= MAX_QUEUED && !Stopped)
+            NotFull.wait(&Mutex);
+        if (Stopped)
+            return false;
+        Queue.enqueue(aBatch);
+        NotEmpty.wakeOne();
+        return true;
+    }
+
+    QString FileName;
+    QByteArray Content;
+    // Strings of the batch being parsed
+    QHash<QString, int> Index;
+
+    QMutex Mutex;
+    QWaitCondition NotEmpty;
+    QWaitCondition NotFull;
+    QQueue<OsmXmlBatch> Queue;
+    bool Stopped;
+    bool Done;
+};
 
 OSMHandler::OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict)
-: theDocument(aDoc), theLayer(aLayer), conflictLayer(aConflict), Current(0)
+: theDocument(aDoc), theLayer(aLayer), conflictLayer(aConflict)
+{
+}
+
+quint32 OSMHandler::userId(const OsmXmlBatch& aBatch, int sid)
 {
+    quint32& id = userIDs[sid];
+    if (id == USER_UNMAPPED)
+        id = g_setUser(aBatch.Strings.at(sid));
+    return id;
 }
 
-void OSMHandler::parseTag(const QXmlAttributes &atts)
+quint32 OSMHandler::keyId(const OsmXmlBatch& aBatch, int sid)
 {
-    if (!Current) return;
+    quint32& id = keyIDs[sid];
+    if (id == TAG_UNMAPPED) {
+        const QString& key = aBatch.Strings.at(sid);
+        if (key.compare("created_by", Qt::CaseInsensitive) == 0)
+            id = TAG_SKIPPED;
+        else
+            id = g_addTagKey(key);
+    }
+    return id;
+}
 
-    Current->setTag(atts.value("k"),atts.value("v"));
+quint32 OSMHandler::valueId(const OsmXmlBatch& aBatch, int sid)
+{
+    quint32& id = valueIDs[sid];
+    if (id == TAG_UNMAPPED)
+        id = g_addTagValue(aBatch.Strings.at(sid));
+    return id;
+}
+
+void OSMHandler::releaseTagIds()
+{
+    for (int i=0; i<keyIDs.size(); ++i)
+        if (keyIDs[i] != TAG_UNMAPPED && keyIDs[i] != TAG_SKIPPED)
+            g_releaseTagKey(keyIDs[i]);
+    for (int i=0; i<valueIDs.size(); ++i)
+        if (valueIDs[i] != TAG_UNMAPPED)
+            g_releaseTagValue(valueIDs[i]);
+}
+
+void OSMHandler::commit(const OsmXmlBatch& aBatch)
+{
+    // Each string is interned at most once per batch, then tags are set by index
+    userIDs.fill(USER_UNMAPPED, aBatch.Strings.size());
+    keyIDs.fill(TAG_UNMAPPED, aBatch.Strings.size());
+    valueIDs.fill(TAG_UNMAPPED, aBatch.Strings.size());
+
+    for (int i=0; i<aBatch.Entities.size(); ++i) {
+        const OsmXmlEntity& e = aBatch.Entities.at(i);
+        switch (e.Type) {
+        case IFeature::Point:
+            commitNode(aBatch, e);
+            break;
+        case IFeature::LineString:
+            commitWay(aBatch, e);
+            break;
+        case IFeature::OsmRelation:
+            commitRelation(aBatch, e);
+            break;
+        }
+    }
+    releaseTagIds();
+}
+
+void OSMHandler::commitTags(Feature* F, const OsmXmlBatch& aBatch, const OsmXmlEntity& e)
+{
+    const int* tags = aBatch.Tags.constData() + 2*e.FirstTag;
+    for (int tag=0; tag<e.TagCount; ++tag) {
+        quint32 k = keyId(aBatch, tags[2*tag]);
+        if (k != TAG_SKIPPED)
+            F->setTagIds(k, valueId(aBatch, tags[2*tag+1]));
+    }
+    if (e.TagCount)
+        F->tagsChanged();
 }
 
-void parseStandardAttributes(const QXmlAttributes& atts, Feature* F)
+void OSMHandler::commitInfo(Feature* F, const OsmXmlBatch& aBatch, const OsmXmlEntity& e)
 {
 #ifndef FRISIUS_BUILD
-    QString ts = atts.value("timestamp");
-    QDateTime time = QDateTime::fromString(ts.left(19), Qt::ISODate);
-    if (!time.isValid())
-        time = QDateTime::currentDateTime();
-    QString user = atts.value("user");
-    F->setTime(time);
-    F->setUser(user);
-    QString version = atts.value("version");
-    if (!version.isEmpty())
-        F->setVersionNumber(version.toInt());
+    if (e.HasTime)
+        F->setTime(e.Time);
+    else
+        F->setTime(QDateTime::currentDateTime());
+    if (e.User >= 0)
+        F->setUserId(userId(aBatch, e.User));
+    else
+        F->setUser(QString());
+    if (e.HasVersion)
+        F->setVersionNumber(e.Version);
+#else
+    Q_UNUSED(F);
+    Q_UNUSED(aBatch);
+    Q_UNUSED(e);
 #endif
 }
 
-void OSMHandler::parseNode(const QXmlAttributes& atts)
+void OSMHandler::commitNode(const OsmXmlBatch& aBatch, const OsmXmlEntity& e)
 {
-    qreal Lat = atts.value("lat").toDouble();
-    qreal Lon = atts.value("lon").toDouble();
-    QString id = atts.value("id");
-    Node* Pt = CAST_NODE(theDocument->getFeature(IFeature::FId(IFeature::Point, id.toLongLong())));
+    bool NewFeature;
+    Node* Pt = CAST_NODE(theDocument->getFeature(IFeature::FId(IFeature::Point, e.Id)));
     if (Pt)
     {
         Node* userPt = Pt;
-        Pt = g_backend.allocNode(theLayer, Coord(Lon,Lat));
-        Pt->setId(IFeature::FId(IFeature::Point | IFeature::Conflict, id.toLongLong()));
+        Pt = g_backend.allocNode(theLayer, e.Position);
+        Pt->setId(IFeature::FId(IFeature::Point | IFeature::Conflict, e.Id));
         Pt->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,Pt);
+        commitInfo(Pt, aBatch, e);
 
         if (userPt->lastUpdated() == Feature::User)
         {
@@ -95,7 +522,7 @@ void OSMHandler::parseNode(const QXmlAttributes& atts)
                 Pt = userPt;
                 Pt->layer()->remove(Pt);
                 theLayer->add(Pt);
-                Pt->setPosition(Coord(Lon,Lat));
+                Pt->setPosition(e.Position);
                 Pt->clearTags();
                 NewFeature = true;
                 if (Pt->lastUpdated() == Feature::NotYetDownloaded)
@@ -114,46 +541,35 @@ void OSMHandler::parseNode(const QXmlAttributes& atts)
     }
     else
     {
-        Pt = g_backend.allocNode(theLayer, Coord(Lon,Lat));
-        Pt->setId(IFeature::FId(IFeature::Point, id.toLongLong()));
+        Pt = g_backend.allocNode(theLayer, e.Position);
+        Pt->setId(IFeature::FId(IFeature::Point, e.Id));
         Pt->setLastUpdated(Feature::OSMServer);
         theLayer->add(Pt);
         NewFeature = true;
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,Pt);
-        Current = Pt;
+        commitInfo(Pt, aBatch, e);
+        commitTags(Pt, aBatch, e);
         for (int i=0; i<Pt->sizeParents(); ++i) {
             if (Pt->getParent(i)->isDeleted()) continue;
             if (Way* w = CAST_WAY(Pt->getParent(i)))
                 touchedWays << w;
         }
-    } else
-        Current = NULL;
-}
-
-void OSMHandler::parseNd(const QXmlAttributes& atts)
-{
-    Way* R = dynamic_cast<Way*>(Current);
-    if (!R) return;
-    Node *Part = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, atts.value("ref").toLongLong()));
-    if (NewFeature)
-        R->add(Part);
+    }
 }
 
-void OSMHandler::parseWay(const QXmlAttributes& atts)
+void OSMHandler::commitWay(const OsmXmlBatch& aBatch, const OsmXmlEntity& e)
 {
-    QString id = atts.value("id");
-    QString ts = atts.value("timestamp"); ts.truncate(19);
-    Way* R = CAST_WAY(theDocument->getFeature(IFeature::FId(IFeature::LineString, id.toLongLong())));
+    bool NewFeature;
+    Way* R = CAST_WAY(theDocument->getFeature(IFeature::FId(IFeature::LineString, e.Id)));
     if (R)
     {
         Way* userRd = R;
         R = g_backend.allocWay(theLayer);
-        R->setId(IFeature::FId(IFeature::LineString | IFeature::Conflict, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::LineString | IFeature::Conflict, e.Id));
         R->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,R);
+        commitInfo(R, aBatch, e);
 
         if (userRd->lastUpdated() == Feature::User)
         {
@@ -201,50 +617,33 @@ void OSMHandler::parseWay(const QXmlAttributes& atts)
     else
     {
         R = g_backend.allocWay(theLayer);
-        R->setId(IFeature::FId(IFeature::LineString, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::LineString, e.Id));
         R->setLastUpdated(Feature::OSMServer);
         theLayer->add(R);
         NewFeature = true;
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,R);
-        Current = R;
+        commitInfo(R, aBatch, e);
+        commitTags(R, aBatch, e);
+        const OsmXmlMember* refs = aBatch.Members.constData() + e.FirstMember;
+        for (int i=0; i<e.MemberCount; ++i)
+            R->add(Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, refs[i].Id)));
         touchedWays << R;
-    } else
-        Current = NULL;
-}
-
-void OSMHandler::parseMember(const QXmlAttributes& atts)
-{
-    Relation* R = dynamic_cast<Relation*>(Current);
-    if (!R)
-        return;
-    QString Type = atts.value("type");
-    Feature* F = 0;
-    if (Type == "node")
-        F = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, atts.value("ref").toLongLong()));
-    else if (Type == "way")
-        F = Feature::getWayOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::LineString, atts.value("ref").toLongLong()));
-    else if (Type == "relation")
-        F = Feature::getRelationOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::OsmRelation, atts.value("ref").toLongLong()));
-
-    if (F && F != R)
-        R->add(atts.value("role"),F);
+    }
 }
 
-void OSMHandler::parseRelation(const QXmlAttributes& atts)
+void OSMHandler::commitRelation(const OsmXmlBatch& aBatch, const OsmXmlEntity& e)
 {
-    QString id = atts.value("id");
-    QString ts = atts.value("timestamp"); ts.truncate(19);
-    Relation* R = CAST_RELATION(theDocument->getFeature(IFeature::FId(IFeature::OsmRelation, id.toLongLong())));
+    bool NewFeature;
+    Relation* R = CAST_RELATION(theDocument->getFeature(IFeature::FId(IFeature::OsmRelation, e.Id)));
     if (R)
     {
         Relation* userR = R;
         R = g_backend.allocRelation(theLayer);
-        R->setId(IFeature::FId(IFeature::OsmRelation | IFeature::Conflict, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::OsmRelation | IFeature::Conflict, e.Id));
         R->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,R);
+        commitInfo(R, aBatch, e);
 
         if (R->lastUpdated() == Feature::User)
         {
@@ -292,42 +691,53 @@ void OSMHandler::parseRelation(const QXmlAttributes& atts)
     else
     {
         R = g_backend.allocRelation(theLayer);
-        R->setId(IFeature::FId(IFeature::OsmRelation, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::OsmRelation, e.Id));
         R->setLastUpdated(Feature::OSMServer);
         NewFeature = true;
         theLayer->add(R);
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,R);
-        Current = R;
+        commitInfo(R, aBatch, e);
+        commitTags(R, aBatch, e);
+        const OsmXmlMember* members = aBatch.Members.constData() + e.FirstMember;
+        for (int i=0; i<e.MemberCount; ++i) {
+            const OsmXmlMember& m = members[i];
+            Feature* F = 0;
+            if (m.Type == IFeature::Point)
+                F = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, m.Id));
+            else if (m.Type == IFeature::LineString)
+                F = Feature::getWayOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::LineString, m.Id));
+            else if (m.Type == IFeature::OsmRelation)
+                F = Feature::getRelationOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::OsmRelation, m.Id));
+
+            if (F && F != R)
+                R->add(aBatch.Strings.at(m.Role), F);
+        }
         touchedRelations << R;
-    } else
-        Current = NULL;
-}
-
-bool OSMHandler::startElement ( const QString &, const QString & /* localName */, const QString & qName, const QXmlAttributes & atts )
-{
-    if (qName == "tag")
-        parseTag(atts);
-    else if (qName == "node")
-        parseNode(atts);
-    else if (qName == "nd")
-        parseNd(atts);
-    else if (qName == "way")
-        parseWay(atts);
-    else if (qName == "member")
-        parseMember(atts);
-    else if (qName == "relation")
-        parseRelation(atts);
-    return true;
+    }
 }
 
-bool OSMHandler::endElement ( const QString &, const QString & /* localName */, const QString & qName )
+/// Commits the batches of aReader as they are parsed. Events are only processed between batches,
+/// and not more often than PROGRESS_INTERVAL.
+static void readOSM(OsmXmlReader& aReader, OSMHandler& aHandler, QProgressDialog* dlg, QProgressBar* Bar)
 {
-    if (qName == "node")
-        Current = 0;
-    return true;
+    aReader.start();
+
+    QTime sinceProgress;
+    sinceProgress.start();
+
+    OsmXmlBatch batch;
+    while (!(dlg && dlg->wasCanceled()) && aReader.next(batch)) {
+        aHandler.commit(batch);
+        if (sinceProgress.elapsed() >= PROGRESS_INTERVAL) {
+            if (Bar)
+                Bar->setValue(batch.Pos);
+            qApp->processEvents();
+            sinceProgress.restart();
+        }
+    }
+    aReader.stop();
 }
 
 static bool downloadToResolve(const QList<Feature*>& Resolution, QWidget* aParent, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
@@ -355,27 +765,9 @@ static bool downloadToResolve(const QList<Feature*>& Resolution, QWidget* aParen
             {
                 Lbl->setText(QApplication::translate("Downloader","Parsing unresolved %1 of %2").arg(i+1).arg(Resolution.size()));
 
-                QByteArray ba(theDownloader->content());
-                QBuffer  File(&ba);
-                File.open(QIODevice::ReadOnly);
-
                 OSMHandler theHandler(theDocument,theLayer,NULL);
-
-                QXmlSimpleReader xmlReader;
-                xmlReader.setContentHandler(&theHandler);
-                QXmlInputSource source;
-                QByteArray buf(File.read(10240));
-                source.setData(buf);
-                xmlReader.parse(&source,true);
-                while (!File.atEnd())
-                {
-                    QByteArray buf(File.read(20480));
-                    source.setData(buf);
-                    xmlReader.parseContinue();
-                    qApp->processEvents();
-                    if (dlg && dlg->wasCanceled())
-                        break;
-                }
+                OsmXmlReader reader(theDownloader->content());
+                readOSM(reader, theHandler, dlg, NULL);
             }
             Resolution[i]->setLastUpdated(Feature::OSMServer);
         }
@@ -443,13 +835,8 @@ static bool deleteIncompleteRelations(QWidget* /*aParent*/, Document* /*theDocum
     return true;
 }
 
-bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
+static bool importOSM(QWidget* aParent, OsmXmlReader& aReader, qint64 aSize, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
 {
-    QDomDocument DomDoc;
-    QString ErrorStr;
-    /* int ErrorLine; */
-    /* int ErrorColumn; */
-
     QProgressDialog* dlg = NULL;
     QProgressBar* Bar = NULL;
     QLabel* Lbl = NULL;
@@ -475,29 +862,15 @@ bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer*
     theDocument->add(conflictLayer);
 
     OSMHandler theHandler(theDocument,theLayer,conflictLayer);
+    g_backend.beginBulkIndex(theLayer);
 
-    QXmlSimpleReader xmlReader;
-    xmlReader.setContentHandler(&theHandler);
-    QXmlInputSource source;
-    QByteArray buf(File.read(10240));
-    source.setData(buf);
-    xmlReader.parse(&source,true);
     if (Bar) {
-        Bar->setMaximum(File.size());
-        Bar->setValue(Bar->value()+buf.size());
-    }
-
-    while (!File.atEnd())
-    {
-        QByteArray buf(File.read(20480));
-        source.setData(buf);
-        xmlReader.parseContinue();
-        if (Bar)
-            Bar->setValue(Bar->value()+buf.size());
-        qApp->processEvents();
-        if (dlg && dlg->wasCanceled())
-            break;
+        Bar->setMaximum(aSize);
+        Bar->setValue(0);
     }
+    // Parsing runs ahead in another thread; features are only created here, in file order
+    readOSM(aReader, theHandler, dlg, Bar);
+    g_backend.endBulkIndex(theLayer);
 
     bool WasCanceled = false;
     if (dlg)
@@ -581,14 +954,17 @@ bool importOSM(QWidget* aParent, const QString& aFilename, Document* theDocument
     QFile File(aFilename);
     if (!File.open(QIODevice::ReadOnly))
          return false;
-    return importOSM(aParent, File, theDocument, theLayer, 0 );
+    qint64 size = File.size();
+    File.close();
+
+    OsmXmlReader reader(aFilename);
+    return importOSM(aParent, reader, size, theDocument, theLayer, 0 );
 }
 
 bool importOSM(QWidget* aParent, QByteArray& Content, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
 {
-    QBuffer File(&Content);
-    File.open(QIODevice::ReadOnly);
-    return importOSM(aParent, File, theDocument, theLayer, theDownloader);
+    OsmXmlReader reader(Content);
+    return importOSM(aParent, reader, Content.size(), theDocument, theLayer, theDownloader);
 }
 
 
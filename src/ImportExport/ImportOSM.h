@@ -13,30 +13,40 @@ class QByteArray;
 class QString;
 class QWidget;
 
-#include <QXmlDefaultHandler>
 #include <QSet>
+#include <QVector>
 
-class OSMHandler : public QXmlDefaultHandler
+struct OsmXmlBatch;
+struct OsmXmlEntity;
+
+/// Applies the entities parsed from OSM XML to a layer, batch by batch, on the thread that owns the document
+class OSMHandler
 {
 public:
     OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict);
 
-    virtual bool startElement ( const QString & namespaceURI, const QString & localName, const QString & qName, const QXmlAttributes & atts );
-    virtual bool endElement ( const QString & namespaceURI, const QString & localName, const QString & qName );
+    void commit(const OsmXmlBatch& aBatch);
 
 private:
-    void parseNode(const QXmlAttributes & atts);
-    void parseTag(const QXmlAttributes & atts);
-    void parseWay(const QXmlAttributes & atts);
-    void parseNd(const QXmlAttributes & atts);
-    void parseMember(const QXmlAttributes & atts);
-    void parseRelation(const QXmlAttributes& atts);
+    void commitInfo(Feature* F, const OsmXmlBatch& aBatch, const OsmXmlEntity& e);
+    void commitTags(Feature* F, const OsmXmlBatch& aBatch, const OsmXmlEntity& e);
+    void commitNode(const OsmXmlBatch& aBatch, const OsmXmlEntity& e);
+    void commitWay(const OsmXmlBatch& aBatch, const OsmXmlEntity& e);
+    void commitRelation(const OsmXmlBatch& aBatch, const OsmXmlEntity& e);
+
+    quint32 userId(const OsmXmlBatch& aBatch, int sid);
+    quint32 keyId(const OsmXmlBatch& aBatch, int sid);
+    quint32 valueId(const OsmXmlBatch& aBatch, int sid);
+    void releaseTagIds();
 
     Document* theDocument;
     Layer* theLayer;
     Layer* conflictLayer;
-    Feature* Current;
-    bool NewFeature;
+
+    // Interned ids of the strings of the batch being committed
+    QVector<quint32> userIDs;
+    QVector<quint32> keyIDs;
+    QVector<quint32> valueIDs;
 
 public:
         QSet<Way*> touchedWays;
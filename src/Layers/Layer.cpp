@@ -24,6 +24,9 @@
 
 #include <algorithm>
 #include "LayerPrivate.h"
+#ifdef USE_SPATIALITE
+#include "SpatialiteBackend.h"
+#endif
 
 /* Layer */
 
@@ -50,7 +53,11 @@ Layer::Layer(const Layer&)
 
 Layer::~Layer()
 {
+#ifdef USE_SPATIALITE
+    SAFE_DELETE(p->DiskStore)
+#endif
     clear();
+    g_backend.releaseLayer(this);
     SAFE_DELETE(p);
 }
 
@@ -85,6 +92,7 @@ void Layer::setVisible(bool b) {
     }
 
     if (p->theDocument) {
+        p->theDocument->touch();
         FeatureIterator it(p->theDocument);
         for(;!it.isEnd(); ++it) {
             it.get()->invalidateMeta();
@@ -114,6 +122,7 @@ void Layer::setEnabled(bool b) {
     }
 
     if (p->theDocument) {
+        p->theDocument->touch();
         FeatureIterator it(p->theDocument);
         for(;!it.isEnd(); ++it) {
             it.get()->invalidateMeta();
@@ -130,6 +139,7 @@ void Layer::setReadonly(bool b) {
     p->Readonly = b;
 
     if (p->theDocument) {
+        p->theDocument->touch();
         FeatureIterator it(p->theDocument);
         for(;!it.isEnd(); ++it) {
             it.get()->invalidateMeta();
@@ -155,10 +165,15 @@ void Layer::add(Feature* aFeature)
 {
     if (aFeature) {
         aFeature->setLayer(this);
-        p->Features.push_back(aFeature);
+        if (!p->FeatureIndex.contains(aFeature))
+            p->addFeature(aFeature);
         g_backend.sync(aFeature);
         aFeature->invalidateMeta();
         notifyIdUpdate(aFeature->id(),aFeature);
+#ifdef USE_SPATIALITE
+        if (p->DiskStore)
+            p->DiskStore->featureAdded(aFeature);
+#endif
     } else {
         qDebug() << "Layer::add: logic error, no featured passed";
     }
@@ -166,21 +181,29 @@ void Layer::add(Feature* aFeature)
 
 void Layer::remove(Feature* aFeature)
 {
-    if (p->Features.removeOne(aFeature))
+    if (p->removeFeature(aFeature))
     {
         g_backend.sync(aFeature);
         aFeature->setLayer(0);
         notifyIdUpdate(aFeature->id(),0);
+#ifdef USE_SPATIALITE
+        if (p->DiskStore)
+            p->DiskStore->featureRemoved(aFeature);
+#endif
     }
 }
 
 void Layer::deleteFeature(Feature* aFeature)
 {
-    if (p->Features.removeOne(aFeature))
+    if (p->removeFeature(aFeature))
     {
         g_backend.deallocFeature(this, aFeature);
         aFeature->setLayer(0);
         notifyIdUpdate(aFeature->id(),0);
+#ifdef USE_SPATIALITE
+        if (p->DiskStore)
+            p->DiskStore->featureRemoved(aFeature);
+#endif
     }
 }
 
@@ -188,14 +211,14 @@ void Layer::clear()
 {
     while (p->Features.count())
     {
-        remove(p->Features[0]);
+        remove(p->Features.last());
     }
 }
 
 void Layer::deleteAll() {
     while (p->Features.count())
     {
-        deleteFeature(p->Features[0]);
+        deleteFeature(p->Features.last());
     }
 }
 
@@ -206,22 +229,26 @@ void Layer::notifyIdUpdate(const IFeature::FId& id, Feature* aFeature)
     if (!aFeature) {
         i = p->IdMap.find(id.numId);
         while (i != p->IdMap.end() && i.key() == id.numId) {
-            if (i.value()->id().type & id.type)
+            if (i.value()->id().type & id.type) {
+                if (p->theDocument)
+                    p->theDocument->notifyIdUpdate(this, i.value()->id(), i.value(), false);
                 i = p->IdMap.erase(i);
-            else
+            } else
                 ++i;
         }
     }
     else {
-        if (!aFeature->isVirtual())
+        if (!aFeature->isVirtual()) {
             p->IdMap.insertMulti(id.numId, aFeature);
+            if (p->theDocument)
+                p->theDocument->notifyIdUpdate(this, id, aFeature, true);
+        }
     }
 }
 
 bool Layer::exists(Feature* F) const
 {
-    int i = p->Features.indexOf(F);
-    return (i != -1);
+    return p->FeatureIndex.contains(F);
 }
 
 int Layer::size() const
@@ -239,13 +266,24 @@ Document* Layer::getDocument()
     return p->theDocument;
 }
 
-int Layer::get(Feature* aFeature)
+#ifdef USE_SPATIALITE
+void Layer::setDiskStore(SpatialiteBackend* aStore)
 {
-    for (int i=0; i<p->Features.size(); ++i)
-        if (p->Features[i] == aFeature)
-            return i;
+    if (p->DiskStore == aStore)
+        return;
+    delete p->DiskStore;
+    p->DiskStore = aStore;
+}
+
+SpatialiteBackend* Layer::diskStore() const
+{
+    return p->DiskStore;
+}
+#endif
 
-    return -1;
+int Layer::get(Feature* aFeature)
+{
+    return p->FeatureIndex.value(aFeature, -1);
 }
 
 QList<Feature *> Layer::get()
@@ -299,6 +337,7 @@ void Layer::setAlpha(const qreal a)
     p->alpha = a;
 
     if (p->theDocument) {
+        p->theDocument->touch();
         FeatureIterator it(p->theDocument);
         for(;!it.isEnd(); ++it) {
             it.get()->invalidateMeta();
@@ -435,6 +474,29 @@ QString Layer::toPropertiesHtml()
     return h;
 }
 
+QString Layer::toMemoryUsageHtml()
+{
+    QMap<QString, int> count;
+    QMap<QString, qint64> bytes;
+    for (int i=0; i<p->Features.size(); ++i) {
+        Feature* F = p->Features.at(i);
+        count[F->getClass()]++;
+        bytes[F->getClass()] += F->memoryUsage();
+    }
+
+    QString h;
+    h += "<u>" + p->Name + "</u><br/>";
+    h += "<table><tr><th>" + tr("Type") + "</th><th>" + tr("Features") + "</th><th>" + tr("Bytes") + "</th><th>" + tr("Bytes/feature") + "</th></tr>";
+    QMap<QString, int>::const_iterator it = count.constBegin();
+    for (; it != count.constEnd(); ++it) {
+        h += QString("<tr><td>%1</td><td align=\"right\">%2</td><td align=\"right\">%3</td><td align=\"right\">%4</td></tr>")
+                .arg(it.key()).arg(it.value()).arg(bytes[it.key()]).arg(bytes[it.key()] / it.value());
+    }
+    h += "</table>";
+
+    return h;
+}
+
 bool Layer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDialog * progress)
 {
     Q_UNUSED(asTemplate);
@@ -494,6 +556,29 @@ LayerWidget* DrawingLayer::newWidget(void)
 }
 
 
+#ifdef USE_SPATIALITE
+/// Writes the stored features of a disk-backed layer as they are read back
+class StoredXmlWriter : public StoredFeatureVisitor
+{
+public:
+    StoredXmlWriter(QXmlStreamWriter& aStream, QProgressDialog* aProgress)
+        : stream(aStream), progress(aProgress)
+    {
+    }
+
+    virtual bool visit(const QList<Feature*>& aBatch)
+    {
+        foreach (Feature* F, aBatch)
+            F->toXML(stream, progress);
+        return !(progress && progress->wasCanceled());
+    }
+
+private:
+    QXmlStreamWriter& stream;
+    QProgressDialog* progress;
+};
+#endif
+
 bool DrawingLayer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDialog * progress)
 {
     bool OK = true;
@@ -506,9 +591,21 @@ bool DrawingLayer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDia
         stream.writeAttribute("version", "0.6");
         stream.writeAttribute("generator", QString("%1 %2").arg(STRINGIFY(PRODUCT)).arg(STRINGIFY(VERSION)));
 
-        if (p->Features.size()) {
+        bool hasStored = false;
+#ifdef USE_SPATIALITE
+        hasStored = (p->DiskStore && p->DiskStore->storedCount());
+#endif
+        if (p->Features.size() || hasStored) {
             stream.writeStartElement("bound");
             CoordBox layBB = boundingBox();
+#ifdef USE_SPATIALITE
+            if (hasStored) {
+                if (layBB.isNull())
+                    layBB = p->DiskStore->extent();
+                else
+                    layBB.merge(p->DiskStore->extent());
+            }
+#endif
             QString S = QString().number(layBB.bottomLeft().y(),'f',6) + ",";
             S += QString().number(layBB.bottomLeft().x(),'f',6) + ",";
             S += QString().number(layBB.topRight().y(),'f',6) + ",";
@@ -521,6 +618,13 @@ bool DrawingLayer::toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDia
         QList<MapFeaturePtr>::iterator it;
         for(it = p->Features.begin(); it != p->Features.end(); it++)
             (*it)->toXML(stream, progress);
+#ifdef USE_SPATIALITE
+        // The document must hold everything, not only what is in memory
+        if (hasStored) {
+            StoredXmlWriter writer(stream, progress);
+            OK = p->DiskStore->visitStored(writer);
+        }
+#endif
         stream.writeEndElement();
 
         QList<CoordBox> downloadBoxes = p->theDocument->getDownloadBoxes(this);
@@ -23,6 +23,7 @@ class TileMapAdapter;
 class TrackSegment;
 class IMapAdapter;
 class Document;
+class SpatialiteBackend;
 
 struct IndexFindContext;
 
@@ -93,6 +94,12 @@ public:
     virtual void setDocument(Document* aDocument);
     Document* getDocument();
 
+#ifdef USE_SPATIALITE
+    /// Keep the content of this layer on disk, paging it in by viewport (the layer owns aStore)
+    void setDiskStore(SpatialiteBackend* aStore);
+    SpatialiteBackend* diskStore() const;
+#endif
+
     LayerWidget* getWidget(void);
     void deleteWidget(void);
     virtual void updateWidget() {}
@@ -113,6 +120,7 @@ public:
     virtual QString toMainHtml();
     virtual QString toHtml();
     virtual QString toPropertiesHtml();
+    virtual QString toMemoryUsageHtml();
 
     virtual bool toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDialog * progress);
     static Layer* fromXML(Layer* l, Document* d, QXmlStreamReader& stream, QProgressDialog * progress);
@@ -7,6 +7,9 @@ public:
     LayerPrivate()
     {
         theDocument = NULL;
+#ifdef USE_SPATIALITE
+        DiskStore = NULL;
+#endif
         selected = false;
         Enabled = true;
         Readonly = false;
@@ -19,7 +22,31 @@ public:
     {
     }
 
+    // Features are kept densely packed: a removed feature is replaced by the last one,
+    // and FeatureIndex gives the position of each feature, so both are O(1).
+    void addFeature(Feature* aFeature)
+    {
+        FeatureIndex.insert(aFeature, Features.size());
+        Features.append(aFeature);
+    }
+    bool removeFeature(Feature* aFeature)
+    {
+        QHash<Feature*, int>::iterator it = FeatureIndex.find(aFeature);
+        if (it == FeatureIndex.end())
+            return false;
+        int i = it.value();
+        FeatureIndex.erase(it);
+
+        Feature* last = Features.takeLast();
+        if (i < Features.size()) {
+            Features[i] = last;
+            FeatureIndex[last] = i;
+        }
+        return true;
+    }
+
     QList<Feature*> Features;
+    QHash<Feature*, int> FeatureIndex;
     QHash<qint64, MapFeaturePtr> IdMap;
 
     QString Name;
@@ -35,6 +62,9 @@ public:
     int dirtyLevel;
 
     Document* theDocument;
+#ifdef USE_SPATIALITE
+    SpatialiteBackend* DiskStore;
+#endif
 };
 
 #endif // LAYERPRIVATE_H
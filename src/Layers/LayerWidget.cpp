@@ -302,6 +302,16 @@ void DrawingLayerWidget::initActions()
     associatedMenu->addAction(actZoom);
     connect(actZoom, SIGNAL(triggered(bool)), this, SLOT(zoomLayer()));
 
+    QAction* actRepack = new QAction(tr("Repack index"), ctxMenu);
+    ctxMenu->addAction(actRepack);
+    associatedMenu->addAction(actRepack);
+    connect(actRepack, SIGNAL(triggered(bool)), this, SLOT(repackLayer()));
+
+    QAction* actMemory = new QAction(tr("Memory usage"), ctxMenu);
+    ctxMenu->addAction(actMemory);
+    associatedMenu->addAction(actMemory);
+    connect(actMemory, SIGNAL(triggered(bool)), this, SLOT(showMemoryUsage()));
+
     closeAction = new QAction(tr("Close"), this);
     connect(closeAction, SIGNAL(triggered()), this, SLOT(close()));
     ctxMenu->addAction(closeAction);
@@ -309,6 +319,17 @@ void DrawingLayerWidget::initActions()
     closeAction->setEnabled(theLayer->canDelete());
 }
 
+void DrawingLayerWidget::repackLayer()
+{
+    g_backend.repackIndex(theLayer);
+    emit (layerChanged(this, false));
+}
+
+void DrawingLayerWidget::showMemoryUsage()
+{
+    QMessageBox::information(this, tr("Memory usage"), theLayer->toMemoryUsageHtml());
+}
+
 // ImageLayerWidget
 
 ImageLayerWidget::ImageLayerWidget(ImageMapLayer* aLayer, QWidget* aParent)
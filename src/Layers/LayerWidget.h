@@ -88,6 +88,10 @@ class DrawingLayerWidget : public LayerWidget
     public:
         virtual void initActions();
 
+    private slots:
+        void repackLayer();
+        void showMemoryUsage();
+
     private:
         //DrawingMapLayer* theLayer;
 };
@@ -3,9 +3,14 @@
 #include "OsmRenderLayer.h"
 
 #include "Document.h"
+#include "Features.h"
 #include "MapRenderer.h"
 #include "MerkaartorPreferences.h"
 
+#include <QTime>
+
+#include <limits.h>
+
 inline uint qHash(const QPoint& p)
 {
     return (uint)(p.y() + (p.x() << 16));
@@ -18,29 +23,294 @@ QReadWriteLock tileLock;
 #define TILE_X(t) t.x()
 #define TILE_Y(t) t.y()
 
+#define TILE_SURROUND 2.0
+// Zoom levels are log2 of the scale in these steps; scales closer than a step share their tiles
+#define ZOOM_STEPS 1000000.
+// Time the GUI thread spends at once preparing tiles for the workers, in ms
+#define PREPARE_BUDGET 20
+// Label placements kept, one per scale, style and options
+#define LABEL_PLACERS 8
+// Labels a placement remembers before it starts over
+#define LABEL_DECISIONS 200000
+
+/// A rendered tile is only good for the scale, style, options and document contents it was drawn with
+struct TileKey
+{
+    TileKey(int z, const TILE_TYPE& t, int s, int o, int r)
+        : Zoom(z), Tile(t), Style(s), Options(o), Revision(r) {}
+
+    bool operator==(const TileKey& other) const
+    {
+        return Zoom == other.Zoom && Tile == other.Tile && Style == other.Style
+                && Options == other.Options && Revision == other.Revision;
+    }
+
+    int Zoom;
+    TILE_TYPE Tile;
+    int Style;
+    int Options;
+    int Revision;
+};
+
+inline uint qHash(const TileKey& k)
+{
+    return qHash(k.Tile) ^ (uint)(k.Zoom * 31) ^ (uint)(k.Style << 8) ^ (uint)(k.Options << 12) ^ (uint)(k.Revision << 20);
+}
+
 class TileCache : public QObject
 {
 public:
     TileCache(QObject* parent) : QObject(parent) {}
-    void insert(const TILE_TYPE& k, QImage* v)
+    ~TileCache()
+    {
+        qDeleteAll(m_labels);
+    }
+    void setBudget(int bytes)
     {
-        m_tileCache.insert(k, v);
+        m_tileCache.setMaxCost(bytes);
     }
-    bool contains(const TILE_TYPE& k)
+    void insert(const TileKey& k, QImage* v)
+    {
+        m_tileCache.insert(k, v, v->byteCount());
+    }
+    bool contains(const TileKey& k)
     {
         return m_tileCache.contains(k);
     }
-    QImage* get(const TILE_TYPE& k)
+    QImage* get(const TileKey& k)
+    {
+        return m_tileCache.object(k);
+    }
+    void clear()
     {
-        return m_tileCache[k];
+        m_tileCache.clear();
+        qDeleteAll(m_labels);
+        m_labels.clear();
+        m_labelOrder.clear();
+    }
+
+    /// Labels shared by the tiles of the scale, style and options of k.
+    /// Tiles drawn with a placement that is dropped or started over would not match the new ones, so they go too.
+    SharedLabelPlacer* labels(const TileKey& k)
+    {
+        TileKey lk = labelKey(k);
+        SharedLabelPlacer* l = m_labels.value(lk);
+        if (l && l->size() > LABEL_DECISIONS) {
+            removeTiles(lk);
+            l->clear();
+        }
+        if (!l) {
+            if (m_labelOrder.size() >= LABEL_PLACERS) {
+                TileKey oldest = m_labelOrder.takeFirst();
+                removeTiles(oldest);
+                delete m_labels.take(oldest);
+            }
+            l = new SharedLabelPlacer;
+            m_labels.insert(lk, l);
+        }
+        m_labelOrder.removeOne(lk);
+        m_labelOrder.append(lk);
+        return l;
+    }
+
+    /// Carries the tiles of revision from over to revision to, unless one of theBoxes touches them
+    void advance(const OsmRenderLayer* p, int from, int to, const QList<CoordBox>& theBoxes)
+    {
+        // Labels around the changes are placed again, and may show up differently in the tiles they cross
+        QHash<TileKey, QList<CoordBox> > spoiled;
+        QHashIterator<TileKey, SharedLabelPlacer*> it(m_labels);
+        while (it.hasNext()) {
+            it.next();
+            qreal S = pow(2., it.key().Zoom / ZOOM_STEPS);
+            QList<CoordBox>& boxes = spoiled[it.key()];
+            boxes = theBoxes;
+            foreach (const CoordBox& b, theBoxes) {
+                QPointF tl = p->theProjection.project(b.topLeft());
+                QPointF br = p->theProjection.project(b.bottomRight());
+                QRectF area = QRectF(QPointF(tl.x()*S, -tl.y()*S), QPointF(br.x()*S, -br.y()*S)).normalized();
+                foreach (const QRectF& r, it.value()->forget(area))
+                    boxes << CoordBox(p->theProjection.inverse2Coord(QPointF(r.left()/S, -r.top()/S)),
+                                      p->theProjection.inverse2Coord(QPointF(r.right()/S, -r.bottom()/S)));
+            }
+        }
+
+        foreach (TileKey k, m_tileCache.keys()) {
+            if (k.Revision != from)
+                continue;
+            // Putting back the others may have evicted it
+            QImage* img = m_tileCache.take(k);
+            if (!img)
+                continue;
+
+            QRectF projR = p->tileRect(k.Zoom, k.Tile);
+            CoordBox bb(p->theProjection.inverse2Coord(projR.topLeft()), p->theProjection.inverse2Coord(projR.bottomRight()));
+            bool touched = false;
+            QHash<TileKey, QList<CoordBox> >::const_iterator s = spoiled.constFind(labelKey(k));
+            foreach (const CoordBox& b, s == spoiled.constEnd() ? theBoxes : *s)
+                if (b.intersects(bb)) {
+                    touched = true;
+                    break;
+                }
+            if (touched) {
+                delete img;
+            } else {
+                k.Revision = to;
+                insert(k, img);
+            }
+        }
     }
 
 private:
-    QCache<const TILE_TYPE, QImage> m_tileCache;
+    static TileKey labelKey(const TileKey& k)
+    {
+        return TileKey(k.Zoom, TILE_TYPE(), k.Style, k.Options, 0);
+    }
+    void removeTiles(const TileKey& lk)
+    {
+        foreach (const TileKey& k, m_tileCache.keys())
+            if (labelKey(k) == lk)
+                m_tileCache.remove(k);
+    }
+
+    QCache<TileKey, QImage> m_tileCache;
+    QHash<TileKey, SharedLabelPlacer*> m_labels;
+    // Least recently used first
+    QList<TileKey> m_labelOrder;
 };
 
 TileCache* tileCache;
 
+/// What the tile workers of one redraw get to see.
+/// Built on the GUI thread: one backend query for all the tiles, split per tile. Then prepare()
+/// resolves the projected paths, their simplification and the painters at the current scale, a few
+/// tiles per call, so that a large redraw doesn't hold up the event loop. Workers only read the
+/// features of tiles that are ready, so they neither query the backend nor update shared feature state.
+class RenderSnapshot
+{
+public:
+    RenderSnapshot(OsmRenderLayer* p, const QList<TILE_TYPE>& theTiles)
+        : Pending(theTiles), Next(0), PixelPerM(p->PixelPerM)
+    {
+        QList<CoordBox> tileBoxes;
+        QHash<TILE_TYPE, CoordBox> boxOfTile;
+        int minX = INT_MAX, maxX = INT_MIN, minY = INT_MAX, maxY = INT_MIN;
+        foreach (const TILE_TYPE& tile, theTiles) {
+            minX = qMin(minX, TILE_X(tile));
+            maxX = qMax(maxX, TILE_X(tile));
+            minY = qMin(minY, TILE_Y(tile));
+            maxY = qMax(maxY, TILE_Y(tile));
+            QRectF projR = p->tileRect(tile);
+            CoordBox invalidRect(p->theProjection.inverse2Coord(projR.topLeft()), p->theProjection.inverse2Coord(projR.bottomRight()));
+            tileBoxes << invalidRect;
+            boxOfTile.insert(tile, invalidRect);
+        }
+
+        RenderQueue theFeatures;
+        for (int i=0; i<p->theDocument->layerSize(); ++i)
+            g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, tileBoxes, p->theProjection);
+        theFeatures.sort();
+
+        // Tiles reach further than their nominal size by the surround
+        QRectF nominal = p->tileRect(TILE_CONSTRUCTOR(0, 0));
+        qreal mx = (fabs(nominal.width()) - fabs(p->tileSizeCoordW)) / 2;
+        qreal my = (fabs(nominal.height()) - fabs(p->tileSizeCoordH)) / 2;
+
+        lodTolerance = MapRenderer::lodTolerance(TILE_SIZE / fabs(p->tileSizeCoordW));
+
+        // Tile queues are taken in order from the sorted one, so they are sorted too
+        for (int k=0; k<theFeatures.size(); ++k) {
+            Feature* F = theFeatures.feature(k);
+            CoordBox bb = F->boundingBox();
+            QRectF projBB = QRectF(p->theProjection.project(bb.topLeft()), p->theProjection.project(bb.bottomRight())).normalized();
+            projBB.adjust(-mx, -my, mx, my);
+            qreal fx1 = floor((projBB.left() - p->tileOriginCoord.x()) / p->tileSizeCoordW);
+            qreal fx2 = floor((projBB.right() - p->tileOriginCoord.x()) / p->tileSizeCoordW);
+            qreal fy1 = floor((projBB.top() - p->tileOriginCoord.y()) / p->tileSizeCoordH);
+            qreal fy2 = floor((projBB.bottom() - p->tileOriginCoord.y()) / p->tileSizeCoordH);
+            if (fy1 > fy2)
+                qSwap(fy1, fy2);
+            // A coastline or boundary spans far more tiles than are pending: only visit those
+            if (fx2 < minX || fx1 > maxX || fy2 < minY || fy1 > maxY)
+                continue;
+            int x1 = (int)qMax(fx1, (qreal)minX);
+            int x2 = (int)qMin(fx2, (qreal)maxX);
+            int y1 = (int)qMax(fy1, (qreal)minY);
+            int y2 = (int)qMin(fy2, (qreal)maxY);
+            for (int y=y1; y<=y2; ++y)
+                for (int x=x1; x<=x2; ++x) {
+                    TILE_TYPE tile = TILE_CONSTRUCTOR(x, y);
+                    QHash<TILE_TYPE, CoordBox>::const_iterator b = boxOfTile.constFind(tile);
+                    if (b != boxOfTile.constEnd() && b.value().intersects(bb))
+                        TileFeatures[tile].append(theFeatures.at(k));
+                }
+        }
+    }
+
+    /// Prepares the features of the pending tiles, in order, for about msecs.
+    /// Returns the tiles that became ready to render.
+    QList<TILE_TYPE> prepare(int msecs)
+    {
+        QList<TILE_TYPE> ready;
+        QTime t;
+        t.start();
+        while (!Pending.isEmpty()) {
+            const RenderQueue& q = features(Pending.first());
+            for (; Next < q.size(); ++Next) {
+                // Reading the clock for every feature would cost more than most features
+                if ((Next & 63) == 0 && t.elapsed() >= msecs)
+                    return ready;
+                prepareFeature(q.feature(Next));
+            }
+            ready << Pending.takeFirst();
+            Next = 0;
+        }
+        return ready;
+    }
+
+    bool isPrepared() const
+    {
+        return Pending.isEmpty();
+    }
+
+    const RenderQueue& features(const TILE_TYPE& tile) const
+    {
+        QHash<TILE_TYPE, RenderQueue>::const_iterator it = TileFeatures.constFind(tile);
+        if (it == TileFeatures.constEnd())
+            return Empty;
+        return it.value();
+    }
+
+private:
+    /// Features already prepared may be drawn by a worker by now: they are never touched again
+    void prepareFeature(Feature* F)
+    {
+        if (Prepared.contains(F))
+            return;
+        Prepared.insert(F);
+        F->getPainter(PixelPerM);
+        F->hasPainter();
+        for (int i=0; i<F->sizeParents(); ++i) {
+            Feature* parent = F->getParent(i);
+            if (!parent->isDeleted() && !Prepared.contains(parent) && !ParentsPrepared.contains(parent)) {
+                ParentsPrepared.insert(parent);
+                parent->hasPainter(PixelPerM);
+            }
+        }
+        if (Way* R = CAST_WAY(F))
+            R->getPath(lodTolerance);
+    }
+
+    QHash<TILE_TYPE, RenderQueue> TileFeatures;
+    RenderQueue Empty;
+
+    QList<TILE_TYPE> Pending;
+    int Next;
+    QSet<Feature*> Prepared;
+    QSet<Feature*> ParentsPrepared;
+    qreal PixelPerM;
+    qreal lodTolerance;
+};
+
 class RenderTile
 {
 public:
@@ -65,28 +335,10 @@ public:
             return;
 
         TILE_TYPE tile = theTile;
+        QRectF projR = p->tileRect(tile);
 
-        QPointF projTL((TILE_X(tile)*p->tileSizeCoordW)+p->tileOriginCoord.x(), (TILE_Y(tile)*p->tileSizeCoordH)+p->tileOriginCoord.y());
-        QPointF projBR(((TILE_X(tile)+1)*p->tileSizeCoordW)+p->tileOriginCoord.x(), ((TILE_Y(tile)+1)*p->tileSizeCoordH)+p->tileOriginCoord.y());
-        QRectF projR(projTL, projBR);
-
-#define TILE_SURROUND 2.0
-        qreal z = TILE_SURROUND * ((TILE_SIZE*TILE_SURROUND) / (p->theTransform.m11()*projR.width()*TILE_SURROUND));    // Adjust to main transform
-        qreal dlat = (projR.top()-projR.bottom())*(z-1)/2;
-        qreal dlon = (projR.right()-projR.left())*(z-1)/2;
-        projR.setBottom(projR.bottom()-dlat);
-        projR.setLeft(projR.left()-dlon);
-        projR.setTop(projR.top()+dlat);
-        projR.setRight(projR.right()+dlon);
-
-        Coord tl = p->theProjection.inverse2Coord(projR.topLeft());
-        Coord br = p->theProjection.inverse2Coord(projR.bottomRight());
-        CoordBox invalidRect(tl, br);
-
-        QMap<RenderPriority, QSet <Feature*> > theFeatures;
-
-        for (int i=0; i<p->theDocument->layerSize(); ++i)
-            g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, invalidRect, p->theProjection);
+        // Only read the snapshot: paths and painters were resolved by the GUI thread
+        const RenderQueue& theFeatures = p->theSnapshot->features(tile);
 
         QImage* img = new QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32);
         img->fill(Qt::transparent);
@@ -95,10 +347,11 @@ public:
         if (M_PREFS->getUseAntiAlias())
             P.setRenderHint(QPainter::Antialiasing);
         MapRenderer r;
+        r.theSharedLabels = p->theLabels;
         r.render(&P, theFeatures, projR, /*QRect(0, 0, TILE_SIZE, TILE_SIZE)*/QRect(-((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, -((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, TILE_SIZE*TILE_SURROUND, TILE_SIZE*TILE_SURROUND), p->PixelPerM, p->ROptions);
         P.end();
         tileLock.lockForWrite();
-        tileCache->insert(tile, img);
+        tileCache->insert(p->tileKey(tile), img);
 
         //            if (theFeatures.size())
         //                img->save(QString("c:/temp/%1-%2.png").arg(tile.x()).arg(tile.y()));
@@ -113,14 +366,31 @@ public:
 OsmRenderLayer::OsmRenderLayer(QObject *parent)
     : QObject(parent)
     , theDocument(0)
+    , ZoomLevel(0), StyleKey(0), OptionsKey(0), DocRevision(0)
+    , theSnapshot(0), theLabels(0)
 {
     tileCache = new TileCache(this);
-    connect(&(renderGatheringWatcher), SIGNAL(finished()), SIGNAL(renderingDone()));
+    prepareTimer.setInterval(0);
+    connect(&prepareTimer, SIGNAL(timeout()), SLOT(prepareNextTiles()));
+    connect(&(renderGatheringWatcher), SIGNAL(finished()), SLOT(on_renderGatheringFinished()));
+}
+
+OsmRenderLayer::~OsmRenderLayer()
+{
+    cancelRendering();
+    delete theSnapshot;
 }
 
 void OsmRenderLayer::setDocument(IDocument *aDocument)
 {
+    cancelRendering();
+
     theDocument = aDocument;
+    DocRevision = theDocument ? theDocument->revision() : 0;
+    tileLock.lockForWrite();
+    theLabels = 0;
+    tileCache->clear();
+    tileLock.unlock();
 }
 
 void OsmRenderLayer::setTransform(const QTransform &aTransform)
@@ -134,13 +404,118 @@ void OsmRenderLayer::setProjection(const Projection& aProjection)
     theProjection = aProjection;
 }
 
-void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform &aTransform, const QRect& rect, qreal ppm, const RendererOptions& roptions)
+QRectF OsmRenderLayer::tileRect(const QPoint& tile) const
+{
+    return tileRect(ZoomLevel, tile);
+}
+
+QRectF OsmRenderLayer::tileRect(int zoom, const QPoint& tile) const
+{
+    // The grid of each zoom level starts at the projection origin, so that its tiles stay put
+    qreal sizeW = TILE_SIZE / pow(2., zoom / ZOOM_STEPS);
+    qreal sizeH = (theTransform.m22() < 0) ? -sizeW : sizeW;
+
+    QPointF projTL(TILE_X(tile)*sizeW, TILE_Y(tile)*sizeH);
+    QPointF projBR((TILE_X(tile)+1)*sizeW, (TILE_Y(tile)+1)*sizeH);
+    QRectF projR(projTL, projBR);
+
+    qreal z = TILE_SURROUND;
+    qreal dlat = (projR.top()-projR.bottom())*(z-1)/2;
+    qreal dlon = (projR.right()-projR.left())*(z-1)/2;
+    projR.setBottom(projR.bottom()-dlat);
+    projR.setLeft(projR.left()-dlon);
+    projR.setTop(projR.top()+dlat);
+    projR.setRight(projR.right()+dlon);
+
+    return projR;
+}
+
+TileKey OsmRenderLayer::tileKey(const QPoint& tile) const
+{
+    return TileKey(ZoomLevel, tile, StyleKey, OptionsKey, DocRevision);
+}
+
+void OsmRenderLayer::updateTileKeys()
 {
-    if (renderGathering.isRunning()) {
-        renderGathering.cancel();
-        renderGathering.waitForFinished();
+    ZoomLevel = qRound(log(fabs(theTransform.m11())) / log(2.) * ZOOM_STEPS);
+
+    // Flags that don't change what is drawn would only split the cache
+    RendererOptions::RenderOptions opts = ROptions.options & ~(RendererOptions::Interacting | RendererOptions::LockZoom);
+    OptionsKey = (int)opts | ((int)ROptions.arrowOptions << 24);
+    if (M_PREFS->getUseAntiAlias())
+        OptionsKey |= (1 << 28);
+    if (M_PREFS->getTrackPointsVisible())
+        OptionsKey |= (1 << 29);
+
+    StyleKey = theDocument->styleRevision() ^ (theProjection.projectionRevision() << 16);
+
+    int rev = theDocument->revision();
+    if (rev != DocRevision) {
+        // An edit only spoils the tiles around it
+        QList<CoordBox> changed;
+        if (theDocument->changedSince(DocRevision, changed))
+            tileCache->advance(this, DocRevision, rev, changed);
+        DocRevision = rev;
     }
 
+    theLabels = tileCache->labels(tileKey(TILE_CONSTRUCTOR(0, 0)));
+}
+
+void OsmRenderLayer::startRendering()
+{
+    if (!theDocument || !tiles.size())
+        return;
+
+    // No worker is running, see cancelRendering()
+    delete theSnapshot;
+    theSnapshot = new RenderSnapshot(this, tiles);
+
+    prepareNextTiles();
+}
+
+void OsmRenderLayer::prepareNextTiles()
+{
+    QList<TILE_TYPE> ready = theSnapshot->prepare(PREPARE_BUDGET);
+    if (theSnapshot->isPrepared())
+        prepareTimer.stop();
+    else
+        prepareTimer.start();
+
+    if (ready.isEmpty())
+        return;
+    renderBatches.append(ready);
+    QFuture<void> f = QtConcurrent::map(renderBatches.last(), RenderTile(this));
+    renderGatherings << f;
+    if (renderGatheringWatcher.isFinished())
+        renderGatheringWatcher.setFuture(f);
+}
+
+void OsmRenderLayer::on_renderGatheringFinished()
+{
+    for (int i=0; i<renderGatherings.size(); ++i)
+        if (!renderGatherings.at(i).isFinished()) {
+            renderGatheringWatcher.setFuture(renderGatherings.at(i));
+            return;
+        }
+    if (isRenderingDone())
+        emit renderingDone();
+}
+
+void OsmRenderLayer::cancelRendering()
+{
+    prepareTimer.stop();
+    for (int i=0; i<renderGatherings.size(); ++i)
+        renderGatherings[i].cancel();
+    for (int i=0; i<renderGatherings.size(); ++i)
+        renderGatherings[i].waitForFinished();
+    renderGatherings.clear();
+    renderBatches.clear();
+}
+
+void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform &aTransform, const QRect& rect, qreal ppm, const RendererOptions& roptions)
+{
+    cancelRendering();
+
     if (!theDocument)
         return;
 
@@ -151,16 +526,14 @@ void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform
     ROptions = roptions;
 
     tileLock.lockForWrite();
-    tileCache->deleteLater();
-    tileCache = new TileCache(this);
-    tileOriginCoord = theInvertedTransform.map(QPointF(rect.topLeft()));
+    tileOriginCoord = QPointF(0, 0);
 
     QPointF tl = theInvertedTransform.map(QPointF(rect.topLeft()));
     QPointF br = theInvertedTransform.map(QPointF(rect.bottomRight())+QPointF(1,1));
     projRect = QRectF(tl, br);
 
-    tileSizeCoordW = (projRect.width()) / rect.width() * TILE_SIZE;
-    //            tileSizeCoordH = (projRect.height()) / rect.height() * TILE_SIZE;
+    updateTileKeys();
+    tileSizeCoordW = TILE_SIZE / pow(2., ZoomLevel / ZOOM_STEPS);
     tileSizeCoordH = tileSizeCoordW * projRect.height() / fabs(projRect.height());
 
     tileViewport.setLeft(((projRect.left()-tileOriginCoord.x()) / tileSizeCoordW) - 1);
@@ -168,26 +541,25 @@ void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform
     tileViewport.setRight(((projRect.right()-tileOriginCoord.x()) / tileSizeCoordW) + 1);
     tileViewport.setBottom(((projRect.bottom()-tileOriginCoord.y()) / tileSizeCoordH) + 1);
 
+    // Never less than twice what the viewport needs
+    int viewportBytes = (tileViewport.width()+1) * (tileViewport.height()+1) * TILE_SIZE*TILE_SIZE*4;
+    tileCache->setBudget(qMax(M_PREFS->getRenderCacheSize()*1024*1024, viewportBytes*2));
+
     tiles.clear();
     for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
         for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
             TILE_TYPE tile = TILE_CONSTRUCTOR(j, i);
-            tiles << tile;
+            if (!tileCache->contains(tileKey(tile)))
+                tiles << tile;
         }
     tileLock.unlock();
 
-    if (tiles.size()) {
-        renderGathering = QtConcurrent::map(tiles, RenderTile(this));
-        renderGatheringWatcher.setFuture(renderGathering);
-    }
+    startRendering();
 }
 
 void OsmRenderLayer::pan(QPoint delta)
 {
-    if (renderGathering.isRunning()) {
-        renderGathering.cancel();
-        renderGathering.waitForFinished();
-    }
+    cancelRendering();
 
     theTransform.translate((qreal)(delta.x())/theTransform.m11(), (qreal)(delta.y())/theTransform.m22());
     theInvertedTransform = theTransform.inverted();
@@ -204,26 +576,25 @@ void OsmRenderLayer::pan(QPoint delta)
     for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
         for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
             TILE_TYPE tile = TILE_CONSTRUCTOR(j, i);
-            if (!tileCache->contains(tile))
+            if (!tileCache->contains(tileKey(tile)))
                 tiles << tile;
         }
     tileLock.unlock();
 
-    if (tiles.size()) {
-        renderGathering = QtConcurrent::map(tiles, RenderTile(this));
-        renderGatheringWatcher.setFuture(renderGathering);
-    }
+    startRendering();
 }
 
 void OsmRenderLayer::drawImage(QPainter *P)
 {
-    QPointF origin = theTransform.map(tileOriginCoord);
     for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
         for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
             tileLock.lockForRead();
-            if (tileCache->contains(TILE_CONSTRUCTOR(j, i))) {
-                QPointF tl = QPointF((j*TILE_SIZE)+origin.x(), (i*TILE_SIZE)+origin.y());
-                P->drawImage(tl, *(tileCache->get(TILE_CONSTRUCTOR(j, i))));
+            QImage* img = tileCache->get(tileKey(TILE_CONSTRUCTOR(j, i)));
+            if (img) {
+                // Tiles are drawn at the scale of their zoom level, a hair off the view's: stepping
+                // TILE_SIZE pixels from the origin would drift away from the other layers
+                QPointF tl = theTransform.map(tileOriginCoord + QPointF(j*tileSizeCoordW, i*tileSizeCoordH));
+                P->drawImage(tl, *img);
             }
             tileLock.unlock();
             //            qDebug() << QPoint(j, i) << tl;
@@ -232,6 +603,11 @@ void OsmRenderLayer::drawImage(QPainter *P)
 
 bool OsmRenderLayer::isRenderingDone()
 {
-    return renderGathering.isFinished();
+    if (prepareTimer.isActive())
+        return false;
+    for (int i=0; i<renderGatherings.size(); ++i)
+        if (!renderGatherings.at(i).isFinished())
+            return false;
+    return true;
 }
 
@@ -6,6 +6,8 @@
 #include <QPointF>
 #include <QFuture>
 #include <QFutureWatcher>
+#include <QLinkedList>
+#include <QTimer>
 #include <QTransform>
 
 #include "IRenderer.h"
@@ -13,21 +15,29 @@
 
 class IDocument;
 class Projection;
+class RenderSnapshot;
+class SharedLabelPlacer;
+class TileCache;
+struct TileKey;
 
 class OsmRenderLayer : public QObject
 {
     Q_OBJECT
 
     friend class RenderTile;
+    friend class RenderSnapshot;
+    friend class TileCache;
 
 public:
     OsmRenderLayer(QObject*parent=0);
+    ~OsmRenderLayer();
     void setDocument(IDocument *aDocument);
     void setTransform(const QTransform& aTransform);
     void setProjection(const Projection& aProjection);
 
     void forceRedraw(const Projection& aProjection, const QTransform &aTransform, const QRect& rect, qreal ppm, const RendererOptions& roptions);
     void pan(QPoint delta);
+    void cancelRendering();
     void drawImage(QPainter* P);
 
     bool isRenderingDone();
@@ -35,7 +45,19 @@ public:
 signals:
     void renderingDone();
 
+private slots:
+    void prepareNextTiles();
+    void on_renderGatheringFinished();
+
 protected:
+    /// Projected area rendered into tile, surround included
+    QRectF tileRect(const QPoint& tile) const;
+    QRectF tileRect(int zoom, const QPoint& tile) const;
+    TileKey tileKey(const QPoint& tile) const;
+    /// Works out which cached tiles the current scale, style and document contents can use
+    void updateTileKeys();
+    void startRendering();
+
     IDocument* theDocument;
 
     QRectF projRect;
@@ -44,7 +66,11 @@ protected:
     QPointF tileOriginCoord;
     QRect tileViewport;
 
-    QFuture<void> renderGathering;
+    // The snapshot is prepared a few tiles at a time; each batch is rendered as soon as it is ready
+    QTimer prepareTimer;
+    // Tiles of each batch: QtConcurrent::map works on them in place, and list nodes never move
+    QLinkedList< QList<QPoint> > renderBatches;
+    QList< QFuture<void> > renderGatherings;
     QFutureWatcher<void> renderGatheringWatcher;
 
     QTransform theTransform;
@@ -53,6 +79,16 @@ protected:
 
     qreal PixelPerM;
     RendererOptions ROptions;
+
+    int ZoomLevel;
+    int StyleKey;
+    int OptionsKey;
+    int DocRevision;
+
+    // Features of the tiles being rendered, owned by the GUI thread and only replaced when no tile is
+    RenderSnapshot* theSnapshot;
+    // Labels of the tiles at the current scale, style and options, owned by the tile cache
+    SharedLabelPlacer* theLabels;
 };
 
 #endif // OSMRENDERLAYER_H
@@ -16,6 +16,7 @@
 #include "ZipEngine.h"
 
 #include "IMapAdapterFactory.h"
+#include "Benchmark.h"
 
 #if defined(Q_OS_WIN)
 extern Q_CORE_EXPORT void qWinMsgHandler(QtMsgType t, const char* str);
@@ -102,6 +103,10 @@ void showHelp()
     fprintf(stdout, "  --ignore-preferences\t\tIgnore saved preferences\n");
     fprintf(stdout, "  --reset-preferences\t\tReset saved preferences to default\n");
     fprintf(stdout, "  --ignore-startup-template\t\tIgnore the saved startup template document and start with a new document\n");
+    fprintf(stdout, "  --benchmark-backend memory|disk filename\t\tImport filename with the given backend, time viewport queries and exit\n");
+    fprintf(stdout, "  --benchmark-import filename\t\tImport filename, report the entities imported per second and exit\n");
+    fprintf(stdout, "  --benchmark-render filename\t\tImport filename, time rendering it at several zooms with and without simplification and exit\n");
+    fprintf(stdout, "  --benchmark-roundtrip filename\t\tImport filename, export it as OSM PBF, import that back, compare both and exit\n");
     fprintf(stdout, "  [filenames]\t\tOpen designated files \n");
 }
 
@@ -125,6 +130,7 @@ int main(int argc, char** argv)
     QtSingleApplication instance(argc,argv);
 
     bool reuse = true;
+    QString benchmarkMode, benchmarkFile;
     QStringList argsIn = QCoreApplication::arguments();
     QStringList argsOut;
     argsIn.removeFirst();
@@ -151,9 +157,24 @@ int main(int argc, char** argv)
             g_Merk_IgnoreStartupTemplate = true;
         } else if (argsIn[i] == "--selfclip") {
             g_Merk_SelfClip = true;
+        } else if (argsIn[i] == "--benchmark-backend" && i+2 < argsIn.size()) {
+            benchmarkMode = argsIn[++i];
+            benchmarkFile = argsIn[++i];
+        } else if (argsIn[i] == "--benchmark-import" && i+1 < argsIn.size()) {
+            benchmarkMode = "import";
+            benchmarkFile = argsIn[++i];
+        } else if (argsIn[i] == "--benchmark-render" && i+1 < argsIn.size()) {
+            benchmarkMode = "render";
+            benchmarkFile = argsIn[++i];
+        } else if (argsIn[i] == "--benchmark-roundtrip" && i+1 < argsIn.size()) {
+            benchmarkMode = "roundtrip";
+            benchmarkFile = argsIn[++i];
         } else
             argsOut << argsIn[i];
     }
+    // Benchmarks run in their own instance, never handed over to a running one
+    if (!benchmarkMode.isEmpty())
+        reuse = false;
 
     QCoreApplication::setOrganizationName("Merkaartor");
     QCoreApplication::setOrganizationDomain("merkaartor.org");
@@ -264,6 +285,16 @@ int main(int argc, char** argv)
 
     MainWindow Main;
     g_Merk_MainWindow = &Main;
+    if (!benchmarkFile.isEmpty()) {
+        splash.close();
+        if (benchmarkMode == "render")
+            return benchmarkRender(benchmarkFile);
+        if (benchmarkMode == "import")
+            return benchmarkImport(benchmarkFile);
+        if (benchmarkMode == "roundtrip")
+            return benchmarkRoundTrip(benchmarkFile);
+        return benchmarkBackend(benchmarkMode, benchmarkFile);
+    }
     instance.setActivationWindow(&Main, false);
     QObject::connect(&instance, SIGNAL(messageReceived(const QString&)),
              &instance, SLOT(activateWindow()));
@@ -382,6 +382,9 @@ MainWindow::MainWindow(QWidget *parent)
 #ifndef OSMARENDER
     ui->renderSVGAction->setVisible(false);
 #endif
+#ifndef USE_PROTOBUF
+    ui->exportOSMBinAction->setVisible(false);
+#endif
 
 #ifndef GEOIMAGE
         ui->windowGeoimageAction->setVisible(false);
@@ -1192,6 +1195,8 @@ void MainWindow::setAreaOpacity(QAction *act)
 {
     qreal a = act->data().toDouble();
     M_PREFS->setAreaOpacity(int(a*100));
+    // Rendered tiles were filled with the old opacity
+    document()->touchStyle();
 
     theView->invalidate(true, true, false);
 }
@@ -3020,9 +3025,10 @@ void MainWindow::on_mapStyleLoadAction_triggered()
                                              + tr("Merkaartor map style (*.mas)\n")
                                              + tr("MapCSS stylesheet (*.css)"));
     if (!f.isNull()) {
-        if (f.endsWith("css"))
+        if (f.endsWith("css")) {
             MapCSSPaintstyle::instance()->loadPainters(f);
-        else {
+            document()->touchStyle();
+        } else {
             M_STYLE->loadPainters(f);
             document()->setPainters(M_STYLE->getPainters());
             for (VisibleFeatureIterator i(theDocument); !i.isEnd(); ++i)
@@ -3216,6 +3222,8 @@ void MainWindow::preferencesChanged(PreferencesDialog* prefs)
         }
     }
 
+    // Colours, widths and the like may have changed
+    theDocument->touchStyle();
     applyStyles(prefs->cbStyles->itemData(prefs->cbStyles->currentIndex()).toString());
     updateStyleMenu();
 
@@ -3468,13 +3476,51 @@ void MainWindow::on_exportOSMAction_triggered()
         if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
             return;
 
-        theDocument->exportOSM(this, &file, theFeatures);
+        // "All" also covers what disk-backed layers keep on disk
+        theDocument->exportOSM(this, &file, theFeatures, M_PREFS->getExportType() == Export_All);
         file.close();
 
     }
     deleteProgressDialog();
 }
 
+void MainWindow::on_exportOSMBinAction_triggered()
+{
+#ifdef USE_PROTOBUF
+    QList<Feature*> theFeatures;
+
+    // The exporter shows its own progress
+    if (!selectExportedFeatures(theFeatures))
+        return;
+
+    QString fileName;
+    QFileDialog dlg(this, tr("Export OSM (Binary)"), QString("%1/%2.osm.pbf").arg(M_PREFS->getworkingdir()).arg(tr("untitled")), tr("Protobuf Binary Format (*.pbf)") + "\n" + tr("All Files (*)"));
+    dlg.setFileMode(QFileDialog::AnyFile);
+    dlg.setDefaultSuffix("pbf");
+    dlg.setAcceptMode(QFileDialog::AcceptSave);
+
+    if (dlg.exec()) {
+        if (dlg.selectedFiles().size())
+            fileName = dlg.selectedFiles()[0];
+    }
+
+    if (fileName != "") {
+#ifndef Q_OS_SYMBIAN
+        QApplication::setOverrideCursor(Qt::BusyCursor);
+#endif
+
+        ImportExportPBF pbf(document());
+        if (pbf.saveFile(fileName)) {
+            pbf.export_(theFeatures, M_PREFS->getExportType() == Export_All);
+        }
+
+#ifndef Q_OS_SYMBIAN
+        QApplication::restoreOverrideCursor();
+#endif
+    }
+#endif
+}
+
 void MainWindow::on_exportOSCAction_triggered()
 {
 #ifndef FRISIUS_BUILD
@@ -156,6 +156,7 @@ public slots:
     virtual void on_mapStyleSaveAsAction_triggered();
     virtual void on_mapStyleLoadAction_triggered();
     virtual void on_exportOSMAction_triggered();
+    virtual void on_exportOSMBinAction_triggered();
     virtual void on_exportOSCAction_triggered();
     virtual void on_exportGPXAction_triggered();
     virtual void on_exportKMLAction_triggered();
@@ -5,11 +5,13 @@
 #include "Features.h"
 #include "LineF.h"
 #include "SvgCache.h"
+#include "LabelPlacer.h"
 
 #include <QtCore/QString>
 #include <QtGui/QPainter>
 #include <QtGui/QPainterPath>
 #include <QMatrix>
+#include <QVarLengthArray>
 #include <QDomElement>
 #include <math.h>
 
@@ -238,7 +240,11 @@ void FeaturePainter::drawBackground(Way* R, QPainter* thePainter, MapRenderer* t
                 thePen.setJoinStyle(Qt::BevelJoin);
                 thePainter->setPen(thePen);
 
-                QPainterPath thePath = theRenderer->theTransform.map(R->getPath());
+                // Offsetting needs a single ring, which only polygon clipping keeps
+                QPainterPath thePath = R->getPath(theRenderer->theLodTolerance);
+                if (R->isClosed())
+                    thePath = theRenderer->clipped(thePath, WW, true);
+                thePath = theRenderer->theTransform.map(thePath);
                 QPainterPath aPath;
 
                 for (int j=1; j < thePath.elementCount(); j++) {
@@ -279,6 +285,7 @@ void FeaturePainter::drawBackground(Way* R, QPainter* thePainter, MapRenderer* t
     }
 
     thePainter->setBrush(Qt::NoBrush);
+    bool filled = false;
     if (R->size() > 2) {
         if (ForegroundFillUseIcon) {
             if (!IconName.isEmpty()) {
@@ -288,14 +295,17 @@ void FeaturePainter::drawBackground(Way* R, QPainter* thePainter, MapRenderer* t
                 QImage* pm = getSVGImageFromFile(IconName,int(WW));
                 if (pm && !pm->isNull()) {
                     thePainter->setBrush(*pm);
+                    filled = true;
                 }
             }
         } else if (ForegroundFill) {
             thePainter->setBrush(ForegroundFillFillColor);
+            filled = true;
         }
     }
 
-    thePainter->drawPath(theRenderer->theTransform.map(R->getPath()));
+    qreal margin = thePainter->pen().style() == Qt::NoPen ? 0 : thePainter->pen().widthF();
+    thePainter->drawPath(theRenderer->theTransform.map(theRenderer->clipped(R->getPath(theRenderer->theLodTolerance), margin, filled)));
 }
 
 void FeaturePainter::drawBackground(Relation* R, QPainter* thePainter, MapRenderer* theRenderer) const
@@ -393,31 +403,49 @@ void FeaturePainter::drawForeground(Node* N, QPainter* thePainter, MapRenderer*
 
 void FeaturePainter::drawForeground(Way* R, QPainter* thePainter, MapRenderer* theRenderer) const
 {
-    if (!DrawForeground) return;
-
-    qreal WW = 0.0;
-    if (DrawForeground)
-    {
-        qreal PixelPerM = theRenderer->thePixelPerM;
-        WW = PixelPerM*R->widthOf()*ForegroundScale+ForegroundOffset;
-        if (WW < 0) return;
-        QPen thePen(ForegroundColor,WW);
-        thePen.setCapStyle(CAPSTYLE);
-        thePen.setJoinStyle(JOINSTYLE);
-        if (ForegroundDashSet)
-        {
-            QVector<qreal> Pattern;
-            Pattern << ForegroundDash << ForegroundWhite;
-            thePen.setDashPattern(Pattern);
-        }
-        thePainter->setPen(thePen);
-    }
-    else
-        thePainter->setPen(Qt::NoPen);
+    QPen thePen;
+    foregroundPen(R, theRenderer, thePen);
+    if (thePen.style() == Qt::NoPen) return;
 
+    thePainter->setPen(thePen);
     thePainter->setBrush(Qt::NoBrush);
+    thePainter->drawPath(theRenderer->theTransform.map(theRenderer->strokePath(R, thePen)));
+}
 
-    thePainter->drawPath(theRenderer->theTransform.map(R->getPath()));
+bool FeaturePainter::backgroundPen(Way* R, MapRenderer* theRenderer, QPen& thePen) const
+{
+    // Fills and offset outlines are up to drawBackground
+    if (ForegroundFill || ForegroundFillUseIcon || BackgroundExterior || BackgroundInterior)
+        return false;
+
+    thePen = QPen(Qt::NoPen);
+    if (!DrawBackground) return true;
+    qreal WW = theRenderer->thePixelPerM*R->widthOf()*BackgroundScale+BackgroundOffset;
+    if (WW < 0) return true;
+
+    thePen = QPen(BackgroundColor,WW);
+    thePen.setCapStyle(CAPSTYLE);
+    thePen.setJoinStyle(JOINSTYLE);
+    return true;
+}
+
+bool FeaturePainter::foregroundPen(Way* R, MapRenderer* theRenderer, QPen& thePen) const
+{
+    thePen = QPen(Qt::NoPen);
+    if (!DrawForeground) return true;
+    qreal WW = theRenderer->thePixelPerM*R->widthOf()*ForegroundScale+ForegroundOffset;
+    if (WW < 0) return true;
+
+    thePen = QPen(ForegroundColor,WW);
+    thePen.setCapStyle(CAPSTYLE);
+    thePen.setJoinStyle(JOINSTYLE);
+    if (ForegroundDashSet)
+    {
+        QVector<qreal> Pattern;
+        Pattern << ForegroundDash << ForegroundWhite;
+        thePen.setDashPattern(Pattern);
+    }
+    return true;
 }
 
 void FeaturePainter::drawForeground(Relation* R, QPainter* thePainter, MapRenderer* theRenderer) const
@@ -598,37 +626,46 @@ void FeaturePainter::drawPointLabel(QPointF C, QString str, QString strBg, QPain
 
     QFont font = getLabelFont();
     font.setPixelSize(int(WW));
-    QFontMetrics metrics(font);
+    const QFontMetricsF& metrics = LabelPlacer::metrics(font);
 
-    int modX = 0;
-    int modY = 0;
-    QPainterPath textPath;
-    QPainterPath bgPath;
+    bool drawBg = DrawLabelBackground && !strBg.isEmpty();
+    if (str.isEmpty() && !drawBg)
+        return;
+    qreal modY = 0;
+    if (DrawIcon && (IconName != "") )
+    {
+        QImage pm(IconName);
+        modY = - pm.height();
+        if (DrawLabelBackground)
+            modY -= BG_SPACING;
+    }
 
+    // Take the space before shaping any text
+    QRectF box;
+    qreal strX = 0, bgX = 0;
     if (!str.isEmpty()) {
-        modX = - (metrics.width(str)/2);
-        if (DrawIcon && (IconName != "") )
-        {
-            QImage pm(IconName);
-            modY = - pm.height();
-            if (DrawLabelBackground)
-                modY -= BG_SPACING;
-        }
-        textPath.addText(modX, modY, font, str);
-        thePainter->translate(C);
+        strX = - (metrics.width(str)/2);
+        box = QRectF(strX, modY - metrics.ascent(), metrics.width(str), metrics.height());
     }
-    if (DrawLabelBackground && !strBg.isEmpty()) {
-        modX = - (metrics.width(strBg)/2);
-        if (DrawIcon && (IconName != "") )
-        {
-            QImage pm(IconName);
-            modY = - pm.height();
-            if (DrawLabelBackground)
-                modY -= BG_SPACING;
-        }
+    if (drawBg) {
+        bgX = - (metrics.width(strBg)/2);
+        box |= QRectF(bgX, modY - metrics.ascent(), metrics.width(strBg), metrics.height());
+        box.adjust(-BG_SPACING-BG_PEN_SZ, -BG_SPACING-BG_PEN_SZ, BG_SPACING+BG_PEN_SZ, BG_SPACING+BG_PEN_SZ);
+    }
+    if (getLabelHalo())
+        box.adjust(-WW/10, -WW/10, WW/10, WW/10);
+    LabelPlacer::Decision d = theRenderer->theLabels.next();
+    if (d == LabelPlacer::Dropped || (d == LabelPlacer::Undecided && !theRenderer->theLabels.place(box.translated(C))))
+        return;
 
-        textPath.addText(modX, modY, font, strBg);
-        thePainter->translate(C);
+    QPainterPath textPath;
+    QPainterPath bgPath;
+
+    thePainter->translate(C);
+    if (!str.isEmpty())
+        textPath.addPath(LabelPlacer::text(font, str).translated(strX, modY));
+    if (drawBg) {
+        textPath.addPath(LabelPlacer::text(font, strBg).translated(bgX, modY));
 
         bgPath.addRect(textPath.boundingRect().adjusted(-BG_SPACING, -BG_SPACING, BG_SPACING, BG_SPACING));
         thePainter->setPen(QPen(LabelColor, BG_PEN_SZ));
@@ -643,13 +680,25 @@ void FeaturePainter::drawPointLabel(QPointF C, QString str, QString strBg, QPain
     thePainter->setBrush(LabelColor);
     thePainter->drawPath(textPath);
 
-    if (DrawLabelBackground && !strBg.isEmpty()) {
+    // Each tile has its own clip region: shared labels can only rely on the placer
+    if (drawBg && !theRenderer->theSharedLabels) {
         QRegion rg = thePainter->clipRegion();
         rg -= textPath.boundingRect().toRect().translated(C.toPoint());
         thePainter->setClipRegion(theRenderer->theTransform.map(rg));
     }
 }
 
+qreal FeaturePainter::labelPriority(Feature* F, MapRenderer* theRenderer) const
+{
+    if (!DrawLabel)
+        return 0;
+    LineParameters lp = labelBoundary();
+    qreal width = 1;
+    if (CHECK_WAY(F) && !getLabelArea())
+        width = STATIC_CAST_WAY(F)->widthOf();
+    return theRenderer->thePixelPerM*width*lp.Proportional+lp.Fixed;
+}
+
 
 void FeaturePainter::drawLabel(Node* Pt, QPainter* thePainter, MapRenderer* theRenderer) const
 {
@@ -692,19 +741,10 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
 
     QPainterPath tranformedRoadPath = theRenderer->theTransform.map(R->getPath());
     QFont font = getLabelFont();
-//#if QT_VERSION >= 0x040700 || defined(FORCE_46)
-//    qreal pathSurface = tranformedRoadPath.controlPointRect().width() * tranformedRoadPath.controlPointRect().height();
-//    if (pathSurface > theRenderer->theScreen.width() * theRenderer->theScreen.height() * 3) {
-//        QPainterPath clipPath;
-//        clipPath.addRect(theRenderer->theScreen.adjusted(-500, -500, 500, 500));
-
-//        tranformedRoadPath = clipPath.intersected(tranformedRoadPath);
-//    }
-//#endif
 
     if (!str.isEmpty()) {
         font.setPixelSize(int(WW));
-        QFontMetricsF metrics(font);
+        const QFontMetricsF& metrics = LabelPlacer::metrics(font);
         qreal strWidth = metrics.width(str);
 
         if ((font.pixelSize() >= 5 || TEST_RFLAGS(RendererOptions::PrintAllLabels)) && tranformedRoadPath.length() > strWidth) {
@@ -715,40 +755,68 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
             qreal lenSegment = tranformedRoadPath.length() / numSegment;
             qreal startSegment = 0;
             QPainterPath textPath;
+            // Labels are spread over the whole way, so that they land at the same place in every tile,
+            // but only the glyphs that can show get laid out
+            QRectF glyphClip = QRectF(QPointF(0, 0), theRenderer->theScreen.size()).adjusted(-2*WW, -2*WW, 2*WW, 2*WW);
+            qreal modY = (metrics.height()/2)-metrics.descent();
+            QVarLengthArray<QMatrix, 64> glyphs;
+            QVarLengthArray<int, 64> glyphIndex;
+            QVarLengthArray<QRectF, 64> glyphBoxes;
             do {
+                LabelPlacer::Decision d = theRenderer->theLabels.next();
+                if (d == LabelPlacer::Dropped) {
+                    startSegment += lenSegment;
+                    continue;
+                }
+                // The tile that decides a shared label needs all of it, the others only what they show
+                bool wholeLabel = d == LabelPlacer::Undecided && theRenderer->theSharedLabels;
                 qreal curLen = startSegment + ((lenSegment - strWidth) / 2);
                 int modIncrement = 1;
                 qreal modAngle = 0;
-                qreal modY = 0;
                 if (cos(angToRad(tranformedRoadPath.angleAtPercent((startSegment+(lenSegment/2))/tranformedRoadPath.length()))) < 0) {
                     modIncrement = -1;
                     modAngle = 180.0;
                     curLen += strWidth;
                 }
+                glyphs.clear();
+                glyphIndex.clear();
+                glyphBoxes.clear();
                 for (int i = 0; i < str.length(); ++i) {
                     qreal t = tranformedRoadPath.percentAtLength(curLen);
                     QPointF pt = tranformedRoadPath.pointAtPercent(t);
+                    qreal incremenet = metrics.width(str[i]);
 
-//                    if (!theRenderer->theScreen.contains(pt.toPoint()))
-//                        continue;
+                    bool visible = glyphClip.contains(pt);
+                    if (!visible && !wholeLabel) {
+                        curLen += (incremenet * modIncrement);
+                        continue;
+                    }
 
                     qreal angle = tranformedRoadPath.angleAtPercent(t);
 //                    modY = (metrics.ascent()/2)-3;
-                    modY = (metrics.height()/2)-metrics.descent();
 
                     QMatrix m;
                     m.translate(pt.x(), pt.y());
                     m.rotate(-angle+modAngle);
 
-                    QPainterPath charPath;
-                    charPath.addText(0, modY, font, str.mid(i, 1));
-                    charPath = charPath * m;
-
-                    textPath.addPath(charPath);
+                    // Glyphs sit centered on the path: whatever their angle, they fit a square around their middle
+                    qreal side = qMax(incremenet, metrics.height());
+                    QPointF mid = m.map(QPointF(incremenet/2, 0));
+                    if (visible) {
+                        glyphs.append(m);
+                        glyphIndex.append(i);
+                    }
+                    glyphBoxes.append(QRectF(mid.x() - side/2, mid.y() - side/2, side, side));
 
-                    qreal incremenet = metrics.width(str[i]);
                     curLen += (incremenet * modIncrement);
                 }
+                bool placed = d == LabelPlacer::Placed;
+                if (d == LabelPlacer::Undecided && glyphBoxes.size())
+                    placed = theRenderer->theLabels.place(glyphBoxes.constData(), glyphBoxes.size());
+                if (placed) {
+                    for (int k=0; k<glyphs.size(); ++k)
+                        textPath.addPath(LabelPlacer::text(font, str.mid(glyphIndex[k], 1)).translated(0, modY) * glyphs[k]);
+                }
                 startSegment += lenSegment;
             } while (--repeat >= 0);
 
@@ -762,9 +830,13 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
         }
     }
     if (DrawLabelBackground && !strBg.isEmpty()) {
-        QRegion rg = thePainter->clipRegion();
+        // Shared labels are kept apart by the placer alone: the clip region differs from tile to tile
+        bool clip = !theRenderer->theSharedLabels;
+        QRegion rg;
+        if (clip)
+            rg = thePainter->clipRegion();
         font.setPixelSize(int(WW));
-        QFontMetrics metrics(font);
+        const QFontMetricsF& metrics = LabelPlacer::metrics(font);
         qreal strWidth = metrics.width(strBg);
 
         int repeat = int((tranformedRoadPath.length() / (strWidth * LABEL_STRAIGHT_DISTANCE)) - 0.5);
@@ -783,11 +855,19 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
             //modX = WW;
             modY = (metrics.ascent()/2);
 
-            QPainterPath textPath, bgPath;
-            textPath.addText(modX, modY, font, strBg);
-            bgPath.addRect(textPath.boundingRect().adjusted(-BG_SPACING, -BG_SPACING, BG_SPACING, BG_SPACING));
+            QRectF box = QRectF(modX, modY - metrics.ascent(), strWidth, metrics.height()).translated(pt);
+            box.adjust(-BG_SPACING-BG_PEN_SZ, -BG_SPACING-BG_PEN_SZ, BG_SPACING+BG_PEN_SZ, BG_SPACING+BG_PEN_SZ);
+
+            LabelPlacer::Decision d = theRenderer->theLabels.next();
+            bool placed = d == LabelPlacer::Placed;
+            if (d == LabelPlacer::Undecided && (!clip || rg.contains(box.toRect())))
+                placed = theRenderer->theLabels.place(box);
+            if (placed) {
+                QPainterPath textPath, bgPath;
+                textPath.addPath(LabelPlacer::text(font, strBg).translated(modX, modY));
+                bgPath.addRect(textPath.boundingRect().adjusted(-BG_SPACING, -BG_SPACING, BG_SPACING, BG_SPACING));
 
-            if (rg.contains(bgPath.boundingRect().toRect().translated(pt.toPoint()))) {
+                thePainter->save();
                 thePainter->translate(pt);
 
                 thePainter->setPen(QPen(LabelColor, BG_PEN_SZ));
@@ -801,13 +881,16 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
                 thePainter->setPen(Qt::NoPen);
                 thePainter->setBrush(LabelColor);
                 thePainter->drawPath(textPath);
+                thePainter->restore();
 
-                rg -= bgPath.boundingRect().toRect().translated(pt.toPoint());
+                if (clip)
+                    rg -= bgPath.boundingRect().toRect().translated(pt.toPoint());
             }
 
             startSegment += lenSegment;
         } while (--repeat >= 0);
 
-        thePainter->setClipRegion(rg);
+        if (clip)
+            thePainter->setClipRegion(rg);
     }
 }
@@ -4,6 +4,7 @@
 #include <QtCore/QString>
 #include <QtGui/QColor>
 #include <QFont>
+#include <QPen>
 
 #include <QList>
 #include <QPair>
@@ -52,6 +53,12 @@ public:
     virtual void drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRender) const;
     virtual void drawPointLabel(QPointF C, QString str, QString strBG, QPainter* thePainter, MapRenderer* theRender) const;
     virtual void drawLabel(Node* Pt, QPainter* thePainter, MapRenderer* theRender) const;
+    /// Pixel size of the labels of F; bigger labels get their place first
+    qreal labelPriority(Feature* F, MapRenderer* theRender) const;
+    /// Pen the background of R is drawn with, when it is nothing but a stroke (NoPen if there's nothing to draw)
+    bool backgroundPen(Way* R, MapRenderer* theRender, QPen& thePen) const;
+    /// Pen the foreground of R is drawn with (NoPen if there's nothing to draw)
+    bool foregroundPen(Way* R, MapRenderer* theRender, QPen& thePen) const;
 
 public:
     TagSelector* theTagSelector;
@@ -1061,6 +1061,9 @@ M_PARAM_IMPLEMENT_DOUBLE(MaxDistNodes, data, 0.0);
 
 M_PARAM_IMPLEMENT_BOOL(AutoSaveDoc, data, false);
 M_PARAM_IMPLEMENT_BOOL(AutoExtractTracks, data, false);
+M_PARAM_IMPLEMENT_BOOL(UseDiskBackend, data, false);
+M_PARAM_IMPLEMENT_INT(DiskBackendWorkingSet, data, 500000);
+M_PARAM_IMPLEMENT_BOOL(ColumnarNodeStore, data, false);
 
 M_PARAM_IMPLEMENT_INT(DirectionalArrowsVisible, visual, 1);
 
@@ -1220,6 +1223,7 @@ M_PARAM_IMPLEMENT_STRING(CustomStyle, style, "")
 M_PARAM_IMPLEMENT_BOOL(DisableStyleForTracks, style, true)
 M_PARAM_IMPLEMENT_STRINGLIST(TechnicalTags, style, TECHNICAL_TAGS)
 M_PARAM_IMPLEMENT_INT(EditRendering, style, 0)
+M_PARAM_IMPLEMENT_INT(RenderCacheSize, style, 64)
 
 /* Zoom */
 M_PARAM_IMPLEMENT_INT(ZoomIn, zoom, 133)
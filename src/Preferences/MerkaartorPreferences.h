@@ -258,6 +258,9 @@ public:
 
     M_PARAM_DECLARE_BOOL(AutoSaveDoc)
     M_PARAM_DECLARE_BOOL(AutoExtractTracks)
+    M_PARAM_DECLARE_BOOL(UseDiskBackend)
+    M_PARAM_DECLARE_INT(DiskBackendWorkingSet)
+    M_PARAM_DECLARE_BOOL(ColumnarNodeStore)
 
     /* Export Type */
     void setExportType(ExportType theValue);
@@ -290,6 +293,7 @@ public:
     M_PARAM_DECLARE_BOOL(DisableStyleForTracks)
     M_PARAM_DECLARE_STRINGList(TechnicalTags)
     M_PARAM_DECLARE_INT(EditRendering)
+    M_PARAM_DECLARE_INT(RenderCacheSize)
 
     /* Visual */
     M_PARAM_DECLARE_INT(ZoomIn)
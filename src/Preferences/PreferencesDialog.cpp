@@ -264,6 +264,7 @@ void PreferencesDialog::loadPrefs()
     rbQuickEdit->setChecked(M_PREFS->getEditRendering() == 0);
     rbWireframeEdit->setChecked(M_PREFS->getEditRendering() == 1);
     rbFullEdit->setChecked(M_PREFS->getEditRendering() == 2);
+    sbRenderCacheSize->setValue(M_PREFS->getRenderCacheSize());
 
     cbDisableStyleForTracks->setChecked(M_PREFS->getDisableStyleForTracks());
 
@@ -314,6 +315,15 @@ void PreferencesDialog::loadPrefs()
     edAutoLoadDoc->setEnabled(cbAutoLoadDoc->isChecked());
     cbAutoSaveDoc->setChecked(M_PREFS->getAutoSaveDoc());
     cbAutoExtractTracks->setChecked(M_PREFS->getAutoExtractTracks());
+    cbColumnarNodeStore->setChecked(M_PREFS->getColumnarNodeStore());
+#ifdef USE_SPATIALITE
+    cbDiskBackend->setChecked(M_PREFS->getUseDiskBackend());
+    sbDiskBackendWorkingSet->setValue(M_PREFS->getDiskBackendWorkingSet());
+#else
+    cbDiskBackend->setVisible(false);
+    lblDiskBackendWorkingSet->setVisible(false);
+    sbDiskBackendWorkingSet->setVisible(false);
+#endif
     cbReadonlyTracksDefault->setChecked(M_PREFS->getReadonlyTracksDefault());
     cbGdalConfirmProjection->setChecked(M_PREFS->getGdalConfirmProjection());
 
@@ -417,6 +427,7 @@ void PreferencesDialog::savePrefs()
         M_PREFS->setEditRendering(1);
     else
         M_PREFS->setEditRendering(2);
+    M_PREFS->setRenderCacheSize(sbRenderCacheSize->value());
 
     bool PainterToInvalidate = false;
     if (cbDisableStyleForTracks->isChecked() != M_PREFS->getDisableStyleForTracks()) {
@@ -474,6 +485,11 @@ void PreferencesDialog::savePrefs()
     M_PREFS->setAutoLoadDocumentFilename((edAutoLoadDoc->text()));
     M_PREFS->setAutoSaveDoc(cbAutoSaveDoc->isChecked());
     M_PREFS->setAutoExtractTracks(cbAutoExtractTracks->isChecked());
+    M_PREFS->setColumnarNodeStore(cbColumnarNodeStore->isChecked());
+#ifdef USE_SPATIALITE
+    M_PREFS->setUseDiskBackend(cbDiskBackend->isChecked());
+    M_PREFS->setDiskBackendWorkingSet(sbDiskBackendWorkingSet->value());
+#endif
     M_PREFS->setReadonlyTracksDefault(cbReadonlyTracksDefault->isChecked());
     M_PREFS->setGdalConfirmProjection(cbGdalConfirmProjection->isChecked());
 
@@ -0,0 +1,256 @@
+#include "LabelPlacer.h"
+
+#include <QCache>
+#include <QHash>
+#include <QThreadStorage>
+#include <QVarLengthArray>
+
+#include <math.h>
+
+// Side of a grid cell, in pixels
+#define LABEL_CELL 64
+// Outlines kept per thread, in path elements
+#define LABEL_TEXT_CACHE 200000
+
+LabelPlacer::LabelPlacer()
+    : Cols(0), Rows(0), Shared(0), Owner(0), Index(-1)
+{
+}
+
+void LabelPlacer::reset(const QRectF& anArea)
+{
+    Area = anArea.normalized();
+    Cols = qMax(1, int(ceil(Area.width() / LABEL_CELL)));
+    Rows = qMax(1, int(ceil(Area.height() / LABEL_CELL)));
+    Cells.clear();
+    Cells.resize(Cols * Rows);
+    Shared = 0;
+    Owner = 0;
+    Index = -1;
+}
+
+void LabelPlacer::share(SharedLabelPlacer* aShared, const QPointF& anOffset)
+{
+    Shared = aShared;
+    Offset = anOffset;
+}
+
+void LabelPlacer::startFeature(Feature* F)
+{
+    Owner = F;
+    Index = -1;
+}
+
+LabelPlacer::Decision LabelPlacer::next()
+{
+    ++Index;
+    if (!Shared)
+        return Undecided;
+    return Shared->decision(Owner, Index);
+}
+
+bool LabelPlacer::cells(const QRectF& box, int& x1, int& y1, int& x2, int& y2) const
+{
+    if (!Cols || box.right() < Area.left() || box.left() > Area.right()
+            || box.bottom() < Area.top() || box.top() > Area.bottom())
+        return false;
+    x1 = qBound(0, int((box.left() - Area.left()) / LABEL_CELL), Cols-1);
+    x2 = qBound(0, int((box.right() - Area.left()) / LABEL_CELL), Cols-1);
+    y1 = qBound(0, int((box.top() - Area.top()) / LABEL_CELL), Rows-1);
+    y2 = qBound(0, int((box.bottom() - Area.top()) / LABEL_CELL), Rows-1);
+    return true;
+}
+
+bool LabelPlacer::place(const QRectF* boxes, int n)
+{
+    if (Shared) {
+        QVarLengthArray<QRectF, 64> moved(n);
+        for (int i=0; i<n; ++i)
+            moved[i] = boxes[i].translated(Offset);
+        return Shared->place(Owner, Index, moved.constData(), n);
+    }
+
+    int x1, y1, x2, y2;
+    for (int i=0; i<n; ++i) {
+        if (!cells(boxes[i], x1, y1, x2, y2))
+            continue;
+        for (int y=y1; y<=y2; ++y)
+            for (int x=x1; x<=x2; ++x) {
+                const QVector<QRectF>& cell = Cells[y*Cols + x];
+                for (int k=0; k<cell.size(); ++k)
+                    if (cell[k].intersects(boxes[i]))
+                        return false;
+            }
+    }
+    for (int i=0; i<n; ++i) {
+        if (!cells(boxes[i], x1, y1, x2, y2))
+            continue;
+        for (int y=y1; y<=y2; ++y)
+            for (int x=x1; x<=x2; ++x)
+                Cells[y*Cols + x].append(boxes[i]);
+    }
+    return true;
+}
+
+bool LabelPlacer::place(const QRectF& box)
+{
+    return place(&box, 1);
+}
+
+static inline quint64 cellKey(int x, int y)
+{
+    return ((quint64)(quint32)x << 32) | (quint32)y;
+}
+
+static inline void cellRange(const QRectF& box, int& x1, int& y1, int& x2, int& y2)
+{
+    x1 = int(floor(box.left() / LABEL_CELL));
+    x2 = int(floor(box.right() / LABEL_CELL));
+    y1 = int(floor(box.top() / LABEL_CELL));
+    y2 = int(floor(box.bottom() / LABEL_CELL));
+}
+
+LabelPlacer::Decision SharedLabelPlacer::decision(Feature* F, int index)
+{
+    QMutexLocker lock(&Lock);
+    QHash<Key, Label>::const_iterator it = Labels.constFind(Key(F, index));
+    if (it == Labels.constEnd())
+        return LabelPlacer::Undecided;
+    return it->Placed ? LabelPlacer::Placed : LabelPlacer::Dropped;
+}
+
+bool SharedLabelPlacer::place(Feature* F, int index, const QRectF* boxes, int n)
+{
+    Key k(F, index);
+    QMutexLocker lock(&Lock);
+    // Another tile may have got there in between
+    QHash<Key, Label>::const_iterator it = Labels.constFind(k);
+    if (it != Labels.constEnd())
+        return it->Placed;
+
+    Label l;
+    l.Placed = true;
+    for (int i=0; i<n; ++i)
+        l.Bound |= boxes[i];
+    int x1, y1, x2, y2;
+    for (int i=0; i<n && l.Placed; ++i) {
+        cellRange(boxes[i], x1, y1, x2, y2);
+        for (int y=y1; y<=y2 && l.Placed; ++y)
+            for (int x=x1; x<=x2 && l.Placed; ++x) {
+                QHash<quint64, QList<Key> >::const_iterator c = Cells.constFind(cellKey(x, y));
+                if (c == Cells.constEnd())
+                    continue;
+                foreach (const Key& other, *c) {
+                    const QVector<QRectF>& otherBoxes = Labels.constFind(other)->Boxes;
+                    for (int j=0; j<otherBoxes.size(); ++j)
+                        if (otherBoxes[j].intersects(boxes[i])) {
+                            l.Placed = false;
+                            break;
+                        }
+                    if (!l.Placed)
+                        break;
+                }
+            }
+    }
+
+    if (l.Placed) {
+        for (int i=0; i<n; ++i) {
+            l.Boxes.append(boxes[i]);
+            cellRange(boxes[i], x1, y1, x2, y2);
+            for (int y=y1; y<=y2; ++y)
+                for (int x=x1; x<=x2; ++x) {
+                    QList<Key>& cell = Cells[cellKey(x, y)];
+                    if (cell.isEmpty() || cell.last() != k)
+                        cell.append(k);
+                }
+        }
+    }
+    Labels.insert(k, l);
+    return l.Placed;
+}
+
+QList<QRectF> SharedLabelPlacer::forget(const QRectF& anArea)
+{
+    QMutexLocker lock(&Lock);
+    QList<QRectF> taken;
+    QHash<Key, Label>::iterator it = Labels.begin();
+    while (it != Labels.end()) {
+        if (!it->Bound.intersects(anArea)) {
+            ++it;
+            continue;
+        }
+        taken << it->Bound;
+        int x1, y1, x2, y2;
+        for (int i=0; i<it->Boxes.size(); ++i) {
+            cellRange(it->Boxes[i], x1, y1, x2, y2);
+            for (int y=y1; y<=y2; ++y)
+                for (int x=x1; x<=x2; ++x) {
+                    QHash<quint64, QList<Key> >::iterator c = Cells.find(cellKey(x, y));
+                    if (c == Cells.end())
+                        continue;
+                    c->removeAll(it.key());
+                    if (c->isEmpty())
+                        Cells.erase(c);
+                }
+        }
+        it = Labels.erase(it);
+    }
+    return taken;
+}
+
+void SharedLabelPlacer::clear()
+{
+    QMutexLocker lock(&Lock);
+    Labels.clear();
+    Cells.clear();
+}
+
+int SharedLabelPlacer::size() const
+{
+    return Labels.size();
+}
+
+struct TextCache
+{
+    TextCache() : Outlines(LABEL_TEXT_CACHE) {}
+    ~TextCache() { qDeleteAll(Metrics); }
+
+    QHash<QString, QFontMetricsF*> Metrics;
+    QCache<QString, QPainterPath> Outlines;
+};
+
+// Tile workers render in parallel: each thread keeps its own cache rather than locking a shared one
+static QThreadStorage<TextCache*> textCache;
+
+static TextCache* localCache()
+{
+    if (!textCache.hasLocalData())
+        textCache.setLocalData(new TextCache);
+    return textCache.localData();
+}
+
+const QFontMetricsF& LabelPlacer::metrics(const QFont& aFont)
+{
+    TextCache* c = localCache();
+    QString key = aFont.key();
+    QFontMetricsF* m = c->Metrics.value(key);
+    if (!m) {
+        m = new QFontMetricsF(aFont);
+        c->Metrics.insert(key, m);
+    }
+    return *m;
+}
+
+QPainterPath LabelPlacer::text(const QFont& aFont, const QString& str)
+{
+    TextCache* c = localCache();
+    QString key = aFont.key() + QChar('\n') + str;
+    if (QPainterPath* pth = c->Outlines.object(key))
+        return *pth;
+
+    QPainterPath* pth = new QPainterPath;
+    pth->addText(0, 0, aFont, str);
+    QPainterPath result(*pth);
+    c->Outlines.insert(key, pth, qMax(1, pth->elementCount()));
+    return result;
+}
@@ -0,0 +1,100 @@
+//
+// C++ Interface: LabelPlacer
+//
+// Description: Keeps labels from overlapping, and caches what it takes to lay them out
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef LABELPLACER_H
+#define LABELPLACER_H
+
+#include <QFont>
+#include <QFontMetricsF>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPainterPath>
+#include <QPair>
+#include <QRectF>
+#include <QVector>
+
+class Feature;
+class SharedLabelPlacer;
+
+/// Screen space taken by the labels drawn so far.
+/// Labels are offered in decreasing priority; a label whose boxes overlap one already placed is dropped.
+/// Boxes are binned in a grid of fixed cells, so that a label is only checked against its neighbours.
+class LabelPlacer
+{
+public:
+    enum Decision { Undecided, Placed, Dropped };
+
+    LabelPlacer();
+
+    /// Forget all labels, and set the area they are placed over
+    void reset(const QRectF& anArea);
+    /// Place the labels in aShared instead, which sees them moved by anOffset
+    void share(SharedLabelPlacer* aShared, const QPointF& anOffset);
+    /// The labels offered from now on are those of F
+    void startFeature(Feature* F);
+    /// Moves on to the next label of the current feature.
+    /// Undecided unless another renderer sharing the placement already placed or dropped it.
+    Decision next();
+    /// Take the space of the current label, made of n boxes, unless one of them overlaps a placed label
+    bool place(const QRectF* boxes, int n);
+    bool place(const QRectF& box);
+
+    /// Metrics of aFont, shared by the renderers of this thread
+    static const QFontMetricsF& metrics(const QFont& aFont);
+    /// Outline of str in aFont with its baseline starting at the origin, shared by the renderers of this thread
+    static QPainterPath text(const QFont& aFont, const QString& str);
+
+private:
+    bool cells(const QRectF& box, int& x1, int& y1, int& x2, int& y2) const;
+
+    QRectF Area;
+    int Cols, Rows;
+    QVector<QVector<QRectF> > Cells;
+
+    SharedLabelPlacer* Shared;
+    QPointF Offset;
+    Feature* Owner;
+    int Index;
+};
+
+/// Labels of the tiles rendered at one scale, in pixels from the projection origin.
+/// Tiles are rendered apart, and each one only sees part of the labels around its edges. So the
+/// first tile to reach a label decides whether it is placed, and the tiles that reach it later
+/// draw it the same way, whatever they would have decided themselves.
+/// Tiles may be rendered in parallel; only forget() and clear() must wait for them.
+class SharedLabelPlacer
+{
+public:
+    /// The decision taken on label index of F, if any
+    LabelPlacer::Decision decision(Feature* F, int index);
+    /// Decides label index of F, made of n boxes, unless a tile already did
+    bool place(Feature* F, int index, const QRectF* boxes, int n);
+
+    /// Forget the labels that touch anArea; returns the area they took
+    QList<QRectF> forget(const QRectF& anArea);
+    void clear();
+    int size() const;
+
+private:
+    typedef QPair<Feature*, int> Key;
+    struct Label
+    {
+        QVector<QRectF> Boxes;
+        QRectF Bound;
+        bool Placed;
+    };
+
+    QMutex Lock;
+    QHash<Key, Label> Labels;
+    // Placed labels, per grid cell
+    QHash<quint64, QList<Key> > Cells;
+};
+
+#endif // LABELPLACER_H
@@ -17,10 +17,84 @@
 #include "MasPaintStyle.h"
 #include "ImageMapLayer.h"
 #include "LineF.h"
+#include "PathClipper.h"
 
 #define TEST_RFLAGS(x) theOptions.options.testFlag(x)
 #define TEST_RENDERER_RFLAGS(x) r->theOptions.options.testFlag(x)
 
+// Pixels beyond the screen clipped paths keep, on top of their stroke width, for caps and joins
+#define CLIP_MARGIN 4
+
+typedef QPair<qreal, Feature*> LabelCandidate;
+
+static bool labelBefore(const LabelCandidate& a, const LabelCandidate& b)
+{
+    return a.first > b.first;
+}
+
+/// Ways that are nothing but a stroke, merged per pen and opacity until they get drawn.
+/// Linear ways of one layer may be drawn in any order, but what can't be batched flushes the
+/// batch first, so that the drawing order only changes among batched ways.
+class StrokeBatch
+{
+public:
+    StrokeBatch(MapRenderer* ar, bool aForeground)
+        : r(ar), Foreground(aForeground) {}
+
+    bool add(Way* R, qreal alpha)
+    {
+        const FeaturePainter* paintsel = R->getPainter(r->thePixelPerM);
+        if (!paintsel)
+            return false;
+        QPen thePen;
+        if (!(Foreground ? paintsel->foregroundPen(R, r, thePen) : paintsel->backgroundPen(R, r, thePen)))
+            return false;
+        if (thePen.style() == Qt::NoPen)
+            return true;
+
+        int i = 0;
+        for (; i<Strokes.size(); ++i)
+            if (Strokes[i].Alpha == alpha && Strokes[i].Pen == thePen)
+                break;
+        if (i == Strokes.size()) {
+            Stroke s;
+            s.Pen = thePen;
+            s.Alpha = alpha;
+            Strokes << s;
+        }
+        Strokes[i].Path.addPath(r->strokePath(R, thePen));
+        return true;
+    }
+
+    void flush()
+    {
+        for (int i=0; i<Strokes.size(); ++i) {
+            const Stroke& s = Strokes[i];
+            if (s.Alpha != 1.) {
+                r->thePainter->save();
+                r->thePainter->setOpacity(s.Alpha);
+            }
+            r->thePainter->setPen(s.Pen);
+            r->thePainter->setBrush(Qt::NoBrush);
+            r->thePainter->drawPath(r->theTransform.map(s.Path));
+            if (s.Alpha != 1.)
+                r->thePainter->restore();
+        }
+        Strokes.clear();
+    }
+
+private:
+    struct Stroke {
+        QPen Pen;
+        qreal Alpha;
+        QPainterPath Path;
+    };
+
+    MapRenderer* r;
+    bool Foreground;
+    QList<Stroke> Strokes;
+};
+
 void BackgroundStyleLayer::draw(Way* R)
 {
     const FeaturePainter* paintsel = R->getPainter(r->thePixelPerM);
@@ -44,7 +118,8 @@ void BackgroundStyleLayer::draw(Way* R)
         }
 
         r->thePainter->setPen(thePen);
-        r->thePainter->drawPath(r->theTransform.map(R->getPath()));
+        bool filled = r->thePainter->brush().style() != Qt::NoBrush;
+        r->thePainter->drawPath(r->theTransform.map(r->clipped(R->getPath(r->theLodTolerance), 1, filled)));
     }
 }
 
@@ -204,6 +279,7 @@ void LabelStyleLayer::draw(Node* Pt)
 /*** MapRenderer ***/
 
 MapRenderer::MapRenderer()
+    : theLodTolerance(0), SimplifyPaths(true), thePixelPerUnit(0), theSharedLabels(0), BatchStrokes(true)
 {
     bglayer = BackgroundStyleLayer(this);
     fglayer = ForegroundStyleLayer(this);
@@ -350,10 +426,35 @@ QPoint MapRenderer::toView(Node* aPt) const
     return theTransform.map(aPt->projected()).toPoint();
 }
 
+QPainterPath MapRenderer::clipped(const QPainterPath& aPath, qreal aMargin, bool asPolygon) const
+{
+    if (thePixelPerUnit <= 0)
+        return aPath;
+    qreal m = (aMargin + CLIP_MARGIN) / thePixelPerUnit;
+    QRectF R = theClipRect.adjusted(-m, -m, m, m);
+    return asPolygon ? PathClipper::clipPolygon(aPath, R) : PathClipper::clipPolyline(aPath, R);
+}
+
+QPainterPath MapRenderer::strokePath(Way* R, const QPen& thePen) const
+{
+    // Dashes restart where a clipped path does, which would differ from tile to tile
+    if (thePen.style() != Qt::SolidLine)
+        return R->getPath(theLodTolerance);
+    return clipped(R->getPath(theLodTolerance), thePen.widthF(), false);
+}
+
+qreal MapRenderer::lodTolerance(qreal pixelsPerUnit)
+{
+    // Half a pixel: about one vertex per pixel, and no visible change from the full path
+    if (pixelsPerUnit <= 0)
+        return 0;
+    return 0.5 / pixelsPerUnit;
+}
+
 
 void MapRenderer::render(
         QPainter* P,
-        const QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+        const RenderQueue& theFeatures,
         const QRectF& pViewport,
         const QRect& screen,
         const qreal pixelPerM,
@@ -386,6 +487,10 @@ void MapRenderer::render(
     theTransform.scale(ScaleLon, -ScaleLat);
     theTransform.translate(-pViewport.topLeft().x(), -pViewport.topLeft().y());
 //    qDebug() << "render transform: " << theTransform;
+    thePixelPerUnit = qMin(ScaleLon, ScaleLat);
+    theLodTolerance = SimplifyPaths ? lodTolerance(thePixelPerUnit) : 0;
+    // The transform maps the viewport to (0, 0), the painter takes care of the screen offset
+    theClipRect = theTransform.inverted().mapRect(QRectF(QPointF(0, 0), screen.size()));
 
     theOptions = options;
     theGlobalPainter = M_STYLE->getGlobalPainter();
@@ -402,134 +507,145 @@ void MapRenderer::render(
     bool tchpLayerVisible = TEST_RFLAGS(RendererOptions::TouchupVisible);
     bool lblLayerVisible = TEST_RFLAGS(RendererOptions::NamesVisible);
 
-    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
-    QMap<RenderPriority, QSet<Feature*> >::const_iterator itmCur;
-    QSet<Feature*>::const_iterator it;
+    int n = theFeatures.size();
 
     thePainter = P;
     thePainter->save();
     thePainter->translate(screen.left(), screen.top());
 
-    itm = theFeatures.constBegin();
-    while (itm != theFeatures.constEnd())
+    for (int first=0, last; first < n; first = last)
     {
-        int curLayer = (itm.key()).layer();
-        itmCur = itm;
-        while (itm != theFeatures.constEnd() && (itm.key()).layer() == curLayer)
+        last = theFeatures.layerEnd(first);
+        StrokeBatch bgStrokes(this, false);
+        StrokeBatch fgStrokes(this, true);
+        if (bgLayerVisible)
         {
-            if (bgLayerVisible)
-            {
-                for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                    qreal alpha = (*it)->getAlpha();
-                    if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                        alpha /= 2.0;
-                    if (alpha != 1.) {
-                        P->save();
-                        P->setOpacity(alpha);
-                    }
-
-                    if (CHECK_WAY(*it)) {
-                        Way * R = STATIC_CAST_WAY(*it);
-                        for (int i=0; i<R->sizeParents(); ++i)
-                            if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
-                                continue;
-                        bglayer.draw(R);
-                    } else if (CHECK_NODE(*it))
-                        bglayer.draw(STATIC_CAST_NODE(*it));
-                    else if (CHECK_RELATION(*it))
-                        bglayer.draw(STATIC_CAST_RELATION(*it));
-                    if (alpha != 1.) {
-                        P->restore();
-                    }
+            for (int k=first; k<last; ++k) {
+                Feature* F = theFeatures.feature(k);
+                qreal alpha = F->getAlpha();
+                if (F->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
+                    alpha /= 2.0;
+                if (BatchStrokes && CHECK_WAY(F) && bgStrokes.add(STATIC_CAST_WAY(F), alpha))
+                    continue;
+                bgStrokes.flush();
+                if (alpha != 1.) {
+                    P->save();
+                    P->setOpacity(alpha);
                 }
-            }
-            ++itm;
-        }
-        itm = itmCur;
-        while (itm != theFeatures.constEnd() && (itm.key()).layer() == curLayer)
-        {
-            if (fgLayerVisible)
-            {
-                for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                    qreal alpha = (*it)->getAlpha();
-                    if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                        alpha /= 2.0;
-                    if (alpha != 1.) {
-                        P->save();
-                        P->setOpacity(alpha);
-                    }
 
-                    if (CHECK_WAY(*it)) {
-                        Way * R = STATIC_CAST_WAY(*it);
-                        for (int i=0; i<R->sizeParents(); ++i)
-                            if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
-                                continue;
-                        fglayer.draw(R);
-                    } else if (CHECK_NODE(*it))
-                        fglayer.draw(STATIC_CAST_NODE(*it));
-                    else if (CHECK_RELATION(*it))
-                        fglayer.draw(STATIC_CAST_RELATION(*it));
-                    if (alpha != 1.) {
-                        P->restore();
-                    }
+                if (CHECK_WAY(F)) {
+                    Way * R = STATIC_CAST_WAY(F);
+                    for (int i=0; i<R->sizeParents(); ++i)
+                        if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
+                            continue;
+                    bglayer.draw(R);
+                } else if (CHECK_NODE(F))
+                    bglayer.draw(STATIC_CAST_NODE(F));
+                else if (CHECK_RELATION(F))
+                    bglayer.draw(STATIC_CAST_RELATION(F));
+                if (alpha != 1.) {
+                    P->restore();
                 }
             }
-            ++itm;
+            bgStrokes.flush();
         }
-    }
-    if (tchpLayerVisible)
-    {
-        for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm) {
-            for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                qreal alpha = (*it)->getAlpha();
-                if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
+        if (fgLayerVisible)
+        {
+            for (int k=first; k<last; ++k) {
+                Feature* F = theFeatures.feature(k);
+                qreal alpha = F->getAlpha();
+                if (F->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
                     alpha /= 2.0;
+                if (BatchStrokes && CHECK_WAY(F) && fgStrokes.add(STATIC_CAST_WAY(F), alpha))
+                    continue;
+                fgStrokes.flush();
                 if (alpha != 1.) {
                     P->save();
                     P->setOpacity(alpha);
                 }
 
-                if (CHECK_WAY(*it)) {
-                    Way * R = STATIC_CAST_WAY(*it);
+                if (CHECK_WAY(F)) {
+                    Way * R = STATIC_CAST_WAY(F);
                     for (int i=0; i<R->sizeParents(); ++i)
                         if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
                             continue;
-                    tchuplayer.draw(R);
-                } else if (CHECK_NODE(*it))
-                    tchuplayer.draw(STATIC_CAST_NODE(*it));
-                else if (CHECK_RELATION(*it))
-                    tchuplayer.draw(STATIC_CAST_RELATION(*it));
+                    fglayer.draw(R);
+                } else if (CHECK_NODE(F))
+                    fglayer.draw(STATIC_CAST_NODE(F));
+                else if (CHECK_RELATION(F))
+                    fglayer.draw(STATIC_CAST_RELATION(F));
                 if (alpha != 1.) {
                     P->restore();
                 }
             }
+            fgStrokes.flush();
         }
     }
-
-    if (lblLayerVisible)
+    if (tchpLayerVisible)
     {
-        for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm) {
-            for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
+        for (int k=0; k<n; ++k) {
+            Feature* F = theFeatures.feature(k);
+            qreal alpha = F->getAlpha();
+            if (F->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
+                alpha /= 2.0;
+            if (alpha != 1.) {
                 P->save();
-                qreal alpha = (*it)->getAlpha();
-                if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                    alpha /= 2.0;
                 P->setOpacity(alpha);
+            }
 
-                if (CHECK_WAY(*it)) {
-                    Way * R = STATIC_CAST_WAY(*it);
-                    for (int i=0; i<R->sizeParents(); ++i)
-                        if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
-                            continue;
-                    lbllayer.draw(R);
-                } else if (CHECK_NODE(*it))
-                    lbllayer.draw(STATIC_CAST_NODE(*it));
-                else if (CHECK_RELATION(*it))
-                    lbllayer.draw(STATIC_CAST_RELATION(*it));
+            if (CHECK_WAY(F)) {
+                Way * R = STATIC_CAST_WAY(F);
+                for (int i=0; i<R->sizeParents(); ++i)
+                    if (!R->getParent(i)->isDeleted() && R->getParent(i)->hasPainter(thePixelPerM))
+                        continue;
+                tchuplayer.draw(R);
+            } else if (CHECK_NODE(F))
+                tchuplayer.draw(STATIC_CAST_NODE(F));
+            else if (CHECK_RELATION(F))
+                tchuplayer.draw(STATIC_CAST_RELATION(F));
+            if (alpha != 1.) {
                 P->restore();
             }
         }
     }
+
+    if (lblLayerVisible)
+    {
+        // Collect the labels first, then place them from the biggest down, so that crowded
+        // labels give way to the more important ones instead of piling up
+        QList<LabelCandidate> candidates;
+        for (int k=0; k<n; ++k) {
+            Feature* F = theFeatures.feature(k);
+            if (CHECK_RELATION(F))
+                continue;
+            const FeaturePainter* paintsel = F->getPainter(thePixelPerM);
+            if (!paintsel)
+                continue;
+            qreal priority = paintsel->labelPriority(F, this);
+            if (priority > 0)
+                candidates << LabelCandidate(priority, F);
+        }
+        qStableSort(candidates.begin(), candidates.end(), labelBefore);
+
+        theLabels.reset(QRectF(QPointF(0, 0), screen.size()));
+        // Shared labels are kept in pixels from the projection origin, the same for every tile
+        if (theSharedLabels)
+            theLabels.share(theSharedLabels, -theTransform.map(QPointF(0, 0)));
+        foreach (const LabelCandidate& c, candidates) {
+            theLabels.startFeature(c.second);
+            P->save();
+            qreal alpha = c.second->getAlpha();
+            if (c.second->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
+                alpha /= 2.0;
+            P->setOpacity(alpha);
+
+            if (CHECK_WAY(c.second))
+                lbllayer.draw(STATIC_CAST_WAY(c.second));
+            else
+                lbllayer.draw(STATIC_CAST_NODE(c.second));
+            P->restore();
+        }
+    }
     thePainter->restore();
 
 //    #ifndef NDEBUG
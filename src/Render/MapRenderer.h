@@ -13,6 +13,8 @@
 #define MAPRENDERER_H
 
 #include "FeaturePainter.h"
+#include "LabelPlacer.h"
+#include "RenderQueue.h"
 
 #include <QPainter>
 #include <QTransform>
@@ -89,7 +91,7 @@ public:
 
     void render(
             QPainter* P,
-            const QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+            const RenderQueue& theFeatures,
             const QRectF& pViewport,
             const QRect& screen,
             const qreal pixelPerM,
@@ -114,6 +116,26 @@ public:
 
     QPoint toView(Node *aPt) const;
 
+    /// Simplification tolerance, in projected units, at pixelsPerUnit screen pixels per projected unit
+    static qreal lodTolerance(qreal pixelsPerUnit);
+    /// Tolerance the background and foreground layers draw ways with, 0 to draw every vertex
+    qreal theLodTolerance;
+    bool SimplifyPaths;
+
+    /// Projected aPath trimmed to the screen plus aMargin pixels, to be filled if asPolygon, else stroked
+    QPainterPath clipped(const QPainterPath& aPath, qreal aMargin, bool asPolygon) const;
+    /// Projected path of R to stroke with thePen, simplified and clipped
+    QPainterPath strokePath(Way* R, const QPen& thePen) const;
+    /// The screen, in projected units
+    QRectF theClipRect;
+    qreal thePixelPerUnit;
+    /// Labels placed so far
+    LabelPlacer theLabels;
+    /// If set, labels are placed along with those of the neighbouring tiles
+    SharedLabelPlacer* theSharedLabels;
+    /// Stroke ways that share a pen and opacity as one path
+    bool BatchStrokes;
+
 protected:
     BackgroundStyleLayer bglayer;
     ForegroundStyleLayer fglayer;
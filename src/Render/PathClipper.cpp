@@ -0,0 +1,211 @@
+#include "PathClipper.h"
+
+#include <QVarLengthArray>
+
+typedef QVarLengthArray<QPointF, 256> PointArray;
+
+enum {
+    Inside = 0,
+    Left = 1,
+    Right = 2,
+    Top = 4,
+    Bottom = 8
+};
+
+static inline int outCode(const QPointF& P, const QRectF& R)
+{
+    int code = Inside;
+    if (P.x() < R.left())
+        code |= Left;
+    else if (P.x() > R.right())
+        code |= Right;
+    if (P.y() < R.top())
+        code |= Top;
+    else if (P.y() > R.bottom())
+        code |= Bottom;
+    return code;
+}
+
+// Point where AB crosses the line of edge
+static inline QPointF crossing(const QPointF& A, const QPointF& B, int edge, const QRectF& R)
+{
+    switch (edge) {
+    case Left:
+        return QPointF(R.left(), A.y() + (B.y() - A.y()) * (R.left() - A.x()) / (B.x() - A.x()));
+    case Right:
+        return QPointF(R.right(), A.y() + (B.y() - A.y()) * (R.right() - A.x()) / (B.x() - A.x()));
+    case Top:
+        return QPointF(A.x() + (B.x() - A.x()) * (R.top() - A.y()) / (B.y() - A.y()), R.top());
+    default:
+        return QPointF(A.x() + (B.x() - A.x()) * (R.bottom() - A.y()) / (B.y() - A.y()), R.bottom());
+    }
+}
+
+// Cohen-Sutherland: clips AB to R, returns false if nothing is left
+static bool clipSegment(QPointF& A, QPointF& B, const QRectF& R)
+{
+    int codeA = outCode(A, R);
+    int codeB = outCode(B, R);
+    for (;;) {
+        if (!(codeA | codeB))
+            return true;
+        if (codeA & codeB)
+            return false;
+
+        int code = codeA ? codeA : codeB;
+        int edge = (code & Left) ? Left : (code & Right) ? Right : (code & Top) ? Top : Bottom;
+        if (code == codeA) {
+            A = crossing(A, B, edge, R);
+            codeA = outCode(A, R);
+        } else {
+            B = crossing(A, B, edge, R);
+            codeB = outCode(B, R);
+        }
+    }
+}
+
+static inline bool insideEdge(const QPointF& P, int edge, const QRectF& R)
+{
+    switch (edge) {
+    case Left:
+        return P.x() >= R.left();
+    case Right:
+        return P.x() <= R.right();
+    case Top:
+        return P.y() >= R.top();
+    default:
+        return P.y() <= R.bottom();
+    }
+}
+
+// Sutherland-Hodgman: clips the polygon in against each edge of R in turn
+static void clipRing(PointArray& in, const QRectF& R)
+{
+    static const int edges[] = { Left, Right, Top, Bottom };
+    PointArray out;
+    for (int e=0; e<4 && in.size(); ++e) {
+        out.clear();
+        QPointF S = in[in.size()-1];
+        bool sIn = insideEdge(S, edges[e], R);
+        for (int i=0; i<in.size(); ++i) {
+            const QPointF& P = in[i];
+            bool pIn = insideEdge(P, edges[e], R);
+            if (pIn != sIn)
+                out.append(crossing(S, P, edges[e], R));
+            if (pIn)
+                out.append(P);
+            S = P;
+            sIn = pIn;
+        }
+        in = out;
+    }
+}
+
+// Unlike QRectF's, these hold for the flat boxes of horizontal or vertical paths
+static inline bool containsBox(const QRectF& R, const QRectF& B)
+{
+    return B.left() >= R.left() && B.right() <= R.right() && B.top() >= R.top() && B.bottom() <= R.bottom();
+}
+
+static inline bool overlapsBox(const QRectF& R, const QRectF& B)
+{
+    return B.left() <= R.right() && B.right() >= R.left() && B.top() <= R.bottom() && B.bottom() >= R.top();
+}
+
+// Splits aPath in its subpaths; false if it has curves, which aren't handled
+template <class Fn>
+static bool forEachSubpath(const QPainterPath& aPath, Fn& fn)
+{
+    PointArray pts;
+    for (int i=0; i<aPath.elementCount(); ++i) {
+        const QPainterPath::Element& e = aPath.elementAt(i);
+        if (e.isCurveTo())
+            return false;
+        if (e.isMoveTo() && pts.size()) {
+            fn(pts);
+            pts.clear();
+        }
+        pts.append(QPointF(e.x, e.y));
+    }
+    if (pts.size())
+        fn(pts);
+    return true;
+}
+
+struct PolylineClip
+{
+    PolylineClip(const QRectF& R) : Rect(R) {}
+
+    void operator()(PointArray& pts)
+    {
+        bool drawing = false;
+        QPointF last;
+        for (int i=1; i<pts.size(); ++i) {
+            QPointF A = pts[i-1];
+            QPointF B = pts[i];
+            if (!clipSegment(A, B, Rect)) {
+                drawing = false;
+                continue;
+            }
+            if (!drawing || A != last)
+                Result.moveTo(A);
+            Result.lineTo(B);
+            last = B;
+            drawing = (B == pts[i]);
+        }
+    }
+
+    QRectF Rect;
+    QPainterPath Result;
+};
+
+struct PolygonClip
+{
+    PolygonClip(const QRectF& R) : Rect(R) {}
+
+    void operator()(PointArray& pts)
+    {
+        // The ring closes on its first point, which must not count twice
+        if (pts.size() > 1 && pts[0] == pts[pts.size()-1])
+            pts.removeLast();
+        clipRing(pts, Rect);
+        if (pts.size() < 3)
+            return;
+        Result.moveTo(pts[0]);
+        for (int i=1; i<pts.size(); ++i)
+            Result.lineTo(pts[i]);
+        Result.lineTo(pts[0]);
+    }
+
+    QRectF Rect;
+    QPainterPath Result;
+};
+
+QPainterPath PathClipper::clipPolyline(const QPainterPath& aPath, const QRectF& aRect)
+{
+    QRectF bbox = aPath.controlPointRect();
+    if (containsBox(aRect, bbox))
+        return aPath;
+    if (!overlapsBox(aRect, bbox))
+        return QPainterPath();
+
+    PolylineClip fn(aRect);
+    if (!forEachSubpath(aPath, fn))
+        return aPath;
+    return fn.Result;
+}
+
+QPainterPath PathClipper::clipPolygon(const QPainterPath& aPath, const QRectF& aRect)
+{
+    QRectF bbox = aPath.controlPointRect();
+    if (containsBox(aRect, bbox))
+        return aPath;
+    if (!overlapsBox(aRect, bbox))
+        return QPainterPath();
+
+    PolygonClip fn(aRect);
+    if (!forEachSubpath(aPath, fn))
+        return aPath;
+    fn.Result.setFillRule(aPath.fillRule());
+    return fn.Result;
+}
@@ -0,0 +1,27 @@
+//
+// C++ Interface: PathClipper
+//
+// Description: Trims projected paths to a rectangle before they get transformed and drawn
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef PATHCLIPPER_H
+#define PATHCLIPPER_H
+
+#include <QPainterPath>
+#include <QRectF>
+
+class PathClipper
+{
+public:
+    /// Parts of the polylines of aPath inside aRect (Cohen-Sutherland), each as its own subpath.
+    /// For stroking only: the result doesn't enclose the same area.
+    static QPainterPath clipPolyline(const QPainterPath& aPath, const QRectF& aRect);
+    /// Polygons of aPath cut down to aRect (Sutherland-Hodgman), one subpath per input subpath.
+    /// Where a polygon leaves aRect, its outline runs along the edge of aRect.
+    static QPainterPath clipPolygon(const QPainterPath& aPath, const QRectF& aRect);
+};
+
+#endif // PATHCLIPPER_H
@@ -4,12 +4,16 @@ DEPENDPATH += $$MERKAARTOR_SRC_DIR/Render
 # Header files
 HEADERS += \
     FeaturePainter.h \
-    MapRenderer.h
+    MapRenderer.h \
+    LabelPlacer.h \
+    PathClipper.h
 
 # Source files
 SOURCES += \
     FeaturePainter.cpp \
-    MapRenderer.cpp
+    MapRenderer.cpp \
+    LabelPlacer.cpp \
+    PathClipper.cpp
 
 isEmpty(MOBILE) {
   QT += svg
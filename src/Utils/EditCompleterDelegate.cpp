@@ -65,7 +65,6 @@ QWidget* EditCompleterDelegate::createEditor(QWidget* parent, const QStyleOption
         QString k = index.model()->data(i).toString();
         if (k != "name") {
             QStringList sl = g_getTagValueList(k);
-            sl.sort();
             completer = new QCompleter(sl, (QObject *)this);
 
             QComboBox *cb = new QComboBox(parent);
@@ -73,7 +73,7 @@ void SelectionDialog::on_cbKey_editTextChanged(const QString & text)
 
     QStringList sl = g_getTagValueList(text);
     QCompleter* completer = new QCompleter(sl, (QObject *)this);
-    cbValue->insertItems(-1, g_getTagValueList(text));
+    cbValue->insertItems(-1, sl);
     cbValue->insertItem(-1, "_NULL_");
     completer->setCompletionMode(QCompleter::InlineCompletion);
     completer->setModelSorting(QCompleter::CaseInsensitivelySortedModel);
@@ -55,7 +55,7 @@ void TagSelectorWidget::on_cbKey_editTextChanged(const QString & text)
 
     QStringList sl = g_getTagValueList(text);
     QCompleter* completer = new QCompleter(sl, (QObject *)this);
-    ui->cbValue->insertItems(-1, g_getTagValueList(text));
+    ui->cbValue->insertItems(-1, sl);
     completer->setCompletionMode(QCompleter::InlineCompletion);
     completer->setModelSorting(QCompleter::CaseInsensitivelySortedModel);
     if (ui->cbValue->completer())
@@ -0,0 +1,466 @@
+#include "Global.h"
+
+#include "Benchmark.h"
+
+#include "Document.h"
+#include "Layer.h"
+#include "Features.h"
+#include "Projection.h"
+#include "ImportOSM.h"
+#include "MapRenderer.h"
+#include "MerkaartorPreferences.h"
+#include "MasPaintStyle.h"
+#include "RenderQueue.h"
+#ifdef USE_SPATIALITE
+#include "SpatialiteBackend.h"
+#endif
+#ifdef USE_PROTOBUF
+#include "ImportExportPBF.h"
+#endif
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QPainter>
+#include <QPaintEngine>
+#include <QTemporaryFile>
+#include <QTime>
+
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+#define BENCHMARK_QUERIES 200
+// Viewport side, as a fraction of the data extent
+#define BENCHMARK_VIEWPORT 0.05
+#define BENCHMARK_RENDER_SIZE 1024
+#define BENCHMARK_RENDER_ZOOMS 4
+// Largest coordinate change a PBF round trip may make, in degrees: the exporter's granularity
+#define BENCHMARK_PBF_PRECISION 1e-7
+
+static qint64 residentBytes()
+{
+#ifdef Q_OS_LINUX
+    QFile f("/proc/self/statm");
+    if (f.open(QIODevice::ReadOnly)) {
+        QList<QByteArray> fields = f.readAll().split(' ');
+        if (fields.size() > 1)
+            return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return -1;
+}
+
+static qint64 featureBytes(Layer* aLayer)
+{
+    qint64 bytes = 0;
+    for (int i=0; i<aLayer->size(); ++i)
+        bytes += aLayer->get(i)->memoryUsage();
+    return bytes;
+}
+
+static void report(const char* what, qint64 value)
+{
+    fprintf(stdout, "%-28s %lld\n", what, value);
+    fflush(stdout);
+}
+
+static bool importFile(Document* theDocument, Layer* theLayer, const QString& aFilename)
+{
+#ifdef USE_PROTOBUF
+    if (aFilename.endsWith(".pbf", Qt::CaseInsensitive))
+        return theDocument->importPBF(aFilename, theLayer);
+#endif
+    return importOSM(NULL, aFilename, theDocument, theLayer);
+}
+
+static void countTypes(Layer* aLayer, int& nodes, int& ways, int& relations)
+{
+    nodes = ways = relations = 0;
+    for (int i=0; i<aLayer->size(); ++i) {
+        Feature* F = aLayer->get(i);
+        if (CAST_NODE(F))
+            ++nodes;
+        else if (CAST_WAY(F))
+            ++ways;
+        else if (CAST_RELATION(F))
+            ++relations;
+    }
+}
+
+int benchmarkBackend(const QString& aMode, const QString& aFilename)
+{
+    bool onDisk = (aMode == "disk");
+    if (!onDisk && aMode != "memory") {
+        fprintf(stderr, "Unknown backend \"%s\" (expected memory or disk)\n", aMode.toLatin1().data());
+        return 1;
+    }
+#ifndef USE_SPATIALITE
+    if (onDisk) {
+        fprintf(stderr, "Built without SpatiaLite support\n");
+        return 1;
+    }
+#endif
+
+    Document* theDocument = new Document();
+    DrawingLayer* theLayer = new DrawingLayer(QFileInfo(aFilename).fileName());
+    theDocument->add(theLayer);
+#ifdef USE_SPATIALITE
+    // Whatever the preferences say
+    theLayer->setDiskStore(onDisk ? new SpatialiteBackend(theLayer) : NULL);
+#endif
+
+    qint64 rssBefore = residentBytes();
+    QTime t;
+    t.start();
+    if (!importFile(theDocument, theLayer, aFilename)) {
+        fprintf(stderr, "Cannot import %s\n", aFilename.toLatin1().data());
+        delete theDocument;
+        return 1;
+    }
+
+    fprintf(stdout, "Backend: %s\n", onDisk ? "disk" : "memory");
+    report("Import (ms)", t.elapsed());
+
+    CoordBox extent = theLayer->boundingBox();
+#ifdef USE_SPATIALITE
+    if (onDisk) {
+        extent = theLayer->diskStore()->extent();
+        report("Stored features", theLayer->diskStore()->storedCount());
+    }
+#endif
+    report("Resident features", theLayer->size());
+    report("Resident feature bytes", featureBytes(theLayer));
+    report("Process RSS growth (bytes)", rssBefore < 0 ? -1 : residentBytes() - rssBefore);
+
+    // Same pseudo-random walk for both backends
+    qsrand(1);
+    qreal w = extent.lonDiff() * BENCHMARK_VIEWPORT;
+    qreal h = extent.latDiff() * BENCHMARK_VIEWPORT;
+    Projection theProjection;
+    QList<int> times;
+    int found = 0;
+    for (int i=0; i<BENCHMARK_QUERIES; ++i) {
+        qreal x = extent.bottomLeft().x() + (extent.lonDiff() - w) * qrand() / RAND_MAX;
+        qreal y = extent.bottomLeft().y() + (extent.latDiff() - h) * qrand() / RAND_MAX;
+        CoordBox vp(Coord(x, y), Coord(x + w, y + h));
+
+        RenderQueue theFeatures;
+        t.restart();
+#ifdef USE_SPATIALITE
+        if (onDisk)
+            theLayer->diskStore()->pageIn(vp);
+#endif
+        g_backend.getFeatureSet(theLayer, theFeatures, vp, theProjection);
+        theFeatures.sort();
+        times << t.elapsed();
+
+        found += theFeatures.size();
+    }
+    std::sort(times.begin(), times.end());
+    qint64 total = 0;
+    foreach (int ms, times)
+        total += ms;
+
+    report("Viewport queries", BENCHMARK_QUERIES);
+    report("Features found", found);
+    report("Query mean (ms)", total / BENCHMARK_QUERIES);
+    report("Query median (ms)", times[BENCHMARK_QUERIES / 2]);
+    report("Query p95 (ms)", times[BENCHMARK_QUERIES * 95 / 100]);
+    report("Query max (ms)", times.last());
+    report("Resident features after", theLayer->size());
+    report("Process RSS growth after", rssBefore < 0 ? -1 : residentBytes() - rssBefore);
+
+    delete theDocument;
+    return 0;
+}
+
+int benchmarkImport(const QString& aFilename)
+{
+    Document* theDocument = new Document();
+    DrawingLayer* theLayer = new DrawingLayer(QFileInfo(aFilename).fileName());
+    theDocument->add(theLayer);
+
+    QTime t;
+    t.start();
+    if (!importFile(theDocument, theLayer, aFilename)) {
+        fprintf(stderr, "Cannot import %s\n", aFilename.toLatin1().data());
+        delete theDocument;
+        return 1;
+    }
+    int ms = qMax(t.elapsed(), 1);
+
+    int nodes, ways, relations;
+    countTypes(theLayer, nodes, ways, relations);
+
+    report("Import (ms)", ms);
+    report("Nodes", nodes);
+    report("Ways", ways);
+    report("Relations", relations);
+    report("Entities per second", (qint64)theLayer->size() * 1000 / ms);
+
+    delete theDocument;
+    return 0;
+}
+
+/// Paint engine that draws nothing, but counts the state changes and draw calls it gets
+class CountingPaintEngine : public QPaintEngine
+{
+public:
+    CountingPaintEngine() : QPaintEngine(QPaintEngine::AllFeatures), StateChanges(0), DrawCalls(0) {}
+
+    virtual bool begin(QPaintDevice*) { return true; }
+    virtual bool end() { return true; }
+    virtual void updateState(const QPaintEngineState&) { ++StateChanges; }
+    virtual void drawPath(const QPainterPath&) { ++DrawCalls; }
+    virtual void drawPolygon(const QPointF*, int, PolygonDrawMode) { ++DrawCalls; }
+    virtual void drawLines(const QLineF*, int) { ++DrawCalls; }
+    virtual void drawRects(const QRectF*, int) { ++DrawCalls; }
+    virtual void drawEllipse(const QRectF&) { ++DrawCalls; }
+    virtual void drawPoints(const QPointF*, int) { ++DrawCalls; }
+    virtual void drawTextItem(const QPointF&, const QTextItem&) { ++DrawCalls; }
+    virtual void drawPixmap(const QRectF&, const QPixmap&, const QRectF&) { ++DrawCalls; }
+    virtual void drawImage(const QRectF&, const QImage&, const QRectF&, Qt::ImageConversionFlags) { ++DrawCalls; }
+    virtual Type type() const { return QPaintEngine::User; }
+
+    int StateChanges;
+    int DrawCalls;
+};
+
+class CountingPaintDevice : public QPaintDevice
+{
+public:
+    CountingPaintDevice(const QSize& aSize) : Size(aSize) {}
+
+    virtual QPaintEngine* paintEngine() const { return &Engine; }
+
+    mutable CountingPaintEngine Engine;
+
+protected:
+    virtual int metric(PaintDeviceMetric m) const
+    {
+        switch (m) {
+        case PdmWidth: return Size.width();
+        case PdmHeight: return Size.height();
+        case PdmNumColors: return INT_MAX;
+        case PdmDepth: return 32;
+        case PdmDpiX: case PdmDpiY: case PdmPhysicalDpiX: case PdmPhysicalDpiY: return 96;
+        default: return Size.width() * 254 / 960;
+        }
+    }
+
+    QSize Size;
+};
+
+static int drawnVertices(const RenderQueue& theFeatures, qreal aTolerance)
+{
+    int n = 0;
+    for (int i=0; i<theFeatures.size(); ++i)
+        if (Way* R = CAST_WAY(theFeatures.feature(i)))
+            n += R->getPath(aTolerance).elementCount();
+    return n;
+}
+
+int benchmarkRender(const QString& aFilename)
+{
+    Document* theDocument = new Document();
+    DrawingLayer* theLayer = new DrawingLayer(QFileInfo(aFilename).fileName());
+    theDocument->add(theLayer);
+
+    QTime t;
+    t.start();
+    if (!importFile(theDocument, theLayer, aFilename)) {
+        fprintf(stderr, "Cannot import %s\n", aFilename.toLatin1().data());
+        delete theDocument;
+        return 1;
+    }
+    report("Import (ms)", t.elapsed());
+    report("Features", theLayer->size());
+
+    // The style the batching figures are quoted for, whatever the preferences say
+    M_STYLE->loadPainters(":/Styles/Mapnik.mas");
+
+    Projection theProjection;
+    CoordBox extent = theLayer->boundingBox();
+    Coord center = extent.center();
+    QRect screen(0, 0, BENCHMARK_RENDER_SIZE, BENCHMARK_RENDER_SIZE);
+    QImage img(screen.size(), QImage::Format_ARGB32_Premultiplied);
+    RendererOptions options = M_PREFS->getRenderOptions();
+
+    fprintf(stdout, "%-8s %-10s %10s %12s %10s %12s %10s %10s %10s %10s\n", "Zoom", "Features", "Full (ms)", "Full vertices", "LOD (ms)", "LOD vertices",
+            "States", "Draws", "B. states", "B. draws");
+    qreal fraction = 1.;
+    for (int z=0; z<BENCHMARK_RENDER_ZOOMS; ++z, fraction /= 4) {
+        qreal w = extent.lonDiff() * fraction / 2;
+        qreal h = extent.latDiff() * fraction / 2;
+        CoordBox vp(Coord(center.x() - w, center.y() - h), Coord(center.x() + w, center.y() + h));
+
+        RenderQueue theFeatures;
+        g_backend.getFeatureSet(theLayer, theFeatures, vp, theProjection);
+        theFeatures.sort();
+        int found = theFeatures.size();
+
+        QPointF tl = theProjection.project(vp.topLeft());
+        QPointF br = theProjection.project(vp.bottomRight());
+        QRectF projVp(QPointF(tl.x(), qMax(tl.y(), br.y())), QPointF(br.x(), qMin(tl.y(), br.y())));
+        qreal pixelPerM = BENCHMARK_RENDER_SIZE / (vp.lonDiff() * 111320. * cos(center.y() * M_PI / 180.));
+
+        int ms[2], vertices[2];
+        for (int simplify=0; simplify<2; ++simplify) {
+            MapRenderer r;
+            r.SimplifyPaths = simplify;
+            img.fill(0);
+            QPainter P(&img);
+            t.restart();
+            r.render(&P, theFeatures, projVp, screen, pixelPerM, options);
+            ms[simplify] = t.elapsed();
+            vertices[simplify] = drawnVertices(theFeatures, r.theLodTolerance);
+        }
+
+        int states[2], draws[2];
+        for (int batch=0; batch<2; ++batch) {
+            MapRenderer r;
+            r.BatchStrokes = batch;
+            CountingPaintDevice dev(screen.size());
+            QPainter P(&dev);
+            r.render(&P, theFeatures, projVp, screen, pixelPerM, options);
+            P.end();
+            states[batch] = dev.Engine.StateChanges;
+            draws[batch] = dev.Engine.DrawCalls;
+        }
+        fprintf(stdout, "1/%-6d %-10d %10d %12d %10d %12d %10d %10d %10d %10d\n", 1 << (2*z), found, ms[0], vertices[0], ms[1], vertices[1],
+                states[0], draws[0], states[1], draws[1]);
+        fflush(stdout);
+    }
+
+    delete theDocument;
+    return 0;
+}
+
+#ifdef USE_PROTOBUF
+/// Whether G, read back from the PBF file, matches F
+static bool sameFeature(Feature* F, Feature* G)
+{
+    if (F->tagSize() != G->tagSize())
+        return false;
+    for (int i=0; i<F->tagSize(); ++i)
+        if (G->tagValue(F->tagKey(i), QString()) != F->tagValue(i))
+            return false;
+#ifndef FRISIUS_BUILD
+    if (F->hasTime() != G->hasTime() || (F->hasTime() && F->time().toTime_t() != G->time().toTime_t()))
+        return false;
+#endif
+
+    if (Node* N = CAST_NODE(F)) {
+        Node* M = CAST_NODE(G);
+        return M && fabs(N->position().x() - M->position().x()) <= BENCHMARK_PBF_PRECISION
+                && fabs(N->position().y() - M->position().y()) <= BENCHMARK_PBF_PRECISION;
+    }
+    if (Way* R = CAST_WAY(F)) {
+        Way* S = CAST_WAY(G);
+        if (!S || R->size() != S->size())
+            return false;
+        for (int i=0; i<R->size(); ++i)
+            if (!(R->getNode(i)->id() == S->getNode(i)->id()))
+                return false;
+        return true;
+    }
+    if (Relation* R = CAST_RELATION(F)) {
+        Relation* S = CAST_RELATION(G);
+        if (!S || R->size() != S->size())
+            return false;
+        for (int i=0; i<R->size(); ++i)
+            if (!(R->get(i)->id() == S->get(i)->id()) || R->getRole(i) != S->getRole(i))
+                return false;
+        return true;
+    }
+    return false;
+}
+#endif
+
+int benchmarkRoundTrip(const QString& aFilename)
+{
+#ifndef USE_PROTOBUF
+    Q_UNUSED(aFilename);
+    fprintf(stderr, "Built without protobuf support\n");
+    return 1;
+#else
+    Document* theDocument = new Document();
+    DrawingLayer* theLayer = new DrawingLayer(QFileInfo(aFilename).fileName());
+    theDocument->add(theLayer);
+
+    QTime t;
+    t.start();
+    if (!importFile(theDocument, theLayer, aFilename)) {
+        fprintf(stderr, "Cannot import %s\n", aFilename.toLatin1().data());
+        delete theDocument;
+        return 1;
+    }
+    report("Import (ms)", t.elapsed());
+
+    QTemporaryFile tmp(QDir::tempPath() + "/merkaartor-XXXXXX.osm.pbf");
+    if (!tmp.open()) {
+        fprintf(stderr, "Cannot create a temporary file\n");
+        delete theDocument;
+        return 1;
+    }
+    tmp.close();
+
+    QList<Feature*> theFeatures;
+    for (int i=0; i<theLayer->size(); ++i)
+        theFeatures << theLayer->get(i);
+    t.restart();
+    ImportExportPBF pbf(theDocument);
+    if (!pbf.saveFile(tmp.fileName()) || !pbf.export_(theFeatures, false)) {
+        fprintf(stderr, "Cannot export to %s\n", tmp.fileName().toLatin1().data());
+        delete theDocument;
+        return 1;
+    }
+    report("Export (ms)", t.elapsed());
+    report("File bytes", QFileInfo(tmp.fileName()).size());
+
+    Document* theCopy = new Document();
+    DrawingLayer* theCopyLayer = new DrawingLayer(QFileInfo(tmp.fileName()).fileName());
+    theCopy->add(theCopyLayer);
+    t.restart();
+    if (!theCopy->importPBF(tmp.fileName(), theCopyLayer)) {
+        fprintf(stderr, "Cannot import %s back\n", tmp.fileName().toLatin1().data());
+        delete theCopy;
+        delete theDocument;
+        return 1;
+    }
+    report("Import back (ms)", t.elapsed());
+
+    int nodes[2], ways[2], relations[2];
+    countTypes(theLayer, nodes[0], ways[0], relations[0]);
+    countTypes(theCopyLayer, nodes[1], ways[1], relations[1]);
+    report("Nodes", nodes[0]);
+    report("Nodes read back", nodes[1]);
+    report("Ways", ways[0]);
+    report("Ways read back", ways[1]);
+    report("Relations", relations[0]);
+    report("Relations read back", relations[1]);
+
+    int missing = 0, different = 0;
+    foreach (Feature* F, theFeatures) {
+        Feature* G = theCopy->getFeature(F->id());
+        if (!G)
+            ++missing;
+        else if (!sameFeature(F, G))
+            ++different;
+    }
+    report("Missing features", missing);
+    report("Different features", different);
+
+    delete theCopy;
+    delete theDocument;
+    bool same = !missing && !different && nodes[0] == nodes[1] && ways[0] == ways[1] && relations[0] == relations[1];
+    fprintf(stdout, "Round trip: %s\n", same ? "ok" : "FAILED");
+    return same ? 0 : 1;
+#endif
+}
@@ -0,0 +1,25 @@
+#ifndef MERKAARTOR_BENCHMARK_H_
+#define MERKAARTOR_BENCHMARK_H_
+
+#include <QString>
+
+/// Import aFilename into a drawing layer, kept in memory (aMode "memory") or on disk (aMode "disk"),
+/// then time viewport queries over it. Results go to stdout; returns the process exit code.
+/// Run one mode per process, so that resident memory figures don't mix.
+int benchmarkBackend(const QString& aMode, const QString& aFilename);
+
+/// Import aFilename into a drawing layer, and report how long it took and how many entities per second that is.
+/// Results go to stdout; returns the process exit code.
+int benchmarkImport(const QString& aFilename);
+
+/// Import aFilename, then render its centre at zooms from the whole extent down to 1/64 of it,
+/// drawing ways in full and simplified to the scale, and counting the painter state changes and draw calls
+/// with and without batched strokes, in the Mapnik style. Results go to stdout; returns the process exit code.
+int benchmarkRender(const QString& aFilename);
+
+/// Import aFilename, export it as OSM PBF to a temporary file and import that back, then compare
+/// the counts, tags, positions, times and refs of the two copies. Results go to stdout; returns
+/// the process exit code, 1 if the copies differ.
+int benchmarkRoundTrip(const QString& aFilename);
+
+#endif
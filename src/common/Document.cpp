@@ -4,6 +4,7 @@
 
 #include "Feature.h"
 #include "Document.h"
+#include "FeatureIdIndex.h"
 #include "ImageMapLayer.h"
 
 #include "ImportNMEA.h"
@@ -14,6 +15,9 @@
 #ifdef USE_PROTOBUF
 #include "ImportExportPBF.h"
 #endif
+#ifdef USE_SPATIALITE
+#include "SpatialiteBackend.h"
+#endif
 
 #include "MainWindow.h"
 #include "MerkaartorPreferences.h"
@@ -50,6 +54,7 @@ public:
         , theDock(0)
         , lastDownloadLayer(0)
         , tagFilter(0), FilterRevision(0)
+        , Revision(0), PendingUnknown(false), HasPending(false), StyleRevision(0)
         , layerNum(0)
     {
     };
@@ -57,6 +62,8 @@ public:
     {
         History->cleanup();
         delete History;
+        // No point keeping the id index up to date while the layers go away
+        IndexedLayers.clear();
         for (int i=0; i<Layers.size(); ++i) {
             if (theDock)
                 theDock->deleteLayer(Layers[i]);
@@ -65,6 +72,8 @@ public:
     }
     CommandHistory*	History;
     QList<Layer*> Layers;
+    QSet<Layer*> IndexedLayers;
+    FeatureIdIndex FeatureIds;
     DirtyLayer*	dirtyLayer;
     UploadedLayer* uploadedLayer;
     LayerDock*	theDock;
@@ -74,6 +83,20 @@ public:
 
     TagSelector* tagFilter;
     int FilterRevision;
+
+    // What changed to get to each of the last revisions, oldest first
+    struct RevisionChange {
+        int Revision;
+        bool Unknown;
+        QList<CoordBox> Boxes;
+    };
+    int Revision;
+    QList<CoordBox> PendingBoxes;
+    bool PendingUnknown;
+    bool HasPending;
+    QList<RevisionChange> RevisionLog;
+    int StyleRevision;
+
     QString title;
     int layerNum;
     mutable QString Id;
@@ -124,6 +147,7 @@ const QString& Document::id() const
 
 void Document::setPainters(QList<Painter> aPainters)
 {
+    touchStyle();
     p->theFeaturePainters.clear();
     for (int i=0; i<aPainters.size(); ++i) {
         FeaturePainter fp(aPainters[i]);
@@ -314,21 +338,27 @@ const CommandHistory& Document::history() const
     return *(p->History);
 }
 
+// Each step of the history gets a revision of its own, so that its changed area stays separate
 void Document::addHistory(Command* aCommand)
 {
     p->History->add(aCommand);
+    revision();
     emit(historyChanged());
 }
 
 void Document::redoHistory()
 {
+    revision();
     p->History->redo();
+    revision();
     emit(historyChanged());
 }
 
 void Document::undoHistory()
 {
+    revision();
     p->History->undo();
+    revision();
     emit(historyChanged());
 }
 
@@ -336,6 +366,20 @@ void Document::add(Layer* aLayer)
 {
     p->Layers.push_back(aLayer);
     aLayer->setDocument(this);
+    touch();
+#ifdef USE_SPATIALITE
+    if (M_PREFS->getUseDiskBackend() && aLayer->classType() == Layer::DrawingLayerType && !aLayer->diskStore())
+        aLayer->setDiskStore(new SpatialiteBackend(aLayer));
+#endif
+
+    if (!p->IndexedLayers.contains(aLayer)) {
+        p->IndexedLayers.insert(aLayer);
+        for (int i=0; i<aLayer->size(); ++i) {
+            Feature* F = aLayer->get(i);
+            if (!F->isVirtual())
+                p->FeatureIds.insert(F->id(), F);
+        }
+    }
     if (p->theDock)
         p->theDock->addLayer(aLayer);
 }
@@ -343,6 +387,7 @@ void Document::add(Layer* aLayer)
 void Document::moveLayer(Layer* aLayer, int pos)
 {
     p->Layers.move(p->Layers.indexOf(aLayer), pos);
+    touch();
 }
 
 ImageMapLayer* Document::addImageLayer(ImageMapLayer* aLayer)
@@ -391,6 +436,14 @@ void Document::remove(Layer* aLayer)
     QList<Layer*>::iterator i = qFind(p->Layers.begin(),p->Layers.end(), aLayer);
     if (i != p->Layers.end()) {
         p->Layers.erase(i);
+        touch();
+    }
+    if (p->IndexedLayers.remove(aLayer)) {
+        for (int i=0; i<aLayer->size(); ++i) {
+            Feature* F = aLayer->get(i);
+            if (!F->isVirtual())
+                p->FeatureIds.remove(F->id(), F);
+        }
     }
     if (aLayer == p->lastDownloadLayer)
         p->lastDownloadLayer = NULL;
@@ -460,13 +513,43 @@ QList<Feature*> Document::getFeatures(Layer::LayerType layerType)
 
 Feature* Document::getFeature(const IFeature::FId& id)
 {
+    Feature* F = getResidentFeature(id);
+#ifdef USE_SPATIALITE
+    for (int i=0; !F && i<p->Layers.size(); ++i)
+        if (p->Layers[i]->diskStore())
+            F = p->Layers[i]->diskStore()->load(id);
+#endif
+    return F;
+}
+
+Feature* Document::getResidentFeature(const IFeature::FId& id)
+{
+    bool ambiguous;
+    Feature* F = p->FeatureIds.find(id, &ambiguous);
+    if (!ambiguous)
+        return F;
+
+    // The same id lives in several layers: the first layer wins
+    QList<Feature*> candidates;
+    p->FeatureIds.findAll(id, candidates);
     for (int i=0; i<p->Layers.size(); ++i)
     {
-        Feature* F = p->Layers[i]->get(id);
-        if (F)
-            return F;
+        foreach (Feature* C, candidates)
+            if (C->layer() == p->Layers[i])
+                return C;
     }
-    return NULL;
+    return F;
+}
+
+void Document::notifyIdUpdate(Layer* aLayer, const IFeature::FId& id, Feature* aFeature, bool added)
+{
+    if (!p->IndexedLayers.contains(aLayer))
+        return;
+
+    if (added)
+        p->FeatureIds.insert(id, aFeature);
+    else
+        p->FeatureIds.remove(id, aFeature);
 }
 
 void Document::setDirtyLayer(DirtyLayer* aLayer)
@@ -558,9 +641,49 @@ UploadedLayer* Document::getUploadedLayer() const
     return p->uploadedLayer;
 }
 
-void Document::exportOSM(QWidget* main, QIODevice* device, QList<Feature*> aFeatures)
+#ifdef USE_SPATIALITE
+/// Writes the exportable stored features of a disk-backed layer, merging their bounds
+class StoredOsmExporter : public StoredFeatureVisitor
+{
+public:
+    StoredOsmExporter(QXmlStreamWriter& aStream, QProgressDialog* aProgress, CoordBox& aBox)
+        : stream(aStream), progress(aProgress), box(aBox)
+    {
+    }
+
+    virtual bool visit(const QList<Feature*>& aBatch)
+    {
+        foreach (Feature* F, aBatch) {
+            if (F->lastUpdated() == Feature::NotYetDownloaded || F->isDeleted() || F->isHidden()
+                    || F->notEverythingDownloaded())
+                continue;
+            if (box.isNull())
+                box = F->boundingBox(true);
+            else
+                box.merge(F->boundingBox(true));
+            F->toXML(stream, progress);
+        }
+        return !(progress && progress->wasCanceled());
+    }
+
+private:
+    QXmlStreamWriter& stream;
+    QProgressDialog* progress;
+    CoordBox& box;
+};
+#endif
+
+void Document::exportOSM(QWidget* main, QIODevice* device, QList<Feature*> aFeatures, bool withStored)
 {
-    if (aFeatures.isEmpty())
+    bool hasStored = false;
+#ifdef USE_SPATIALITE
+    for (int i=0; withStored && i<p->Layers.size(); ++i)
+        if (p->Layers[i]->diskStore() && p->Layers[i]->diskStore()->storedCount())
+            hasStored = true;
+#else
+    Q_UNUSED(withStored);
+#endif
+    if (aFeatures.isEmpty() && !hasStored)
         return;
 
     IProgressWindow* aProgressWindow = dynamic_cast<IProgressWindow*>(main);
@@ -593,12 +716,25 @@ void Document::exportOSM(QWidget* main, QIODevice* device, QList<Feature*> aFeat
     stream.writeAttribute("version", "0.6");
     stream.writeAttribute("generator", QString("%1 %2").arg(qApp->applicationName()).arg(STRINGIFY(VERSION)));
 
-    CoordBox aCoordBox = aFeatures[0]->boundingBox(true);
-    aFeatures[0]->toXML(stream, dlg);
+    CoordBox aCoordBox;
+    if (aFeatures.size()) {
+        aCoordBox = aFeatures[0]->boundingBox(true);
+        aFeatures[0]->toXML(stream, dlg);
+    }
     for (int i=1; i < aFeatures.size(); i++) {
         aCoordBox.merge(aFeatures[i]->boundingBox(true));
         aFeatures[i]->toXML(stream, dlg);
     }
+#ifdef USE_SPATIALITE
+    // Paged out features are read back a batch at a time, not all at once
+    for (int i=0; hasStored && i<p->Layers.size(); ++i) {
+        if (!p->Layers[i]->diskStore())
+            continue;
+        StoredOsmExporter exporter(stream, dlg, aCoordBox);
+        if (!p->Layers[i]->diskStore()->visitStored(exporter))
+            break;
+    }
+#endif
 
     stream.writeStartElement("bound");
     QString S = QString().number(aCoordBox.bottom(),'f',6) + ",";
@@ -749,7 +885,9 @@ bool Document::importPBF(const QString& filename, DrawingLayer* NewLayer)
     ImportExportPBF imp(this);
     if (!imp.loadFile(filename))
         return false;
+    g_backend.beginBulkIndex(NewLayer);
     imp.import(NewLayer);
+    g_backend.endBulkIndex(NewLayer);
 
     if (NewLayer->size())
         return true;
@@ -841,6 +979,7 @@ QPair<bool,CoordBox> Document::boundingBox()
 bool Document::setFilterType(FilterType aFilter)
 {
     p->FilterRevision++;
+    touchStyle();
     QString theFilter = M_PREFS->getFilter(aFilter).filter;
     if (theFilter.isEmpty()) {
         if (p->tagFilter)
@@ -861,6 +1000,77 @@ int Document::filterRevision() const
     return p->FilterRevision;
 }
 
+// Past this, pending boxes are merged into one
+#define MAX_PENDING_BOXES 64
+#define MAX_REVISION_LOG 64
+
+int Document::revision()
+{
+    if (p->HasPending) {
+        MapDocumentPrivate::RevisionChange c;
+        c.Revision = ++p->Revision;
+        c.Unknown = p->PendingUnknown;
+        c.Boxes = p->PendingBoxes;
+        p->RevisionLog << c;
+        if (p->RevisionLog.size() > MAX_REVISION_LOG)
+            p->RevisionLog.removeFirst();
+
+        p->PendingBoxes.clear();
+        p->PendingUnknown = false;
+        p->HasPending = false;
+    }
+    return p->Revision;
+}
+
+void Document::touch(const CoordBox& aBox)
+{
+    p->HasPending = true;
+    if (aBox.isNull() || p->PendingUnknown)
+        return;
+    if (p->PendingBoxes.size() < MAX_PENDING_BOXES) {
+        p->PendingBoxes << aBox;
+        return;
+    }
+    CoordBox all = aBox;
+    foreach (const CoordBox& bb, p->PendingBoxes)
+        all.merge(bb);
+    p->PendingBoxes.clear();
+    p->PendingBoxes << all;
+}
+
+void Document::touch()
+{
+    p->HasPending = true;
+    p->PendingUnknown = true;
+    p->PendingBoxes.clear();
+}
+
+bool Document::changedSince(int aRevision, QList<CoordBox>& theBoxes) const
+{
+    if (aRevision == p->Revision)
+        return true;
+    if (p->RevisionLog.isEmpty() || p->RevisionLog.first().Revision > aRevision+1)
+        return false;
+    foreach (const MapDocumentPrivate::RevisionChange& c, p->RevisionLog) {
+        if (c.Revision <= aRevision)
+            continue;
+        if (c.Unknown)
+            return false;
+        theBoxes << c.Boxes;
+    }
+    return true;
+}
+
+int Document::styleRevision() const
+{
+    return p->StyleRevision;
+}
+
+void Document::touchStyle()
+{
+    ++p->StyleRevision;
+}
+
 QString Document::title() const
 {
     return p->title;
@@ -65,6 +65,9 @@ public:
     int size() const;
 
     Feature* getFeature(const IFeature::FId& id);
+    /// Like getFeature(), without paging anything in from a layer disk store
+    Feature* getResidentFeature(const IFeature::FId& id);
+    void notifyIdUpdate(Layer* aLayer, const IFeature::FId& id, Feature* aFeature, bool added);
     QList<Feature*> getFeatures(Layer::LayerType layerType = Layer::UndefinedType);
     void setHistory(CommandHistory* h);
     CommandHistory& history();
@@ -84,7 +87,8 @@ public:
     void setUploadedLayer(UploadedLayer* aLayer);
     UploadedLayer* getUploadedLayer() const;
 
-    void exportOSM(QWidget* main, QIODevice* device, QList<Feature*> aFeatures);
+    /// With withStored, what disk-backed layers keep on disk is exported too
+    void exportOSM(QWidget* main, QIODevice* device, QList<Feature*> aFeatures, bool withStored = false);
     QList<Feature*> exportCoreOSM(QList<Feature*> aFeatures, bool forCopyPaste=false, QProgressDialog * progress=NULL);
     bool toXML(QXmlStreamWriter& stream, bool asTemplate, QProgressDialog * progress);
     static Document* fromXML(QString title, QXmlStreamReader& stream, qreal version, LayerDock* aDock, QProgressDialog * progress);
@@ -116,6 +120,21 @@ public:
     TagSelector* getTagFilter();
     int filterRevision() const;
 
+    /// Revision of what the document draws. Changes recorded with touch() since the last call
+    /// make up a new revision.
+    int revision();
+    /// Records that what is drawn within aBox changed
+    void touch(const CoordBox& aBox);
+    /// Records a change whose extent isn't known
+    void touch();
+    /// Appends the areas changed since aRevision to theBoxes. False if some of them aren't known
+    /// any more, or never were.
+    bool changedSince(int aRevision, QList<CoordBox>& theBoxes) const;
+
+    /// Bumped by anything that may change how every feature is drawn (painters, filter, preferences)
+    int styleRevision() const;
+    void touchStyle();
+
     QString title() const;
     void setTitle(const QString aTitle);
 
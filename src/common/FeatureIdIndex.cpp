@@ -0,0 +1,243 @@
+#include "FeatureIdIndex.h"
+
+#include <string.h>
+
+#define PAGE_BITS 6
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define PAGE_MASK (PAGE_SIZE - 1)
+// Ids a page range must hold before it gets a page; below that, a hash entry is cheaper
+#define PAGE_MIN_IDS 8
+
+static const unsigned char DenseTypes[3] = { IFeature::Point, IFeature::LineString, IFeature::OsmRelation };
+
+struct FeatureIdIndex::Page
+{
+    Page() : count(0)
+    {
+        memset(slots, 0, sizeof(slots));
+        memset(shared, 0, sizeof(shared));
+    }
+
+    // Set when Others holds more features with the same id and type
+    bool isShared(int i) const
+    {
+        return shared[i >> 5] & (1u << (i & 31));
+    }
+    void setShared(int i, bool b)
+    {
+        if (b)
+            shared[i >> 5] |= (1u << (i & 31));
+        else
+            shared[i >> 5] &= ~(1u << (i & 31));
+    }
+
+    int count;
+    Feature* slots[PAGE_SIZE];
+    quint32 shared[PAGE_SIZE / 32];
+};
+
+FeatureIdIndex::FeatureIdIndex()
+{
+}
+
+FeatureIdIndex::~FeatureIdIndex()
+{
+    clear();
+}
+
+void FeatureIdIndex::clear()
+{
+    for (int t=0; t<3; ++t) {
+        qDeleteAll(Dense[t]);
+        Dense[t].clear();
+        Sparse[t].clear();
+    }
+    Others.clear();
+}
+
+int FeatureIdIndex::denseTable(const IFeature::FId& id)
+{
+    if (id.numId <= 0)
+        return -1;
+    switch (id.type) {
+    case IFeature::Point:
+        return 0;
+    case IFeature::LineString:
+        return 1;
+    case IFeature::OsmRelation:
+        return 2;
+    }
+    return -1;
+}
+
+void FeatureIdIndex::insert(const IFeature::FId& id, Feature* F)
+{
+    int t = denseTable(id);
+    if (t != -1) {
+        qint64 key = id.numId >> PAGE_BITS;
+        Page* pg = Dense[t].value(key);
+        if (!pg) {
+            int& n = Sparse[t][key];
+            if (++n < PAGE_MIN_IDS) {
+                Others.insert(id.numId, Entry(id.type, F));
+                return;
+            }
+            Sparse[t].remove(key);
+            createPage(t, key);
+            pg = Dense[t].value(key);
+        }
+        int i = id.numId & PAGE_MASK;
+        if (!pg->slots[i]) {
+            pg->slots[i] = F;
+            ++pg->count;
+            return;
+        }
+        if (pg->slots[i] == F)
+            return;
+        pg->setShared(i, true);
+    }
+    Others.insert(id.numId, Entry(id.type, F));
+}
+
+void FeatureIdIndex::createPage(int t, qint64 key)
+{
+    Page* pg = new Page;
+    Dense[t].insert(key, pg);
+
+    // Move the ids of this range out of Others
+    unsigned char type = DenseTypes[t];
+    for (int i=0; i<PAGE_SIZE; ++i) {
+        qint64 numId = (key << PAGE_BITS) | i;
+        if (!numId)
+            continue;
+        pg->slots[i] = takeOther(numId, type);
+        if (pg->slots[i]) {
+            ++pg->count;
+            pg->setShared(i, otherExists(numId, type));
+        }
+    }
+}
+
+void FeatureIdIndex::remove(const IFeature::FId& id, Feature* F)
+{
+    int t = denseTable(id);
+    bool paged = false;
+    QHash<qint64, Page*>::iterator pi;
+    if (t != -1) {
+        pi = Dense[t].find(id.numId >> PAGE_BITS);
+        paged = (pi != Dense[t].end());
+    }
+    if (paged) {
+        Page* pg = pi.value();
+        int i = id.numId & PAGE_MASK;
+        if (pg->slots[i] == F) {
+            pg->slots[i] = 0;
+            if (pg->isShared(i)) {
+                pg->slots[i] = takeOther(id.numId, id.type);
+                pg->setShared(i, otherExists(id.numId, id.type));
+            }
+            if (!pg->slots[i] && --pg->count == 0) {
+                delete pg;
+                Dense[t].erase(pi);
+            }
+            return;
+        }
+        if (!pg->isShared(i))
+            return;
+    }
+
+    QMultiHash<qint64, Entry>::iterator it = Others.find(id.numId);
+    while (it != Others.end() && it.key() == id.numId) {
+        if (it.value().F == F && it.value().type == id.type) {
+            Others.erase(it);
+            if (t != -1 && !paged) {
+                qint64 key = id.numId >> PAGE_BITS;
+                if (--Sparse[t][key] <= 0)
+                    Sparse[t].remove(key);
+            }
+            break;
+        }
+        ++it;
+    }
+    if (paged && !otherExists(id.numId, id.type))
+        Dense[t].value(id.numId >> PAGE_BITS)->setShared(id.numId & PAGE_MASK, false);
+}
+
+bool FeatureIdIndex::otherExists(qint64 numId, unsigned char type) const
+{
+    QMultiHash<qint64, Entry>::const_iterator it = Others.find(numId);
+    for (; it != Others.end() && it.key() == numId; ++it)
+        if (it.value().type == type)
+            return true;
+    return false;
+}
+
+Feature* FeatureIdIndex::takeOther(qint64 numId, unsigned char type)
+{
+    QMultiHash<qint64, Entry>::iterator it = Others.find(numId);
+    for (; it != Others.end() && it.key() == numId; ++it)
+        if (it.value().type == type) {
+            Feature* F = it.value().F;
+            Others.erase(it);
+            return F;
+        }
+    return NULL;
+}
+
+Feature* FeatureIdIndex::find(const IFeature::FId& id, bool* ambiguous) const
+{
+    Feature* found = NULL;
+    int matches = 0;
+    int otherTypes = id.type;
+
+    if (id.numId > 0) {
+        for (int t=0; t<3; ++t) {
+            if (!(id.type & DenseTypes[t]))
+                continue;
+            Page* pg = Dense[t].value(id.numId >> PAGE_BITS);
+            if (!pg)
+                continue;
+            // Paged: the slot and its shared bit tell everything
+            otherTypes &= ~DenseTypes[t];
+            int i = id.numId & PAGE_MASK;
+            if (pg->slots[i]) {
+                found = pg->slots[i];
+                ++matches;
+                if (pg->isShared(i))
+                    ++matches;
+            }
+        }
+    }
+
+    if (otherTypes) {
+        QMultiHash<qint64, Entry>::const_iterator it = Others.find(id.numId);
+        for (; it != Others.end() && it.key() == id.numId; ++it) {
+            if (it.value().type & otherTypes) {
+                found = it.value().F;
+                ++matches;
+            }
+        }
+    }
+
+    if (ambiguous)
+        *ambiguous = (matches > 1);
+    return found;
+}
+
+void FeatureIdIndex::findAll(const IFeature::FId& id, QList<Feature*>& result) const
+{
+    if (id.numId > 0) {
+        for (int t=0; t<3; ++t) {
+            if (!(id.type & DenseTypes[t]))
+                continue;
+            Page* pg = Dense[t].value(id.numId >> PAGE_BITS);
+            if (pg && pg->slots[id.numId & PAGE_MASK])
+                result << pg->slots[id.numId & PAGE_MASK];
+        }
+    }
+
+    QMultiHash<qint64, Entry>::const_iterator it = Others.find(id.numId);
+    for (; it != Others.end() && it.key() == id.numId; ++it)
+        if (it.value().type & id.type)
+            result << it.value().F;
+}
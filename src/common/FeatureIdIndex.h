@@ -0,0 +1,52 @@
+#ifndef FEATUREIDINDEX_H
+#define FEATUREIDINDEX_H
+
+#include "IFeature.h"
+
+#include <QHash>
+#include <QList>
+
+class Feature;
+
+/// Document-wide FId -> Feature lookup table.
+/// Positive ids of nodes, ways and relations (i.e. everything coming from OSM) live in
+/// paged dense arrays, so resolving a reference costs a single page lookup. Everything else
+/// (negative/new ids, other feature types, duplicate ids across layers, and ids too sparse
+/// to be worth a page) goes to a hash.
+class FeatureIdIndex
+{
+public:
+    FeatureIdIndex();
+    ~FeatureIdIndex();
+
+    void insert(const IFeature::FId& id, Feature* F);
+    void remove(const IFeature::FId& id, Feature* F);
+    void clear();
+
+    /// Returns a feature whose id matches (id.type being a type mask), or NULL.
+    /// \a ambiguous is set if more than one feature matches.
+    Feature* find(const IFeature::FId& id, bool* ambiguous = 0) const;
+    void findAll(const IFeature::FId& id, QList<Feature*>& result) const;
+
+private:
+    struct Page;
+    struct Entry
+    {
+        Entry() : type(IFeature::Uninitialized), F(0) {}
+        Entry(unsigned char t, Feature* f) : type(t), F(f) {}
+        unsigned char type;
+        Feature* F;
+    };
+
+    static int denseTable(const IFeature::FId& id);
+    void createPage(int t, qint64 key);
+    bool otherExists(qint64 numId, unsigned char type) const;
+    Feature* takeOther(qint64 numId, unsigned char type);
+
+    QHash<qint64, Page*> Dense[3];
+    // Number of ids per page key that live in Others because their page doesn't exist yet
+    QHash<qint64, int> Sparse[3];
+    QMultiHash<qint64, Entry> Others;
+};
+
+#endif // FEATUREIDINDEX_H
@@ -14,6 +14,11 @@
 #include "MainWindow.h"
 #include "SlippyMapWidget.h"
 
+#include <QReadWriteLock>
+#include <QMutex>
+
+#include <string.h>
+
 #ifdef PORTABLE_BUILD
 bool g_Merk_Portable = true;
 #else
@@ -31,98 +36,330 @@ bool g_Merk_SelfClip = true;
 bool g_Merk_SelfClip = false;
 #endif
 
+/* Interned strings */
+
+#define STRINGTABLE_PAGE_BITS 12
+#define STRINGTABLE_PAGE_SIZE (1 << STRINGTABLE_PAGE_BITS)
+#define STRINGTABLE_MAX_PAGES (1 << 14)
+
+/* Reference counted string <-> index table.
+   Strings live in fixed pages that never move, so reference counts are updated without a lock.
+   Reading a string or looking one up takes a read lock, as a reclaimed slot gets reused for
+   another string; only inserting a new string or reclaiming an unused one takes the write lock. */
+class StringTable
+{
+public:
+    StringTable()
+        : Count(0)
+    {
+        memset(Pages, 0, sizeof(Pages));
+    }
+    ~StringTable()
+    {
+        for (int i=0; i<STRINGTABLE_MAX_PAGES && Pages[i]; ++i)
+            delete [] Pages[i];
+    }
+
+    /// Returns the index of s, adding a reference to it
+    quint32 add(const QString& s)
+    {
+        return insert(s, true);
+    }
+
+    /// Returns the index of s, for strings that are never released
+    quint32 intern(const QString& s)
+    {
+        return insert(s, false);
+    }
+
+    void addRef(quint32 idx)
+    {
+        entry(idx).Refs.ref();
+    }
+
+    /// Drops a reference to idx; the string goes away with the last one
+    void release(quint32 idx)
+    {
+        if (entry(idx).Refs.deref())
+            return;
+
+        QWriteLocker lock(&Lock);
+        // add() may have picked it up again before we got the lock
+        Entry& e = entry(idx);
+        if (e.Refs != 0 || e.Str.isNull())
+            return;
+        Index.remove(e.Str);
+        e.Str = QString();
+        Free << idx;
+    }
+
+    /// Returns the index of s without referencing it, or 0xffffffff
+    quint32 find(const QString& s) const
+    {
+        QReadLocker lock(&Lock);
+        return Index.value(s, 0xffffffff);
+    }
+
+    QString get(quint32 idx) const
+    {
+        QReadLocker lock(&Lock);
+        if (idx >= Count)
+            return QString();
+        return entry(idx).Str;
+    }
+
+    QStringList strings() const
+    {
+        QReadLocker lock(&Lock);
+        return Index.keys();
+    }
+
+private:
+    struct Entry
+    {
+        QString Str;
+        QAtomicInt Refs;
+    };
+
+    quint32 insert(const QString& s, bool ref)
+    {
+        {
+            QReadLocker lock(&Lock);
+            QHash<QString, quint32>::const_iterator it = Index.constFind(s);
+            if (it != Index.constEnd()) {
+                if (ref)
+                    entry(it.value()).Refs.ref();
+                return it.value();
+            }
+        }
+
+        QWriteLocker lock(&Lock);
+        // Someone else may have added it in the meantime
+        QHash<QString, quint32>::const_iterator it = Index.constFind(s);
+        if (it != Index.constEnd()) {
+            if (ref)
+                entry(it.value()).Refs.ref();
+            return it.value();
+        }
+
+        quint32 idx;
+        if (!Free.isEmpty()) {
+            idx = Free.takeLast();
+        } else {
+            idx = Count;
+            int pg = idx >> STRINGTABLE_PAGE_BITS;
+            if (pg >= STRINGTABLE_MAX_PAGES)
+                qFatal("StringTable: more than %d distinct strings", STRINGTABLE_MAX_PAGES * STRINGTABLE_PAGE_SIZE);
+            if (!Pages[pg])
+                Pages[pg] = new Entry[STRINGTABLE_PAGE_SIZE];
+            ++Count;
+        }
+        Entry& e = entry(idx);
+        e.Str = s;
+        e.Refs = (ref ? 1 : 0);
+        Index.insert(s, idx);
+        return idx;
+    }
+
+    Entry& entry(quint32 idx) const
+    {
+        return Pages[idx >> STRINGTABLE_PAGE_BITS][idx & (STRINGTABLE_PAGE_SIZE - 1)];
+    }
+
+    Entry* Pages[STRINGTABLE_MAX_PAGES];
+    quint32 Count;
+    QList<quint32> Free;
+    QHash<QString, quint32> Index;
+    mutable QReadWriteLock Lock;
+};
+
+static bool caseInsensitiveLessThan(const QString& s1, const QString& s2)
+{
+    return s1.compare(s2, Qt::CaseInsensitive) < 0;
+}
+
+/* Values in use for each key, with the number of tags using them.
+   The sorted value lists fed to the completers are only rebuilt when a value appears or goes away. */
+class TagValueIndex
+{
+public:
+    void add(quint32 k, quint32 v)
+    {
+        QMutexLocker lock(&Lock);
+        add(Keys[k], v);
+        add(All, v);
+    }
+
+    void remove(quint32 k, quint32 v)
+    {
+        QMutexLocker lock(&Lock);
+        QHash<quint32, KeyValues>::iterator it = Keys.find(k);
+        if (it == Keys.end())
+            return;
+        remove(it.value(), v);
+        if (it.value().Counts.isEmpty())
+            Keys.erase(it);
+        remove(All, v);
+    }
+
+    /// Values of key k (or of any key if k is "*"), case insensitively sorted
+    QStringList values(quint32 k)
+    {
+        QMutexLocker lock(&Lock);
+        QHash<quint32, KeyValues>::iterator it = Keys.find(k);
+        if (it == Keys.end())
+            return QStringList();
+        return sorted(it.value());
+    }
+
+    QStringList allValues()
+    {
+        QMutexLocker lock(&Lock);
+        return sorted(All);
+    }
+
+private:
+    struct KeyValues
+    {
+        KeyValues() : SortedValid(false) {}
+        QHash<quint32, int> Counts;
+        QStringList Sorted;
+        bool SortedValid;
+    };
+
+    void add(KeyValues& kv, quint32 v)
+    {
+        if (++kv.Counts[v] == 1)
+            kv.SortedValid = false;
+    }
+    void remove(KeyValues& kv, quint32 v)
+    {
+        QHash<quint32, int>::iterator it = kv.Counts.find(v);
+        if (it == kv.Counts.end())
+            return;
+        if (--it.value() == 0) {
+            kv.Counts.erase(it);
+            kv.SortedValid = false;
+        }
+    }
+    const QStringList& sorted(KeyValues& kv)
+    {
+        if (!kv.SortedValid) {
+            kv.Sorted.clear();
+            QHash<quint32, int>::const_iterator it = kv.Counts.constBegin();
+            for (; it != kv.Counts.constEnd(); ++it)
+                kv.Sorted << g_getTagValue(it.key());
+            qSort(kv.Sorted.begin(), kv.Sorted.end(), caseInsensitiveLessThan);
+            kv.SortedValid = true;
+        }
+        return kv.Sorted;
+    }
+
+    QHash<quint32, KeyValues> Keys;
+    KeyValues All;
+    QMutex Lock;
+};
+
+// Defined before g_backend: the features it destroys on exit release their tags here
+StringTable tagKeys;
+StringTable tagValues;
+TagValueIndex tagList;
+
 MainWindow* g_Merk_MainWindow = NULL;
 MemoryBackend g_backend;
 SlippyMapCache* SlippyMapWidget::theSlippyCache = 0;
 
-QStringList tagKeys;
-QHash<QString, quint32> tagKeysHash;
-QStringList tagValues;
-QHash<QString, quint32> tagValuesHash;
-QHash< quint32, QList<quint32> > tagList;
-QStringList userList;
+StringTable userList;
 QString noUser;
 
 QPair<quint32, quint32> g_addToTagList(QString k, QString v)
 {
-    qint32 ik, iv;
+    quint32 ik = tagKeys.add(k);
+    quint32 iv = tagValues.add(v);
 
-    if (!tagKeysHash.contains(k)) {
-        tagKeys.append(k);
-        ik = tagKeys.size()-1;
-        tagKeysHash[k] = ik;
-    } else
-        ik = tagKeysHash.value(k);
+    if (!k.isEmpty() && !v.isEmpty())
+        tagList.add(ik, iv);
 
-    if (!tagValuesHash.contains(v)) {
-        tagValues.append(v);
-        iv = tagValues.size()-1;
-        tagValuesHash[v] = iv;
-    } else
-        iv = tagValuesHash.value(v);
+    return qMakePair(ik, iv);
+}
 
-    if (!k.isEmpty() && !v.isEmpty())
-        tagList[ik].append(iv);
+void g_addToTagList(quint32 k, quint32 v)
+{
+    tagKeys.addRef(k);
+    tagValues.addRef(v);
 
-    return qMakePair((quint32)ik, (quint32)iv);
+    if (!tagKeys.get(k).isEmpty() && !tagValues.get(v).isEmpty())
+        tagList.add(k, v);
 }
 
 void g_removeFromTagList(quint32 k, quint32 v)
 {
-    tagList[k].removeOne(v);
-    if (tagList[k].isEmpty())
-        tagList.remove(k);
+    tagList.remove(k, v);
+
+    tagKeys.release(k);
+    tagValues.release(v);
+}
+
+quint32 g_addTagKey(const QString& k)
+{
+    return tagKeys.add(k);
+}
+
+quint32 g_addTagValue(const QString& v)
+{
+    return tagValues.add(v);
+}
+
+void g_releaseTagKey(quint32 k)
+{
+    tagKeys.release(k);
+}
+
+void g_releaseTagValue(quint32 v)
+{
+    tagValues.release(v);
 }
 
 QList<QString> g_getTagKeys()
 {
-    return tagKeys;
+    return tagKeys.strings();
 }
 
 QList<QString> g_getTagValues()
 {
-    return tagValues;
+    return tagValues.strings();
 }
 
 QStringList g_getTagValueList(QString k)
 {
-    QSet<quint32> retList;
-    if (k == "*") {
-        foreach (QList<quint32> list, tagList)
-            retList.unite(list.toSet());
-    } else
-        retList = tagList[tagKeys.indexOf(k)].toSet();
-
-    QStringList res;
-    foreach (quint32 i, retList)
-        res << g_getTagValue(i);
-
-    return res;
+    if (k == "*")
+        return tagList.allValues();
+    return tagList.values(g_getTagKeyIndex(k));
 }
 
-const QString& g_getTagKey(int idx)
+QString g_getTagKey(int idx)
 {
-    return tagKeys.at(idx);
+    return tagKeys.get(idx);
 }
 
 quint32 g_getTagKeyIndex(const QString& s)
 {
-    return tagKeys.indexOf(s);
+    return tagKeys.find(s);
 }
 
 QStringList g_getTagKeyList()
 {
-    return tagKeys.toSet().toList();
+    return tagKeys.strings();
 }
 
 QString g_getTagValue(int idx)
 {
-    return tagValues.at(idx);
+    return tagValues.get(idx);
 }
 
 quint32 g_getTagValueIndex(const QString& s)
 {
-    return tagValues.indexOf(s);
+    return tagValues.find(s);
 }
 
 quint32 g_setUser(const QString& u)
@@ -130,18 +367,13 @@ quint32 g_setUser(const QString& u)
     if (u.isEmpty())
         return 0xffffffff;
 
-    qint32 ret = userList.indexOf(u);
-    if (ret == -1) {
-        userList.append(u);
-        return userList.size()-1;
-    }
-    return ret;
+    return userList.intern(u);
 }
 
-const QString& g_getUser(quint32 idx)
+QString g_getUser(quint32 idx)
 {
     if (idx != 0xffffffff)
-        return userList[idx];
+        return userList.get(idx);
     else
         return noUser;
 }
@@ -31,19 +31,28 @@ extern bool g_Merk_SelfClip;
 
 extern MainWindow* g_Merk_MainWindow;
 
+// Tag keys and values are interned; each feature tag holds a reference on both
 extern QPair<quint32, quint32> g_addToTagList(QString k, QString v);
+extern void g_addToTagList(quint32 k, quint32 v);
 extern void g_removeFromTagList(quint32 k, quint32 v);
+// Index of a tag key or value, with a reference held by the caller until it releases it:
+// lets importers intern each string once and hand the indices to Feature::setTagIds
+extern quint32 g_addTagKey(const QString& k);
+extern quint32 g_addTagValue(const QString& v);
+extern void g_releaseTagKey(quint32 k);
+extern void g_releaseTagValue(quint32 v);
 extern QList<QString> g_getTagKeys();
 extern QList<QString> g_getTagValues();
-extern const QString& g_getTagKey(int idx);
+extern QString g_getTagKey(int idx);
 extern quint32 g_getTagKeyIndex(const QString& s);
 extern QStringList g_getTagKeyList();
 extern QString g_getTagValue(int idx);
 extern quint32 g_getTagValueIndex(const QString& s);
+// Case insensitively sorted, as the completers expect
 extern QStringList g_getTagValueList(QString k) ;
 
 extern quint32 g_setUser(const QString& u);
-extern const QString& g_getUser(quint32 idx);
+extern QString g_getUser(quint32 idx);
 
 extern MemoryBackend g_backend;
 
@@ -12,6 +12,7 @@
 #include "IMapAdapter.h"
 #include "IMapWatermark.h"
 #include "Feature.h"
+#include "RenderQueue.h"
 #include "Interaction.h"
 #include "IPaintStyle.h"
 #include "Projection.h"
@@ -19,6 +20,10 @@
 #include "qgpsdevice.h"
 
 #include "OsmRenderLayer.h"
+#ifdef USE_SPATIALITE
+#include "Layer.h"
+#include "SpatialiteBackend.h"
+#endif
 
 #ifdef USE_WEBKIT
     #include "browserimagemanager.h"
@@ -34,12 +39,77 @@
 #include <QToolTip>
 #include <QMap>
 #include <QSet>
+#include <QPicture>
+#include <QFutureWatcher>
 #include <QtConcurrentMap>
 
 // from wikipedia
 #define EQUATORIALRADIUS 6378137.0
 #define LAT_ANG_PER_M 1.0 / EQUATORIALRADIUS
 #define TEST_RFLAGS(x) p->ROptions.options.testFlag(x)
+// Around changed features, in pixels: node markers, line widths, oneway arrows
+#define DIRTY_MARGIN 16
+// Height of the screen bands the wireframe is rasterized in, one worker each
+#define WIREFRAME_BAND_HEIGHT 128
+
+/// One screen band of the wireframe and touchup buffers, rasterized by a worker
+struct WireframeBand
+{
+    QRect Rect;
+    QImage Wireframe;
+    QImage Touchup;
+};
+
+/// Plays the wireframe and touchup recorded on the GUI thread back into one band.
+/// Workers only see the recordings, never the features, so edits can go on meanwhile.
+class RenderWireframeBand
+{
+public:
+    RenderWireframeBand(const QPicture& aWireframe, const QPicture& aTouchup, const QRegion& aClip)
+        : Wireframe(aWireframe.data(), aWireframe.size())
+        , Touchup(aTouchup.data(), aTouchup.size())
+        , Clip(aClip) {}
+
+    typedef WireframeBand result_type;
+
+    WireframeBand operator()(const QRect& aRect) const
+    {
+        WireframeBand b;
+        b.Rect = aRect;
+        b.Wireframe = play(Wireframe, aRect);
+        b.Touchup = play(Touchup, aRect);
+        return b;
+    }
+
+private:
+    QImage play(const QByteArray& aRecording, const QRect& aRect) const
+    {
+        // QPicture playback goes through a buffer of its own, so each band needs its own copy
+        QPicture pic;
+        pic.setData(aRecording.constData(), aRecording.size());
+
+        QImage img(aRect.size(), QImage::Format_ARGB32_Premultiplied);
+        img.fill(0);
+        QPainter P(&img);
+        P.setClipRegion((Clip & aRect).translated(-aRect.topLeft()));
+        P.drawPicture(-aRect.topLeft(), pic);
+        P.end();
+        return img;
+    }
+
+    QByteArray Wireframe;
+    QByteArray Touchup;
+    QRegion Clip;
+};
+
+/// Bands being rasterized, and the area of the buffers they replace
+struct WireframeJob
+{
+    QFuture<WireframeBand> Future;
+    QRegion Clip;
+    // How far the buffers were scrolled since the job started
+    QPoint Offset;
+};
 
 class MapViewPrivate
 {
@@ -67,11 +137,29 @@ public:
 
     OsmRenderLayer* osmLayer;
 
+    // What the wireframe buffers were last invalidated for
+    QTransform WireframeTransform;
+    QSize WireframeSize;
+    RendererOptions::RenderOptions WireframeOptions;
+    int WireframeStyle;
+    // Preferences that decide what goes into the buffers, see wireframeMode()
+    int WireframeMode;
+    int WireframeRevision;
+    // Screen area of invalidRects when only part of the buffers is to be redrawn
+    QRegion DirtyRegion;
+    // Kept between redraws, so that its storage is reused
+    RenderQueue WireframeQueue;
+    // Jobs not copied into the buffers yet, oldest first: later ones are drawn over them
+    QList<WireframeJob> WireframeJobs;
+    // Watches the oldest job
+    QFutureWatcher<WireframeBand> WireframeWatcher;
+
     MapViewPrivate()
       : PixelPerM(0.0), Viewport(WORLD_COORDBOX), theVectorRotation(0.0)
       , BackgroundOnlyPanZoom(false)
       , theDocument(0)
       , theInteraction(0)
+      , WireframeStyle(-1), WireframeMode(-1), WireframeRevision(-1)
     {}
 };
 
@@ -137,10 +225,12 @@ MapView::MapView(QWidget* parent) :
 
     p->osmLayer = new OsmRenderLayer(this);
     connect(p->osmLayer, SIGNAL(renderingDone()), SLOT(update()));
+    connect(&p->WireframeWatcher, SIGNAL(finished()), SLOT(on_wireframeRendered()));
 }
 
 MapView::~MapView()
 {
+    dropWireframe();
     delete StaticBackground;
     delete StaticWireframe;
     delete StaticTouchup;
@@ -156,6 +246,8 @@ void MapView::setDocument(IDocument* aDoc)
 {
     p->theDocument = aDoc;
     p->osmLayer->setDocument(aDoc);
+    // Revisions of another document mean nothing
+    p->WireframeRevision = -1;
 
     setViewport(viewport(), rect());
 }
@@ -165,8 +257,77 @@ IDocument *MapView::document()
     return p->theDocument;
 }
 
+void MapView::pageInViewport()
+{
+#ifdef USE_SPATIALITE
+    if (!p->theDocument)
+        return;
+    // The render threads read the layers: stop them before features come and go
+    bool cancelled = false;
+    for (LayerIterator<DrawingLayer*> it(p->theDocument); !it.isEnd(); ++it) {
+        SpatialiteBackend* store = it.get()->diskStore();
+        if (store && store->needsPaging(p->Viewport)) {
+            if (!cancelled) {
+                p->osmLayer->cancelRendering();
+                cancelled = true;
+            }
+            store->pageIn(p->Viewport);
+        }
+    }
+#endif
+}
+
+// Preferences read while drawing the buffers: wireframe or rendered view, and how editing is drawn
+static int wireframeMode()
+{
+    return (M_PREFS->getWireframeView() ? 1 : 0) | (M_PREFS->getEditRendering() << 1)
+            | (M_PREFS->getUseAntiAlias() ? 1 << 4 : 0);
+}
+
+// Queues for redraw only what the document changed since the last invalidation, if the view stayed the same.
+// False if everything has to be redrawn.
+bool MapView::invalidateChanges()
+{
+    if (!p->theDocument)
+        return false;
+
+    int mode = wireframeMode();
+    bool sameView = p->theVectorPanDelta.isNull() && StaticBackground
+            && p->theTransform == p->WireframeTransform && size() == p->WireframeSize
+            && p->ROptions.options == p->WireframeOptions && p->theDocument->styleRevision() == p->WireframeStyle
+            && mode == p->WireframeMode;
+    int rev = p->theDocument->revision();
+    QList<CoordBox> changed;
+    bool known = sameView && p->theDocument->changedSince(p->WireframeRevision, changed);
+
+    p->WireframeTransform = p->theTransform;
+    p->WireframeSize = size();
+    p->WireframeOptions = p->ROptions.options;
+    p->WireframeStyle = p->theDocument->styleRevision();
+    p->WireframeMode = mode;
+    p->WireframeRevision = rev;
+
+    if (!known)
+        return false;
+    // Everything is already due
+    if (!p->invalidRects.isEmpty() && p->DirtyRegion.isEmpty())
+        return true;
+
+    foreach (const CoordBox& bb, changed) {
+        if (p->Viewport.disjunctFrom(bb))
+            continue;
+        QRectF r = p->theTransform.mapRect(QRectF(p->theProjection.project(bb.topLeft()), p->theProjection.project(bb.bottomRight())));
+        QRect dirty = r.normalized().toAlignedRect().adjusted(-DIRTY_MARGIN, -DIRTY_MARGIN, DIRTY_MARGIN, DIRTY_MARGIN);
+        p->DirtyRegion += dirty;
+        p->invalidRects << CoordBox(fromView(dirty.topLeft()), fromView(dirty.bottomRight()));
+    }
+    return true;
+}
+
 void MapView::invalidate(bool updateWireframe, bool updateOsmMap, bool updateBgMap)
 {
+    if (updateWireframe || updateOsmMap)
+        pageInViewport();
     if (updateOsmMap) {
         if (!M_PREFS->getWireframeView()) {
             if (!TEST_RFLAGS(RendererOptions::Interacting))
@@ -175,9 +336,10 @@ void MapView::invalidate(bool updateWireframe, bool updateOsmMap, bool updateBgM
                 p->osmLayer->forceRedraw(p->theProjection, p->theTransform, rect(), p->PixelPerM, p->ROptions);
         }
     }
-    if (updateWireframe) {
+    if (updateWireframe && !invalidateChanges()) {
         p->invalidRects.clear();
         p->invalidRects.push_back(p->Viewport);
+        p->DirtyRegion = QRegion();
 
         p->theVectorPanDelta = QPoint(0, 0);
         SAFE_DELETE(StaticBackground)
@@ -242,6 +404,7 @@ void MapView::panScreen(QPoint delta)
         p->theTransform.translate((qreal)(delta.x())/p->theTransform.m11(), (qreal)(delta.y())/p->theTransform.m22());
         p->theInvertedTransform = p->theTransform.inverted();
         viewportRecalc(rect());
+        pageInViewport();
         if (!M_PREFS->getWireframeView() && p->theDocument) {
             p->osmLayer->pan(delta);
         }
@@ -601,92 +764,146 @@ void MapView::updateStaticBackground()
 
 void MapView::updateWireframe()
 {
-    QMap<RenderPriority, QSet <Feature*> > theFeatures;
-    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
-    QSet<Feature*>::const_iterator it;
+    // A full redraw makes what is being rasterized useless, anything less builds on it
+    bool full = p->theVectorPanDelta.isNull() && p->DirtyRegion.isEmpty();
+    if (full)
+        dropWireframe();
+    else
+        for (int i=0; i<p->WireframeJobs.size(); ++i)
+            p->WireframeJobs[i].Offset += p->theVectorPanDelta;
 
-    QPainter P;
+    RenderQueue& theFeatures = p->WireframeQueue;
+    theFeatures.clear();
 
     for (int i=0; i<p->theDocument->layerSize(); ++i)
         g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, p->invalidRects, p->theProjection);
+    theFeatures.sort();
 
+    // The buffers get what is already known right away: scrolled by the pan, and cleared where stale.
+    // Edited areas keep their old contents until the bands replace them.
+    QRegion clip;
     if (!p->theVectorPanDelta.isNull()) {
         QRegion exposed;
         StaticWireframe->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticWireframe->rect(), &exposed);
+        StaticTouchup->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticTouchup->rect(), &exposed);
+        clip = exposed;
+        QPainter P;
         P.begin(StaticWireframe);
-        P.setClipping(true);
         P.setClipRegion(exposed);
         P.setCompositionMode(QPainter::CompositionMode_Source);
         P.fillRect(StaticWireframe->rect(), Qt::transparent);
+        P.end();
+        P.begin(StaticTouchup);
+        P.setClipRegion(exposed);
+        P.setCompositionMode(QPainter::CompositionMode_Source);
+        P.fillRect(StaticTouchup->rect(), Qt::transparent);
+        P.end();
+    } else if (!p->DirtyRegion.isEmpty()) {
+        clip = p->DirtyRegion;
     } else {
+        clip = rect();
         StaticWireframe->fill(Qt::transparent);
-        P.begin(StaticWireframe);
-        P.setClipping(true);
-        P.setClipRegion(rect());
+        StaticTouchup->fill(Qt::transparent);
     }
 
+    // Recording is all the GUI thread does with the features; the workers rasterize
+    QPicture wireframe;
+    QPainter P(&wireframe);
     if (M_PREFS->getWireframeView() || !p->osmLayer->isRenderingDone() || M_PREFS->getEditRendering() == 1) {
         if (M_PREFS->getWireframeView() && M_PREFS->getUseAntiAlias())
             P.setRenderHint(QPainter::Antialiasing);
         else if (M_PREFS->getEditRendering() == 1)
             P.setRenderHint(QPainter::Antialiasing);
-        for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm)
+        for (int k=0; k<theFeatures.size(); ++k)
         {
-            for (it = itm.value().constBegin() ;it != itm.value().constEnd(); ++it)
-            {
-                qreal alpha = (*it)->getAlpha();
-                P.setOpacity(alpha);
+            Feature* F = theFeatures.feature(k);
+            qreal alpha = F->getAlpha();
+            P.setOpacity(alpha);
 
-                (*it)->drawSimple(P, this);
-            }
+            F->drawSimple(P, this);
         }
     }
     P.end();
 
-    if (!p->theVectorPanDelta.isNull()) {
-        QRegion exposed;
-        StaticTouchup->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticTouchup->rect(), &exposed);
-        P.begin(StaticTouchup);
-        P.setClipping(true);
-        P.setClipRegion(exposed);
-        P.setCompositionMode(QPainter::CompositionMode_Source);
-        P.fillRect(StaticTouchup->rect(), Qt::transparent);
-    } else {
-        StaticTouchup->fill(Qt::transparent);
-        P.begin(StaticTouchup);
-        P.setClipping(true);
-        P.setClipRegion(rect());
-    }
-
+    QPicture touchup;
+    P.begin(&touchup);
     P.setRenderHint(QPainter::Antialiasing);
-
-    for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm)
+    for (int k=0; k<theFeatures.size(); ++k)
     {
-        for (it = itm.value().constBegin() ;it != itm.value().constEnd(); ++it)
-        {
-            qreal alpha = (*it)->getAlpha();
-            P.setOpacity(alpha);
+        Feature* F = theFeatures.feature(k);
+        qreal alpha = F->getAlpha();
+        P.setOpacity(alpha);
 
-            (*it)->drawTouchup(P, this);
-        }
+        F->drawTouchup(P, this);
     }
     P.end();
 
     p->invalidRects.clear();
+    p->DirtyRegion = QRegion();
     p->theVectorPanDelta = QPoint(0, 0);
 
+    QList<QRect> bands;
+    QRect bounds = clip.boundingRect() & rect();
+    for (int y=0; y<height(); y+=WIREFRAME_BAND_HEIGHT) {
+        QRect band(0, y, width(), qMin(WIREFRAME_BAND_HEIGHT, height()-y));
+        if (band.intersects(bounds) && !(clip & band).isEmpty())
+            bands << band;
+    }
+    if (bands.isEmpty())
+        return;
+
+    WireframeJob job;
+    job.Future = QtConcurrent::mapped(bands, RenderWireframeBand(wireframe, touchup, clip));
+    job.Clip = clip;
+    p->WireframeJobs << job;
+    if (p->WireframeJobs.size() == 1)
+        p->WireframeWatcher.setFuture(job.Future);
+}
+
+// Copies the bands of the finished wireframe jobs into the buffers, in the order they were started.
+// A job that is still running holds back the ones after it.
+void MapView::applyWireframe()
+{
+    bool applied = false;
+    while (!p->WireframeJobs.isEmpty() && p->WireframeJobs.first().Future.isFinished()) {
+        WireframeJob job = p->WireframeJobs.takeFirst();
+        QList<WireframeBand> bands = job.Future.results();
+        QRegion clip = job.Clip.translated(job.Offset);
+
+        QPainter P;
+        P.begin(StaticWireframe);
+        P.setClipRegion(clip);
+        P.setCompositionMode(QPainter::CompositionMode_Source);
+        foreach (const WireframeBand& b, bands)
+            P.drawImage(b.Rect.topLeft() + job.Offset, b.Wireframe);
+        P.end();
+
+        P.begin(StaticTouchup);
+        P.setClipRegion(clip);
+        P.setCompositionMode(QPainter::CompositionMode_Source);
+        foreach (const WireframeBand& b, bands)
+            P.drawImage(b.Rect.topLeft() + job.Offset, b.Touchup);
+        P.end();
+        applied = true;
+    }
+    if (!p->WireframeJobs.isEmpty())
+        p->WireframeWatcher.setFuture(p->WireframeJobs.first().Future);
+    if (applied)
+        update();
+}
 
-//    QPainter P;
+// Cancels the wireframe jobs without waiting for them: the workers only use their own copies
+// of the recordings, and their bands are never looked at
+void MapView::dropWireframe()
+{
+    for (int i=0; i<p->WireframeJobs.size(); ++i)
+        p->WireframeJobs[i].Future.cancel();
+    p->WireframeJobs.clear();
+}
 
-//    StaticBuffer->fill(Qt::transparent);
-//    P.begin(StaticBuffer);
-//    P.setCompositionMode(QPainter::CompositionMode_Source);
-//    P.setClipping(true);
-//    P.setClipRegion(rect());
-////    if (M_PREFS->getUseAntiAlias())
-////        P.setRenderHint(QPainter::Antialiasing);
-//    drawFeatures(P);
-//    P.end();
+void MapView::on_wireframeRendered()
+{
+    applyWireframe();
 }
 
 void MapView::mousePressEvent(QMouseEvent* anEvent)
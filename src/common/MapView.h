@@ -98,6 +98,8 @@ private:
     void drawGPS(QPainter & painter);
     void updateStaticBackground();
     void updateWireframe();
+    void applyWireframe();
+    void dropWireframe();
 
     MainWindow* Main;
     QPixmap* StaticBackground;
@@ -108,6 +110,8 @@ private:
     QLabel* lockIcon;
 
     void viewportRecalc(const QRect& Screen);
+    void pageInViewport();
+    bool invalidateChanges();
 
     QShortcut* MoveLeftShortcut;
     QShortcut* MoveRightShortcut;
@@ -124,6 +128,9 @@ public slots:
     virtual void zoomIn();
     virtual void zoomOut();
 
+private slots:
+    void on_wireframeRendered();
+
 signals:
     void viewportChanged();
 
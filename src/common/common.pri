@@ -5,6 +5,8 @@ DEPENDPATH += $$MERKAARTOR_SRC_DIR/common
 HEADERS += Global.h \
     Coord.h \
     Document.h \
+    FeatureIdIndex.h \
+    Benchmark.h \
     MapTypedef.h \
     Painting.h \
     Projection.h \
@@ -18,6 +20,8 @@ HEADERS += Global.h \
 SOURCES += Global.cpp \
     Coord.cpp \
     Document.cpp \
+    FeatureIdIndex.cpp \
+    Benchmark.cpp \
     Painting.cpp \
     Projection.cpp \
     FeatureManipulations.cpp \